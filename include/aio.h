@@ -0,0 +1,17 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <stdint.h>
+#include "fs.h"
+
+#define AIO_DEFAULT_DEPTH 32
+#define AIO_MAX_DEPTH     4096
+
+/* Batched sector I/O engine: io_uring on plain image files, a thread pool otherwise (see src/aio.c). */
+int aio_start(uint32_t depth);
+void aio_stop(void);
+int aio_run(const SectorReq *reqs, uint32_t n);
+const char *aio_engine(void);
+uint32_t aio_depth(void);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stdint.h>
+#include "fs.h"
+
+/* Allocation policy state (see src/alloc.c). */
+void alloc_reset(void);
+void alloc_note_free(const uint32_t *clusters, uint32_t count);
+int alloc_policy_parse(const char *name);
+const char *alloc_policy_name(AllocPolicy p);
+
+#endif
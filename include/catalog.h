@@ -0,0 +1,17 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdint.h>
+#include "fat32.h"
+
+/* Sidecar catalog of all directory entries (see src/catalog.c). */
+void catalog_load(const char *image_path);
+void catalog_close(void);
+void catalog_note_write(void);
+void catalog_invalidate(void);
+void catalog_drop_file(const char *image_path);
+int catalog_copy(const char *dst_image_path);
+int catalog_lookup(uint32_t dir, const char key[11], DirEntry *out, uint32_t *sector, uint32_t *offset);
+int catalog_ls(uint32_t dir);
+
+#endif
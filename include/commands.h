@@ -2,6 +2,7 @@
 #define COMMANDS_H
 
 void run_shell();
+int shell_execute(char *cmdline);
 
 #endif
 
@@ -0,0 +1,9 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include <stdint.h>
+
+/* Compacts a directory after deletions when the automatic threshold is reached (see src/compact.c). */
+void dir_maybe_compact(uint32_t dir);
+
+#endif
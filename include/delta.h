@@ -0,0 +1,7 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+/* Applies a delta written by `diff` to an unmounted image (see src/delta.c). */
+int delta_apply(const char *delta_path, const char *image_path);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef FATSCAN_H
+#define FATSCAN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Free-cluster and contiguous-link maps built by a background FAT scan (see src/fatscan.c). */
+void fatscan_start(void);
+void fatscan_stop(void);
+void fatscan_note(uint32_t cluster, uint32_t value);
+bool fatscan_is_free(uint32_t cluster);
+uint32_t fatscan_next_free(uint32_t from, uint32_t end);
+uint32_t fatscan_free_run(uint32_t from, uint32_t end, uint32_t max);
+uint32_t fatscan_link_run(uint32_t cluster, uint32_t max);
+bool fatscan_progress(uint32_t *done, uint32_t *total, uint32_t *free_clusters);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef FDTABLE_H
+#define FDTABLE_H
+
+#include <stdint.h>
+#include "fs.h"
+
+#define FD_MAX (1u << 20)
+
+/* Open-file descriptor table with pooled entries and interned paths (see src/fdtable.c). */
+int fd_alloc(OpenFileEntry **out);
+void fd_free(int fd);
+OpenFileEntry *fd_get(int fd);
+int fd_limit(void);
+uint32_t fd_count(void);
+void fd_reset(void);
+int fd_set_path(OpenFileEntry *of, const char *path);
+OpenFileEntry *fd_by_path(const char *path, uint32_t *count);
+
+#endif
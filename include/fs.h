@@ -5,9 +5,20 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include "fat32.h"
+#include "image.h"
+#include "readahead.h"
 
-#define MAX_OPEN_FILES 10
 #define MAX_NAME_LEN   11
+#define WB_MAX_BYTES   (64*1024)
+#define FAT_COPIES_MAX 4
+#define SECTOR_SIZE_MAX 4096
+
+typedef enum {
+    ALLOC_FIRST_FIT,
+    ALLOC_NEXT_FIT,
+    ALLOC_BEST_FIT,
+    ALLOC_AFFINITY
+} AllocPolicy;
 
 typedef struct {
     uint16_t bytes_per_sector;
@@ -20,16 +31,32 @@ typedef struct {
     uint32_t total_clusters;
     uint32_t first_FAT_sector;
     uint32_t first_data_sector;
+    uint16_t fsi_sector;         /* BPB_FSInfo */
+    uint8_t sector_shift;       /* log2 of bytes_per_sector */
+    uint8_t cluster_shift;      /* log2 of sectors_per_cluster */
     uint64_t image_size_bytes;
     uint32_t cwd_cluster;
     char image_name[256];
+    AllocPolicy alloc_policy;
+    uint8_t compact_pct;        /* auto-compact directories at this dead-slot share, 0 = off */
 
-    FILE *fp;
+    ImageDev *dev;
 } FSInfo;
 
 typedef struct {
-    bool in_use;
-    char name[MAX_NAME_LEN+1];
+    const char *overlay_path;
+    AllocPolicy alloc_policy;
+    bool direct_io;
+    uint32_t io_depth;          /* 0 for the default */
+    uint8_t compact_pct;
+    const LatencyModel *latency;    /* slow-device model, NULL for none */
+} MountOptions;
+
+typedef struct OpenFileEntry {
+    int fd;
+    const char *name;           /* last component of path */
+    const char *path;           /* interned, upper case */
+    struct OpenFileEntry *next_same;    /* next handle on the same path */
     uint32_t cluster;
     uint32_t size;
     uint8_t attr;
@@ -37,21 +64,88 @@ typedef struct {
     uint32_t offset;
     uint32_t dir_entry_sector;
     uint32_t dir_entry_offset;
-    char path[512]; 
+    ReadAhead *ra;
+
+    /* write-behind: one contiguous dirty range plus pending directory-entry changes */
+    uint8_t *wb;
+    uint32_t wb_start;
+    uint32_t wb_len;
+    uint32_t wb_cap;
+    bool meta_dirty;
+
+    /* cached chain shape, so appends and flushes do not rewalk the FAT */
+    bool chain_known;
+    uint32_t nclusters;
+    uint32_t last_cluster;
+    uint32_t pos_idx;
+    uint32_t pos_cluster;
 } OpenFileEntry;
 
+typedef struct {
+    uint32_t *items;
+    uint32_t count;
+    uint32_t cap;
+} ClusterList;
+
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+} Extent;
+
+typedef struct {
+    Extent *items;
+    uint32_t count;
+    uint32_t cap;
+} ExtentList;
+
+/* Remembers the last FAT sector read, so walking a chain does not reread it for every entry. */
+typedef struct {
+    bool valid;
+    uint32_t sector;
+    uint8_t buf[SECTOR_SIZE_MAX];
+} FatCursor;
+
+/* Sector I/O issued through read_sector()/write_sector() and friends. */
+typedef struct {
+    uint64_t read_ops;
+    uint64_t write_ops;
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+} IoStats;
+
+/* One request of a batch handed to sectors_batch(). */
+typedef struct {
+    uint32_t sector;
+    uint32_t count;
+    uint8_t *buf;
+    bool write;
+} SectorReq;
+
+typedef int (*UsedRangeFn)(uint64_t off, uint64_t len, void *ctx);
+typedef int (*TreeWalkFn)(const DirEntry *entry, const char *path, void *ctx);
+
 extern FSInfo fsinfo;
-extern OpenFileEntry open_files[MAX_OPEN_FILES];
+extern IoStats io_stats;
 
 
 extern char current_path[512]; 
 
-int fs_mount(const char *image_path);
+static inline uint32_t fs_cluster_bytes(void) {
+    return (uint32_t)fsinfo.sectors_per_cluster * fsinfo.bytes_per_sector;
+}
+
+/* A cluster number that points into the data region: not free, reserved, bad or end of chain. */
+static inline bool fs_valid_cluster(uint32_t c) {
+    return c >= 2 && c < 0x0FFFFFF8;
+}
+
+int fs_mount(const char *image_path, const MountOptions *opts);
 void fs_unmount();
 int fs_info();
 int fs_cd(const char *dirname);
-int fs_ls();
+int fs_ls(const char *dirname);
 int fs_mkdir(const char *dirname);
+int fs_make_dir(uint32_t parent, const char *dirname, uint32_t *out_cluster);
 int fs_creat(const char *filename);
 int fs_open(const char *filename, const char *flags);
 int fs_close(const char *filename);
@@ -60,26 +154,71 @@ int fs_size(const char *filename);
 int fs_lseek(const char *filename, uint32_t offset);
 int fs_read(const char *filename, uint32_t size);
 int fs_write(const char *filename, const char *str);
+int fs_fallocate(const char *filename, uint32_t size);
+int fs_truncate(const char *filename, uint32_t size);
 int fs_rename(const char *oldname, const char *newname);
 int fs_rm(const char *filename);
 int fs_rmdir(const char *dirname);
+int fs_rm_recursive(char **names, int count);
+int fs_compact(const char *dirname);
+int fs_compact_auto(const char *pct);
+int fs_catalog(const char *action);
+int fs_find(const char *dirname, const char *pattern);
+int fs_cp(const char *src, const char *dst, bool recursive);
+int fs_put(const char *host, const char *dst, bool recursive);
+int fs_export_tar(const char *dirname, const char *out_path);
+int fs_pack(const char *out_path);
+int fs_unpack(const char *out_path);
+int fs_clone(const char *out_path);
+int fs_diff(const char *other_path, const char *out_path, bool full);
+int fs_hash();
+int fs_verify(bool full);
+int fs_dupes();
+int fs_df();
+int fs_frag(bool all);
+int fs_overlay(const char *action);
+int fs_sync();
+int fs_flush(OpenFileEntry *of);
+int fs_flush_data(OpenFileEntry *of);
+int fs_flush_meta(OpenFileEntry *of);
 
 int fs_find_entry_in_dir(uint32_t dir_cluster, const char *name, DirEntry *out_entry, uint32_t *out_sector, uint32_t *out_offset);
 bool fs_name_exists_in_dir(uint32_t dir_cluster, const char *name);
-int fs_allocate_cluster_chain(uint32_t count, uint32_t *start_cluster);
+int fs_allocate_cluster_chain(uint32_t count, uint32_t goal, uint32_t *start_cluster);
 int fs_free_cluster_chain(uint32_t start_cluster);
+int fs_free_clusters(uint32_t *clusters, uint32_t count);
+int fs_collect_chain(uint32_t start_cluster, FatCursor *fc, ClusterList *out);
+uint32_t fat_cursor_get(FatCursor *fc, uint32_t cluster);
+int cluster_list_push(ClusterList *l, uint32_t c);
+void cluster_list_free(ClusterList *l);
+int extent_list_push(ExtentList *l, uint32_t start, uint32_t count);
+void extent_list_free(ExtentList *l);
+int fs_chain_extents(uint32_t start_cluster, uint32_t max_clusters, ExtentList *out);
+int fs_allocate_extents(uint32_t count, uint32_t goal, ExtentList *out);
+int fs_allocate_run(uint32_t count, uint32_t goal, bool link, uint32_t *start_cluster);
+int fs_set_fat_entries(const uint32_t *clusters, const uint32_t *values, uint32_t count);
+int fs_copy_sectors(uint32_t src_sector, uint32_t dst_sector, uint32_t count);
+int fs_for_each_used_range(UsedRangeFn fn, void *ctx);
+int fs_walk_tree(uint32_t dir, TreeWalkFn fn, void *ctx);
 int fs_update_dir_entry(uint32_t sector, uint32_t offset, DirEntry *entry);
 int fs_read_cluster_chain(uint32_t start_cluster, uint8_t *buffer, uint32_t offset, uint32_t size);
 int fs_write_cluster_chain(uint32_t start_cluster, const uint8_t *buffer, uint32_t offset, uint32_t size);
 int fs_extend_file(uint32_t *start_cluster, uint32_t old_size, uint32_t new_size);
 int fs_is_dir_empty(uint32_t dir_cluster);
 int create_dir_entry(uint32_t dir_cluster, const char *name, uint8_t attr, uint32_t start_cluster, uint32_t size);
+int create_dir_entries(uint32_t dir_cluster, const DirEntry *entries, uint32_t count);
+bool is_dot_entry(const DirEntry *d);
+void entry_name(const DirEntry *e, char out[12]);
 
 uint32_t get_fat_entry(uint32_t cluster);
 int set_fat_entry(uint32_t cluster, uint32_t value);
 int read_sector(uint32_t sector, uint8_t *buffer);
 int write_sector(uint32_t sector, const uint8_t *buffer);
+int read_sectors(uint32_t sector, uint32_t count, uint8_t *buffer);
+int write_sectors(uint32_t sector, uint32_t count, const uint8_t *buffer);
+int sectors_batch(const SectorReq *reqs, uint32_t n);
 uint32_t cluster_to_sector(uint32_t cluster);
+void io_stats_get(IoStats *out);
 
 #endif
 
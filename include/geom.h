@@ -0,0 +1,49 @@
+#ifndef GEOM_H
+#define GEOM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fs.h"
+
+/*
+ * Cluster and FAT address math. The sector size is picked at mount as one of
+ * a few kinds, and each helper switches on it with the shifts for 512 and
+ * 4096-byte sectors written as constants, so every call site inlines them.
+ */
+typedef enum {
+    GEOM_GENERIC,           /* shifts by fsinfo.sector_shift */
+    GEOM_SECTOR_512,
+    GEOM_SECTOR_4096,
+} GeomKind;
+
+extern GeomKind geom_kind;
+
+static inline uint32_t geom_cluster_to_sector(uint32_t cluster) {
+    return ((cluster - 2) << fsinfo.cluster_shift) + fsinfo.first_data_sector;
+}
+
+static inline uint32_t geom_sector_to_cluster(uint32_t sector) {
+    return ((sector - fsinfo.first_data_sector) >> fsinfo.cluster_shift) + 2;
+}
+
+/* FAT sector of a cluster's entry, relative to the start of a FAT. A sector holds 2^(shift-2) entries. */
+static inline uint32_t geom_fat_sector(uint32_t cluster) {
+    switch (geom_kind) {
+    case GEOM_SECTOR_512:  return cluster >> 7;
+    case GEOM_SECTOR_4096: return cluster >> 10;
+    default:               return cluster >> (fsinfo.sector_shift - 2);
+    }
+}
+
+/* The entry's index within that sector. */
+static inline uint32_t geom_fat_index(uint32_t cluster) {
+    switch (geom_kind) {
+    case GEOM_SECTOR_512:  return cluster & 127;
+    case GEOM_SECTOR_4096: return cluster & 1023;
+    default:               return cluster & ((1u << (fsinfo.sector_shift - 2)) - 1);
+    }
+}
+
+void geom_select(void);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+
+/* Write tracking for the cluster hash index (see src/hash.c). */
+void hash_track_load(const char *image_path);
+void hash_track_save(void);
+void hash_track_close(void);
+void hash_note_write(uint64_t off, uint64_t len);
+int hash_copy_index(const char *dst_image_path);
+void hash_drop_index(const char *image_path);
+int hash_clean_crcs(const char *image_path, uint32_t vol_id, uint32_t **crcs, uint8_t **clean);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct ImageDev ImageDev;
+typedef struct ContainerWriter ContainerWriter;
+
+#define CONTAINER_CHUNK_BYTES (64*1024)
+
+/* Storage model of the slow-device backend (see src/latency.c); zero turns a term off. */
+typedef struct {
+    uint32_t lat_us;            /* per request */
+    uint32_t seek_us;           /* across the whole image */
+    uint32_t bw_mbps;
+    uint32_t qd;                /* requests in flight, 0 for no limit */
+} LatencyModel;
+
+struct ImageDev {
+    const char *kind;
+    uint64_t size;
+    bool writable;
+
+    int  (*read)(ImageDev *dev, uint64_t off, void *buf, uint32_t len);
+    int  (*write)(ImageDev *dev, uint64_t off, const void *buf, uint32_t len);
+    int  (*copy)(ImageDev *dev, uint64_t src, uint64_t dst, uint64_t len);
+    int  (*sync)(ImageDev *dev);
+    void (*close)(ImageDev *dev);
+
+    void *priv;
+};
+
+int image_pread(int fd, void *buf, uint32_t len, uint64_t off);
+int image_pwrite(int fd, const void *buf, uint32_t len, uint64_t off);
+
+ImageDev *image_open(const char *path, bool writable);
+ImageDev *image_open_file(const char *path, bool writable);
+ImageDev *image_open_overlay(const char *base_path, const char *delta_path);
+ImageDev *image_open_container(const char *path, bool writable);
+ImageDev *image_open_direct(const char *path, bool writable);
+ImageDev *image_open_latency(ImageDev *inner, const LatencyModel *m);
+bool image_is_container(const char *path);
+int image_file_fd(ImageDev *dev);
+int image_copy_file(const char *src_path, const char *dst_path);
+int image_meta_crc(ImageDev *dev, uint32_t *out);
+
+int image_overlay_commit(ImageDev *dev);
+int image_overlay_discard(ImageDev *dev);
+int image_overlay_stat(ImageDev *dev, uint64_t *used_units, uint64_t *total_units, uint32_t *unit_size);
+int image_direct_stat(ImageDev *dev, uint64_t *hits, uint64_t *misses, uint64_t *bypassed);
+int image_latency_parse(const char *spec, LatencyModel *out);
+int image_latency_stat(ImageDev *dev, LatencyModel *m, uint64_t *ios, uint64_t *seeks, uint64_t *delay_us);
+ImageDev *image_latency_inner(ImageDev *dev);
+
+ContainerWriter *container_create(const char *path, uint64_t image_size, uint32_t chunk_size);
+int container_put_chunk(ContainerWriter *w, uint64_t idx, const uint8_t *data);
+int container_finish(ContainerWriter *w);
+void container_stat(ContainerWriter *w, uint64_t *stored_bytes, uint64_t *zero_chunks);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+
+int lz_compress(const uint8_t *in, uint32_t in_len, uint8_t *out, uint32_t out_cap);
+int lz_decompress(const uint8_t *in, uint32_t in_len, uint8_t *out, uint32_t out_len);
+
+#endif
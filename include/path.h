@@ -0,0 +1,19 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PATH_LEAF_MAX 256
+
+/* Multi-component path resolution over a dentry cache (see src/path.c). */
+int path_split(const char *path, uint32_t *dir, char *leaf, size_t cap);
+int path_dir(const char *path, uint32_t *dir);
+int path_parent_of(uint32_t dir, uint32_t *out);
+int path_normalize(const char *base, const char *path, char *out, size_t cap);
+void dcache_clear(void);
+void dcache_forget(uint32_t parent, const char *name);
+void dcache_note(uint32_t parent, const char *name, uint32_t child);
+void dcache_stat(uint64_t *hits, uint64_t *misses, uint32_t *entries);
+
+#endif
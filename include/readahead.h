@@ -0,0 +1,16 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+
+#define RA_MIN_BYTES  (16*1024)
+#define RA_MAX_BYTES  (1024*1024)
+
+typedef struct ReadAhead ReadAhead;
+
+ReadAhead *ra_create(void);
+void ra_destroy(ReadAhead *ra);
+void ra_invalidate(ReadAhead *ra);
+int ra_read(ReadAhead *ra, uint32_t start_cluster, uint32_t file_size, uint8_t *out, uint32_t offset, uint32_t size);
+
+#endif
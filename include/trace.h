@@ -0,0 +1,14 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fs.h"
+
+uint64_t trace_now_us(void);
+int trace_start(const char *path);
+void trace_stop(void);
+void trace_record(const char *line, uint64_t start_us, const IoStats *before);
+int trace_replay(const char *trace_path, const char *image_path, bool paced, const MountOptions *opts);
+
+#endif
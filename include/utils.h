@@ -10,6 +10,7 @@ void format_name_11(const char *input, char output[11]);
 int validate_filename(const char *filename);
 void print_error(const char *msg);
 void print_hex_dump(const uint8_t *data, uint32_t length);
+void fat_timestamp(uint16_t *date, uint16_t *time_out);
 
 #endif
 
@@ -0,0 +1,275 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "fs.h"
+#include "image.h"
+#include "aio.h"
+
+/*
+ * Batched sector I/O. Callers hand over a set of independent requests and
+ * wait for all of them; the engine keeps up to `depth` of them in flight.
+ *
+ *   io_uring   plain image files: one ring, set up with the raw syscalls so
+ *              there is no library dependency. Requests are queued into the
+ *              submission ring and submitted with a single io_uring_enter()
+ *              that also waits for completions.
+ *   threads    every other backend (overlay, container, direct) and kernels
+ *              without io_uring: a pool of workers calling the backend.
+ *
+ * A batch of one request, or any batch when no engine is running, is done
+ * inline. Batches from different threads run one after the other.
+ */
+
+#define AIO_POOL_MAX 16
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned entries;
+    int file_fd;
+} Ring;
+
+typedef struct {
+    const char *engine;
+    uint32_t depth;
+    pthread_mutex_t batch_lock;
+
+    Ring ring;
+    bool ring_ok;
+
+    pthread_t threads[AIO_POOL_MAX];
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    const SectorReq *reqs;
+    uint32_t n, next, finished;
+    int rc;
+    bool quit;
+} Aio;
+
+static Aio aio;
+
+static int do_sync(const SectorReq *r) {
+    uint64_t off = (uint64_t)r->sector * fsinfo.bytes_per_sector;
+    uint32_t len = r->count * fsinfo.bytes_per_sector;
+    if (r->write) return fsinfo.dev->write(fsinfo.dev, off, r->buf, len);
+    return fsinfo.dev->read(fsinfo.dev, off, r->buf, len);
+}
+
+/* ---- io_uring ---- */
+
+static int ring_setup(Ring *r, unsigned entries, int file_fd) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) goto fail;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto fail;
+
+    uint8_t *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    r->entries = p.sq_entries < p.cq_entries ? p.sq_entries : p.cq_entries;
+    r->file_fd = file_fd;
+    return 0;
+
+fail:
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+    return -1;
+}
+
+static void ring_teardown(Ring *r) {
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+}
+
+static int ring_run(Ring *r, const SectorReq *reqs, uint32_t n) {
+    uint32_t queued = 0, completed = 0, inflight = 0, pending = 0;
+    int rc = 0;
+    while (completed < n) {
+        unsigned tail = *r->sq_tail;
+        while (queued < n && inflight + pending < r->entries) {
+            const SectorReq *q = &reqs[queued];
+            unsigned idx = tail & *r->sq_mask;
+            struct io_uring_sqe *sqe = &r->sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = q->write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = r->file_fd;
+            sqe->off = (uint64_t)q->sector * fsinfo.bytes_per_sector;
+            sqe->addr = (uint64_t)(uintptr_t)q->buf;
+            sqe->len = q->count * fsinfo.bytes_per_sector;
+            sqe->user_data = queued;
+            r->sq_array[idx] = idx;
+            tail++;
+            pending++;
+            queued++;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+        int ret = (int)syscall(__NR_io_uring_enter, r->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN) return -1;
+        if (ret > 0) {
+            pending -= (uint32_t)ret;
+            inflight += (uint32_t)ret;
+        }
+        if (inflight == 0) {
+            if (ret == 0) return -1;        /* the kernel refused the queue */
+            continue;
+        }
+
+        unsigned head = *r->cq_head;
+        unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; head++) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            const SectorReq *q = &reqs[cqe->user_data];
+            uint32_t len = q->count * fsinfo.bytes_per_sector;
+            /* Errors and short transfers (or an old kernel without the opcode) are redone synchronously. */
+            if (cqe->res < 0 || (uint32_t)cqe->res < len) {
+                if (do_sync(q) != 0) rc = -1;
+            }
+            inflight--;
+            completed++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return rc;
+}
+
+/* ---- thread pool ---- */
+
+static void *pool_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&aio.lock);
+    while (1) {
+        while (!aio.quit && aio.next >= aio.n) pthread_cond_wait(&aio.work, &aio.lock);
+        if (aio.quit) break;
+        const SectorReq *q = &aio.reqs[aio.next++];
+        pthread_mutex_unlock(&aio.lock);
+        int rc = do_sync(q);
+        pthread_mutex_lock(&aio.lock);
+        if (rc != 0) aio.rc = -1;
+        if (++aio.finished == aio.n) pthread_cond_signal(&aio.done);
+    }
+    pthread_mutex_unlock(&aio.lock);
+    return NULL;
+}
+
+static int pool_run(const SectorReq *reqs, uint32_t n) {
+    pthread_mutex_lock(&aio.lock);
+    aio.reqs = reqs;
+    aio.n = n;
+    aio.next = aio.finished = 0;
+    aio.rc = 0;
+    pthread_cond_broadcast(&aio.work);
+    while (aio.finished < aio.n) pthread_cond_wait(&aio.done, &aio.lock);
+    int rc = aio.rc;
+    aio.reqs = NULL;
+    aio.n = aio.next = 0;
+    pthread_mutex_unlock(&aio.lock);
+    return rc;
+}
+
+/* ---- engine ---- */
+
+int aio_start(uint32_t depth) {
+    aio_stop();
+    if (depth == 0) depth = AIO_DEFAULT_DEPTH;
+    if (depth > AIO_MAX_DEPTH) depth = AIO_MAX_DEPTH;
+    aio.depth = depth;
+    pthread_mutex_init(&aio.batch_lock, NULL);
+
+    int fd = image_file_fd(fsinfo.dev);
+    if (fd >= 0 && ring_setup(&aio.ring, depth, fd) == 0) {
+        aio.ring_ok = true;
+        aio.engine = "io_uring";
+        return 0;
+    }
+
+    pthread_mutex_init(&aio.lock, NULL);
+    pthread_cond_init(&aio.work, NULL);
+    pthread_cond_init(&aio.done, NULL);
+    uint32_t nw = depth < AIO_POOL_MAX ? depth : AIO_POOL_MAX;
+    for (uint32_t t = 0; t < nw; t++) {
+        if (pthread_create(&aio.threads[aio.nthreads], NULL, pool_worker, NULL) == 0) aio.nthreads++;
+    }
+    aio.engine = aio.nthreads ? "threads" : "sync";
+    return 0;
+}
+
+void aio_stop(void) {
+    if (!aio.engine) return;
+    if (aio.ring_ok) {
+        ring_teardown(&aio.ring);
+    } else {
+        pthread_mutex_lock(&aio.lock);
+        aio.quit = true;
+        pthread_cond_broadcast(&aio.work);
+        pthread_mutex_unlock(&aio.lock);
+        for (int t = 0; t < aio.nthreads; t++) pthread_join(aio.threads[t], NULL);
+        pthread_mutex_destroy(&aio.lock);
+        pthread_cond_destroy(&aio.work);
+        pthread_cond_destroy(&aio.done);
+    }
+    pthread_mutex_destroy(&aio.batch_lock);
+    memset(&aio, 0, sizeof(aio));
+}
+
+int aio_run(const SectorReq *reqs, uint32_t n) {
+    if (n == 1 || !aio.engine || (!aio.ring_ok && aio.nthreads == 0)) {
+        for (uint32_t i = 0; i < n; i++) {
+            if (do_sync(&reqs[i]) != 0) return -1;
+        }
+        return 0;
+    }
+    pthread_mutex_lock(&aio.batch_lock);
+    int rc = aio.ring_ok ? ring_run(&aio.ring, reqs, n) : pool_run(reqs, n);
+    pthread_mutex_unlock(&aio.batch_lock);
+    return rc;
+}
+
+const char *aio_engine(void) {
+    return aio.engine ? aio.engine : "sync";
+}
+
+uint32_t aio_depth(void) {
+    return aio.depth;
+}
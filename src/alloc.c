@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs.h"
+#include "alloc.h"
+#include "fatscan.h"
+
+/*
+ * Cluster allocation policies. Every policy only chooses free runs; marking
+ * them in the FAT (one batched write per touched FAT sector) is shared.
+ *
+ *   first-fit  first free run from cluster 2 that holds the request
+ *   next-fit   like first-fit, but the search starts where the last one ended
+ *   best-fit   smallest free extent that holds the request, from a tree of
+ *              free extents ordered by size
+ *   affinity   first-fit starting after a goal cluster: the parent directory
+ *              for new files and directories, the current tail for appends
+ *
+ * A request that no single run can hold is spread over several runs; best-fit
+ * takes the largest extents first, the others go in scan order.
+ */
+
+static const char *policy_names[] = {"first-fit", "next-fit", "best-fit", "affinity"};
+
+static uint32_t next_fit_cursor;
+
+/* ---- free-extent tree ----
+ * Each free extent is one node linked into two treaps: t=0 ordered by start
+ * (to find and merge neighbours), t=1 ordered by (length, start) for best-fit.
+ * The tree is built from the FAT the first time best-fit runs and from then on
+ * updated by every allocation and free until the next reset.
+ */
+
+typedef struct FreeExt {
+    uint32_t start, len;
+    uint32_t prio;
+    struct FreeExt *l[2], *r[2];
+} FreeExt;
+
+static FreeExt *roots[2];
+static bool tree_ready;
+static uint32_t prio_state = 2463534242u;
+
+static uint32_t next_prio(void) {
+    prio_state ^= prio_state << 13;
+    prio_state ^= prio_state >> 17;
+    prio_state ^= prio_state << 5;
+    return prio_state;
+}
+
+static uint64_t key(const FreeExt *n, int t) {
+    return t == 0 ? n->start : ((uint64_t)n->len << 32) | n->start;
+}
+
+/* Splits n into keys < k (a) and keys >= k (b). */
+static void split(FreeExt *n, uint64_t k, int t, FreeExt **a, FreeExt **b) {
+    if (!n) {
+        *a = *b = NULL;
+    } else if (key(n, t) < k) {
+        split(n->r[t], k, t, &n->r[t], b);
+        *a = n;
+    } else {
+        split(n->l[t], k, t, a, &n->l[t]);
+        *b = n;
+    }
+}
+
+static FreeExt *merge(FreeExt *a, FreeExt *b, int t) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->prio > b->prio) {
+        a->r[t] = merge(a->r[t], b, t);
+        return a;
+    }
+    b->l[t] = merge(a, b->l[t], t);
+    return b;
+}
+
+static void tree_insert(FreeExt *n) {
+    for (int t = 0; t < 2; t++) {
+        FreeExt *a, *b;
+        n->l[t] = n->r[t] = NULL;
+        split(roots[t], key(n, t), t, &a, &b);
+        roots[t] = merge(merge(a, n, t), b, t);
+    }
+}
+
+static void tree_remove(FreeExt *n) {
+    for (int t = 0; t < 2; t++) {
+        FreeExt *a, *m, *b;
+        split(roots[t], key(n, t), t, &a, &m);
+        split(m, key(n, t) + 1, t, &m, &b);
+        roots[t] = merge(a, b, t);
+    }
+}
+
+/* Extent with the largest start <= c. */
+static FreeExt *tree_at_or_before(uint32_t c) {
+    FreeExt *n = roots[0], *best = NULL;
+    while (n) {
+        if (n->start <= c) { best = n; n = n->r[0]; }
+        else n = n->l[0];
+    }
+    return best;
+}
+
+/* Smallest extent of at least len clusters, lowest start among equals. */
+static FreeExt *tree_best(uint32_t len) {
+    uint64_t k = (uint64_t)len << 32;
+    FreeExt *n = roots[1], *best = NULL;
+    while (n) {
+        if (key(n, 1) >= k) { best = n; n = n->l[1]; }
+        else n = n->r[1];
+    }
+    return best;
+}
+
+static FreeExt *tree_largest(void) {
+    FreeExt *n = roots[1];
+    while (n && n->r[1]) n = n->r[1];
+    return n;
+}
+
+static int tree_add(uint32_t start, uint32_t len) {
+    FreeExt *n = calloc(1, sizeof(FreeExt));
+    if (!n) return -1;
+    n->start = start;
+    n->len = len;
+    n->prio = next_prio();
+    tree_insert(n);
+    return 0;
+}
+
+static void free_nodes(FreeExt *n) {
+    if (!n) return;
+    free_nodes(n->l[0]);
+    free_nodes(n->r[0]);
+    free(n);
+}
+
+void alloc_reset(void) {
+    free_nodes(roots[0]);
+    roots[0] = roots[1] = NULL;
+    tree_ready = false;
+    next_fit_cursor = 0;
+}
+
+static int tree_build(void) {
+    uint32_t end = fsinfo.total_clusters + 2;
+    alloc_reset();
+    for (uint32_t c = fatscan_next_free(2, end); c < end; c = fatscan_next_free(c, end)) {
+        uint32_t len = fatscan_free_run(c, end, UINT32_MAX);
+        if (tree_add(c, len) != 0) {
+            alloc_reset();
+            return -1;
+        }
+        c += len;
+    }
+    tree_ready = true;
+    return 0;
+}
+
+/* Removes [start, start+len) from the tree, splitting the extent that holds it. */
+static void tree_take(uint32_t start, uint32_t len) {
+    FreeExt *n = tree_at_or_before(start);
+    if (!n || start + len > n->start + n->len) {
+        alloc_reset();          /* out of step with the FAT; rebuild on next use */
+        return;
+    }
+    uint32_t n_end = n->start + n->len;
+    tree_remove(n);
+    if (start > n->start) {
+        n->len = start - n->start;
+        tree_insert(n);
+        n = NULL;
+    }
+    if (start + len < n_end) {
+        if (n) {
+            n->start = start + len;
+            n->len = n_end - (start + len);
+            tree_insert(n);
+            n = NULL;
+        } else if (tree_add(start + len, n_end - (start + len)) != 0) {
+            alloc_reset();
+            return;
+        }
+    }
+    free(n);
+}
+
+/* Returns [start, start+len) to the tree, merging with free neighbours. */
+static void tree_give(uint32_t start, uint32_t len) {
+    FreeExt *prev = tree_at_or_before(start);
+    if (prev && prev->start + prev->len > start) {
+        alloc_reset();
+        return;
+    }
+    FreeExt *next = tree_at_or_before(start + len);
+    if (next && next->start != start + len) next = NULL;
+    if (prev && prev->start + prev->len == start) {
+        tree_remove(prev);
+        prev->len += len;
+        if (next) {
+            tree_remove(next);
+            prev->len += next->len;
+            free(next);
+        }
+        tree_insert(prev);
+    } else if (next) {
+        tree_remove(next);
+        next->start = start;
+        next->len += len;
+        tree_insert(next);
+    } else if (tree_add(start, len) != 0) {
+        alloc_reset();
+    }
+}
+
+void alloc_note_free(const uint32_t *clusters, uint32_t count) {
+    if (!tree_ready) return;
+    for (uint32_t i = 0; i < count; ) {
+        uint32_t run = 1;
+        while (i + run < count && clusters[i + run] == clusters[i] + run) run++;
+        tree_give(clusters[i], run);
+        if (!tree_ready) return;
+        i += run;
+    }
+}
+
+/* ---- policies ---- */
+
+/*
+ * Scans from `from` to the end of the volume and then from cluster 2 up to
+ * `from`. The first run that holds everything wins; otherwise runs are
+ * collected in scan order until the request is covered.
+ */
+static int pick_scan(uint32_t count, uint32_t from, ExtentList *runs) {
+    uint32_t end = fsinfo.total_clusters + 2;
+    uint32_t got = 0;
+    if (from < 2 || from >= end) from = 2;
+
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t lo = pass == 0 ? from : 2;
+        uint32_t hi = pass == 0 ? end : from;
+        for (uint32_t c = fatscan_next_free(lo, hi); c < hi; c = fatscan_next_free(c, hi)) {
+            uint32_t len = fatscan_free_run(c, hi, count);
+            if (len == count) {
+                runs->count = 0;
+                extent_list_push(runs, c, len);
+                return 0;
+            }
+            if (got < count) {
+                uint32_t take = (len < count - got) ? len : count - got;
+                if (extent_list_push(runs, c, take) != 0) return -1;
+                got += take;
+            }
+            c += len;
+        }
+    }
+    return got == count ? 0 : -1;
+}
+
+/* Whether the FAT still has [start, start+len) free; the tree is only a cache of it. */
+static bool still_free(uint32_t start, uint32_t len) {
+    return fatscan_free_run(start, fsinfo.total_clusters + 2, len) == len;
+}
+
+/* 0 with the runs, -1 if the tree has no room, 1 if it offered a run the FAT has since used. */
+static int pick_tree(uint32_t count, ExtentList *runs) {
+    FreeExt *n = tree_best(count);
+    if (n) {
+        if (!still_free(n->start, count)) return 1;
+        return extent_list_push(runs, n->start, count);
+    }
+
+    /* Nothing holds it whole: take the largest extents, in descending size. */
+    FreeExt *taken = NULL;
+    uint32_t got = 0;
+    int rc = 0;
+    while (got < count && (n = tree_largest()) != NULL) {
+        uint32_t take = (n->len < count - got) ? n->len : count - got;
+        if (!still_free(n->start, take)) { rc = 1; break; }
+        if (extent_list_push(runs, n->start, take) != 0) { rc = -1; break; }
+        got += take;
+        tree_remove(n);
+        n->l[0] = taken;
+        taken = n;
+    }
+    while (taken) {
+        FreeExt *next = taken->l[0];
+        tree_insert(taken);
+        taken = next;
+    }
+    if (rc != 0) return rc;
+    return got == count ? 0 : -1;
+}
+
+/* A stale tree is rebuilt from the FAT once; after that the scan decides. */
+static int pick_best(uint32_t count, ExtentList *runs) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!tree_ready && tree_build() != 0) break;
+        int rc = pick_tree(count, runs);
+        if (rc <= 0) return rc;
+        runs->count = 0;
+        alloc_reset();
+    }
+    runs->count = 0;
+    return pick_scan(count, 2, runs);
+}
+
+static int pick(uint32_t count, uint32_t goal, ExtentList *runs) {
+    switch (fsinfo.alloc_policy) {
+    case ALLOC_NEXT_FIT:  return pick_scan(count, next_fit_cursor, runs);
+    case ALLOC_BEST_FIT:  return pick_best(count, runs);
+    case ALLOC_AFFINITY:  return pick_scan(count, goal + 1, runs);
+    default:              return pick_scan(count, 2, runs);
+    }
+}
+
+/*
+ * Links the chosen runs into one chain ending in EOC, with after (if a
+ * cluster) pointing at its head, all in one FAT write.
+ */
+static int mark_runs(const ExtentList *runs, uint32_t count, uint32_t after, ExtentList *out) {
+    /* Runs are not necessarily in disk order; the FAT writer copes with that. */
+    uint32_t *clusters = malloc((count + 1) * sizeof(uint32_t));
+    uint32_t *values = malloc((count + 1) * sizeof(uint32_t));
+    int rc = (clusters && values) ? 0 : -1;
+    uint32_t k = 0;
+    if (rc == 0 && after >= 2) {
+        clusters[k] = after;
+        values[k++] = runs->items[0].start;
+    }
+    for (uint32_t r = 0; rc == 0 && r < runs->count; r++) {
+        for (uint32_t j = 0; j < runs->items[r].count; j++) {
+            clusters[k] = runs->items[r].start + j;
+            if (k > 0) values[k-1] = clusters[k];
+            k++;
+        }
+    }
+    if (rc == 0) values[k-1] = EOC;
+    if (rc == 0) rc = fs_set_fat_entries(clusters, values, k);
+    for (uint32_t r = 0; rc == 0 && r < runs->count; r++) {
+        if (tree_ready) tree_take(runs->items[r].start, runs->items[r].count);
+        if (extent_list_push(out, runs->items[r].start, runs->items[r].count) != 0) rc = -1;
+    }
+    if (rc == 0) {
+        Extent *last = &runs->items[runs->count - 1];
+        next_fit_cursor = last->start + last->count;
+    }
+    free(clusters);
+    free(values);
+    return rc;
+}
+
+int fs_allocate_extents(uint32_t count, uint32_t goal, ExtentList *out) {
+    ExtentList runs = {0};
+    if (count == 0) return 0;
+    int rc = pick(count, goal, &runs);
+    if (rc != 0) {
+        extent_list_free(&runs);
+        return -1;
+    }
+
+    rc = mark_runs(&runs, count, 0, out);
+    extent_list_free(&runs);
+    return rc;
+}
+
+/*
+ * Allocates count physically adjacent clusters as one chain, right after goal
+ * when that space is free and wherever the policy finds a run that holds them
+ * otherwise. With link, goal is a chain's tail and gets pointed at the run in
+ * the same FAT write. Fails rather than splitting the request.
+ */
+int fs_allocate_run(uint32_t count, uint32_t goal, bool link, uint32_t *start_cluster) {
+    ExtentList runs = {0}, out = {0};
+    uint32_t end = fsinfo.total_clusters + 2;
+    int rc;
+    if (count == 0) return -1;
+    if (goal >= 2 && goal + 1 < end && fatscan_free_run(goal + 1, end, count) == count) rc = extent_list_push(&runs, goal + 1, count);
+    else rc = pick(count, goal, &runs);
+    if (rc == 0 && runs.count != 1) rc = -1;
+    if (rc == 0) rc = mark_runs(&runs, count, link ? goal : 0, &out);
+    if (rc == 0) *start_cluster = out.items[0].start;
+    extent_list_free(&runs);
+    extent_list_free(&out);
+    return rc;
+}
+
+int fs_allocate_cluster_chain(uint32_t count, uint32_t goal, uint32_t *start_cluster) {
+    ExtentList ext = {0};
+    if (fs_allocate_extents(count ? count : 1, goal, &ext) != 0) return -1;
+    *start_cluster = ext.items[0].start;
+    extent_list_free(&ext);
+    return 0;
+}
+
+int alloc_policy_parse(const char *name) {
+    for (int i = 0; i < (int)(sizeof(policy_names) / sizeof(policy_names[0])); i++) {
+        if (strcmp(name, policy_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+const char *alloc_policy_name(AllocPolicy p) {
+    return policy_names[p];
+}
@@ -0,0 +1,603 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fs.h"
+#include "catalog.h"
+#include "fdtable.h"
+#include "path.h"
+#include "utils.h"
+
+/*
+ * Metadata catalog. `catalog build` writes every directory entry of the
+ * volume into a sidecar file next to the image (IMAGE.cat, or DELTA.cat in
+ * overlay mode), sorted by (directory cluster, name), together with a table
+ * of directories. The file is mapped at mount, so name lookups, `ls` and
+ * `find` become binary searches in memory instead of directory reads.
+ *
+ * The catalog is trusted only while a 64-bit generation stamp, stored in
+ * reserved bytes of the image's FSInfo sector, matches the one in the
+ * sidecar. The first write of a session puts a fresh stamp into the image
+ * before the write itself goes out, and from then on everything goes back to
+ * the directories, so a crash cannot leave a catalog that looks current.
+ * Writes to the image that bypass a session with its catalog loaded (overlay
+ * commit, --apply) delete IMAGE.cat first. Other FAT tools leave the stamp
+ * alone, so after one has written the image, `catalog drop` is needed. When
+ * a sidecar exists, unmount rebuilds it if it is stale.
+ *
+ * Sidecar layout: header, dirs[ndirs] (by cluster), entries[nentries],
+ * then the NUL-terminated paths the entries and dirs point into.
+ */
+
+#define CATALOG_MAGIC    "F32CAT1"
+#define CATALOG_VERSION  1
+#define CATALOG_TAG      0x31544143u     /* "CAT1", after the stamp */
+#define FSI_STAMP_OFF    496             /* FSI_Reserved2 */
+#define CATALOG_DEPTH_MAX 64
+
+#pragma pack(push,1)
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t ndirs;
+    uint32_t nentries;
+    uint32_t root_cluster;
+    uint32_t cluster_size;
+    uint32_t total_clusters;
+    uint64_t generation;
+    uint64_t names_len;
+    uint8_t  reserved[16];
+} CatalogHeader;
+
+typedef struct {
+    uint32_t cluster;
+    uint32_t first;             /* its entries are entries[first .. first+count) */
+    uint32_t count;
+    uint32_t path;
+} CatalogDir;
+
+typedef struct {
+    uint32_t parent;            /* first cluster of the directory holding it */
+    char     key[11];           /* name as stored, upper case */
+    uint8_t  pad;
+    DirEntry e;
+    uint32_t sector;
+    uint32_t offset;
+    uint32_t slot;              /* position in the directory */
+    uint32_t extents;           /* contiguous runs in its chain */
+    uint32_t path;
+} CatalogEntry;
+#pragma pack(pop)
+
+typedef struct {
+    char path[512];
+    bool enabled;               /* a sidecar belongs to this image */
+    bool current;               /* the image stamp matches it */
+    uint8_t *map;
+    size_t map_len;
+    const CatalogHeader *h;
+    const CatalogDir *dirs;
+    const CatalogEntry *entries;
+    const char *names;
+    uint64_t hits, misses;
+} Catalog;
+
+static Catalog cat;
+static pthread_mutex_t cat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool live(void) {
+    return cat.map && __atomic_load_n(&cat.current, __ATOMIC_ACQUIRE);
+}
+
+/* ---- the stamp in the FSInfo sector ---- */
+
+static int stamp_io(uint64_t *gen, bool write) {
+    uint32_t bps = fsinfo.bytes_per_sector;
+    uint8_t buf[SECTOR_SIZE_MAX];
+    uint32_t lead, struc, tag;
+    if (fsinfo.fsi_sector == 0 || fsinfo.fsi_sector >= fsinfo.reserved_sector_count) return -1;
+    uint64_t off = (uint64_t)fsinfo.fsi_sector * bps;
+    if (fsinfo.dev->read(fsinfo.dev, off, buf, bps) != 0) return -1;
+    memcpy(&lead, buf, 4);
+    memcpy(&struc, buf + 484, 4);
+    if (lead != 0x41615252 || struc != 0x61417272) return -1;
+    if (!write) {
+        memcpy(&tag, buf + FSI_STAMP_OFF + 8, 4);
+        if (tag == CATALOG_TAG) memcpy(gen, buf + FSI_STAMP_OFF, 8);
+        else *gen = 0;
+        return 0;
+    }
+    tag = CATALOG_TAG;
+    memcpy(buf + FSI_STAMP_OFF, gen, 8);
+    memcpy(buf + FSI_STAMP_OFF + 8, &tag, 4);
+    return fsinfo.dev->write(fsinfo.dev, off, buf, bps);
+}
+
+static uint64_t new_generation(void) {
+    static uint64_t last;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t g = ((uint64_t)ts.tv_sec << 30) ^ (uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 44);
+    if (g == 0 || g == last) g = last + 1;
+    last = g;
+    return g;
+}
+
+/* ---- mapping ---- */
+
+static void unmap(void) {
+    if (cat.map) munmap(cat.map, cat.map_len);
+    cat.map = NULL;
+    cat.map_len = 0;
+    cat.h = NULL;
+    cat.dirs = NULL;
+    cat.entries = NULL;
+    cat.names = NULL;
+}
+
+static int map_sidecar(void) {
+    int fd = open(cat.path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    void *m = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CatalogHeader)) {
+        m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (m == MAP_FAILED) return -1;
+
+    const CatalogHeader *h = m;
+    uint64_t want = sizeof(CatalogHeader) + (uint64_t)h->ndirs * sizeof(CatalogDir) +
+                    (uint64_t)h->nentries * sizeof(CatalogEntry) + h->names_len;
+    if (memcmp(h->magic, CATALOG_MAGIC, 8) != 0 || h->version != CATALOG_VERSION ||
+        h->root_cluster != fsinfo.root_cluster || h->cluster_size != fs_cluster_bytes() ||
+        h->total_clusters != fsinfo.total_clusters || want != (uint64_t)st.st_size ||
+        h->names_len == 0 || ((const char*)m)[st.st_size - 1] != '\0') {
+        munmap(m, (size_t)st.st_size);
+        return -1;
+    }
+    cat.map = m;
+    cat.map_len = (size_t)st.st_size;
+    cat.h = h;
+    cat.dirs = (const CatalogDir*)(cat.map + sizeof(CatalogHeader));
+    cat.entries = (const CatalogEntry*)(cat.dirs + h->ndirs);
+    cat.names = (const char*)(cat.entries + h->nentries);
+    return 0;
+}
+
+static const char *name_at(uint32_t off) {
+    return off < cat.h->names_len ? cat.names + off : "";
+}
+
+void catalog_load(const char *image_path) {
+    unmap();
+    memset(&cat, 0, sizeof(cat));
+    snprintf(cat.path, sizeof(cat.path), "%s.cat", image_path);
+    if (access(cat.path, F_OK) != 0) return;
+    cat.enabled = true;
+    uint64_t gen;
+    if (map_sidecar() != 0) return;
+    if (stamp_io(&gen, false) == 0 && gen != 0 && gen == cat.h->generation) {
+        __atomic_store_n(&cat.current, true, __ATOMIC_RELEASE);
+    } else {
+        unmap();
+    }
+}
+
+/* Called before every write to the image: the first one moves the image's stamp away from the sidecar's. */
+void catalog_note_write(void) {
+    if (!__atomic_load_n(&cat.current, __ATOMIC_ACQUIRE)) return;
+    pthread_mutex_lock(&cat_lock);
+    if (cat.current) {
+        uint64_t gen = new_generation();
+        /* If the stamp cannot be changed, the sidecar must not survive. */
+        if (stamp_io(&gen, true) != 0) unlink(cat.path);
+        __atomic_store_n(&cat.current, false, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&cat_lock);
+}
+
+/* Removes another image's sidecar before something writes that image behind its stamp. */
+void catalog_drop_file(const char *image_path) {
+    char path[520];
+    snprintf(path, sizeof(path), "%s.cat", image_path);
+    unlink(path);
+}
+
+/* The image changed underneath (overlay discard). */
+void catalog_invalidate(void) {
+    __atomic_store_n(&cat.current, false, __ATOMIC_RELEASE);
+}
+
+/* ---- building ---- */
+
+typedef struct {
+    CatalogEntry *e;
+    uint32_t n, cap;
+    CatalogDir *d;
+    uint32_t nd, capd;
+    char *names;
+    size_t len, ncap;
+} Builder;
+
+static int add_name(Builder *b, const char *s, uint32_t *off) {
+    size_t k = strlen(s) + 1;
+    if (b->len + k > b->ncap) {
+        size_t cap = b->ncap ? b->ncap * 2 : 4096;
+        while (cap < b->len + k) cap *= 2;
+        char *names = realloc(b->names, cap);
+        if (!names) return -1;
+        b->names = names;
+        b->ncap = cap;
+    }
+    if (b->len + k > UINT32_MAX) return -1;
+    memcpy(b->names + b->len, s, k);
+    *off = (uint32_t)b->len;
+    b->len += k;
+    return 0;
+}
+
+static uint32_t count_extents(uint32_t cluster) {
+    ExtentList ext = {0};
+    uint32_t n = 0;
+    if (cluster >= 2 && fs_chain_extents(cluster, UINT32_MAX, &ext) == 0) n = ext.count;
+    extent_list_free(&ext);
+    return n;
+}
+
+static int build_dir(Builder *b, uint32_t dir, const char *path, int depth) {
+    if (b->nd == b->capd) {
+        uint32_t cap = b->capd ? b->capd * 2 : 64;
+        CatalogDir *d = realloc(b->d, cap * sizeof(CatalogDir));
+        if (!d) return -1;
+        b->d = d;
+        b->capd = cap;
+    }
+    CatalogDir *cd = &b->d[b->nd++];
+    cd->cluster = dir;
+    cd->first = cd->count = 0;
+    if (add_name(b, path, &cd->path) != 0) return -1;
+
+    uint32_t bpc = fs_cluster_bytes(), bps = fsinfo.bytes_per_sector;
+    uint8_t *buf = malloc(bpc);
+    if (!buf) return -1;
+    uint32_t first = b->n, slot = 0;
+    int rc = 0;
+    bool end = false;
+    for (uint32_t c = dir; rc == 0 && !end && c >= 2 && c < 0x0FFFFFF8; c = get_fat_entry(c)) {
+        if (read_sectors(cluster_to_sector(c), fsinfo.sectors_per_cluster, buf) != 0) {
+            rc = -1;
+            break;
+        }
+        for (uint32_t i = 0; rc == 0 && i < bpc; i += 32, slot++) {
+            const DirEntry *e = (const DirEntry*)&buf[i];
+            if (e->DIR_Name[0] == 0x00) {
+                end = true;
+                break;
+            }
+            if ((e->DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME || e->DIR_Name[0] == 0xE5) continue;
+            if (b->n == b->cap) {
+                uint32_t cap = b->cap ? b->cap * 2 : 1024;
+                CatalogEntry *grown = realloc(b->e, cap * sizeof(CatalogEntry));
+                if (!grown) {
+                    rc = -1;
+                    break;
+                }
+                b->e = grown;
+                b->cap = cap;
+            }
+            CatalogEntry *ce = &b->e[b->n];
+            memset(ce, 0, sizeof(*ce));
+            ce->parent = dir;
+            for (int k = 0; k < 11; k++) ce->key[k] = (char)toupper(e->DIR_Name[k]);
+            ce->e = *e;
+            ce->sector = cluster_to_sector(c) + i / bps;
+            ce->offset = i % bps;
+            ce->slot = slot;
+            ce->extents = is_dot_entry(e) ? 0 : count_extents(((uint32_t)e->DIR_FstClusHI << 16) | e->DIR_FstClusLO);
+            char name[12], child[1024];
+            entry_name(e, name);
+            snprintf(child, sizeof(child), "%s%s%s", strcmp(path, "/") == 0 ? "" : path, "/", name);
+            if (add_name(b, is_dot_entry(e) ? "" : child, &ce->path) != 0) rc = -1;
+            b->n++;
+        }
+    }
+    free(buf);
+
+    uint32_t last = b->n;
+    for (uint32_t k = first; rc == 0 && k < last && depth < CATALOG_DEPTH_MAX; k++) {
+        const DirEntry *e = &b->e[k].e;
+        uint32_t sub = ((uint32_t)e->DIR_FstClusHI << 16) | e->DIR_FstClusLO;
+        if (!(e->DIR_Attr & ATTR_DIRECTORY) || is_dot_entry(e) || sub < 2) continue;
+        /* The name table may move while the subdirectory is added. */
+        char sub_path[1024];
+        snprintf(sub_path, sizeof(sub_path), "%s", b->names + b->e[k].path);
+        rc = build_dir(b, sub, sub_path, depth + 1);
+    }
+    return rc;
+}
+
+static int cmp_entry(const void *a, const void *b) {
+    const CatalogEntry *x = a, *y = b;
+    if (x->parent != y->parent) return x->parent < y->parent ? -1 : 1;
+    int c = memcmp(x->key, y->key, 11);
+    if (c) return c;
+    return (x->slot > y->slot) - (x->slot < y->slot);
+}
+
+static int cmp_dir(const void *a, const void *b) {
+    const CatalogDir *x = a, *y = b;
+    return (x->cluster > y->cluster) - (x->cluster < y->cluster);
+}
+
+/* Sorts what was collected, points each directory at its entries and writes the sidecar under gen. */
+static int write_sidecar(Builder *b, uint64_t gen) {
+    qsort(b->e, b->n, sizeof(CatalogEntry), cmp_entry);
+    qsort(b->d, b->nd, sizeof(CatalogDir), cmp_dir);
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < b->nd; i++) {
+        while (k < b->n && b->e[k].parent < b->d[i].cluster) k++;
+        b->d[i].first = k;
+        while (k < b->n && b->e[k].parent == b->d[i].cluster) k++;
+        b->d[i].count = k - b->d[i].first;
+    }
+
+    CatalogHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CATALOG_MAGIC, 8);
+    h.version = CATALOG_VERSION;
+    h.ndirs = b->nd;
+    h.nentries = b->n;
+    h.root_cluster = fsinfo.root_cluster;
+    h.cluster_size = fs_cluster_bytes();
+    h.total_clusters = fsinfo.total_clusters;
+    h.generation = gen;
+    h.names_len = b->len;
+
+    /* Written aside and renamed over, so a mapped old catalog stays intact. */
+    char tmp[520];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cat.path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return -1;
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+              fwrite(b->d, sizeof(CatalogDir), b->nd, f) == b->nd &&
+              fwrite(b->e, sizeof(CatalogEntry), b->n, f) == b->n &&
+              fwrite(b->names, 1, b->len, f) == b->len;
+    ok = fflush(f) == 0 && ok;
+    ok = fsync(fileno(f)) == 0 && ok;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, cat.path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Walks the whole tree into a new sidecar, then stamps the image with its generation and maps it. */
+static int catalog_build(void) {
+    Builder b;
+    memset(&b, 0, sizeof(b));
+    uint64_t gen = new_generation();
+    int rc = stamp_io(&(uint64_t){0}, false);
+    if (rc != 0) print_error("Image has no FSInfo sector to hold the catalog stamp.");
+    if (rc == 0) rc = build_dir(&b, fsinfo.root_cluster, "/", 0);
+    if (rc == 0) {
+        unmap();
+        rc = write_sidecar(&b, gen);
+    }
+    /* The sidecar goes first: a crash before the stamp leaves it stale, not wrong. */
+    if (rc == 0) rc = stamp_io(&gen, true);
+    if (rc == 0) rc = map_sidecar();
+    if (rc == 0) {
+        cat.enabled = true;
+        __atomic_store_n(&cat.current, true, __ATOMIC_RELEASE);
+    }
+    free(b.e);
+    free(b.d);
+    free(b.names);
+    return rc;
+}
+
+void catalog_close(void) {
+    if (fsinfo.dev && cat.enabled && !live()) catalog_build();
+    unmap();
+    memset(&cat, 0, sizeof(cat));
+}
+
+/* Puts a copy of a current catalog next to a clone of the image. */
+int catalog_copy(const char *dst_image_path) {
+    if (!live()) return 0;
+    char dst[520];
+    snprintf(dst, sizeof(dst), "%s.cat", dst_image_path);
+    return image_copy_file(cat.path, dst);
+}
+
+/* ---- queries ---- */
+
+static const CatalogDir *find_dir(uint32_t cluster) {
+    uint32_t lo = 0, hi = cat.h->ndirs;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (cat.dirs[mid].cluster < cluster) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == cat.h->ndirs || cat.dirs[lo].cluster != cluster) return NULL;
+    const CatalogDir *d = &cat.dirs[lo];
+    if (d->first > cat.h->nentries || d->count > cat.h->nentries - d->first) return NULL;
+    return d;
+}
+
+/*
+ * Looks name (padded, upper case) up in directory dir. Returns 1 with the
+ * entry and its location, 0 if the directory has no such name, or -1 if the
+ * catalog cannot answer.
+ */
+int catalog_lookup(uint32_t dir, const char key[11], DirEntry *out, uint32_t *sector, uint32_t *offset) {
+    if (!live()) return -1;
+    const CatalogDir *d = find_dir(dir);
+    if (!d) return -1;
+    uint32_t lo = d->first, hi = d->first + d->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (memcmp(cat.entries[mid].key, key, 11) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == d->first + d->count || memcmp(cat.entries[lo].key, key, 11) != 0) {
+        __atomic_fetch_add(&cat.misses, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    __atomic_fetch_add(&cat.hits, 1, __ATOMIC_RELAXED);
+    *out = cat.entries[lo].e;
+    *sector = cat.entries[lo].sector;
+    *offset = cat.entries[lo].offset;
+    return 1;
+}
+
+static int cmp_slot(const void *a, const void *b) {
+    const CatalogEntry *x = *(const CatalogEntry* const*)a, *y = *(const CatalogEntry* const*)b;
+    return (x->slot > y->slot) - (x->slot < y->slot);
+}
+
+/* A directory's entries in on-disk order; NULL if the catalog cannot answer. */
+static const CatalogEntry **dir_listing(uint32_t dir, uint32_t *count) {
+    const CatalogDir *d = live() ? find_dir(dir) : NULL;
+    if (!d) return NULL;
+    const CatalogEntry **v = malloc(((size_t)d->count + 1) * sizeof(CatalogEntry*));
+    if (!v) return NULL;
+    for (uint32_t i = 0; i < d->count; i++) v[i] = &cat.entries[d->first + i];
+    qsort(v, d->count, sizeof(CatalogEntry*), cmp_slot);
+    *count = d->count;
+    return v;
+}
+
+/* ls from the catalog; -1 if it cannot answer. */
+int catalog_ls(uint32_t dir) {
+    uint32_t n;
+    const CatalogEntry **v = dir_listing(dir, &n);
+    if (!v) return -1;
+    for (uint32_t i = 0; i < n; i++) {
+        char fname[12];
+        entry_name(&v[i]->e, fname);
+        if (v[i]->e.DIR_Attr & ATTR_DIRECTORY) printf("\033[34m%s\033[0m    ", fname);
+        else printf("%s    ", fname);
+    }
+    free(v);
+    return 0;
+}
+
+static bool leaf_matches(const char *pattern, const DirEntry *e) {
+    if (!pattern) return true;
+    char name[12];
+    entry_name(e, name);
+    to_upper(name);
+    return fnmatch(pattern, name, 0) == 0;
+}
+
+typedef struct {
+    const char *base;
+    const char *pattern;
+} FindCtx;
+
+static int find_visit(const DirEntry *e, const char *path, void *arg) {
+    FindCtx *ctx = arg;
+    if (leaf_matches(ctx->pattern, e)) printf("%s%s\n", ctx->base, path);
+    return 0;
+}
+
+/* Directories below CATALOG_DEPTH_MAX are not in the catalog; those subtrees are read from disk. */
+static int find_in(uint32_t dir, const char *pattern, int depth) {
+    uint32_t n;
+    const CatalogEntry **v = dir_listing(dir, &n);
+    if (!v) return -1;
+    int rc = 0;
+    for (uint32_t i = 0; rc == 0 && i < n; i++) {
+        const DirEntry *e = &v[i]->e;
+        if ((e->DIR_Attr & ATTR_VOLUME_ID) || is_dot_entry(e)) continue;
+        if (leaf_matches(pattern, e)) printf("%s\n", name_at(v[i]->path));
+        uint32_t sub = ((uint32_t)e->DIR_FstClusHI << 16) | e->DIR_FstClusLO;
+        if (!(e->DIR_Attr & ATTR_DIRECTORY) || sub < 2) continue;
+        if (depth < CATALOG_DEPTH_MAX && find_dir(sub)) {
+            rc = find_in(sub, pattern, depth + 1);
+        } else {
+            FindCtx ctx = {name_at(v[i]->path), pattern};
+            rc = fs_walk_tree(sub, find_visit, &ctx);
+        }
+    }
+    free(v);
+    return rc;
+}
+
+int fs_find(const char *dirname, const char *pattern) {
+    uint32_t dir = fsinfo.cwd_cluster;
+    char base[512], pat[256];
+    int rc = path_dir(dirname ? dirname : ".", &dir);
+    if (rc == -2) {
+        print_error("Not a directory.");
+        return -1;
+    }
+    if (rc != 0) {
+        print_error("Directory does not exist.");
+        return -1;
+    }
+    if (path_normalize(current_path, dirname ? dirname : ".", base, sizeof(base)) != 0) {
+        print_error("Path too long.");
+        return -1;
+    }
+    to_upper(base);
+    if (pattern) {
+        snprintf(pat, sizeof(pat), "%s", pattern);
+        to_upper(pat);
+    }
+    if (live() && find_dir(dir)) {
+        return find_in(dir, pattern ? pat : NULL, 0);
+    }
+    FindCtx ctx = {strcmp(base, "/") == 0 ? "" : base, pattern ? pat : NULL};
+    return fs_walk_tree(dir, find_visit, &ctx);
+}
+
+int fs_catalog(const char *action) {
+    if (!action) {
+        if (live()) {
+            printf("catalog: %u entries in %u directories, current (%llu hits, %llu misses)\n",
+                   cat.h->nentries, cat.h->ndirs, (unsigned long long)cat.hits, (unsigned long long)cat.misses);
+        } else if (cat.enabled) {
+            printf("catalog: stale, rebuilt at unmount\n");
+        } else {
+            printf("catalog: none\n");
+        }
+        return 0;
+    }
+    if (strcmp(action, "build") == 0) {
+        /* Handles may hold sizes not yet on disk. */
+        for (int fd = 0; fd < fd_limit(); fd++) {
+            OpenFileEntry *of = fd_get(fd);
+            if (of) fs_flush(of);
+        }
+        if (catalog_build() != 0) {
+            print_error("Failed to build catalog.");
+            return -1;
+        }
+        uint32_t fragmented = 0;
+        for (uint32_t i = 0; i < cat.h->nentries; i++) if (cat.entries[i].extents > 1) fragmented++;
+        printf("catalog: %u entries in %u directories, %u fragmented\n", cat.h->nentries, cat.h->ndirs, fragmented);
+        return 0;
+    }
+    if (strcmp(action, "drop") == 0) {
+        unmap();
+        __atomic_store_n(&cat.current, false, __ATOMIC_RELEASE);
+        cat.enabled = false;
+        unlink(cat.path);
+        return 0;
+    }
+    print_error("Usage: catalog [build|drop]");
+    return -1;
+}
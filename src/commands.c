@@ -1,16 +1,203 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include "commands.h"
 #include "fs.h"
 #include "utils.h"
+#include "alloc.h"
+#include "trace.h"
 
 extern char current_path[512];
 
+/* Returns the text following the first n whitespace-separated words of line, without surrounding quotes. */
+static char *rest_of_line(char *line, int n) {
+    char *p = line;
+    for (int i = 0; i < n; i++) {
+        while (*p == ' ') p++;
+        while (*p && *p != ' ') p++;
+    }
+    while (*p == ' ') p++;
+    size_t len = strlen(p);
+    if (len >= 2 && p[0] == '"' && p[len-1] == '"') {
+        p[len-1] = '\0';
+        p++;
+    }
+    return p;
+}
+
+/* Parses a decimal offset or size; it must fit the 32-bit file sizes of FAT32. */
+static bool parse_u32(const char *s, uint32_t *out) {
+    char *end;
+    if (*s < '0' || *s > '9') return false;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno != 0 || *end || v > UINT32_MAX) return false;
+    *out = (uint32_t)v;
+    return true;
+}
+
+/*
+ * Runs one parsed command. line is the original command line and skip the
+ * number of leading words that are not part of this command (a prefix such
+ * as "alloc best-fit"). Returns 1 when the shell should exit.
+ */
+static int run_command(int argc, char **args, char *line, int skip) {
+    uint32_t n;
+    if (strcmp(args[0], "exit") == 0) {
+        return 1;
+    } else if(strcmp(args[0], "pwd") == 0) {
+        printf("%s\n", current_path);
+    } else if (strcmp(args[0], "info") == 0) {
+        fs_info();
+    } else if (strcmp(args[0], "cd") == 0) {
+        if (argc != 2) print_error("Usage: cd [DIRNAME]");
+        else fs_cd(args[1]);
+    } else if (strcmp(args[0], "ls") == 0) {
+        if (argc>2) print_error("Usage: ls [DIRNAME]");
+        else fs_ls(argc==2 ? args[1] : NULL);
+    } else if (strcmp(args[0], "mkdir") == 0) {
+        if (argc!=2) print_error("Usage: mkdir [DIRNAME]");
+        else fs_mkdir(args[1]);
+    } else if (strcmp(args[0], "touch") == 0) {
+        if (argc!=2) print_error("Usage: creat [FILENAME]");
+        else fs_creat(args[1]);
+    } else if (strcmp(args[0],"open")==0) {
+        int fd;
+        if (argc!=3) print_error("Usage: open [FILENAME] [FLAGS]");
+        else if ((fd = fs_open(args[1], args[2])) >= 0) printf("fd %d\n", fd);
+    } else if (strcmp(args[0],"close")==0) {
+        if (argc!=2) print_error("Usage: close [FILENAME|FD]");
+        else fs_close(args[1]);
+    } else if (strcmp(args[0],"lsof")==0) {
+        fs_lsof();
+    } else if (strcmp(args[0],"size")==0) {
+        if (argc!=2) print_error("Usage: size [FILENAME]");
+        else fs_size(args[1]);
+    } else if (strcmp(args[0],"lseek")==0) {
+        if (argc!=3 || !parse_u32(args[2], &n)) print_error("Usage: lseek [FILENAME|FD] [OFFSET]  (0 to 4294967295)");
+        else fs_lseek(args[1], n);
+    } else if (strcmp(args[0],"read")==0) {
+        if (argc!=3 || !parse_u32(args[2], &n)) print_error("Usage: read [FILENAME|FD] [SIZE]  (0 to 4294967295)");
+        else fs_read(args[1], n);
+    } else if (strcmp(args[0],"write")==0) {
+        if (argc<3) print_error("Usage: write [FILENAME|FD] [STRING]");
+        else fs_write(args[1], rest_of_line(line, skip + 2));
+    } else if (strcmp(args[0],"sync")==0) {
+        fs_sync();
+    } else if (strcmp(args[0],"fallocate")==0) {
+        if (argc!=3 || !parse_u32(args[2], &n)) print_error("Usage: fallocate [FILENAME] [SIZE]  (0 to 4294967295)");
+        else fs_fallocate(args[1], n);
+    } else if (strcmp(args[0],"truncate")==0) {
+        if (argc!=3 || !parse_u32(args[2], &n)) print_error("Usage: truncate [FILENAME] [SIZE]  (0 to 4294967295)");
+        else fs_truncate(args[1], n);
+    } else if (strcmp(args[0],"rename")==0) {
+        if (argc!=3) print_error("Usage: rename [FILENAME] [NEW_FILENAME]");
+        else fs_rename(args[1], args[2]);
+    } else if (strcmp(args[0],"rm")==0) {
+        if (argc>=3 && strcmp(args[1],"-r")==0) fs_rm_recursive(&args[2], argc-2);
+        else if (argc!=2) print_error("Usage: rm [-r] [FILENAME]");
+        else fs_rm(args[1]);
+    } else if (strcmp(args[0],"cp")==0) {
+        if (argc==4 && strcmp(args[1],"-r")==0) fs_cp(args[2], args[3], true);
+        else if (argc==3) fs_cp(args[1], args[2], false);
+        else print_error("Usage: cp [-r] [SRC] [DST]");
+    } else if (strcmp(args[0],"put")==0) {
+        if (argc==4 && strcmp(args[1],"-r")==0) fs_put(args[2], args[3], true);
+        else if (argc==3) fs_put(args[1], args[2], false);
+        else print_error("Usage: put [-r] [HOST_PATH] [DST]");
+    } else if (strcmp(args[0],"export-tar")==0) {
+        if (argc==3 && strcmp(args[1],"-o")==0) fs_export_tar(NULL, args[2]);
+        else if (argc==4 && strcmp(args[2],"-o")==0) fs_export_tar(args[1], args[3]);
+        else print_error("Usage: export-tar [DIRNAME] -o [HOST_FILE]  (--export-tar at startup writes to stdout)");
+    } else if (strcmp(args[0],"compact")==0) {
+        if (argc>=2 && strcmp(args[1],"-auto")==0 && argc<=3) fs_compact_auto(argc==3 ? args[2] : NULL);
+        else if (argc>2) print_error("Usage: compact [DIRNAME] | compact -auto [PERCENT]");
+        else fs_compact(argc==2 ? args[1] : NULL);
+    } else if (strcmp(args[0],"catalog")==0) {
+        if (argc>2) print_error("Usage: catalog [build|drop]");
+        else fs_catalog(argc==2 ? args[1] : NULL);
+    } else if (strcmp(args[0],"find")==0) {
+        if (argc==1) fs_find(NULL, NULL);
+        else if (argc==2) fs_find(args[1], NULL);
+        else if (argc==3 && strcmp(args[1],"-name")==0) fs_find(NULL, args[2]);
+        else if (argc==4 && strcmp(args[2],"-name")==0) fs_find(args[1], args[3]);
+        else print_error("Usage: find [DIRNAME] [-name PATTERN]");
+    } else if (strcmp(args[0],"rmdir")==0) {
+        if (argc!=2) print_error("Usage: rmdir [DIRNAME]");
+        else fs_rmdir(args[1]);
+    } else if (strcmp(args[0],"pack")==0) {
+        if (argc!=2) print_error("Usage: pack [OUT.f32z]");
+        else fs_pack(args[1]);
+    } else if (strcmp(args[0],"unpack")==0) {
+        if (argc!=2) print_error("Usage: unpack [OUT.img]");
+        else fs_unpack(args[1]);
+    } else if (strcmp(args[0],"clone")==0) {
+        if (argc!=2) print_error("Usage: clone [OUT.img]");
+        else fs_clone(args[1]);
+    } else if (strcmp(args[0],"diff")==0) {
+        if (argc==4 && strcmp(args[1],"-full")==0) fs_diff(args[2], args[3], true);
+        else if (argc==3) fs_diff(args[1], args[2], false);
+        else print_error("Usage: diff [-full] [OTHER.img] [OUT.delta]");
+    } else if (strcmp(args[0],"df")==0) {
+        fs_df();
+    } else if (strcmp(args[0],"frag")==0) {
+        if (argc==2 && strcmp(args[1],"-a")==0) fs_frag(true);
+        else if (argc!=1) print_error("Usage: frag [-a]");
+        else fs_frag(false);
+    } else if (strcmp(args[0],"hash")==0) {
+        fs_hash();
+    } else if (strcmp(args[0],"verify")==0) {
+        if (argc==2 && strcmp(args[1],"-full")==0) fs_verify(true);
+        else if (argc!=1) print_error("Usage: verify [-full]");
+        else fs_verify(false);
+    } else if (strcmp(args[0],"dupes")==0) {
+        fs_dupes();
+    } else if (strcmp(args[0],"alloc")==0) {
+        int p = argc >= 2 ? alloc_policy_parse(args[1]) : -1;
+        if (argc == 1) {
+            printf("allocation policy: %s\n", alloc_policy_name(fsinfo.alloc_policy));
+        } else if (p < 0) {
+            print_error("Usage: alloc [first-fit|next-fit|best-fit|affinity] [COMMAND...]");
+        } else if (argc == 2) {
+            fsinfo.alloc_policy = (AllocPolicy)p;
+        } else {
+            /* One command under a different policy. */
+            AllocPolicy saved = fsinfo.alloc_policy;
+            fsinfo.alloc_policy = (AllocPolicy)p;
+            int rc = run_command(argc - 2, args + 2, line, skip + 2);
+            fsinfo.alloc_policy = saved;
+            return rc;
+        }
+    } else if (strcmp(args[0],"overlay")==0) {
+        if (argc!=2) print_error("Usage: overlay [status|commit|discard]");
+        else fs_overlay(args[1]);
+    } else {
+        print_error("Unknown command.");
+    }
+    return 0;
+}
+
+/* Parses and runs one command line (modified in place). Returns 1 for exit. */
+int shell_execute(char *cmdline) {
+    char orig_line[256];
+    char *args[17];
+
+    snprintf(orig_line, sizeof(orig_line), "%s", cmdline);
+    int argc = 0;
+    char *token = strtok(cmdline, " ");
+    while (token && argc < 16) {
+        args[argc++] = token;
+        token = strtok(NULL, " ");
+    }
+    args[argc] = NULL;
+    if (argc == 0) return 0;
+    return run_command(argc, args, orig_line, 0);
+}
+
 void run_shell() {
     char cmdline[256];
     char orig_line[256];
-    char *args[16];
 
     while (1) {
         printf("%s%s> ", fsinfo.image_name, current_path);
@@ -22,71 +209,10 @@ void run_shell() {
 
         strcpy(orig_line, cmdline);
 
-        int argc = 0;
-        char *token = strtok(cmdline, " ");
-        while (token && argc < 16) {
-            args[argc++] = token;
-            token = strtok(NULL, " ");
-        }
-        args[argc] = NULL;
-        if (argc == 0) continue;
-
-        if (strcmp(args[0], "exit") == 0) {
-            break;
-        } else if(strcmp(args[0], "pwd") == 0) {
-            printf("%s\n", current_path);
-        } else if (strcmp(args[0], "info") == 0) {
-            fs_info();
-        } else if (strcmp(args[0], "cd") == 0) {
-            if (argc != 2) {
-                print_error("Usage: cd [DIRNAME]");
-            } else {
-                char old_path[512];
-                strcpy(old_path, current_path);
-
-                if (fs_cd(args[1]) == 0) {
-                    if (strcmp(args[1], ".") == 0) {
-                    } else if (strcmp(args[1], "..") == 0) {
-                        if (strcmp(current_path, "/") != 0) {
-                            char *last_slash = strrchr(current_path, '/');
-                            if (last_slash && last_slash != current_path) {
-                                *last_slash = '\0';
-                            } else {
-                                strcpy(current_path, "/");
-                            }
-                        }
-                    } else {
-                        if (strcmp(current_path, "/") == 0) {
-                            snprintf(current_path, sizeof(current_path), "/%s", args[1]);
-                        } else {
-                            size_t len = strlen(current_path);
-                            snprintf(current_path + len, sizeof(current_path) - len, "/%s", args[1]);
-                        }
-                    }
-                } else {
-                    strcpy(current_path, old_path);
-                }
-            }
-        } else if (strcmp(args[0], "ls") == 0) {
-            fs_ls();
-        } else if (strcmp(args[0], "mkdir") == 0) {
-            if (argc!=2) print_error("Usage: mkdir [DIRNAME]");
-            else fs_mkdir(args[1]);
-        } else if (strcmp(args[0], "touch") == 0) {
-            if (argc!=2) print_error("Usage: creat [FILENAME]");
-            else fs_creat(args[1]);
-        } else if (strcmp(args[0],"rename")==0) {
-            if (argc!=3) print_error("Usage: rename [FILENAME] [NEW_FILENAME]");
-            else fs_rename(args[1], args[2]);
-        } else if (strcmp(args[0],"rm")==0) {
-            if (argc!=2) print_error("Usage: rm [FILENAME]");
-            else fs_rm(args[1]);
-        } else if (strcmp(args[0],"rmdir")==0) {
-            if (argc!=2) print_error("Usage: rmdir [DIRNAME]");
-            else fs_rmdir(args[1]);
-        } else {
-            print_error("Unknown command.");
-        }
+        IoStats before;
+        io_stats_get(&before);
+        uint64_t start = trace_now_us();
+        if (shell_execute(cmdline)) break;
+        trace_record(orig_line, start, &before);
     }
 }
-
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs.h"
+#include "fdtable.h"
+#include "compact.h"
+#include "geom.h"
+#include "path.h"
+#include "utils.h"
+
+/*
+ * Directory compaction. Deleting only marks a slot 0xE5 and directories never
+ * shrink, so a directory that has seen many files keeps its largest size and
+ * every lookup walks the dead slots. Compaction rewrites the live entries
+ * (long-name entries included, in order) densely from the first slot, puts
+ * the 0x00 terminator after them, cuts the chain after the last cluster still
+ * needed and frees the rest. Only sectors whose contents change are written.
+ * Long-name runs whose short entry is gone, or does not match their checksum,
+ * count as dead.
+ *
+ * Entries only move towards the start, so sectors are written in ascending
+ * order, in batches separated by a device sync: a sector is not overwritten
+ * until every entry moving out of it is on disk in its new place. A crash
+ * part way can leave a moved entry in both places but never loses one, and a
+ * crash before the chain is cut only leaks the tail clusters, which lie past
+ * the terminator.
+ *
+ * With an automatic threshold set, dir_maybe_compact runs on the directory
+ * an entry left: the parent of what rm, rmdir or rm -r removed, and the old
+ * parent of an entry rename moved elsewhere. It compacts once the dead share
+ * of the slots reaches the threshold and at least one cluster would be freed.
+ */
+
+typedef struct {
+    ClusterList chain;
+    uint8_t *buf;               /* the whole directory */
+    uint64_t *kept;             /* slots of the live entries, ascending */
+    uint32_t live, dead;
+} DirImage;
+
+static uint32_t slots_per_cluster(void) {
+    return fs_cluster_bytes() / 32;
+}
+
+static void dir_image_free(DirImage *d) {
+    cluster_list_free(&d->chain);
+    free(d->buf);
+    free(d->kept);
+    d->buf = NULL;
+    d->kept = NULL;
+}
+
+static uint8_t lfn_checksum(const uint8_t *short_name) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + short_name[i]);
+    return sum;
+}
+
+/* Reads the chain (contiguous clusters in one request, all runs in one batch) and counts slots up to the terminator. */
+static int dir_image_load(uint32_t dir, DirImage *d) {
+    FatCursor fc = {0};
+    memset(d, 0, sizeof(*d));
+    uint32_t bpc = fs_cluster_bytes();
+    if (fs_collect_chain(dir, &fc, &d->chain) != 0 || d->chain.count == 0) return -1;
+    d->buf = malloc((size_t)d->chain.count * bpc);
+    SectorReq *reqs = malloc(d->chain.count * sizeof(SectorReq));
+    int rc = (d->buf && reqs) ? 0 : -1;
+    uint32_t n = 0;
+    for (uint32_t i = 0; rc == 0 && i < d->chain.count; ) {
+        uint32_t run = 1;
+        while (i + run < d->chain.count && d->chain.items[i + run] == d->chain.items[i] + run) run++;
+        reqs[n++] = (SectorReq){cluster_to_sector(d->chain.items[i]), run * fsinfo.sectors_per_cluster,
+                                d->buf + (size_t)i * bpc, false};
+        i += run;
+    }
+    if (rc == 0) rc = sectors_batch(reqs, n);
+    free(reqs);
+    if (rc != 0) return -1;
+
+    uint64_t nslots = (uint64_t)d->chain.count * slots_per_cluster();
+    if (!(d->kept = malloc(nslots * sizeof(uint64_t)))) return -1;
+    uint64_t run = 0;
+    uint32_t pending = 0;       /* long-name slots waiting for their short entry */
+    for (uint64_t i = 0; i < nslots; i++) {
+        const uint8_t *e = d->buf + i * 32;
+        if (e[0] == 0x00) break;
+        if (e[0] == 0xE5) {
+            d->dead += 1 + pending;
+            pending = 0;
+        } else if ((e[11] & ATTR_LONG_NAME) == ATTR_LONG_NAME) {
+            if (pending++ == 0) run = i;
+        } else {
+            uint8_t sum = lfn_checksum(e);
+            bool match = true;
+            for (uint32_t j = 0; j < pending; j++) match = match && d->buf[(run + j) * 32 + 13] == sum;
+            for (uint32_t j = 0; j < pending && match; j++) d->kept[d->live++] = run + j;
+            if (!match) d->dead += pending;
+            d->kept[d->live++] = i;
+            pending = 0;
+        }
+    }
+    d->dead += pending;
+    return 0;
+}
+
+/* Leaves room for the terminator, so a crash before the chain is cut never exposes the tail. */
+static uint32_t clusters_needed(uint32_t live) {
+    return live / slots_per_cluster() + 1;
+}
+
+static uint32_t slot_sector(const DirImage *d, uint64_t slot) {
+    uint64_t per_sector = fsinfo.bytes_per_sector / 32;
+    uint32_t sector = (uint32_t)(slot / per_sector);
+    return cluster_to_sector(d->chain.items[sector / fsinfo.sectors_per_cluster]) + sector % fsinfo.sectors_per_cluster;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Open handles remember where their entry is; move them along with it. */
+static void relocate_handles(const DirImage *d, const uint64_t *moved_from, uint32_t count) {
+    uint32_t per_sector = fsinfo.bytes_per_sector / 32;
+    for (int fd = 0; fd < fd_limit(); fd++) {
+        OpenFileEntry *of = fd_get(fd);
+        if (!of || of->dir_entry_sector < fsinfo.first_data_sector) continue;
+        uint32_t rel = of->dir_entry_sector - fsinfo.first_data_sector;
+        uint32_t c = geom_sector_to_cluster(of->dir_entry_sector);
+        for (uint32_t i = 0; i < d->chain.count; i++) {
+            if (d->chain.items[i] != c) continue;
+            uint64_t slot = ((uint64_t)i * fsinfo.sectors_per_cluster + rel % fsinfo.sectors_per_cluster) * per_sector +
+                            of->dir_entry_offset / 32;
+            /* moved_from is ascending, in the order entries were copied. */
+            const uint64_t *hit = bsearch(&slot, moved_from, count, sizeof(uint64_t), cmp_u64);
+            if (hit) {
+                uint32_t k = (uint32_t)(hit - moved_from);
+                of->dir_entry_sector = slot_sector(d, k);
+                of->dir_entry_offset = (k % per_sector) * 32;
+            }
+            break;
+        }
+    }
+}
+
+/* Writes a batch of sectors and makes it durable before anything that depends on it. */
+static int write_barrier(SectorReq *reqs, uint32_t n) {
+    if (n > 0 && sectors_batch(reqs, n) != 0) return -1;
+    return fsinfo.dev->sync(fsinfo.dev);
+}
+
+static int dir_compact(const DirImage *d, uint32_t *freed) {
+    uint32_t bpc = fs_cluster_bytes();
+    uint32_t per_sector = fsinfo.bytes_per_sector / 32;
+    uint32_t keep = clusters_needed(d->live);
+    uint32_t nsec = keep * fsinfo.sectors_per_cluster;
+    uint8_t *out = calloc(1, (size_t)keep * bpc);
+    uint32_t *after = calloc(nsec, sizeof(uint32_t));
+    SectorReq *reqs = malloc((size_t)nsec * sizeof(SectorReq));
+    int rc = (out && after && reqs) ? 0 : -1;
+
+    /* after[s]: one past the last earlier sector that receives an entry from s. */
+    for (uint32_t k = 0; rc == 0 && k < d->live; k++) {
+        memcpy(out + (size_t)k * 32, d->buf + d->kept[k] * 32, 32);
+        uint64_t from = d->kept[k] / per_sector, to = k / per_sector;
+        if (from < nsec && to < from && after[from] < to + 1) after[from] = (uint32_t)to + 1;
+    }
+
+    uint32_t n = 0, batch_start = 0;
+    for (uint32_t s = 0; rc == 0 && s < nsec; s++) {
+        size_t at = (size_t)s * fsinfo.bytes_per_sector;
+        if (memcmp(out + at, d->buf + at, fsinfo.bytes_per_sector) == 0) continue;
+        if (n > 0 && after[s] > batch_start) {
+            rc = write_barrier(reqs, n);
+            n = 0;
+        }
+        if (n == 0) batch_start = s;
+        uint32_t sector = cluster_to_sector(d->chain.items[s / fsinfo.sectors_per_cluster]) + s % fsinfo.sectors_per_cluster;
+        if (n > 0 && reqs[n-1].sector + reqs[n-1].count == sector) reqs[n-1].count++;
+        else reqs[n++] = (SectorReq){sector, 1, out + at, true};
+    }
+    if (rc == 0) rc = write_barrier(reqs, n);
+    if (rc == 0) relocate_handles(d, d->kept, d->live);
+
+    *freed = 0;
+    if (rc == 0 && keep < d->chain.count) {
+        rc = set_fat_entry(d->chain.items[keep - 1], EOC);
+        if (rc == 0) rc = fs_free_clusters(d->chain.items + keep, d->chain.count - keep);
+        if (rc == 0) *freed = d->chain.count - keep;
+    }
+    free(out);
+    free(after);
+    free(reqs);
+    return rc;
+}
+
+int fs_compact(const char *dirname) {
+    uint32_t dir = fsinfo.cwd_cluster;
+    int found = dirname ? path_dir(dirname, &dir) : 0;
+    if (found == -2) {
+        print_error("Not a directory.");
+        return -1;
+    }
+    if (found != 0) {
+        print_error("Directory does not exist.");
+        return -1;
+    }
+
+    DirImage d;
+    if (dir_image_load(dir, &d) != 0) {
+        dir_image_free(&d);
+        print_error("Failed to read directory.");
+        return -1;
+    }
+    uint32_t before = d.chain.count, freed = 0;
+    int rc = 0;
+    if (d.dead > 0 || clusters_needed(d.live) < d.chain.count) rc = dir_compact(&d, &freed);
+    if (rc != 0) print_error("Compaction failed.");
+    else printf("%u live entries, %u dead slots removed, %u -> %u clusters\n", d.live, d.dead, before, before - freed);
+    dir_image_free(&d);
+    return rc;
+}
+
+int fs_compact_auto(const char *pct) {
+    if (!pct) {
+        if (fsinfo.compact_pct) printf("auto compaction at %u%% dead slots\n", fsinfo.compact_pct);
+        else printf("auto compaction off\n");
+        return 0;
+    }
+    char *end;
+    unsigned long p = strtoul(pct, &end, 10);
+    if (*end || p > 100) {
+        print_error("Usage: compact -auto [PERCENT]  (0 turns it off)");
+        return -1;
+    }
+    fsinfo.compact_pct = (uint8_t)p;
+    return 0;
+}
+
+void dir_maybe_compact(uint32_t dir) {
+    if (!fsinfo.compact_pct) return;
+    DirImage d;
+    uint32_t freed;
+    if (dir_image_load(dir, &d) == 0 && d.dead > 0 &&
+        (uint64_t)d.dead * 100 >= (uint64_t)(d.live + d.dead) * fsinfo.compact_pct &&
+        clusters_needed(d.live) < d.chain.count) {
+        dir_compact(&d, &freed);
+    }
+    dir_image_free(&d);
+}
@@ -0,0 +1,439 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "image.h"
+#include "lz.h"
+
+/*
+ * Seekable compressed container. The image is cut into fixed-size chunks,
+ * each stored raw, LZ-compressed or not at all (all zero). An index of
+ * (offset, length, kind) per chunk and a footer sit at the end of the file:
+ *
+ *   [chunk data ...][ChunkRef x chunk_count][ContainerFooter]
+ *
+ * A mounted container decompresses only the chunks it touches, through a
+ * small LRU chunk cache. Rewritten chunks are appended past the committed
+ * index, never over it. Each append first puts a copy of the committed
+ * footer at the new end of file, so the file ends in a valid footer at
+ * every point and a crash falls back to the last sync. Sync writes the new
+ * index behind the chunks, flushes, and only then writes the footer that
+ * points at it. Once superseded chunk data outweighs live data, sync copies
+ * the live chunks into a fresh file and renames it over the container.
+ */
+
+#define CONTAINER_MAGIC   "F32ZIMG"
+#define CONTAINER_VERSION 1
+#define CACHE_SLOTS       16
+#define RECLAIM_MIN_BYTES (4u << 20)
+
+#define CHUNK_ZERO  0
+#define CHUNK_RAW   1
+#define CHUNK_LZ    2
+
+#pragma pack(push,1)
+typedef struct {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t kind;
+} ChunkRef;
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t image_size;
+    uint64_t chunk_count;
+    uint64_t index_offset;
+    uint8_t  reserved[24];
+} ContainerFooter;
+#pragma pack(pop)
+
+typedef struct {
+    uint64_t idx;
+    uint8_t *data;
+    bool valid;
+    bool dirty;
+    uint64_t used;
+} CacheSlot;
+
+struct ContainerWriter {
+    int fd;
+    uint32_t chunk;
+    uint64_t size;
+    uint64_t nchunks;
+    ChunkRef *index;
+    uint64_t append_off;
+    uint8_t *zbuf;
+    bool committed;             /* the file holds a footer that must stay valid */
+    ContainerFooter footer;
+};
+
+typedef struct {
+    ContainerWriter w;
+    char *path;
+    bool index_dirty;
+    CacheSlot slots[CACHE_SLOTS];
+    uint64_t tick;
+    pthread_mutex_t lock;
+} ContainerDev;
+
+static uint32_t chunk_len(ContainerWriter *w, uint64_t idx) {
+    uint64_t start = idx * w->chunk;
+    return (w->size - start < w->chunk) ? (uint32_t)(w->size - start) : w->chunk;
+}
+
+static bool all_zero(const uint8_t *p, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        if (p[i]) return false;
+    }
+    return true;
+}
+
+/* Writes len bytes at the end of the file, moving the committed footer out of the way first. */
+static int append_bytes(ContainerWriter *w, const void *src, uint32_t len) {
+    if (w->committed && image_pwrite(w->fd, &w->footer, sizeof(w->footer), w->append_off + len) != 0) return -1;
+    if (image_pwrite(w->fd, src, len, w->append_off) != 0) return -1;
+    w->append_off += len;
+    return 0;
+}
+
+/* Appends one chunk's data and points the index at it. */
+static int store_chunk(ContainerWriter *w, uint64_t idx, const uint8_t *data) {
+    uint32_t len = chunk_len(w, idx);
+    ChunkRef *ref = &w->index[idx];
+
+    if (all_zero(data, len)) {
+        ref->offset = 0;
+        ref->length = 0;
+        ref->kind = CHUNK_ZERO;
+        return 0;
+    }
+    int clen = lz_compress(data, len, w->zbuf, len - 1);
+    const uint8_t *src = data;
+    ref->kind = CHUNK_RAW;
+    ref->length = len;
+    if (clen > 0) {
+        src = w->zbuf;
+        ref->kind = CHUNK_LZ;
+        ref->length = (uint32_t)clen;
+    }
+    ref->offset = w->append_off;
+    return append_bytes(w, src, ref->length);
+}
+
+static int load_chunk(ContainerWriter *w, uint64_t idx, uint8_t *data) {
+    uint32_t len = chunk_len(w, idx);
+    ChunkRef *ref = &w->index[idx];
+    switch (ref->kind) {
+    case CHUNK_ZERO:
+        memset(data, 0, len);
+        return 0;
+    case CHUNK_RAW:
+        return image_pread(w->fd, data, len, ref->offset);
+    case CHUNK_LZ:
+        if (ref->length > w->chunk) return -1;
+        if (image_pread(w->fd, w->zbuf, ref->length, ref->offset) != 0) return -1;
+        return lz_decompress(w->zbuf, ref->length, data, len);
+    }
+    return -1;
+}
+
+static int write_index(ContainerWriter *w) {
+    uint64_t index_bytes = w->nchunks * sizeof(ChunkRef);
+    ContainerFooter f;
+    memset(&f, 0, sizeof(f));
+    memcpy(f.magic, CONTAINER_MAGIC, 8);
+    f.version = CONTAINER_VERSION;
+    f.chunk_size = w->chunk;
+    f.image_size = w->size;
+    f.chunk_count = w->nchunks;
+    f.index_offset = w->append_off;
+
+    uint64_t foot = w->append_off + index_bytes;
+    if (w->committed && image_pwrite(w->fd, &w->footer, sizeof(w->footer), foot) != 0) return -1;
+    for (uint64_t done = 0; done < index_bytes; ) {
+        uint32_t n = (index_bytes - done > (1u << 30)) ? (1u << 30) : (uint32_t)(index_bytes - done);
+        if (image_pwrite(w->fd, (uint8_t*)w->index + done, n, w->append_off + done) != 0) return -1;
+        done += n;
+    }
+    /* Chunks and index must be down before a footer points at them. */
+    if (w->committed && fdatasync(w->fd) != 0) return -1;
+    if (image_pwrite(w->fd, &f, sizeof(f), foot) != 0) return -1;
+    if (ftruncate(w->fd, (off_t)(foot + sizeof(f))) != 0) return -1;
+    w->footer = f;
+    w->committed = true;
+    w->append_off = foot;
+    return 0;
+}
+
+static int read_footer(int fd, ContainerFooter *f) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(*f)) return -1;
+    if (image_pread(fd, f, sizeof(*f), (uint64_t)st.st_size - sizeof(*f)) != 0) return -1;
+    if (memcmp(f->magic, CONTAINER_MAGIC, 8) != 0 || f->version != CONTAINER_VERSION) return -1;
+    if (f->chunk_size == 0 || f->chunk_count != (f->image_size + f->chunk_size - 1) / f->chunk_size) return -1;
+    if (f->chunk_count > (uint64_t)st.st_size / sizeof(ChunkRef)) return -1;
+    /* The index may sit anywhere before the footer: chunks appended since the last sync lie in between. */
+    if (f->index_offset + f->chunk_count * sizeof(ChunkRef) + sizeof(*f) > (uint64_t)st.st_size) return -1;
+    return 0;
+}
+
+bool image_is_container(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    ContainerFooter f;
+    bool ok = read_footer(fd, &f) == 0;
+    close(fd);
+    return ok;
+}
+
+static CacheSlot *get_slot(ContainerDev *c, uint64_t idx) {
+    CacheSlot *victim = &c->slots[0];
+    for (int i = 0; i < CACHE_SLOTS; i++) {
+        CacheSlot *s = &c->slots[i];
+        if (s->valid && s->idx == idx) {
+            s->used = ++c->tick;
+            return s;
+        }
+        if (!s->valid) victim = s;
+        else if (victim->valid && s->used < victim->used) victim = s;
+    }
+    if (victim->valid && victim->dirty) {
+        if (store_chunk(&c->w, victim->idx, victim->data) != 0) return NULL;
+        c->index_dirty = true;
+    }
+    if (!victim->data && !(victim->data = malloc(c->w.chunk))) return NULL;
+    victim->valid = false;
+    victim->dirty = false;
+    if (load_chunk(&c->w, idx, victim->data) != 0) return NULL;
+    victim->idx = idx;
+    victim->valid = true;
+    victim->used = ++c->tick;
+    return victim;
+}
+
+static int container_io(ImageDev *dev, uint64_t off, uint8_t *buf, uint32_t len, bool write) {
+    ContainerDev *c = dev->priv;
+    if (off + len > dev->size) return -1;
+    if (write && !dev->writable) return -1;
+
+    int rc = 0;
+    pthread_mutex_lock(&c->lock);
+    while (len > 0) {
+        uint64_t idx = off / c->w.chunk;
+        uint32_t in = (uint32_t)(off % c->w.chunk);
+        uint32_t n = c->w.chunk - in;
+        if (n > len) n = len;
+        CacheSlot *s = get_slot(c, idx);
+        if (!s) {
+            rc = -1;
+            break;
+        }
+        if (write) {
+            memcpy(s->data + in, buf, n);
+            s->dirty = true;
+        } else {
+            memcpy(buf, s->data + in, n);
+        }
+        buf += n; off += n; len -= n;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+static int container_read(ImageDev *dev, uint64_t off, void *buf, uint32_t len) {
+    return container_io(dev, off, buf, len, false);
+}
+
+static int container_write(ImageDev *dev, uint64_t off, const void *buf, uint32_t len) {
+    return container_io(dev, off, (uint8_t*)buf, len, true);
+}
+
+/* Bytes held by chunks the index no longer points at. */
+static uint64_t garbage_bytes(ContainerWriter *w, uint64_t *live) {
+    *live = 0;
+    for (uint64_t i = 0; i < w->nchunks; i++) *live += w->index[i].length;
+    return w->append_off - w->nchunks * sizeof(ChunkRef) - *live;
+}
+
+/* Copies the live chunks, still compressed, into a fresh file and renames it over the container. */
+static int reclaim(ContainerDev *c) {
+    ContainerWriter *w = &c->w;
+    size_t plen = strlen(c->path) + 5;
+    char *tmp = malloc(plen);
+    ContainerWriter n = *w;
+    n.index = malloc(w->nchunks * sizeof(ChunkRef));
+    n.append_off = 0;
+    n.committed = false;
+    n.fd = -1;
+    int rc = (tmp && n.index) ? 0 : -1;
+    if (rc == 0) {
+        snprintf(tmp, plen, "%s.tmp", c->path);
+        n.fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (n.fd < 0) rc = -1;
+    }
+    for (uint64_t i = 0; rc == 0 && i < w->nchunks; i++) {
+        ChunkRef *ref = &n.index[i];
+        *ref = w->index[i];
+        if (ref->kind == CHUNK_ZERO) continue;
+        if (ref->length > w->chunk || image_pread(w->fd, w->zbuf, ref->length, ref->offset) != 0) rc = -1;
+        ref->offset = n.append_off;
+        if (rc == 0 && append_bytes(&n, w->zbuf, ref->length) != 0) rc = -1;
+    }
+    if (rc == 0 && write_index(&n) != 0) rc = -1;
+    if (rc == 0 && fdatasync(n.fd) != 0) rc = -1;
+    if (rc == 0 && rename(tmp, c->path) != 0) rc = -1;
+    if (rc == 0) {
+        close(w->fd);
+        free(w->index);
+        *w = n;
+    } else {
+        if (n.fd >= 0) {
+            close(n.fd);
+            if (tmp) unlink(tmp);
+        }
+        free(n.index);
+    }
+    free(tmp);
+    return rc;
+}
+
+static int container_sync(ImageDev *dev) {
+    ContainerDev *c = dev->priv;
+    if (!dev->writable) return 0;
+    int rc = 0;
+    pthread_mutex_lock(&c->lock);
+    for (int i = 0; i < CACHE_SLOTS && rc == 0; i++) {
+        CacheSlot *s = &c->slots[i];
+        if (s->valid && s->dirty) {
+            if (store_chunk(&c->w, s->idx, s->data) != 0) rc = -1;
+            s->dirty = false;
+            c->index_dirty = true;
+        }
+    }
+    if (rc == 0 && c->index_dirty) {
+        if (write_index(&c->w) != 0) rc = -1;
+        else c->index_dirty = false;
+    }
+    if (rc == 0 && fdatasync(c->w.fd) != 0) rc = -1;
+    uint64_t live, garbage = garbage_bytes(&c->w, &live);
+    /* A failed reclaim leaves the synced container as it was. */
+    if (rc == 0 && garbage >= RECLAIM_MIN_BYTES && garbage > live) reclaim(c);
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+static void container_close(ImageDev *dev) {
+    ContainerDev *c = dev->priv;
+    container_sync(dev);
+    for (int i = 0; i < CACHE_SLOTS; i++) free(c->slots[i].data);
+    close(c->w.fd);
+    free(c->w.index);
+    free(c->w.zbuf);
+    pthread_mutex_destroy(&c->lock);
+    free(c->path);
+    free(c);
+    free(dev);
+}
+
+ImageDev *image_open_container(const char *path, bool writable) {
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return NULL;
+    }
+    ContainerFooter f;
+    struct stat st;
+    if (read_footer(fd, &f) != 0) {
+        fprintf(stderr, "Error: not a valid image container.\n");
+        close(fd);
+        return NULL;
+    }
+
+    ImageDev *dev = calloc(1, sizeof(ImageDev));
+    ContainerDev *c = calloc(1, sizeof(ContainerDev));
+    if (!dev || !c) goto fail;
+    c->w.fd = fd;
+    c->w.chunk = f.chunk_size;
+    c->w.size = f.image_size;
+    c->w.nchunks = f.chunk_count;
+    c->w.committed = true;
+    c->w.footer = f;
+    if (fstat(fd, &st) != 0) goto fail;
+    c->w.append_off = (uint64_t)st.st_size - sizeof(f);
+    c->w.index = malloc(f.chunk_count * sizeof(ChunkRef));
+    c->w.zbuf = malloc(f.chunk_size);
+    c->path = strdup(path);
+    if (!c->w.index || !c->w.zbuf || !c->path) goto fail;
+    if (image_pread(fd, c->w.index, (uint32_t)(f.chunk_count * sizeof(ChunkRef)), f.index_offset) != 0) goto fail;
+    pthread_mutex_init(&c->lock, NULL);
+
+    dev->kind = "container";
+    dev->size = f.image_size;
+    dev->writable = writable;
+    dev->read = container_read;
+    dev->write = container_write;
+    dev->sync = container_sync;
+    dev->close = container_close;
+    dev->priv = c;
+    return dev;
+
+fail:
+    if (c) {
+        free(c->w.index);
+        free(c->w.zbuf);
+        free(c->path);
+    }
+    free(c);
+    free(dev);
+    close(fd);
+    return NULL;
+}
+
+ContainerWriter *container_create(const char *path, uint64_t image_size, uint32_t chunk_size) {
+    ContainerWriter *w = calloc(1, sizeof(ContainerWriter));
+    if (!w) return NULL;
+    w->chunk = chunk_size;
+    w->size = image_size;
+    w->nchunks = (image_size + chunk_size - 1) / chunk_size;
+    w->index = calloc(w->nchunks ? w->nchunks : 1, sizeof(ChunkRef));
+    w->zbuf = malloc(chunk_size);
+    w->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) perror("open");
+    if (!w->index || !w->zbuf || w->fd < 0) {
+        if (w->fd >= 0) close(w->fd);
+        free(w->index);
+        free(w->zbuf);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+int container_put_chunk(ContainerWriter *w, uint64_t idx, const uint8_t *data) {
+    if (idx >= w->nchunks) return -1;
+    return store_chunk(w, idx, data);
+}
+
+int container_finish(ContainerWriter *w) {
+    int rc = write_index(w);
+    if (rc == 0 && fdatasync(w->fd) != 0) rc = -1;
+    close(w->fd);
+    free(w->index);
+    free(w->zbuf);
+    free(w);
+    return rc;
+}
+
+void container_stat(ContainerWriter *w, uint64_t *stored_bytes, uint64_t *zero_chunks) {
+    *stored_bytes = w->append_off;
+    *zero_chunks = 0;
+    for (uint64_t i = 0; i < w->nchunks; i++) {
+        if (w->index[i].kind == CHUNK_ZERO) (*zero_chunks)++;
+    }
+}
@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "fs.h"
+#include "fdtable.h"
+#include "path.h"
+#include "utils.h"
+
+/*
+ * cp / cp -r inside the image. Metadata (allocation, directory entries) is
+ * done on the calling thread; the data moves as sector-range copy jobs that
+ * a small pool of workers drains in parallel. Files are copied one directory
+ * at a time: their entries are written only once the pool has drained, so an
+ * entry never points at clusters whose data is still queued.
+ */
+
+#define COPY_JOB_SECTORS_MAX  8192
+#define COPY_WORKERS_MAX      8
+
+typedef struct {
+    uint32_t src;
+    uint32_t dst;
+    uint32_t count;
+} CopyJob;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    CopyJob *jobs;
+    uint32_t njobs, cap, next, pending;
+    pthread_cond_t drained;
+    bool closed;
+    int rc;
+    pthread_t threads[COPY_WORKERS_MAX];
+    int nthreads;
+    uint32_t new_root;
+} CopyPool;
+
+static void *copy_worker(void *arg) {
+    CopyPool *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (p->next == p->njobs && !p->closed) pthread_cond_wait(&p->cond, &p->lock);
+        if (p->next == p->njobs) break;
+        CopyJob job = p->jobs[p->next++];
+        pthread_mutex_unlock(&p->lock);
+        int rc = fs_copy_sectors(job.src, job.dst, job.count);
+        pthread_mutex_lock(&p->lock);
+        if (rc != 0) p->rc = -1;
+        if (--p->pending == 0) pthread_cond_broadcast(&p->drained);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void pool_start(CopyPool *p) {
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    pthread_cond_init(&p->drained, NULL);
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > COPY_WORKERS_MAX) n = COPY_WORKERS_MAX;
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&p->threads[p->nthreads], NULL, copy_worker, p) == 0) p->nthreads++;
+    }
+}
+
+static int pool_push(CopyPool *p, uint32_t src, uint32_t dst, uint32_t count) {
+    if (p->nthreads == 0) return fs_copy_sectors(src, dst, count);
+    pthread_mutex_lock(&p->lock);
+    if (p->njobs == p->cap) {
+        uint32_t cap = p->cap ? p->cap * 2 : 64;
+        CopyJob *jobs = realloc(p->jobs, cap * sizeof(CopyJob));
+        if (!jobs) {
+            pthread_mutex_unlock(&p->lock);
+            return fs_copy_sectors(src, dst, count);
+        }
+        p->jobs = jobs;
+        p->cap = cap;
+    }
+    p->jobs[p->njobs].src = src;
+    p->jobs[p->njobs].dst = dst;
+    p->jobs[p->njobs].count = count;
+    p->njobs++;
+    p->pending++;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+/* Waits until every queued copy is done; returns the pool's status. */
+static int pool_drain(CopyPool *p) {
+    pthread_mutex_lock(&p->lock);
+    while (p->pending > 0) pthread_cond_wait(&p->drained, &p->lock);
+    int rc = p->rc;
+    pthread_mutex_unlock(&p->lock);
+    return rc;
+}
+
+static int pool_finish(CopyPool *p) {
+    pthread_mutex_lock(&p->lock);
+    p->closed = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->nthreads; i++) pthread_join(p->threads[i], NULL);
+    int rc = p->rc;
+    free(p->jobs);
+    pthread_cond_destroy(&p->cond);
+    pthread_cond_destroy(&p->drained);
+    pthread_mutex_destroy(&p->lock);
+    return rc;
+}
+
+/* Queues copies for every overlap of the source and destination extent lists. */
+static int queue_extent_copies(CopyPool *pool, const ExtentList *src, const ExtentList *dst) {
+    uint32_t si = 0, di = 0, soff = 0, doff = 0;
+    while (si < src->count && di < dst->count) {
+        uint32_t n = src->items[si].count - soff;
+        if (dst->items[di].count - doff < n) n = dst->items[di].count - doff;
+        uint32_t ssec = cluster_to_sector(src->items[si].start + soff);
+        uint32_t dsec = cluster_to_sector(dst->items[di].start + doff);
+        uint32_t sectors = n * fsinfo.sectors_per_cluster;
+        for (uint32_t done = 0; done < sectors; ) {
+            uint32_t k = sectors - done;
+            if (k > COPY_JOB_SECTORS_MAX) k = COPY_JOB_SECTORS_MAX;
+            if (pool_push(pool, ssec + done, dsec + done, k) != 0) return -1;
+            done += k;
+        }
+        soff += n;
+        doff += n;
+        if (soff == src->items[si].count) { si++; soff = 0; }
+        if (doff == dst->items[di].count) { di++; doff = 0; }
+    }
+    return 0;
+}
+
+static int copy_file_data(CopyPool *pool, const DirEntry *src, uint32_t dst_dir, uint32_t *out_cluster) {
+    uint32_t bytes_per_cluster = fs_cluster_bytes();
+    uint32_t c = ((uint32_t)src->DIR_FstClusHI << 16) | src->DIR_FstClusLO;
+    uint32_t n = (src->DIR_FileSize + bytes_per_cluster - 1) / bytes_per_cluster;
+    *out_cluster = 0;
+    if (c < 2 || n == 0) return 0;
+
+    ExtentList se = {0}, de = {0};
+    int rc = 0;
+    if (fs_chain_extents(c, n, &se) != 0) {
+        print_error("Source cluster chain is shorter than its size.");
+        rc = -1;
+    } else if (fs_allocate_extents(n, dst_dir, &de) != 0) {
+        print_error("No space.");
+        rc = -1;
+    } else {
+        *out_cluster = de.items[0].start;
+        rc = queue_extent_copies(pool, &se, &de);
+        if (rc != 0) {
+            fs_free_cluster_chain(*out_cluster);
+            *out_cluster = 0;
+        }
+    }
+    extent_list_free(&se);
+    extent_list_free(&de);
+    return rc;
+}
+
+/* One directory's worth of copied files, whose entries wait for the pool to drain. */
+typedef struct {
+    DirEntry *entries;
+    uint32_t count, cap;
+} CopyBatch;
+
+static int batch_add(CopyBatch *b, const DirEntry *src, const char *name, uint32_t cluster) {
+    if (b->count == b->cap) {
+        uint32_t cap = b->cap ? b->cap * 2 : 16;
+        DirEntry *entries = realloc(b->entries, cap * sizeof(DirEntry));
+        if (!entries) return -1;
+        b->entries = entries;
+        b->cap = cap;
+    }
+    DirEntry *e = &b->entries[b->count++];
+    memset(e, 0, sizeof(*e));
+    format_name_11(name, (char*)e->DIR_Name);
+    e->DIR_Attr = src->DIR_Attr;
+    e->DIR_FileSize = src->DIR_FileSize;
+    e->DIR_FstClusHI = (uint16_t)(cluster >> 16);
+    e->DIR_FstClusLO = (uint16_t)(cluster & 0xFFFF);
+    return 0;
+}
+
+/* Once the batch's data is written, creates its entries; on any failure its clusters are freed instead. */
+static int batch_end(CopyPool *pool, uint32_t dst_dir, CopyBatch *b, int rc) {
+    if (pool_drain(pool) != 0) {
+        print_error("Copy I/O error.");
+        rc = -1;
+    }
+    if (rc == 0 && b->count > 0 && create_dir_entries(dst_dir, b->entries, b->count) != 0) {
+        print_error("Failed to create file entry.");
+        rc = -1;
+    }
+    for (uint32_t i = 0; rc != 0 && i < b->count; i++) {
+        uint32_t c = ((uint32_t)b->entries[i].DIR_FstClusHI << 16) | b->entries[i].DIR_FstClusLO;
+        if (c >= 2) fs_free_cluster_chain(c);
+    }
+    b->count = 0;
+    return rc;
+}
+
+/* Queues a file's data and adds its entry to the batch. */
+static int copy_file(CopyPool *pool, const DirEntry *src, uint32_t dst_dir, const char *name, CopyBatch *b) {
+    uint32_t c;
+    if (copy_file_data(pool, src, dst_dir, &c) != 0) return -1;
+    if (batch_add(b, src, name, c) != 0) {
+        if (c >= 2) {
+            pool_drain(pool);
+            fs_free_cluster_chain(c);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Copies src_dir's contents into dst_dir. Subdirectories are made as they are
+ * met (an empty directory is consistent on its own) and filled once this
+ * directory's files are done.
+ */
+static int copy_tree(CopyPool *pool, uint32_t src_dir, uint32_t dst_dir) {
+    uint32_t bytes_per_cluster = fs_cluster_bytes();
+    uint8_t *cbuf = malloc(bytes_per_cluster);
+    if (!cbuf) return -1;
+
+    CopyBatch batch = {0};
+    uint32_t *subs = NULL, nsub = 0, subcap = 0;
+    int rc = 0;
+    bool end = false;
+    uint32_t cluster = src_dir;
+    while (!end && rc == 0 && cluster >= 2 && cluster < 0x0FFFFFF8) {
+        if (read_sectors(cluster_to_sector(cluster), fsinfo.sectors_per_cluster, cbuf) != 0) {
+            rc = -1;
+            break;
+        }
+        for (uint32_t i = 0; i < bytes_per_cluster && rc == 0; i += 32) {
+            DirEntry *e = (DirEntry*)&cbuf[i];
+            if (e->DIR_Name[0] == 0x00) {
+                end = true;
+                break;
+            }
+            if ((e->DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME || e->DIR_Name[0] == 0xE5) continue;
+            if (e->DIR_Attr & ATTR_VOLUME_ID || is_dot_entry(e)) continue;
+            uint32_t src_c = ((uint32_t)e->DIR_FstClusHI << 16) | e->DIR_FstClusLO;
+            /* Copying a directory into itself must not descend into the copy. */
+            if ((e->DIR_Attr & ATTR_DIRECTORY) && src_c == pool->new_root) continue;
+            char name[12];
+            entry_name(e, name);
+            if (!(e->DIR_Attr & ATTR_DIRECTORY)) {
+                rc = copy_file(pool, e, dst_dir, name, &batch);
+                continue;
+            }
+            uint32_t new_dir;
+            if (fs_make_dir(dst_dir, name, &new_dir) != 0) {
+                rc = -1;
+            } else if (src_c >= 2) {
+                if (nsub + 2 > subcap) {
+                    subcap = subcap ? subcap * 2 : 16;
+                    uint32_t *grown = realloc(subs, subcap * sizeof(uint32_t));
+                    if (!grown) {
+                        rc = -1;
+                        break;
+                    }
+                    subs = grown;
+                }
+                subs[nsub++] = src_c;
+                subs[nsub++] = new_dir;
+            }
+        }
+        cluster = get_fat_entry(cluster);
+    }
+    free(cbuf);
+    rc = batch_end(pool, dst_dir, &batch, rc);
+    free(batch.entries);
+    for (uint32_t i = 0; rc == 0 && i < nsub; i += 2) rc = copy_tree(pool, subs[i], subs[i + 1]);
+    free(subs);
+    return rc;
+}
+
+static int copy_entry(CopyPool *pool, const DirEntry *src, uint32_t dst_dir, const char *name) {
+    if (src->DIR_Attr & ATTR_DIRECTORY) {
+        uint32_t src_c = ((uint32_t)src->DIR_FstClusHI << 16) | src->DIR_FstClusLO;
+        uint32_t new_dir;
+        if (fs_make_dir(dst_dir, name, &new_dir) != 0) return -1;
+        pool->new_root = new_dir;
+        if (src_c < 2) return 0;
+        return copy_tree(pool, src_c, new_dir);
+    }
+
+    CopyBatch batch = {0};
+    int rc = batch_end(pool, dst_dir, &batch, copy_file(pool, src, dst_dir, name, &batch));
+    free(batch.entries);
+    return rc;
+}
+
+int fs_cp(const char *src, const char *dst, bool recursive) {
+    DirEntry se; uint32_t s, o, src_dir;
+    char leaf[PATH_LEAF_MAX];
+    if (path_split(src, &src_dir, leaf, sizeof(leaf)) != 0 || fs_find_entry_in_dir(src_dir, leaf, &se, &s, &o) != 0) {
+        print_error("Source does not exist.");
+        return -1;
+    }
+    if (strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0) {
+        print_error("Cannot copy special directories.");
+        return -1;
+    }
+    if ((se.DIR_Attr & ATTR_DIRECTORY) && !recursive) {
+        print_error("Is a directory (use cp -r).");
+        return -1;
+    }
+
+    /* Flush handles so the source's data and size on disk are current. */
+    for (int fd = 0; fd < fd_limit(); fd++) {
+        OpenFileEntry *of = fd_get(fd);
+        if (of) fs_flush(of);
+    }
+    if (fs_find_entry_in_dir(src_dir, leaf, &se, &s, &o) != 0) return -1;
+
+    /* An existing directory receives the source under its own name. */
+    uint32_t dst_dir;
+    char name[PATH_LEAF_MAX], made[1024];
+    int rc = path_dir(dst, &dst_dir);
+    if (rc == 0) {
+        snprintf(made, sizeof(made), "%s/%s", dst, leaf);
+        strcpy(name, leaf);
+        if (fs_name_exists_in_dir(dst_dir, name)) {
+            print_error("Destination already exists.");
+            return -1;
+        }
+    } else if (rc == -2) {
+        print_error("Destination already exists.");
+        return -1;
+    } else if (path_split(dst, &dst_dir, name, sizeof(name)) != 0) {
+        print_error("Destination directory does not exist.");
+        return -1;
+    } else {
+        snprintf(made, sizeof(made), "%s", dst);
+    }
+
+    CopyPool pool;
+    pool_start(&pool);
+    rc = copy_entry(&pool, &se, dst_dir, name);
+    if (pool_finish(&pool) != 0) rc = -1;
+    /* The name was free before the copy, so whatever now holds it is a partial copy. */
+    if (rc != 0 && fs_name_exists_in_dir(dst_dir, name)) {
+        char *names[1] = {made};
+        if (fs_rm_recursive(names, 1) != 0) print_error("Could not remove the partial copy.");
+    }
+    return rc;
+}
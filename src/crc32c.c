@@ -0,0 +1,91 @@
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+/*
+ * CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has
+ * it and a slicing-by-8 table otherwise. The choice is made, and the table
+ * built, once on first use; hashing and I/O workers may get there together.
+ */
+
+#define POLY 0x82F63B78u
+
+static uint32_t table[8][256];
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static bool use_hw;
+
+static void build_table(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+        table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) table[k][n] = (table[k-1][n] >> 8) ^ table[0][table[k-1][n] & 0xFF];
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^ table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+#if defined(__x86_64__)
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+#endif
+    while (len--) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+static bool detect_hw(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+#else
+static bool detect_hw(void) {
+    return false;
+}
+#endif
+
+static void crc_init(void) {
+    use_hw = detect_hw();
+    if (!use_hw) build_table();
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&init_once, crc_init);
+    crc = ~crc;
+#if defined(__x86_64__) || defined(__i386__)
+    if (use_hw) return ~crc32c_hw(crc, data, len);
+#endif
+    return ~crc32c_sw(crc, data, len);
+}
+
+const char *crc32c_impl(void) {
+    pthread_once(&init_once, crc_init);
+    return use_hw ? "sse4.2" : "table";
+}
@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fs.h"
+#include "hash.h"
+#include "catalog.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "delta.h"
+#include "utils.h"
+
+/*
+ * clone / diff / --apply: allocation-aware image copies and deltas. All
+ * three only look at the ranges fs_for_each_used_range() reports (boot
+ * sectors and FATs, allocated clusters, the tail after the data region), so
+ * their cost follows the data in use rather than the volume size.
+ *
+ * A delta turns a base image (the OTHER of `diff`) into the mounted one. It
+ * is a header followed by records, each an image offset, a length and that
+ * many bytes, LZ-compressed when that is smaller. Clusters that are free in
+ * the mounted image are not compared, so after applying they may still hold
+ * the base's old data, which the file system never reads.
+ *
+ * Delta layout: header, then { DeltaRecord, data[stored] } * records.
+ */
+
+#define DELTA_MAGIC      "F32DLT1"
+#define DELTA_VERSION    1
+#define DELTA_CHUNK_BYTES (1024*1024)
+
+#pragma pack(push,1)
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t cluster_size;
+    uint64_t image_size;
+    uint32_t base_volume_id;
+    uint32_t base_meta_crc;     /* crc32c of the base's sectors before the data region */
+    uint64_t records;
+    uint64_t changed_bytes;
+    uint8_t  reserved[16];
+} DeltaHeader;
+
+typedef struct {
+    uint64_t off;
+    uint32_t len;
+    uint32_t stored;            /* len: raw, less: LZ */
+    uint32_t crc;               /* crc32c of the len bytes */
+} DeltaRecord;
+#pragma pack(pop)
+
+/* ---- clone ---- */
+
+typedef struct {
+    int in, out;
+    uint8_t *buf;
+    uint64_t copied;
+} CloneState;
+
+static int clone_range(uint64_t off, uint64_t len, void *ctx) {
+    CloneState *st = ctx;
+    st->copied += len;
+    /* In-kernel copy from a plain image file (a reflink on filesystems that share extents). */
+    while (st->in >= 0 && len > 0) {
+        loff_t i = (loff_t)off, o = (loff_t)off;
+        ssize_t n = copy_file_range(st->in, &i, st->out, &o, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            st->in = -1;
+            break;
+        }
+        off += (uint64_t)n;
+        len -= (uint64_t)n;
+    }
+    while (len > 0) {
+        uint32_t n = len > DELTA_CHUNK_BYTES ? DELTA_CHUNK_BYTES : (uint32_t)len;
+        if (fsinfo.dev->read(fsinfo.dev, off, st->buf, n) != 0) return -1;
+        if (image_pwrite(st->out, st->buf, n, off) != 0) return -1;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int fs_clone(const char *out_path) {
+    if (fs_sync() != 0) return -1;
+    CloneState st;
+    st.in = image_file_fd(fsinfo.dev);
+    st.copied = 0;
+    st.buf = malloc(DELTA_CHUNK_BYTES);
+    st.out = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (st.out < 0 || !st.buf) {
+        if (st.out >= 0) close(st.out);
+        free(st.buf);
+        print_error("Cannot create output image.");
+        return -1;
+    }
+
+    /* Free clusters stay holes in the output file. */
+    int rc = ftruncate(st.out, (off_t)fsinfo.image_size_bytes);
+    if (rc == 0) rc = fs_for_each_used_range(clone_range, &st);
+    if (rc == 0 && fdatasync(st.out) != 0) rc = -1;
+    close(st.out);
+    free(st.buf);
+    if (rc != 0) {
+        print_error("Clone failed.");
+        return -1;
+    }
+    /* The clone has the same contents, so the hash index is valid for it too. */
+    bool indexed = hash_copy_index(out_path) == 0;
+    catalog_copy(out_path);
+    printf("cloned %llu of %llu bytes -> %s%s\n", (unsigned long long)st.copied,
+           (unsigned long long)fsinfo.image_size_bytes, out_path, indexed ? "" : " (hash index not copied)");
+    return 0;
+}
+
+/* ---- diff ---- */
+
+typedef struct {
+    int fd;
+    uint64_t pos;
+    uint8_t *run, *z;
+    uint64_t run_off;
+    uint32_t run_len;
+    DeltaHeader h;
+} DeltaWriter;
+
+static int delta_flush(DeltaWriter *w) {
+    if (w->run_len == 0) return 0;
+    DeltaRecord r;
+    r.off = w->run_off;
+    r.len = r.stored = w->run_len;
+    r.crc = crc32c(0, w->run, w->run_len);
+    int clen = lz_compress(w->run, w->run_len, w->z, w->run_len - 1);
+    const uint8_t *src = w->run;
+    if (clen > 0) {
+        r.stored = (uint32_t)clen;
+        src = w->z;
+    }
+    if (image_pwrite(w->fd, &r, sizeof(r), w->pos) != 0) return -1;
+    if (image_pwrite(w->fd, src, r.stored, w->pos + sizeof(r)) != 0) return -1;
+    w->pos += sizeof(r) + r.stored;
+    w->h.records++;
+    w->h.changed_bytes += w->run_len;
+    w->run_len = 0;
+    return 0;
+}
+
+/* Appends changed bytes, extending the current record when they follow it. */
+static int delta_put(DeltaWriter *w, uint64_t off, const uint8_t *data, uint32_t len) {
+    if (w->run_len > 0 && (w->run_off + w->run_len != off || w->run_len + len > DELTA_CHUNK_BYTES)) {
+        if (delta_flush(w) != 0) return -1;
+    }
+    if (w->run_len == 0) w->run_off = off;
+    memcpy(w->run + w->run_len, data, len);
+    w->run_len += len;
+    return 0;
+}
+
+typedef struct {
+    ImageDev *other;
+    uint8_t *a, *b;
+    DeltaWriter w;
+    bool full;
+    uint32_t *crc_a, *crc_b;
+    uint8_t *clean_a, *clean_b;
+    uint64_t by_hash, by_bytes;
+} DiffState;
+
+static bool clean_bit(const uint8_t *map, uint32_t i) {
+    return map && ((map[i>>3] >> (i&7)) & 1);
+}
+
+/* Sectors outside the data region: compared byte for byte, a sector at a time. */
+static int diff_meta(DiffState *st, uint64_t off, uint64_t len) {
+    uint64_t data_start = (uint64_t)fsinfo.first_data_sector * fsinfo.bytes_per_sector;
+    while (len > 0) {
+        uint32_t n = len > DELTA_CHUNK_BYTES ? DELTA_CHUNK_BYTES : (uint32_t)len;
+        if (fsinfo.dev->read(fsinfo.dev, off, st->a, n) != 0) return -1;
+        if (st->other->read(st->other, off, st->b, n) != 0) return -1;
+        if (off < data_start) st->w.h.base_meta_crc = crc32c(st->w.h.base_meta_crc, st->b, n);
+        for (uint32_t i = 0; i < n; i += fsinfo.bytes_per_sector) {
+            uint32_t u = n - i < fsinfo.bytes_per_sector ? n - i : fsinfo.bytes_per_sector;
+            if (memcmp(st->a + i, st->b + i, u) != 0 && delta_put(&st->w, off + i, st->a + i, u) != 0) return -1;
+        }
+        st->by_bytes += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Allocated clusters. Where both images have an index entry that is still
+ * clean and the hashes differ, the cluster has changed and only the mounted
+ * image is read. Equal hashes are not proof, since a 32-bit CRC collides, so
+ * those clusters are read on both sides and compared like everything else
+ * (and everything with -full).
+ */
+static int diff_clusters(DiffState *st, uint64_t off, uint64_t len) {
+    uint64_t data_start = (uint64_t)fsinfo.first_data_sector * fsinfo.bytes_per_sector;
+    uint32_t bpc = fs_cluster_bytes();
+    uint32_t per_chunk = DELTA_CHUNK_BYTES / bpc ? DELTA_CHUNK_BYTES / bpc : 1;
+    uint32_t first = (uint32_t)((off - data_start) / bpc);
+    uint32_t count = (uint32_t)(len / bpc);
+    for (uint32_t c = 0; c < count; ) {
+        uint32_t k = count - c < per_chunk ? count - c : per_chunk;
+        bool need_a = false, need_b = false;
+        for (uint32_t j = 0; j < k; j++) {
+            uint32_t i = first + c + j;
+            bool hashed = !st->full && clean_bit(st->clean_a, i) && clean_bit(st->clean_b, i);
+            if (hashed && st->crc_a[i] != st->crc_b[i]) need_a = true;
+            else need_a = need_b = true;
+        }
+        uint64_t at = off + (uint64_t)c * bpc;
+        if (need_a && fsinfo.dev->read(fsinfo.dev, at, st->a, k * bpc) != 0) return -1;
+        if (need_b && st->other->read(st->other, at, st->b, k * bpc) != 0) return -1;
+        for (uint32_t j = 0; j < k; j++) {
+            uint32_t i = first + c + j;
+            const uint8_t *pa = st->a + (size_t)j * bpc;
+            bool changed;
+            if (!st->full && clean_bit(st->clean_a, i) && clean_bit(st->clean_b, i) && st->crc_a[i] != st->crc_b[i]) {
+                changed = true;
+                st->by_hash++;
+            } else {
+                changed = memcmp(pa, st->b + (size_t)j * bpc, bpc) != 0;
+                st->by_bytes += bpc;
+            }
+            if (changed && delta_put(&st->w, at + (uint64_t)j * bpc, pa, bpc) != 0) return -1;
+        }
+        c += k;
+    }
+    return 0;
+}
+
+static int diff_range(uint64_t off, uint64_t len, void *ctx) {
+    DiffState *st = ctx;
+    uint64_t data_start = (uint64_t)fsinfo.first_data_sector * fsinfo.bytes_per_sector;
+    uint64_t data_end = data_start + (uint64_t)fsinfo.total_clusters * fsinfo.sectors_per_cluster * fsinfo.bytes_per_sector;
+    if (off < data_start || off >= data_end) return diff_meta(st, off, len);
+    return diff_clusters(st, off, len);
+}
+
+static bool same_geometry(const FAT32BootSector *b, uint64_t size) {
+    return b->BPB_BytsPerSec == fsinfo.bytes_per_sector && b->BPB_SecPerClus == fsinfo.sectors_per_cluster &&
+           b->BPB_RsvdSecCnt == fsinfo.reserved_sector_count && b->BPB_NumFATs == fsinfo.num_FATs &&
+           b->BPB_FATSz32 == fsinfo.FATSz32 && b->BPB_TotSec32 == fsinfo.tot_sec && size == fsinfo.image_size_bytes;
+}
+
+int fs_diff(const char *other_path, const char *out_path, bool full) {
+    if (fs_sync() != 0) return -1;
+    ImageDev *other = image_open(other_path, false);
+    if (!other) {
+        print_error("Cannot open the other image.");
+        return -1;
+    }
+    FAT32BootSector ob, mb;
+    if (other->read(other, 0, &ob, sizeof(ob)) != 0 || fsinfo.dev->read(fsinfo.dev, 0, &mb, sizeof(mb)) != 0 ||
+        !same_geometry(&ob, other->size)) {
+        other->close(other);
+        print_error("Images differ in geometry; diff needs another copy of this volume.");
+        return -1;
+    }
+
+    DiffState st;
+    memset(&st, 0, sizeof(st));
+    st.other = other;
+    st.full = full;
+    st.a = malloc(DELTA_CHUNK_BYTES);
+    st.b = malloc(DELTA_CHUNK_BYTES);
+    st.w.run = malloc(DELTA_CHUNK_BYTES);
+    st.w.z = malloc(DELTA_CHUNK_BYTES);
+    st.w.fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int rc = (st.a && st.b && st.w.run && st.w.z && st.w.fd >= 0) ? 0 : -1;
+    if (rc != 0) print_error("Cannot create delta file.");
+    if (rc == 0 && !full && hash_clean_crcs(NULL, mb.BS_VolID, &st.crc_a, &st.clean_a) == 0) {
+        hash_clean_crcs(other_path, ob.BS_VolID, &st.crc_b, &st.clean_b);
+    }
+
+    DeltaHeader *h = &st.w.h;
+    memcpy(h->magic, DELTA_MAGIC, 8);
+    h->version = DELTA_VERSION;
+    h->cluster_size = fs_cluster_bytes();
+    h->image_size = fsinfo.image_size_bytes;
+    h->base_volume_id = ob.BS_VolID;
+    st.w.pos = sizeof(DeltaHeader);
+    if (rc == 0) {
+        rc = fs_for_each_used_range(diff_range, &st);
+        if (rc == 0) rc = delta_flush(&st.w);
+        if (rc == 0) rc = image_pwrite(st.w.fd, h, sizeof(*h), 0);
+        if (rc == 0) rc = fdatasync(st.w.fd);
+        if (rc != 0) print_error("Diff failed.");
+    }
+    if (rc == 0) {
+        printf("%llu bytes changed in %llu records, delta %llu bytes -> %s\n",
+               (unsigned long long)h->changed_bytes, (unsigned long long)h->records,
+               (unsigned long long)st.w.pos, out_path);
+        printf("%llu clusters decided by hash, %llu bytes compared\n",
+               (unsigned long long)st.by_hash, (unsigned long long)st.by_bytes);
+    }
+    if (st.w.fd >= 0) close(st.w.fd);
+    if (rc != 0) unlink(out_path);
+    other->close(other);
+    free(st.a);
+    free(st.b);
+    free(st.w.run);
+    free(st.w.z);
+    free(st.crc_a);
+    free(st.crc_b);
+    free(st.clean_a);
+    free(st.clean_b);
+    return rc;
+}
+
+/* ---- apply ---- */
+
+/* Reads record data into out (len bytes), checking bounds and the crc. */
+static int read_record(int fd, uint64_t pos, const DeltaRecord *r, uint64_t image_size, uint8_t *z, uint8_t *out) {
+    if (r->len == 0 || r->len > DELTA_CHUNK_BYTES || r->stored > r->len) return -1;
+    if (r->off > image_size || r->len > image_size - r->off) return -1;
+    if (r->stored == r->len) {
+        if (image_pread(fd, out, r->len, pos) != 0) return -1;
+    } else {
+        if (image_pread(fd, z, r->stored, pos) != 0) return -1;
+        if (lz_decompress(z, r->stored, out, r->len) != 0) return -1;
+    }
+    return crc32c(0, out, r->len) == r->crc ? 0 : -1;
+}
+
+/*
+ * Run once to check every record, so that a damaged delta leaves the image
+ * untouched, then again to write. The writing pass checks each record again
+ * before writing it. Records are written in place, so a crash or write error
+ * part way leaves the image neither the base nor the target; applying to a
+ * clone keeps the base.
+ */
+static int apply_records(int fd, const DeltaHeader *h, ImageDev *dev, bool write) {
+    uint8_t *z = malloc(DELTA_CHUNK_BYTES), *buf = malloc(DELTA_CHUNK_BYTES);
+    int rc = (z && buf) ? 0 : -1;
+    uint64_t pos = sizeof(DeltaHeader);
+    for (uint64_t i = 0; rc == 0 && i < h->records; i++) {
+        DeltaRecord r;
+        if (image_pread(fd, &r, sizeof(r), pos) != 0) rc = -1;
+        else if (read_record(fd, pos + sizeof(r), &r, h->image_size, z, buf) != 0) rc = -1;
+        else if (write && dev->write(dev, r.off, buf, r.len) != 0) rc = -1;
+        pos += sizeof(r) + r.stored;
+    }
+    free(z);
+    free(buf);
+    return rc;
+}
+
+int delta_apply(const char *delta_path, const char *image_path) {
+    int fd = open(delta_path, O_RDONLY);
+    if (fd < 0) {
+        print_error("Cannot open delta file.");
+        return -1;
+    }
+    DeltaHeader h;
+    if (image_pread(fd, &h, sizeof(h), 0) != 0 || memcmp(h.magic, DELTA_MAGIC, 8) != 0 || h.version != DELTA_VERSION) {
+        close(fd);
+        print_error("Not a delta file.");
+        return -1;
+    }
+    ImageDev *dev = image_open(image_path, true);
+    if (!dev) {
+        close(fd);
+        print_error("Cannot open image.");
+        return -1;
+    }
+
+    FAT32BootSector b;
+    uint32_t crc;
+    int rc = 0;
+    if (dev->read(dev, 0, &b, sizeof(b)) != 0 || dev->size != h.image_size || b.BS_VolID != h.base_volume_id ||
+        (uint32_t)b.BPB_SecPerClus * b.BPB_BytsPerSec != h.cluster_size ||
+        image_meta_crc(dev, &crc) != 0 || crc != h.base_meta_crc) {
+        print_error("The delta was made against a different base image.");
+        rc = -1;
+    }
+    if (rc == 0 && apply_records(fd, &h, dev, false) != 0) {
+        print_error("Delta file is damaged; image left unchanged.");
+        rc = -1;
+    }
+    if (rc == 0) catalog_drop_file(image_path);
+    if (rc == 0 && (apply_records(fd, &h, dev, true) != 0 || dev->sync(dev) != 0)) {
+        print_error("Failed to write the image.");
+        rc = -1;
+    }
+    /* The image's hash index did not see these writes. */
+    if (rc == 0) hash_drop_index(image_path);
+    if (rc == 0) {
+        printf("applied %llu records, %llu bytes\n", (unsigned long long)h.records, (unsigned long long)h.changed_bytes);
+    }
+    dev->close(dev);
+    close(fd);
+    return rc;
+}
@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "image.h"
+
+/*
+ * Direct-I/O backend. The image is opened with O_DIRECT so scans of images
+ * larger than RAM neither fill the host page cache nor copy everything twice.
+ * Since the kernel no longer caches, the backend keeps its own: a fixed pool
+ * of 64 KiB lines kept in LRU order, written back lazily. Lines follow image
+ * offsets, not clusters (the data region need not start on a line, and with
+ * 4096-byte sectors a cluster can be up to 512 KiB), so a request that
+ * crosses lines is split across them. Requests of DIRECT_STREAM_BYTES or more go around the
+ * cache through 1 MiB bounce buffers, so hashing, exporting or the FAT scan
+ * do not evict the metadata the shell keeps touching. All buffers come from
+ * one allocation aligned to the device's direct-I/O alignment.
+ *
+ * Every request goes through the one O_DIRECT descriptor. When the image
+ * size is not a multiple of the alignment, the last block is written whole
+ * from its line and the file is truncated back to the image size. The size
+ * is kept under the lock, since the I/O engine calls in from several threads.
+ */
+
+#define DIRECT_LINE_BYTES   (64*1024)
+#define DIRECT_CACHE_LINES  256
+#define DIRECT_HASH         512
+#define DIRECT_BOUNCE_BYTES (1024*1024)
+#define DIRECT_BOUNCES      4
+#define DIRECT_STREAM_BYTES (128*1024)
+
+typedef struct Line {
+    uint64_t idx;
+    bool valid;
+    uint8_t *data;
+    uint32_t dirty_lo, dirty_hi;    /* dirty byte range within the line */
+    struct Line *hnext;
+    struct Line *prev, *next;       /* LRU list, most recent first */
+} Line;
+
+typedef struct {
+    int fd;                 /* O_DIRECT */
+    uint32_t align;
+    uint8_t *pool;
+    Line lines[DIRECT_CACHE_LINES];
+    Line *hash[DIRECT_HASH];
+    Line *head, *tail;
+    uint8_t *bounce[DIRECT_BOUNCES];
+    bool bounce_busy[DIRECT_BOUNCES];
+    uint64_t gen;           /* bumped on every write-back */
+    uint64_t hits, misses, bypassed;
+    pthread_mutex_t lock;
+    pthread_cond_t bounce_cv;
+} DirectDev;
+
+static uint64_t align_down(const DirectDev *d, uint64_t v) {
+    return v & ~(uint64_t)(d->align - 1);
+}
+
+static uint64_t align_up(const DirectDev *d, uint64_t v) {
+    return align_down(d, v + d->align - 1);
+}
+
+/* Reads len bytes at an aligned offset into an aligned buffer; bytes past size read as zero. */
+static int dio_read(DirectDev *d, uint64_t size, void *buf, uint32_t len, uint64_t off) {
+    uint32_t want = (uint32_t)align_up(d, len), done = 0;
+    while (done < want) {
+        ssize_t n = pread(d->fd, (uint8_t*)buf + done, want - done, (off_t)(off + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += (uint32_t)n;
+        if (done & (d->align - 1)) break;       /* short read at end of file */
+    }
+    uint64_t need = off + len < size ? len : (size > off ? size - off : 0);
+    if (done < need) return -1;
+    if (done < len) memset((uint8_t*)buf + done, 0, len - done);
+    return 0;
+}
+
+/*
+ * Writes at an aligned offset from an aligned buffer. len ends unaligned only
+ * at the end of the image (a line write-back, under the lock): the buffer has
+ * room up to the next block, so the whole block is written and the bytes past
+ * the end are cut off again.
+ */
+static int dio_write(ImageDev *dev, const void *buf, uint32_t len, uint64_t off) {
+    DirectDev *d = dev->priv;
+    uint32_t want = (uint32_t)align_up(d, len), done = 0;
+    while (done < want) {
+        ssize_t n = pwrite(d->fd, (const uint8_t*)buf + done, want - done, (off_t)(off + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += (uint32_t)n;
+    }
+    if (want > len && ftruncate(d->fd, (off_t)dev->size) != 0) return -1;
+    return 0;
+}
+
+/* ---- line cache; callers hold the lock ---- */
+
+static uint32_t line_len(ImageDev *dev, uint64_t idx) {
+    uint64_t off = idx * DIRECT_LINE_BYTES;
+    if (off >= dev->size) return 0;
+    return dev->size - off < DIRECT_LINE_BYTES ? (uint32_t)(dev->size - off) : DIRECT_LINE_BYTES;
+}
+
+static Line *line_find(DirectDev *d, uint64_t idx) {
+    for (Line *l = d->hash[idx % DIRECT_HASH]; l; l = l->hnext) {
+        if (l->idx == idx) return l;
+    }
+    return NULL;
+}
+
+static void lru_unlink(DirectDev *d, Line *l) {
+    if (l->prev) l->prev->next = l->next; else d->head = l->next;
+    if (l->next) l->next->prev = l->prev; else d->tail = l->prev;
+    l->prev = l->next = NULL;
+}
+
+static void lru_front(DirectDev *d, Line *l) {
+    if (d->head == l) return;
+    if (l->prev || l->next || d->tail == l) lru_unlink(d, l);
+    l->next = d->head;
+    if (d->head) d->head->prev = l;
+    d->head = l;
+    if (!d->tail) d->tail = l;
+}
+
+static void hash_unlink(DirectDev *d, Line *l) {
+    Line **p = &d->hash[l->idx % DIRECT_HASH];
+    while (*p && *p != l) p = &(*p)->hnext;
+    if (*p) *p = l->hnext;
+    l->hnext = NULL;
+}
+
+static int line_flush(ImageDev *dev, Line *l) {
+    DirectDev *d = dev->priv;
+    if (l->dirty_lo >= l->dirty_hi) return 0;
+    uint32_t lo = (uint32_t)align_down(d, l->dirty_lo);
+    uint32_t hi = (uint32_t)align_up(d, l->dirty_hi);
+    uint32_t len = line_len(dev, l->idx);
+    if (hi > len) hi = len;
+    if (dio_write(dev, l->data + lo, hi - lo, l->idx * DIRECT_LINE_BYTES + lo) != 0) return -1;
+    l->dirty_lo = l->dirty_hi = 0;
+    d->gen++;
+    return 0;
+}
+
+/* Returns the line for idx, recycling the least recently used one; load=false skips the read for full overwrites. */
+static Line *line_get(ImageDev *dev, uint64_t idx, bool load) {
+    DirectDev *d = dev->priv;
+    Line *l = line_find(d, idx);
+    if (l) {
+        d->hits++;
+        lru_front(d, l);
+        return l;
+    }
+    l = d->tail;
+    if (l->valid) {
+        if (line_flush(dev, l) != 0) return NULL;
+        hash_unlink(d, l);
+        l->valid = false;
+    }
+    if (load && dio_read(d, dev->size, l->data, DIRECT_LINE_BYTES, idx * DIRECT_LINE_BYTES) != 0) return NULL;
+    d->misses++;
+    l->idx = idx;
+    l->valid = true;
+    l->hnext = d->hash[idx % DIRECT_HASH];
+    d->hash[idx % DIRECT_HASH] = l;
+    lru_front(d, l);
+    return l;
+}
+
+static int cached_read(ImageDev *dev, uint64_t off, uint8_t *buf, uint32_t len) {
+    while (len > 0) {
+        uint32_t in = (uint32_t)(off % DIRECT_LINE_BYTES);
+        uint32_t n = DIRECT_LINE_BYTES - in < len ? DIRECT_LINE_BYTES - in : len;
+        Line *l = line_get(dev, off / DIRECT_LINE_BYTES, true);
+        if (!l) return -1;
+        memcpy(buf, l->data + in, n);
+        off += n; buf += n; len -= n;
+    }
+    return 0;
+}
+
+static int cached_write(ImageDev *dev, uint64_t off, const uint8_t *buf, uint32_t len) {
+    while (len > 0) {
+        uint64_t idx = off / DIRECT_LINE_BYTES;
+        uint32_t in = (uint32_t)(off % DIRECT_LINE_BYTES);
+        uint32_t n = DIRECT_LINE_BYTES - in < len ? DIRECT_LINE_BYTES - in : len;
+        Line *l = line_get(dev, idx, !(in == 0 && n >= line_len(dev, idx)));
+        if (!l) return -1;
+        memcpy(l->data + in, buf, n);
+        if (l->dirty_lo >= l->dirty_hi) {
+            l->dirty_lo = in;
+            l->dirty_hi = in + n;
+        } else {
+            if (in < l->dirty_lo) l->dirty_lo = in;
+            if (in + n > l->dirty_hi) l->dirty_hi = in + n;
+        }
+        off += n; buf += n; len -= n;
+    }
+    return 0;
+}
+
+/* Copies cached lines over [off, off+len) of buf (to_line=false) or buf into them (to_line=true). */
+static void overlay_lines(DirectDev *d, uint64_t off, uint8_t *buf, uint32_t len, bool to_line) {
+    for (uint64_t idx = off / DIRECT_LINE_BYTES; idx * DIRECT_LINE_BYTES < off + len; idx++) {
+        Line *l = line_find(d, idx);
+        if (!l) continue;
+        uint64_t lo = idx * DIRECT_LINE_BYTES > off ? idx * DIRECT_LINE_BYTES : off;
+        uint64_t hi = (idx + 1) * DIRECT_LINE_BYTES < off + len ? (idx + 1) * DIRECT_LINE_BYTES : off + len;
+        uint8_t *ld = l->data + (lo - idx * DIRECT_LINE_BYTES);
+        if (to_line) memcpy(ld, buf + (lo - off), hi - lo);
+        else memcpy(buf + (lo - off), ld, hi - lo);
+    }
+}
+
+/* ---- streaming path, around the cache ---- */
+
+static uint8_t *bounce_get(DirectDev *d, int *slot) {
+    pthread_mutex_lock(&d->lock);
+    while (1) {
+        for (int i = 0; i < DIRECT_BOUNCES; i++) {
+            if (!d->bounce_busy[i]) {
+                d->bounce_busy[i] = true;
+                pthread_mutex_unlock(&d->lock);
+                *slot = i;
+                return d->bounce[i];
+            }
+        }
+        pthread_cond_wait(&d->bounce_cv, &d->lock);
+    }
+}
+
+static void bounce_put(DirectDev *d, int slot) {
+    pthread_mutex_lock(&d->lock);
+    d->bounce_busy[slot] = false;
+    pthread_cond_signal(&d->bounce_cv);
+    pthread_mutex_unlock(&d->lock);
+}
+
+static int stream_read(ImageDev *dev, uint64_t off, uint8_t *buf, uint32_t len) {
+    DirectDev *d = dev->priv;
+    int slot;
+    uint8_t *b = bounce_get(d, &slot);
+    int rc = 0;
+    while (rc == 0 && len > 0) {
+        uint64_t a0 = align_down(d, off);
+        uint64_t end = off + len < a0 + DIRECT_BOUNCE_BYTES ? off + len : a0 + DIRECT_BOUNCE_BYTES;
+        uint32_t n = (uint32_t)(end - off);
+        uint32_t span = (uint32_t)(align_up(d, end) - a0);
+        /* A line written back while the read was in flight may have been evicted with newer data; retry. */
+        while (1) {
+            pthread_mutex_lock(&d->lock);
+            uint64_t gen = d->gen, size = dev->size;
+            pthread_mutex_unlock(&d->lock);
+            if (dio_read(d, size, b, span, a0) != 0) { rc = -1; break; }
+            pthread_mutex_lock(&d->lock);
+            if (d->gen == gen) break;
+            pthread_mutex_unlock(&d->lock);
+        }
+        if (rc != 0) break;
+        memcpy(buf, b + (off - a0), n);
+        overlay_lines(d, off, buf, n, false);
+        d->bypassed++;
+        pthread_mutex_unlock(&d->lock);
+        off += n; buf += n; len -= n;
+    }
+    bounce_put(d, slot);
+    return rc;
+}
+
+/* off and len are aligned. */
+static int stream_write(ImageDev *dev, uint64_t off, const uint8_t *buf, uint32_t len) {
+    DirectDev *d = dev->priv;
+    int slot;
+    uint8_t *b = bounce_get(d, &slot);
+    int rc = 0;
+    while (rc == 0 && len > 0) {
+        uint32_t n = len < DIRECT_BOUNCE_BYTES ? len : DIRECT_BOUNCE_BYTES;
+        memcpy(b, buf, n);
+        pthread_mutex_lock(&d->lock);
+        overlay_lines(d, off, b, n, true);      /* keep cached copies current */
+        d->bypassed++;
+        pthread_mutex_unlock(&d->lock);
+        rc = dio_write(dev, b, n, off);
+        pthread_mutex_lock(&d->lock);
+        overlay_lines(d, off, b, n, true);      /* and lines another thread loaded meanwhile */
+        pthread_mutex_unlock(&d->lock);
+        off += n; buf += n; len -= n;
+    }
+    bounce_put(d, slot);
+    return rc;
+}
+
+static int direct_read(ImageDev *dev, uint64_t off, void *buf, uint32_t len) {
+    DirectDev *d = dev->priv;
+    pthread_mutex_lock(&d->lock);
+    int rc = off + len > dev->size ? -1 : 0;
+    if (rc == 0 && len < DIRECT_STREAM_BYTES) rc = cached_read(dev, off, buf, len);
+    pthread_mutex_unlock(&d->lock);
+    if (rc == 0 && len >= DIRECT_STREAM_BYTES) rc = stream_read(dev, off, buf, len);
+    return rc;
+}
+
+static int direct_write(ImageDev *dev, uint64_t off, const void *buf, uint32_t len) {
+    DirectDev *d = dev->priv;
+    const uint8_t *p = buf;
+    if (!dev->writable) return -1;
+
+    uint64_t a = align_up(d, off), b = align_down(d, off + len);
+    int rc = 0;
+    pthread_mutex_lock(&d->lock);
+    if (off + len > dev->size) dev->size = off + len;
+    if (len < DIRECT_STREAM_BYTES || b <= a) {
+        rc = cached_write(dev, off, p, len);
+        pthread_mutex_unlock(&d->lock);
+        return rc;
+    }
+    /* Unaligned edges through the cache, the aligned middle straight to the device. */
+    if (a > off) rc = cached_write(dev, off, p, (uint32_t)(a - off));
+    if (rc == 0 && off + len > b) rc = cached_write(dev, b, p + (b - off), (uint32_t)(off + len - b));
+    pthread_mutex_unlock(&d->lock);
+    if (rc == 0) rc = stream_write(dev, a, p + (a - off), (uint32_t)(b - a));
+    return rc;
+}
+
+static int flush_all(ImageDev *dev) {
+    DirectDev *d = dev->priv;
+    int rc = 0;
+    pthread_mutex_lock(&d->lock);
+    for (int i = 0; i < DIRECT_CACHE_LINES; i++) {
+        if (d->lines[i].valid && line_flush(dev, &d->lines[i]) != 0) rc = -1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return rc;
+}
+
+static int direct_sync(ImageDev *dev) {
+    DirectDev *d = dev->priv;
+    if (!dev->writable) return 0;
+    if (flush_all(dev) != 0) return -1;
+    if (fdatasync(d->fd) != 0) return -1;
+    return 0;
+}
+
+static void direct_close(ImageDev *dev) {
+    DirectDev *d = dev->priv;
+    if (dev->writable && flush_all(dev) != 0) fprintf(stderr, "direct: failed to write back cached data\n");
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->bounce_cv);
+    close(d->fd);
+    free(d->pool);
+    free(d);
+    free(dev);
+}
+
+/* Alignment the device wants for O_DIRECT offsets and buffers, 4 KiB when the kernel cannot say. */
+static uint32_t dio_alignment(int fd) {
+    uint32_t a = 4096;
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN) &&
+        stx.stx_dio_offset_align) {
+        a = stx.stx_dio_offset_align > stx.stx_dio_mem_align ? stx.stx_dio_offset_align : stx.stx_dio_mem_align;
+    }
+#endif
+    return a < 512 ? 512 : a;
+}
+
+ImageDev *image_open_direct(const char *path, bool writable) {
+    int flags = writable ? O_RDWR : O_RDONLY;
+    int fd = open(path, flags | O_DIRECT);
+    if (fd < 0) {
+        perror("open (O_DIRECT)");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        close(fd);
+        return NULL;
+    }
+    uint32_t align = dio_alignment(fd);
+    if (DIRECT_LINE_BYTES % align != 0) {
+        fprintf(stderr, "direct: unsupported alignment %u\n", align);
+        close(fd);
+        return NULL;
+    }
+
+    ImageDev *dev = calloc(1, sizeof(ImageDev));
+    DirectDev *d = calloc(1, sizeof(DirectDev));
+    size_t pool_bytes = (size_t)DIRECT_CACHE_LINES * DIRECT_LINE_BYTES + (size_t)DIRECT_BOUNCES * DIRECT_BOUNCE_BYTES;
+    void *pool = NULL;
+    if (!dev || !d || posix_memalign(&pool, align < 4096 ? 4096 : align, pool_bytes) != 0) {
+        free(dev); free(d);
+        close(fd);
+        return NULL;
+    }
+    d->fd = fd;
+    d->align = align;
+    d->pool = pool;
+    for (int i = 0; i < DIRECT_CACHE_LINES; i++) {
+        d->lines[i].data = d->pool + (size_t)i * DIRECT_LINE_BYTES;
+        lru_front(d, &d->lines[i]);
+    }
+    for (int i = 0; i < DIRECT_BOUNCES; i++) {
+        d->bounce[i] = d->pool + (size_t)DIRECT_CACHE_LINES * DIRECT_LINE_BYTES + (size_t)i * DIRECT_BOUNCE_BYTES;
+    }
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->bounce_cv, NULL);
+
+    dev->kind = "direct";
+    dev->size = (uint64_t)st.st_size;
+    dev->writable = writable;
+    dev->read = direct_read;
+    dev->write = direct_write;
+    dev->copy = NULL;           /* fs_copy_sectors() falls back to large reads and writes */
+    dev->sync = direct_sync;
+    dev->close = direct_close;
+    dev->priv = d;
+    return dev;
+}
+
+int image_direct_stat(ImageDev *dev, uint64_t *hits, uint64_t *misses, uint64_t *bypassed) {
+    if (strcmp(dev->kind, "direct") != 0) return -1;
+    DirectDev *d = dev->priv;
+    pthread_mutex_lock(&d->lock);
+    *hits = d->hits;
+    *misses = d->misses;
+    *bypassed = d->bypassed;
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
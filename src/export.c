@@ -0,0 +1,456 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "fs.h"
+#include "fdtable.h"
+#include "path.h"
+#include "utils.h"
+
+/*
+ * export-tar: writes a directory tree as a POSIX ustar archive. One walk of
+ * the tree collects the entries. Directories and empty files come first, in
+ * walk order. Files with data follow, sorted by first cluster, so the image is
+ * read mostly front to back. A reader thread turns the files' chains into runs
+ * and reads them into a fixed ring of buffers, several runs per batch. The
+ * calling thread writes headers and data from those buffers to the output, so
+ * reading and writing overlap. Memory holds the entry list and the ring,
+ * whatever the files add up to.
+ */
+
+#define TAR_CHUNK_BYTES  (1u << 20)
+#define TAR_BUFFERS      8
+#define TAR_BLOCK        512
+#define TAR_RECORD       (20 * TAR_BLOCK)
+
+typedef struct {
+    char *path;                 /* relative to the exported directory */
+    uint32_t cluster, size;
+    uint16_t date, time;
+    uint8_t attr;
+} TarItem;
+
+typedef struct {
+    uint32_t item;
+    uint32_t off, len;          /* within the chunk's buffer */
+} TarPiece;
+
+typedef struct {
+    uint8_t *buf;
+    TarPiece *pieces;
+    uint32_t npieces;
+    int rc;
+} TarChunk;
+
+typedef struct {
+    TarItem *items;
+    uint32_t nitems, cap;
+    uint32_t first_data;        /* items before this have no data */
+
+    pthread_mutex_t lock;
+    pthread_cond_t filled, drained;
+    TarChunk chunks[TAR_BUFFERS];
+    uint32_t head, count;       /* ring of filled chunks, oldest at head */
+    bool done, stop, threaded;
+    SectorReq *reqs;
+    uint32_t chunk_bytes;
+
+    /* writer side */
+    int out;
+    uint64_t out_bytes;
+    int64_t cur;                /* item whose data is being written, -1 before the first */
+    uint32_t cur_done;
+    uint32_t files, dirs;
+    uint64_t bytes;
+} TarPipe;
+
+static int write_all(TarPipe *p, const void *data, size_t len) {
+    const uint8_t *b = data;
+    while (len > 0) {
+        ssize_t n = write(p->out, b, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        b += n;
+        len -= (size_t)n;
+        p->out_bytes += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int write_zeros(TarPipe *p, size_t len) {
+    static const uint8_t zero[TAR_BLOCK];
+    while (len > 0) {
+        size_t k = len < sizeof(zero) ? len : sizeof(zero);
+        if (write_all(p, zero, k) != 0) return -1;
+        len -= k;
+    }
+    return 0;
+}
+
+/* ---- headers ---- */
+
+static void octal(char *field, size_t width, uint64_t v) {
+    snprintf(field, width, "%0*llo", (int)width - 1, (unsigned long long)v);
+}
+
+static time_t fat_time(uint16_t date, uint16_t time_v) {
+    if (date == 0) return 0;
+    struct tm tm = {0};
+    tm.tm_year = 80 + (date >> 9);
+    tm.tm_mon = ((date >> 5) & 0x0F) - 1;
+    tm.tm_mday = date & 0x1F;
+    tm.tm_hour = time_v >> 11;
+    tm.tm_min = (time_v >> 5) & 0x3F;
+    tm.tm_sec = (time_v & 0x1F) * 2;
+    tm.tm_isdst = -1;
+    time_t t = mktime(&tm);
+    return t < 0 ? 0 : t;
+}
+
+/* Splits name into ustar's prefix and name fields; false if it cannot be split. */
+static bool ustar_name(const char *name, char *h) {
+    size_t len = strlen(name);
+    if (len <= 100) {
+        memcpy(h, name, len);
+        return true;
+    }
+    for (size_t i = len - 1; i > 0; i--) {
+        if (name[i] != '/' || len - i - 1 > 100) continue;
+        if (i > 155) continue;
+        memcpy(h + 345, name, i);
+        memcpy(h, name + i + 1, len - i - 1);
+        return true;
+    }
+    return false;
+}
+
+static int write_header(TarPipe *p, const char *name, char type, uint32_t mode, uint64_t size, time_t mtime) {
+    char h[TAR_BLOCK];
+    memset(h, 0, sizeof(h));
+    if (!ustar_name(name, h)) return -1;
+    octal(h + 100, 8, mode);
+    octal(h + 108, 8, 0);
+    octal(h + 116, 8, 0);
+    octal(h + 124, 12, size);
+    octal(h + 136, 12, (uint64_t)mtime);
+    h[156] = type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memset(h + 148, ' ', 8);
+    uint32_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) sum += (uint8_t)h[i];
+    snprintf(h + 148, 8, "%06o", sum);
+    h[155] = ' ';
+    return write_all(p, h, sizeof(h));
+}
+
+/* A name too long for ustar goes in a pax extended header in front of the entry. */
+static int write_pax_path(TarPipe *p, const char *name, time_t mtime) {
+    char rec[1024];
+    size_t body = strlen(name) + strlen(" path=\n");
+    size_t len = body + 1;
+    while ((size_t)snprintf(NULL, 0, "%zu", len) + body != len) len++;
+    int n = snprintf(rec, sizeof(rec), "%zu path=%s\n", len, name);
+    if (n < 0 || (size_t)n != len) return -1;
+    if (write_header(p, "././@PaxHeader", 'x', 0644, len, mtime) != 0) return -1;
+    if (write_all(p, rec, len) != 0) return -1;
+    return write_zeros(p, (TAR_BLOCK - len % TAR_BLOCK) % TAR_BLOCK);
+}
+
+static int item_header(TarPipe *p, const TarItem *it) {
+    bool dir = (it->attr & ATTR_DIRECTORY) != 0;
+    uint32_t mode = dir ? 0755 : 0644;
+    if (it->attr & ATTR_READ_ONLY) mode &= ~0222u;
+    time_t mtime = fat_time(it->date, it->time);
+    char name[1024];
+    snprintf(name, sizeof(name), "%s%s", it->path, dir ? "/" : "");
+    char probe[TAR_BLOCK] = {0};
+    if (!ustar_name(name, probe)) {
+        if (write_pax_path(p, name, mtime) != 0) return -1;
+        /* With a pax path in front, the ustar name is only a fallback. */
+        name[100] = '\0';
+    }
+    if (dir) p->dirs++;
+    else p->files++;
+    return write_header(p, name, dir ? '5' : '0', mode, dir ? 0 : it->size, mtime);
+}
+
+/* ---- collecting entries ---- */
+
+static int collect(const DirEntry *e, const char *path, void *arg) {
+    TarPipe *p = arg;
+    if (p->nitems == p->cap) {
+        uint32_t cap = p->cap ? p->cap * 2 : 256;
+        TarItem *items = realloc(p->items, cap * sizeof(TarItem));
+        if (!items) return -1;
+        p->items = items;
+        p->cap = cap;
+    }
+    TarItem *it = &p->items[p->nitems];
+    it->path = strdup(path[0] == '/' ? path + 1 : path);
+    if (!it->path) return -1;
+    it->cluster = ((uint32_t)e->DIR_FstClusHI << 16) | e->DIR_FstClusLO;
+    it->size = (e->DIR_Attr & ATTR_DIRECTORY) || it->cluster < 2 ? 0 : e->DIR_FileSize;
+    it->date = e->DIR_WrtDate;
+    it->time = e->DIR_WrtTime;
+    it->attr = e->DIR_Attr;
+    p->nitems++;
+    return 0;
+}
+
+static bool has_data(const TarItem *it) {
+    return it->size > 0 && it->cluster >= 2;
+}
+
+static int cmp_cluster(const void *a, const void *b) {
+    uint32_t x = ((const TarItem*)a)->cluster, y = ((const TarItem*)b)->cluster;
+    return (x > y) - (x < y);
+}
+
+/* Entries without data keep walk order, so parents precede children; the rest go by position. */
+static int order_items(TarPipe *p) {
+    uint32_t k = 0;
+    TarItem *sorted = malloc((p->nitems ? p->nitems : 1) * sizeof(TarItem));
+    if (!sorted) return -1;
+    for (uint32_t i = 0; i < p->nitems; i++) if (!has_data(&p->items[i])) sorted[k++] = p->items[i];
+    p->first_data = k;
+    for (uint32_t i = 0; i < p->nitems; i++) if (has_data(&p->items[i])) sorted[k++] = p->items[i];
+    qsort(sorted + p->first_data, p->nitems - p->first_data, sizeof(TarItem), cmp_cluster);
+    free(p->items);
+    p->items = sorted;
+    return 0;
+}
+
+/* ---- writer side ---- */
+
+static int finish_item(TarPipe *p) {
+    if (p->cur < 0) return 0;
+    const TarItem *it = &p->items[p->cur];
+    if (p->cur_done != it->size) return -1;
+    p->bytes += it->size;
+    return write_zeros(p, (TAR_BLOCK - it->size % TAR_BLOCK) % TAR_BLOCK);
+}
+
+static int drain_chunk(TarPipe *p, const TarChunk *c) {
+    if (c->rc != 0) return -1;
+    for (uint32_t i = 0; i < c->npieces; i++) {
+        const TarPiece *pc = &c->pieces[i];
+        if ((int64_t)pc->item != p->cur) {
+            /* Items arrive in order, each with at least one piece. */
+            uint32_t expect = p->cur < 0 ? p->first_data : (uint32_t)p->cur + 1;
+            if (finish_item(p) != 0 || pc->item != expect) return -1;
+            p->cur = pc->item;
+            p->cur_done = 0;
+            if (item_header(p, &p->items[p->cur]) != 0) return -1;
+        }
+        if (write_all(p, c->buf + pc->off, pc->len) != 0) return -1;
+        p->cur_done += pc->len;
+    }
+    return 0;
+}
+
+/* ---- reader side ---- */
+
+/* Hands a filled chunk to the writer: queued when threaded, written at once otherwise. */
+static int publish(TarPipe *p, TarChunk *c) {
+    if (!p->threaded) return drain_chunk(p, c);
+    pthread_mutex_lock(&p->lock);
+    p->count++;
+    pthread_cond_signal(&p->filled);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+/* Next chunk to fill, or NULL once the writer has given up. */
+static TarChunk *next_chunk(TarPipe *p) {
+    if (!p->threaded) return &p->chunks[0];
+    pthread_mutex_lock(&p->lock);
+    while (p->count == TAR_BUFFERS && !p->stop) pthread_cond_wait(&p->drained, &p->lock);
+    TarChunk *c = p->stop ? NULL : &p->chunks[(p->head + p->count) % TAR_BUFFERS];
+    pthread_mutex_unlock(&p->lock);
+    return c;
+}
+
+static int flush_chunk(TarPipe *p, TarChunk *c, uint32_t nreq) {
+    c->rc = nreq ? sectors_batch(p->reqs, nreq) : 0;
+    return publish(p, c);
+}
+
+static int read_items(TarPipe *p) {
+    uint32_t bpc = fs_cluster_bytes();
+    TarChunk *c = NULL;
+    uint32_t used = 0, nreq = 0;
+    int rc = 0;
+    for (uint32_t i = p->first_data; rc == 0 && i < p->nitems; i++) {
+        const TarItem *it = &p->items[i];
+        ExtentList ext = {0};
+        uint32_t need = (uint32_t)(((uint64_t)it->size + bpc - 1) / bpc);
+        /* A short or broken chain stops the reader; the writer then finds the file incomplete. */
+        if (fs_chain_extents(it->cluster, need, &ext) != 0) {
+            extent_list_free(&ext);
+            return -1;
+        }
+        uint32_t off = 0;
+        for (uint32_t r = 0; rc == 0 && r < ext.count; r++) {
+            for (uint32_t k = 0; rc == 0 && k < ext.items[r].count; ) {
+                if (c && used + bpc > p->chunk_bytes) {
+                    rc = flush_chunk(p, c, nreq);
+                    c = NULL;
+                }
+                if (rc != 0) break;
+                if (!c) {
+                    if (!(c = next_chunk(p))) {
+                        rc = -1;
+                        break;
+                    }
+                    c->npieces = 0;
+                    used = nreq = 0;
+                }
+                uint32_t n = (p->chunk_bytes - used) / bpc;
+                if (n > ext.items[r].count - k) n = ext.items[r].count - k;
+                uint32_t len = (uint64_t)n * bpc < it->size - off ? n * bpc : it->size - off;
+                p->reqs[nreq++] = (SectorReq){cluster_to_sector(ext.items[r].start + k), n * fsinfo.sectors_per_cluster,
+                                              c->buf + used, false};
+                /* A file's pieces in one chunk are adjacent, since only its last piece can be short. */
+                if (c->npieces > 0 && c->pieces[c->npieces - 1].item == i) c->pieces[c->npieces - 1].len += len;
+                else c->pieces[c->npieces++] = (TarPiece){i, used, len};
+                used += n * bpc;
+                off += len;
+                k += n;
+            }
+        }
+        extent_list_free(&ext);
+    }
+    if (rc == 0 && c) rc = flush_chunk(p, c, nreq);
+    return rc;
+}
+
+static void *tar_reader(void *arg) {
+    TarPipe *p = arg;
+    read_items(p);
+    pthread_mutex_lock(&p->lock);
+    p->done = true;
+    pthread_cond_signal(&p->filled);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static int pipe_init(TarPipe *p) {
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->filled, NULL);
+    pthread_cond_init(&p->drained, NULL);
+    uint32_t bpc = fs_cluster_bytes();
+    p->chunk_bytes = TAR_CHUNK_BYTES < bpc ? bpc : TAR_CHUNK_BYTES / bpc * bpc;
+    uint32_t max_pieces = p->chunk_bytes / bpc;
+    p->reqs = malloc(max_pieces * sizeof(SectorReq));
+    if (!p->reqs) return -1;
+    for (int i = 0; i < TAR_BUFFERS; i++) {
+        p->chunks[i].buf = malloc(p->chunk_bytes);
+        p->chunks[i].pieces = malloc(max_pieces * sizeof(TarPiece));
+        if (!p->chunks[i].buf || !p->chunks[i].pieces) return -1;
+    }
+    return 0;
+}
+
+static void pipe_free(TarPipe *p) {
+    for (uint32_t i = 0; i < p->nitems; i++) free(p->items[i].path);
+    free(p->items);
+    free(p->reqs);
+    for (int i = 0; i < TAR_BUFFERS; i++) {
+        free(p->chunks[i].buf);
+        free(p->chunks[i].pieces);
+    }
+    pthread_cond_destroy(&p->filled);
+    pthread_cond_destroy(&p->drained);
+    pthread_mutex_destroy(&p->lock);
+}
+
+/* Streams the file data: through the reader thread when one starts, inline otherwise. */
+static int export_data(TarPipe *p) {
+    pthread_t reader;
+    p->threaded = pthread_create(&reader, NULL, tar_reader, p) == 0;
+    if (!p->threaded) return read_items(p);
+
+    int rc = 0;
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (p->count == 0 && !p->done) pthread_cond_wait(&p->filled, &p->lock);
+        if (p->count == 0) break;
+        TarChunk *c = &p->chunks[p->head];
+        pthread_mutex_unlock(&p->lock);
+        if (rc == 0) rc = drain_chunk(p, c);
+        pthread_mutex_lock(&p->lock);
+        p->head = (p->head + 1) % TAR_BUFFERS;
+        p->count--;
+        if (rc != 0) p->stop = true;
+        pthread_cond_signal(&p->drained);
+    }
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(reader, NULL);
+    return rc;
+}
+
+int fs_export_tar(const char *dirname, const char *out_path) {
+    uint32_t dir = fsinfo.cwd_cluster;
+    int found = path_dir(dirname ? dirname : ".", &dir);
+    if (found == -2) {
+        print_error("Not a directory.");
+        return -1;
+    }
+    if (found != 0) {
+        print_error("Directory does not exist.");
+        return -1;
+    }
+
+    TarPipe p;
+    memset(&p, 0, sizeof(p));
+    p.cur = -1;
+    if (pipe_init(&p) != 0) {
+        pipe_free(&p);
+        print_error("Out of memory.");
+        return -1;
+    }
+    /* Handles may hold data and sizes not yet on disk. */
+    for (int fd = 0; fd < fd_limit(); fd++) {
+        OpenFileEntry *of = fd_get(fd);
+        if (of) fs_flush(of);
+    }
+    if (fs_walk_tree(dir, collect, &p) != 0 || order_items(&p) != 0) {
+        pipe_free(&p);
+        print_error("Failed to read directory tree.");
+        return -1;
+    }
+
+    if (out_path) {
+        p.out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (p.out < 0) {
+            pipe_free(&p);
+            print_error("Cannot create output file.");
+            return -1;
+        }
+    } else {
+        fflush(stdout);
+        p.out = STDOUT_FILENO;
+    }
+
+    int rc = 0;
+    for (uint32_t i = 0; rc == 0 && i < p.first_data; i++) rc = item_header(&p, &p.items[i]);
+    if (rc == 0) rc = export_data(&p);
+    if (rc == 0) rc = finish_item(&p);
+    if (rc == 0 && p.nitems > p.first_data && p.cur != (int64_t)p.nitems - 1) rc = -1;
+    /* Two zero blocks end the archive, padded out to a whole record. */
+    if (rc == 0) rc = write_zeros(&p, 2 * TAR_BLOCK);
+    if (rc == 0) rc = write_zeros(&p, (TAR_RECORD - p.out_bytes % TAR_RECORD) % TAR_RECORD);
+    if (out_path && close(p.out) != 0) rc = -1;
+
+    if (rc != 0) print_error("Export failed.");
+    else if (out_path) printf("%u files, %u directories, %llu bytes\n", p.files, p.dirs, (unsigned long long)p.bytes);
+    pipe_free(&p);
+    return rc;
+}
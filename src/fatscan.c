@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "fs.h"
+#include "fatscan.h"
+
+/*
+ * Background FAT scan. fs_mount() starts a thread that streams the first FAT
+ * in 1 MiB reads and fills two bitmaps over all clusters: free (entry is 0)
+ * and linked (entry is c+1, i.e. the chain continues in the next cluster).
+ * The volume is split into chunks of one read each; a chunk becomes usable
+ * once its bits are in. A lookup in a chunk the thread has not reached yet
+ * scans that chunk on the spot, so the foreground only ever waits for the
+ * regions it touches. FAT updates made through fs.c are mirrored into
+ * chunks that are already scanned.
+ *
+ * When the maps cannot be allocated everything falls back to reading the FAT.
+ */
+
+#define SCAN_CHUNK_BYTES    (1024*1024)
+#define SCAN_CHUNK_CLUSTERS (SCAN_CHUNK_BYTES / 4)
+
+typedef struct {
+    bool active;
+    uint32_t nclusters;         /* cluster numbers 0..nclusters-1 */
+    uint32_t nchunks;
+    uint8_t *scanned;
+    uint64_t *free_map;
+    uint64_t *link_map;
+    uint32_t *chunk_free;
+    uint8_t *buf;
+    uint32_t done;
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool running;
+    volatile bool stop;
+} FatScan;
+
+static FatScan scan;
+
+static bool map_get(const uint64_t *m, uint32_t c) {
+    return (m[c >> 6] >> (c & 63)) & 1;
+}
+
+static void map_put(uint64_t *m, uint32_t c, bool v) {
+    if (v) m[c >> 6] |= 1ull << (c & 63);
+    else m[c >> 6] &= ~(1ull << (c & 63));
+}
+
+/* Reads chunk i of the FAT into the maps. Caller holds the lock. */
+static void scan_chunk(uint32_t i) {
+    uint32_t first = i * SCAN_CHUNK_CLUSTERS;
+    uint32_t n = scan.nclusters - first < SCAN_CHUNK_CLUSTERS ? scan.nclusters - first : SCAN_CHUNK_CLUSTERS;
+    uint32_t bps = fsinfo.bytes_per_sector;
+    uint32_t nsec = (n * 4 + bps - 1) / bps;
+    uint32_t sec0 = (uint32_t)((uint64_t)first * 4 / bps);
+    uint32_t nfree = 0;
+
+    /* Straight to the device: background reads are not charged to the command being traced. */
+    uint64_t off = (uint64_t)(fsinfo.first_FAT_sector + sec0) * bps;
+    if (fsinfo.dev->read(fsinfo.dev, off, scan.buf, nsec * bps) != 0) return;
+    const uint32_t *e = (const uint32_t*)scan.buf;
+    for (uint32_t k = 0; k < n; k++) {
+        uint32_t c = first + k;
+        uint32_t v = e[k] & 0x0FFFFFFF;
+        bool is_free = c >= 2 && v == 0;
+        map_put(scan.free_map, c, is_free);
+        map_put(scan.link_map, c, c >= 2 && v == c + 1);
+        nfree += is_free;
+    }
+    scan.chunk_free[i] = nfree;
+    scan.done++;
+    __atomic_store_n(&scan.scanned[i], 1, __ATOMIC_RELEASE);
+}
+
+static void ensure_chunk(uint32_t i) {
+    if (__atomic_load_n(&scan.scanned[i], __ATOMIC_ACQUIRE)) return;
+    pthread_mutex_lock(&scan.lock);
+    if (!scan.scanned[i]) scan_chunk(i);
+    pthread_mutex_unlock(&scan.lock);
+}
+
+static void *scan_thread(void *arg) {
+    (void)arg;
+    for (uint32_t i = 0; i < scan.nchunks && !scan.stop; i++) {
+        pthread_mutex_lock(&scan.lock);
+        if (!scan.scanned[i]) scan_chunk(i);
+        pthread_mutex_unlock(&scan.lock);
+    }
+    return NULL;
+}
+
+void fatscan_start(void) {
+    memset(&scan, 0, sizeof(scan));
+    scan.nclusters = fsinfo.total_clusters + 2;
+    scan.nchunks = (scan.nclusters + SCAN_CHUNK_CLUSTERS - 1) / SCAN_CHUNK_CLUSTERS;
+    size_t words = (scan.nclusters + 63) / 64;
+    scan.scanned = calloc(scan.nchunks, 1);
+    scan.free_map = calloc(words, sizeof(uint64_t));
+    scan.link_map = calloc(words, sizeof(uint64_t));
+    scan.chunk_free = calloc(scan.nchunks, sizeof(uint32_t));
+    scan.buf = malloc(SCAN_CHUNK_BYTES + fsinfo.bytes_per_sector);
+    if (!scan.scanned || !scan.free_map || !scan.link_map || !scan.chunk_free || !scan.buf) {
+        fatscan_stop();
+        return;
+    }
+    pthread_mutex_init(&scan.lock, NULL);
+    scan.active = true;
+    if (pthread_create(&scan.thread, NULL, scan_thread, NULL) == 0) scan.running = true;
+}
+
+void fatscan_stop(void) {
+    if (scan.running) {
+        scan.stop = true;
+        pthread_join(scan.thread, NULL);
+    }
+    if (scan.active) pthread_mutex_destroy(&scan.lock);
+    free(scan.scanned);
+    free(scan.free_map);
+    free(scan.link_map);
+    free(scan.chunk_free);
+    free(scan.buf);
+    memset(&scan, 0, sizeof(scan));
+}
+
+void fatscan_note(uint32_t cluster, uint32_t value) {
+    if (!scan.active || cluster < 2 || cluster >= scan.nclusters) return;
+    uint32_t i = cluster / SCAN_CHUNK_CLUSTERS;
+    pthread_mutex_lock(&scan.lock);
+    if (scan.scanned[i]) {
+        value &= 0x0FFFFFFF;
+        bool was_free = map_get(scan.free_map, cluster);
+        map_put(scan.free_map, cluster, value == 0);
+        map_put(scan.link_map, cluster, value == cluster + 1);
+        if (was_free && value != 0) scan.chunk_free[i]--;
+        else if (!was_free && value == 0) scan.chunk_free[i]++;
+    }
+    pthread_mutex_unlock(&scan.lock);
+}
+
+bool fatscan_is_free(uint32_t cluster) {
+    if (!scan.active) return get_fat_entry(cluster) == 0;
+    if (cluster < 2 || cluster >= scan.nclusters) return false;
+    ensure_chunk(cluster / SCAN_CHUNK_CLUSTERS);
+    return map_get(scan.free_map, cluster);
+}
+
+/* Finds the first cluster in [from, end) whose free bit equals want, a word at a time. */
+static uint32_t find_bit(uint32_t from, uint32_t end, bool want) {
+    uint32_t c = from;
+    while (c < end) {
+        ensure_chunk(c / SCAN_CHUNK_CLUSTERS);
+        uint64_t w = scan.free_map[c >> 6];
+        if (!want) w = ~w;
+        w &= ~0ull << (c & 63);
+        if (w) {
+            uint32_t hit = (c & ~63u) + (uint32_t)__builtin_ctzll(w);
+            return hit < end ? hit : end;
+        }
+        c = (c & ~63u) + 64;
+    }
+    return end;
+}
+
+uint32_t fatscan_next_free(uint32_t from, uint32_t end) {
+    if (!scan.active) {
+        FatCursor fc = {0};
+        while (from < end && fat_cursor_get(&fc, from) != 0) from++;
+        return from;
+    }
+    if (end > scan.nclusters) end = scan.nclusters;
+    if (from < 2) from = 2;
+    return from < end ? find_bit(from, end, true) : end;
+}
+
+uint32_t fatscan_free_run(uint32_t from, uint32_t end, uint32_t max) {
+    if (from >= end) return 0;
+    if (max < end - from) end = from + max;
+    if (!scan.active) {
+        FatCursor fc = {0};
+        uint32_t c = from;
+        while (c < end && fat_cursor_get(&fc, c) == 0) c++;
+        return c - from;
+    }
+    if (end > scan.nclusters) end = scan.nclusters;
+    return from < end ? find_bit(from, end, false) - from : 0;
+}
+
+uint32_t fatscan_link_run(uint32_t cluster, uint32_t max) {
+    if (!scan.active || cluster < 2 || cluster >= scan.nclusters) return 0;
+    uint32_t n = 0;
+    uint32_t c = cluster;
+    while (n < max && c < scan.nclusters) {
+        ensure_chunk(c / SCAN_CHUNK_CLUSTERS);
+        if (!map_get(scan.link_map, c)) break;
+        n++;
+        c++;
+    }
+    return n;
+}
+
+bool fatscan_progress(uint32_t *done, uint32_t *total, uint32_t *free_clusters) {
+    if (!scan.active) return false;
+    pthread_mutex_lock(&scan.lock);
+    *done = scan.done;
+    *total = scan.nchunks;
+    *free_clusters = 0;
+    for (uint32_t i = 0; i < scan.nchunks; i++) *free_clusters += scan.chunk_free[i];
+    pthread_mutex_unlock(&scan.lock);
+    return true;
+}
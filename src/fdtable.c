@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs.h"
+#include "fdtable.h"
+
+/*
+ * Open-file table. A descriptor indexes a growable array of entry pointers,
+ * so every lookup is one bounds check and one load; closed descriptors go on
+ * a free stack and are handed out again first. Entries come from slabs of
+ * FD_SLAB and return to a free list on close, so holding thousands of handles
+ * costs a few allocations.
+ *
+ * Paths are interned: each distinct path is stored once, with a reference
+ * count and the list of handles open on it, which is how a file name given
+ * to read/write/close finds its handle without scanning the table.
+ */
+
+#define FD_SLAB     64
+#define PATH_BUCKETS_MIN 64
+
+typedef struct PathRef {
+    struct PathRef *next;           /* hash chain */
+    uint32_t hash;
+    uint32_t refs;
+    OpenFileEntry *handles;         /* linked through next_same */
+    char str[];
+} PathRef;
+
+typedef struct Slab {
+    struct Slab *next;
+    OpenFileEntry entries[FD_SLAB];
+} Slab;
+
+static OpenFileEntry **slots;
+static uint32_t nslots, cap;
+static uint32_t *free_fds;
+static uint32_t nfree, free_cap;
+static uint32_t nopen;
+
+static Slab *slabs;
+static OpenFileEntry *pool;         /* unused entries, linked through next_same */
+
+static PathRef **buckets;
+static uint32_t nbuckets, npaths;
+
+static uint32_t path_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) h = (h ^ (uint8_t)*s++) * 16777619u;
+    return h;
+}
+
+static PathRef *path_find(const char *s, uint32_t h) {
+    if (!nbuckets) return NULL;
+    for (PathRef *p = buckets[h & (nbuckets - 1)]; p; p = p->next) {
+        if (p->hash == h && strcmp(p->str, s) == 0) return p;
+    }
+    return NULL;
+}
+
+static int path_grow(void) {
+    uint32_t n = nbuckets ? nbuckets * 2 : PATH_BUCKETS_MIN;
+    PathRef **b = calloc(n, sizeof(PathRef*));
+    if (!b) return -1;
+    for (uint32_t i = 0; i < nbuckets; i++) {
+        for (PathRef *p = buckets[i], *next; p; p = next) {
+            next = p->next;
+            p->next = b[p->hash & (n - 1)];
+            b[p->hash & (n - 1)] = p;
+        }
+    }
+    free(buckets);
+    buckets = b;
+    nbuckets = n;
+    return 0;
+}
+
+static PathRef *path_intern(const char *s) {
+    uint32_t h = path_hash(s);
+    PathRef *p = path_find(s, h);
+    if (p) {
+        p->refs++;
+        return p;
+    }
+    if (npaths >= nbuckets && path_grow() != 0) return NULL;
+    size_t len = strlen(s);
+    p = malloc(sizeof(PathRef) + len + 1);
+    if (!p) return NULL;
+    memcpy(p->str, s, len + 1);
+    p->hash = h;
+    p->refs = 1;
+    p->handles = NULL;
+    p->next = buckets[h & (nbuckets - 1)];
+    buckets[h & (nbuckets - 1)] = p;
+    npaths++;
+    return p;
+}
+
+static PathRef *path_of(const OpenFileEntry *of) {
+    return (PathRef*)(of->path - offsetof(PathRef, str));
+}
+
+static void path_release(OpenFileEntry *of) {
+    if (!of->path) return;
+    PathRef *p = path_of(of);
+    OpenFileEntry **h = &p->handles;
+    while (*h && *h != of) h = &(*h)->next_same;
+    if (*h) *h = of->next_same;
+    of->path = of->name = NULL;
+    if (--p->refs > 0) return;
+    PathRef **b = &buckets[p->hash & (nbuckets - 1)];
+    while (*b != p) b = &(*b)->next;
+    *b = p->next;
+    npaths--;
+    free(p);
+}
+
+/* Returns a zeroed entry under a new descriptor, or -1. */
+int fd_alloc(OpenFileEntry **out) {
+    if (!pool) {
+        Slab *s = malloc(sizeof(Slab));
+        if (!s) return -1;
+        s->next = slabs;
+        slabs = s;
+        for (int i = 0; i < FD_SLAB; i++) {
+            s->entries[i].next_same = pool;
+            pool = &s->entries[i];
+        }
+    }
+    uint32_t fd;
+    if (nfree > 0) {
+        fd = free_fds[--nfree];
+    } else {
+        if (nslots >= FD_MAX) return -1;
+        if (nslots == cap) {
+            uint32_t n = cap ? cap * 2 : 16;
+            OpenFileEntry **s = realloc(slots, n * sizeof(OpenFileEntry*));
+            if (!s) return -1;
+            slots = s;
+            cap = n;
+        }
+        fd = nslots++;
+    }
+    OpenFileEntry *of = pool;
+    pool = of->next_same;
+    memset(of, 0, sizeof(*of));
+    of->fd = (int)fd;
+    slots[fd] = of;
+    nopen++;
+    *out = of;
+    return (int)fd;
+}
+
+void fd_free(int fd) {
+    OpenFileEntry *of = fd_get(fd);
+    if (!of) return;
+    path_release(of);
+    slots[fd] = NULL;
+    if (nfree == free_cap) {
+        uint32_t n = free_cap ? free_cap * 2 : 16;
+        uint32_t *f = realloc(free_fds, n * sizeof(uint32_t));
+        if (f) {
+            free_fds = f;
+            free_cap = n;
+        }
+    }
+    if (nfree < free_cap) free_fds[nfree++] = (uint32_t)fd;
+    of->next_same = pool;
+    pool = of;
+    nopen--;
+}
+
+OpenFileEntry *fd_get(int fd) {
+    if (fd < 0 || (uint32_t)fd >= nslots) return NULL;
+    return slots[fd];
+}
+
+/* Descriptors are below this; iterate with fd_get(). */
+int fd_limit(void) {
+    return (int)nslots;
+}
+
+uint32_t fd_count(void) {
+    return nopen;
+}
+
+/* Drops every handle and the memory behind the table. Callers release per-handle buffers first. */
+void fd_reset(void) {
+    for (uint32_t i = 0; i < nbuckets; i++) {
+        for (PathRef *p = buckets[i], *next; p; p = next) {
+            next = p->next;
+            free(p);
+        }
+    }
+    free(buckets);
+    buckets = NULL;
+    nbuckets = npaths = 0;
+    while (slabs) {
+        Slab *next = slabs->next;
+        free(slabs);
+        slabs = next;
+    }
+    pool = NULL;
+    free(slots);
+    free(free_fds);
+    slots = NULL;
+    free_fds = NULL;
+    nslots = cap = nfree = free_cap = nopen = 0;
+}
+
+/* Attaches an interned copy of path to the handle; of->name points at its last component. */
+int fd_set_path(OpenFileEntry *of, const char *path) {
+    PathRef *p = path_intern(path);
+    if (!p) return -1;
+    of->path = p->str;
+    const char *slash = strrchr(p->str, '/');
+    of->name = slash ? slash + 1 : p->str;
+    of->next_same = p->handles;
+    p->handles = of;
+    return 0;
+}
+
+/* Handle open on path (the most recent one) and how many there are. */
+OpenFileEntry *fd_by_path(const char *path, uint32_t *count) {
+    PathRef *p = path_find(path, path_hash(path));
+    *count = 0;
+    if (!p) return NULL;
+    for (OpenFileEntry *of = p->handles; of; of = of->next_same) (*count)++;
+    return p->handles;
+}
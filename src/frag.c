@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "fs.h"
+#include "utils.h"
+
+/*
+ * df / frag. The first FAT is cut into chunks that worker threads read with
+ * large sequential requests; each chunk is reduced to a free count, a
+ * histogram of the free runs that lie entirely inside it, and the free runs
+ * touching its two edges, which are then stitched together in disk order.
+ * Entries are tested four at a time, so fully used or fully free groups cost
+ * one compare.
+ */
+
+#define SCAN_CHUNK_BYTES (1024*1024)
+#define SCAN_WORKERS_MAX 8
+#define HIST_BUCKETS     32
+
+typedef struct {
+    uint32_t first, count;      /* clusters covered */
+    uint32_t free;
+    uint32_t lead, trail;       /* free run at the start / end of the chunk */
+    uint32_t largest;           /* largest run strictly inside */
+    uint64_t hist[HIST_BUCKETS];
+    int rc;
+} ScanChunk;
+
+typedef struct {
+    ScanChunk *chunks;
+    uint32_t nchunks;
+    uint32_t next;
+    pthread_mutex_t lock;
+} ScanState;
+
+typedef struct {
+    uint32_t free;
+    uint32_t runs;
+    uint32_t largest;
+    uint64_t hist[HIST_BUCKETS];
+} FreeStats;
+
+static int bucket_of(uint32_t len) {
+    return 31 - __builtin_clz(len);
+}
+
+/* 4-bit mask of the free entries among e[0..3]. */
+static unsigned free_mask4(const uint32_t *e) {
+#if defined(__SSE2__)
+    __m128i v = _mm_loadu_si128((const __m128i*)e);
+    v = _mm_and_si128(v, _mm_set1_epi32(0x0FFFFFFF));
+    v = _mm_cmpeq_epi32(v, _mm_setzero_si128());
+    return (unsigned)_mm_movemask_ps(_mm_castsi128_ps(v));
+#else
+    unsigned m = 0;
+    for (int k = 0; k < 4; k++) if ((e[k] & 0x0FFFFFFF) == 0) m |= 1u << k;
+    return m;
+#endif
+}
+
+static void scan_entries(ScanChunk *ch, const uint32_t *e, uint32_t n) {
+    uint32_t run = 0;
+    bool at_start = true;
+    uint32_t i = 0;
+
+#define END_RUN() do { \
+        if (run) { \
+            if (at_start) ch->lead = run; \
+            else { ch->hist[bucket_of(run)]++; if (run > ch->largest) ch->largest = run; } \
+        } \
+        run = 0; at_start = false; \
+    } while (0)
+
+    for (; i + 4 <= n; i += 4) {
+        unsigned m = free_mask4(e + i);
+        if (m == 0xF) { run += 4; ch->free += 4; continue; }
+        if (m == 0) { END_RUN(); continue; }
+        for (int k = 0; k < 4; k++) {
+            if (m & (1u << k)) { run++; ch->free++; }
+            else END_RUN();
+        }
+    }
+    for (; i < n; i++) {
+        if ((e[i] & 0x0FFFFFFF) == 0) { run++; ch->free++; }
+        else END_RUN();
+    }
+#undef END_RUN
+    if (at_start) ch->lead = run;   /* the whole chunk is one free run */
+    else ch->trail = run;
+}
+
+static void *scan_worker(void *arg) {
+    ScanState *st = arg;
+    uint32_t bps = fsinfo.bytes_per_sector;
+    uint8_t *buf = malloc(SCAN_CHUNK_BYTES + bps);
+    while (1) {
+        pthread_mutex_lock(&st->lock);
+        uint32_t idx = st->next < st->nchunks ? st->next++ : st->nchunks;
+        pthread_mutex_unlock(&st->lock);
+        if (idx == st->nchunks) break;
+        ScanChunk *ch = &st->chunks[idx];
+        if (!buf) {
+            ch->rc = -1;
+            continue;
+        }
+        /* FAT entry c lives at byte 4*c of the FAT; chunks start on sector boundaries. */
+        uint64_t byte0 = (uint64_t)ch->first * 4;
+        uint32_t sec0 = (uint32_t)(byte0 / bps);
+        uint32_t skip = (uint32_t)(byte0 % bps);
+        uint32_t nsec = (skip + ch->count * 4 + bps - 1) / bps;
+        if (read_sectors(fsinfo.first_FAT_sector + sec0, nsec, buf) != 0) {
+            ch->rc = -1;
+            continue;
+        }
+        scan_entries(ch, (const uint32_t*)(buf + skip), ch->count);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Scans the FAT for clusters 2..total+1 and merges the chunk results. */
+static int scan_free(FreeStats *out) {
+    uint32_t per_chunk = SCAN_CHUNK_BYTES / 4;
+    uint32_t total = fsinfo.total_clusters;
+    ScanState st;
+    memset(&st, 0, sizeof(st));
+    memset(out, 0, sizeof(*out));
+    st.nchunks = (total + per_chunk - 1) / per_chunk;
+    st.chunks = calloc(st.nchunks ? st.nchunks : 1, sizeof(ScanChunk));
+    if (!st.chunks) return -1;
+    for (uint32_t i = 0; i < st.nchunks; i++) {
+        st.chunks[i].first = 2 + i * per_chunk;
+        st.chunks[i].count = (total - i * per_chunk < per_chunk) ? total - i * per_chunk : per_chunk;
+    }
+    pthread_mutex_init(&st.lock, NULL);
+
+    pthread_t threads[SCAN_WORKERS_MAX];
+    int nthreads = 0;
+    long nw = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nw > SCAN_WORKERS_MAX) nw = SCAN_WORKERS_MAX;
+    if (nw > (long)st.nchunks) nw = st.nchunks;
+    for (long t = 1; t < nw; t++) {
+        if (pthread_create(&threads[nthreads], NULL, scan_worker, &st) == 0) nthreads++;
+    }
+    scan_worker(&st);
+    for (int t = 0; t < nthreads; t++) pthread_join(threads[t], NULL);
+    pthread_mutex_destroy(&st.lock);
+
+    int rc = 0;
+    uint32_t run = 0;
+#define ADD_RUN(len) do { \
+        out->runs++; out->hist[bucket_of(len)]++; \
+        if ((len) > out->largest) out->largest = (len); \
+    } while (0)
+    for (uint32_t i = 0; i < st.nchunks; i++) {
+        ScanChunk *ch = &st.chunks[i];
+        if (ch->rc != 0) rc = -1;
+        out->free += ch->free;
+        if (ch->lead == ch->count) {
+            run += ch->count;
+            continue;
+        }
+        run += ch->lead;
+        if (run) ADD_RUN(run);
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            out->runs += ch->hist[b];
+            out->hist[b] += ch->hist[b];
+        }
+        if (ch->largest > out->largest) out->largest = ch->largest;
+        run = ch->trail;
+    }
+    if (run) ADD_RUN(run);
+#undef ADD_RUN
+    free(st.chunks);
+    return rc;
+}
+
+static void print_bytes(uint64_t b) {
+    const char *unit[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int u = 0;
+    double v = (double)b;
+    while (v >= 1024 && u < 4) { v /= 1024; u++; }
+    printf("%.1f %s", v, unit[u]);
+}
+
+int fs_df() {
+    FreeStats fs;
+    if (scan_free(&fs) != 0) {
+        print_error("Failed to read the FAT.");
+        return -1;
+    }
+    uint64_t bpc = (uint64_t)fsinfo.sectors_per_cluster * fsinfo.bytes_per_sector;
+    uint32_t total = fsinfo.total_clusters;
+    printf("clusters: %u total, %u used, %u free (%.1f%% free)\n", total, total - fs.free, fs.free,
+           total ? 100.0 * fs.free / total : 0.0);
+    printf("size: "); print_bytes((uint64_t)total * bpc);
+    printf(", used: "); print_bytes((uint64_t)(total - fs.free) * bpc);
+    printf(", free: "); print_bytes((uint64_t)fs.free * bpc);
+    printf("\nlargest free run: %u clusters (", fs.largest); print_bytes((uint64_t)fs.largest * bpc);
+    printf(")\n");
+    return 0;
+}
+
+typedef struct {
+    uint32_t frags;
+    uint32_t clusters;
+    char *path;
+} FileFrag;
+
+typedef struct {
+    FileFrag *items;
+    uint32_t count, cap;
+} FragList;
+
+static int collect_frag(const DirEntry *e, const char *path, void *ctx) {
+    FragList *l = ctx;
+    uint32_t c = ((uint32_t)e->DIR_FstClusHI << 16) | e->DIR_FstClusLO;
+    if (c < 2) return 0;
+    ExtentList ext = {0};
+    if (fs_chain_extents(c, UINT32_MAX, &ext) != 0) {
+        extent_list_free(&ext);
+        return 0;
+    }
+    uint32_t clusters = 0;
+    for (uint32_t i = 0; i < ext.count; i++) clusters += ext.items[i].count;
+    uint32_t frags = ext.count;
+    extent_list_free(&ext);
+
+    if (l->count == l->cap) {
+        uint32_t cap = l->cap ? l->cap * 2 : 64;
+        FileFrag *items = realloc(l->items, cap * sizeof(FileFrag));
+        if (!items) return -1;
+        l->items = items;
+        l->cap = cap;
+    }
+    char *p = strdup(path);
+    if (!p) return -1;
+    if (e->DIR_Attr & ATTR_DIRECTORY) {
+        /* Directories are reported with a trailing slash. */
+        char *q = malloc(strlen(p) + 2);
+        if (!q) { free(p); return -1; }
+        sprintf(q, "%s/", p);
+        free(p);
+        p = q;
+    }
+    l->items[l->count].frags = frags;
+    l->items[l->count].clusters = clusters;
+    l->items[l->count].path = p;
+    l->count++;
+    return 0;
+}
+
+static int cmp_frag(const void *a, const void *b) {
+    const FileFrag *x = a, *y = b;
+    if (x->frags != y->frags) return x->frags < y->frags ? 1 : -1;
+    return strcmp(x->path, y->path);
+}
+
+int fs_frag(bool all) {
+    fs_sync();
+    FreeStats fs;
+    if (scan_free(&fs) != 0) {
+        print_error("Failed to read the FAT.");
+        return -1;
+    }
+    printf("free: %u clusters in %u runs, largest %u\n", fs.free, fs.runs, fs.largest);
+    printf("free run sizes (clusters):\n");
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        if (!fs.hist[b]) continue;
+        uint64_t lo = 1ull << b, hi = (2ull << b) - 1;
+        printf("  %10llu - %-10llu %llu\n", (unsigned long long)lo, (unsigned long long)hi, (unsigned long long)fs.hist[b]);
+    }
+
+    FragList l = {0};
+    if (fs_walk_tree(fsinfo.root_cluster, collect_frag, &l) != 0) print_error("Failed to walk the directory tree.");
+    qsort(l.items, l.count, sizeof(FileFrag), cmp_frag);
+    uint32_t fragmented = 0;
+    uint64_t frags = 0;
+    for (uint32_t i = 0; i < l.count; i++) {
+        frags += l.items[i].frags;
+        if (l.items[i].frags > 1) fragmented++;
+    }
+    printf("files: %u, fragmented: %u (%.1f%%), %.2f fragments per file\n", l.count, fragmented,
+           l.count ? 100.0 * fragmented / l.count : 0.0, l.count ? (double)frags / l.count : 0.0);
+    uint32_t show = all ? l.count : (fragmented < 10 ? fragmented : 10);
+    for (uint32_t i = 0; i < show; i++) {
+        printf("  %6u fragments %8u clusters  %s\n", l.items[i].frags, l.items[i].clusters, l.items[i].path);
+    }
+    for (uint32_t i = 0; i < l.count; i++) free(l.items[i].path);
+    free(l.items);
+    return 0;
+}
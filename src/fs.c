@@ -5,79 +5,163 @@
 #include <ctype.h>
 #include "fs.h"
 #include "utils.h"
+#include "hash.h"
+#include "alloc.h"
+#include "fatscan.h"
+#include "geom.h"
+#include "aio.h"
+#include "fdtable.h"
+#include "compact.h"
+#include "path.h"
+#include "catalog.h"
 
 FSInfo fsinfo;
-OpenFileEntry open_files[MAX_OPEN_FILES];
+IoStats io_stats;
 
 static FAT32BootSector bs;
 
 extern char current_path[512];
 
 
+/* Counters are bumped from worker threads too. */
+static void count_io(uint64_t *ops, uint64_t *sectors, uint64_t n) {
+    __atomic_fetch_add(ops, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(sectors, n, __ATOMIC_RELAXED);
+}
+
+void io_stats_get(IoStats *out) {
+    out->read_ops = __atomic_load_n(&io_stats.read_ops, __ATOMIC_RELAXED);
+    out->write_ops = __atomic_load_n(&io_stats.write_ops, __ATOMIC_RELAXED);
+    out->sectors_read = __atomic_load_n(&io_stats.sectors_read, __ATOMIC_RELAXED);
+    out->sectors_written = __atomic_load_n(&io_stats.sectors_written, __ATOMIC_RELAXED);
+}
+
 int read_sector(uint32_t sector, uint8_t *buffer) {
-    if (!fsinfo.fp) return -1;
-    if (fseek(fsinfo.fp, sector * fsinfo.bytes_per_sector, SEEK_SET)!=0) return -1;
-    if (fread(buffer, 1, fsinfo.bytes_per_sector, fsinfo.fp)!=fsinfo.bytes_per_sector) return -1;
-    return 0;
+    if (!fsinfo.dev) return -1;
+    count_io(&io_stats.read_ops, &io_stats.sectors_read, 1);
+    return fsinfo.dev->read(fsinfo.dev, (uint64_t)sector * fsinfo.bytes_per_sector, buffer, fsinfo.bytes_per_sector);
 }
 
 int write_sector(uint32_t sector, const uint8_t *buffer) {
-    if (!fsinfo.fp) return -1;
-    if (fseek(fsinfo.fp, sector * fsinfo.bytes_per_sector, SEEK_SET)!=0) return -1;
-    if (fwrite(buffer, 1, fsinfo.bytes_per_sector, fsinfo.fp)!=fsinfo.bytes_per_sector) return -1;
+    if (!fsinfo.dev) return -1;
+    catalog_note_write();
+    hash_note_write((uint64_t)sector * fsinfo.bytes_per_sector, fsinfo.bytes_per_sector);
+    count_io(&io_stats.write_ops, &io_stats.sectors_written, 1);
+    return fsinfo.dev->write(fsinfo.dev, (uint64_t)sector * fsinfo.bytes_per_sector, buffer, fsinfo.bytes_per_sector);
+}
 
-    return 0;
+int read_sectors(uint32_t sector, uint32_t count, uint8_t *buffer) {
+    if (!fsinfo.dev) return -1;
+    count_io(&io_stats.read_ops, &io_stats.sectors_read, count);
+    return fsinfo.dev->read(fsinfo.dev, (uint64_t)sector * fsinfo.bytes_per_sector, buffer, count * fsinfo.bytes_per_sector);
+}
+
+int write_sectors(uint32_t sector, uint32_t count, const uint8_t *buffer) {
+    if (!fsinfo.dev) return -1;
+    catalog_note_write();
+    hash_note_write((uint64_t)sector * fsinfo.bytes_per_sector, (uint64_t)count * fsinfo.bytes_per_sector);
+    count_io(&io_stats.write_ops, &io_stats.sectors_written, count);
+    return fsinfo.dev->write(fsinfo.dev, (uint64_t)sector * fsinfo.bytes_per_sector, buffer, count * fsinfo.bytes_per_sector);
+}
+
+/* Issues independent sector reads and writes together and waits for all of them. */
+int sectors_batch(const SectorReq *reqs, uint32_t n) {
+    if (!fsinfo.dev) return -1;
+    for (uint32_t i = 0; i < n; i++) {
+        if (reqs[i].write) {
+            catalog_note_write();
+            hash_note_write((uint64_t)reqs[i].sector * fsinfo.bytes_per_sector, (uint64_t)reqs[i].count * fsinfo.bytes_per_sector);
+            count_io(&io_stats.write_ops, &io_stats.sectors_written, reqs[i].count);
+        } else {
+            count_io(&io_stats.read_ops, &io_stats.sectors_read, reqs[i].count);
+        }
+    }
+    return aio_run(reqs, n);
 }
 
 uint32_t cluster_to_sector(uint32_t cluster) {
-    return (cluster - 2)*fsinfo.sectors_per_cluster + fsinfo.first_data_sector;
+    return geom_cluster_to_sector(cluster);
 }
 
 uint32_t get_fat_entry(uint32_t cluster) {
-    uint32_t fat_offset = cluster *4;
-    uint32_t sector_num = fsinfo.first_FAT_sector + (fat_offset / fsinfo.bytes_per_sector);
-    uint32_t offset_in_sector = fat_offset % fsinfo.bytes_per_sector;
+    uint32_t sector_num = fsinfo.first_FAT_sector + geom_fat_sector(cluster);
+    uint32_t offset_in_sector = geom_fat_index(cluster) * 4;
 
-    uint8_t sector[512];
+    uint8_t sector[SECTOR_SIZE_MAX];
     if (read_sector(sector_num, sector)!=0) return EOC;
     uint32_t val = *((uint32_t*)&sector[offset_in_sector]) & 0x0FFFFFFF;
     return val;
 }
 
 int set_fat_entry(uint32_t cluster, uint32_t value) {
-    uint32_t fat_offset = cluster *4;
-    uint32_t sector_num = fsinfo.first_FAT_sector + (fat_offset / fsinfo.bytes_per_sector);
-    uint32_t offset_in_sector = fat_offset % fsinfo.bytes_per_sector;
+    uint32_t sector_num = fsinfo.first_FAT_sector + geom_fat_sector(cluster);
+    uint32_t offset_in_sector = geom_fat_index(cluster) * 4;
 
-    uint8_t sector[512];
+    uint8_t sector[SECTOR_SIZE_MAX];
     if (read_sector(sector_num, sector)!=0) return -1;
     *((uint32_t*)&sector[offset_in_sector]) = value;
-    if (write_sector(sector_num, sector)!=0) return -1;
 
-    for (int i=1; i<fsinfo.num_FATs; i++) {
-        uint32_t backup_sec = fsinfo.first_FAT_sector + i*fsinfo.FATSz32 + (fat_offset / fsinfo.bytes_per_sector);
-        if (fseek(fsinfo.fp, backup_sec*fsinfo.bytes_per_sector, SEEK_SET)!=0) return -1;
-        if (fwrite(sector, 1, fsinfo.bytes_per_sector, fsinfo.fp)!=fsinfo.bytes_per_sector) return -1;
+    /* All FAT copies are written together. */
+    SectorReq reqs[FAT_COPIES_MAX];
+    uint32_t n = 0;
+    for (int i=0; i<fsinfo.num_FATs; i++) {
+        reqs[n++] = (SectorReq){sector_num + i*fsinfo.FATSz32, 1, sector, true};
     }
+    if (sectors_batch(reqs, n)!=0) return -1;
+    fatscan_note(cluster, value);
 
     return 0;
 }
 
 
-int fs_mount(const char *image_path) {
-    memset(&fsinfo,0,sizeof(fsinfo));
-    memset(open_files,0,sizeof(open_files));
-
-    fsinfo.fp = fopen(image_path, "r+b");
-    if (!fsinfo.fp) {
-        perror("fopen");
+static int validate_geometry(const uint8_t *boot) {
+    uint32_t bps = fsinfo.bytes_per_sector, spc = fsinfo.sectors_per_cluster;
+    if (boot[510] != 0x55 || boot[511] != 0xAA) {
+        print_error("Missing boot sector signature.");
+        return -1;
+    }
+    if (bps < 512 || bps > SECTOR_SIZE_MAX || (bps & (bps - 1))) {
+        print_error("Unsupported sector size.");
+        return -1;
+    }
+    if (spc == 0 || (spc & (spc - 1)) || fsinfo.num_FATs == 0 || fsinfo.num_FATs > FAT_COPIES_MAX || fsinfo.FATSz32 == 0 ||
+        fsinfo.reserved_sector_count == 0 || fsinfo.tot_sec <= fsinfo.first_data_sector ||
+        (uint64_t)fsinfo.tot_sec * bps > fsinfo.image_size_bytes) {
+        print_error("Invalid FAT32 geometry.");
+        return -1;
+    }
+    if ((uint64_t)fsinfo.FATSz32 * bps / 4 < (uint64_t)fsinfo.total_clusters + 2 ||
+        fsinfo.root_cluster < 2 || fsinfo.root_cluster >= fsinfo.total_clusters + 2) {
+        print_error("FAT does not cover the data region.");
         return -1;
     }
+    return 0;
+}
+
+int fs_mount(const char *image_path, const MountOptions *opts) {
+    memset(&fsinfo,0,sizeof(fsinfo));
+    fd_reset();
+    dcache_clear();
+
+    if (opts && opts->overlay_path) fsinfo.dev = image_open_overlay(image_path, opts->overlay_path);
+    else if (opts && opts->direct_io && !image_is_container(image_path)) fsinfo.dev = image_open_direct(image_path, true);
+    else fsinfo.dev = image_open(image_path, true);
+    if (!fsinfo.dev) return -1;
+    if (opts && opts->latency) {
+        ImageDev *slow = image_open_latency(fsinfo.dev, opts->latency);
+        if (!slow) {
+            fsinfo.dev->close(fsinfo.dev);
+            fsinfo.dev = NULL;
+            return -1;
+        }
+        fsinfo.dev = slow;
+    }
     strncpy(fsinfo.image_name, image_path, sizeof(fsinfo.image_name)-1);
 
     uint8_t sector[512];
-    if (fread(sector,1,512,fsinfo.fp)!=512) {
-        fclose(fsinfo.fp);
+    if (fsinfo.dev->read(fsinfo.dev,0,sector,512)!=0) {
+        fsinfo.dev->close(fsinfo.dev);
+        fsinfo.dev=NULL;
         return -1;
     }
     memcpy(&bs, sector, sizeof(FAT32BootSector));
@@ -88,27 +172,105 @@ int fs_mount(const char *image_path) {
     fsinfo.num_FATs = bs.BPB_NumFATs;
     fsinfo.FATSz32 = bs.BPB_FATSz32;
     fsinfo.root_cluster = bs.BPB_RootClus;
+    fsinfo.fsi_sector = bs.BPB_FSInfo;
 
     if (bs.BPB_TotSec32!=0) fsinfo.tot_sec = bs.BPB_TotSec32;
     else fsinfo.tot_sec = bs.BPB_TotSec16;
 
-    fseek(fsinfo.fp,0,SEEK_END);
-    fsinfo.image_size_bytes = ftell(fsinfo.fp);
-    fseek(fsinfo.fp,0,SEEK_SET);
+    fsinfo.image_size_bytes = fsinfo.dev->size;
 
     fsinfo.first_FAT_sector = fsinfo.reserved_sector_count;
     fsinfo.first_data_sector = fsinfo.reserved_sector_count + fsinfo.num_FATs * fsinfo.FATSz32;
     fsinfo.total_clusters = (fsinfo.tot_sec - fsinfo.first_data_sector)/fsinfo.sectors_per_cluster;
     fsinfo.cwd_cluster = fsinfo.root_cluster;
 
+    if (validate_geometry(sector) != 0) {
+        fsinfo.dev->close(fsinfo.dev);
+        fsinfo.dev=NULL;
+        return -1;
+    }
+    geom_select();
+
+    aio_start(opts ? opts->io_depth : 0);
+    /* Free-space and chain maps fill in behind the prompt. */
+    fatscan_start();
+    alloc_reset();
+    if (opts && opts->alloc_policy) fsinfo.alloc_policy = opts->alloc_policy;
+    if (opts) fsinfo.compact_pct = opts->compact_pct;
+    hash_track_load(opts && opts->overlay_path ? opts->overlay_path : image_path);
+    catalog_load(opts && opts->overlay_path ? opts->overlay_path : image_path);
     return 0;
 }
 
 void fs_unmount() {
-    if (fsinfo.fp) {
-        fclose(fsinfo.fp);
-        fsinfo.fp=NULL;
+    for (int fd=0; fd<fd_limit(); fd++) {
+        OpenFileEntry *of = fd_get(fd);
+        if (!of) continue;
+        if (fs_flush(of) != 0) fprintf(stderr, "Error: Flush of %s on unmount failed.\n", of->path);
+        ra_destroy(of->ra);
+        free(of->wb);
+    }
+    fd_reset();
+    catalog_close();
+    fatscan_stop();
+    aio_stop();
+    if (fsinfo.dev) fsinfo.dev->sync(fsinfo.dev);
+    hash_track_close();
+    if (fsinfo.dev) {
+        fsinfo.dev->close(fsinfo.dev);
+        fsinfo.dev=NULL;
+    }
+}
+
+int fs_overlay(const char *action) {
+    ImageDev *dev = image_latency_inner(fsinfo.dev);
+    if (strcmp(dev->kind,"overlay")!=0) {
+        print_error("Image is not mounted with an overlay.");
+        return -1;
+    }
+    if (strcmp(action,"status")==0) {
+        uint64_t used,total; uint32_t unit;
+        image_overlay_stat(dev,&used,&total,&unit);
+        printf("overlay units: %llu of %llu dirty (%u bytes each, %llu bytes in delta)\n",
+               (unsigned long long)used,(unsigned long long)total,unit,(unsigned long long)(used*unit));
+        return 0;
+    }
+    if (strcmp(action,"commit")==0) {
+        fs_sync();
+        /* The base's stamp comes back unchanged from the delta, so its own catalog would look current. */
+        catalog_drop_file(fsinfo.image_name);
+        /* Nothing tracks the commit's writes into the base, so its cluster hashes go too. */
+        hash_drop_index(fsinfo.image_name);
+        if (image_overlay_commit(dev)!=0) {
+            print_error("Overlay commit failed.");
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(action,"discard")==0) {
+        if (image_overlay_discard(dev)!=0) {
+            print_error("Overlay discard failed.");
+            return -1;
+        }
+        /* Everything cached from the delta is stale now. */
+        for (int fd=0; fd<fd_limit(); fd++) {
+            OpenFileEntry *of = fd_get(fd);
+            if (!of) continue;
+            ra_destroy(of->ra);
+            free(of->wb);
+        }
+        fd_reset();
+        fatscan_stop();
+        fatscan_start();
+        alloc_reset();
+        dcache_clear();
+        catalog_invalidate();
+        fsinfo.cwd_cluster = fsinfo.root_cluster;
+        strcpy(current_path,"/");
+        return 0;
     }
+    print_error("Usage: overlay [status|commit|discard]");
+    return -1;
 }
 
 int fs_info() {
@@ -118,17 +280,50 @@ int fs_info() {
     printf("total # of clusters in data region: %u\n", fsinfo.total_clusters);
     printf("# of entries in one FAT: %u\n", (fsinfo.FATSz32 * (fsinfo.bytes_per_sector/4)));
     printf("size of image (in bytes): %llu\n",(unsigned long long)fsinfo.image_size_bytes);
+    uint32_t done, total, free_clusters;
+    if (fatscan_progress(&done, &total, &free_clusters)) {
+        if (done < total) printf("FAT scan: %u of %u chunks (%u free clusters so far)\n", done, total, free_clusters);
+        else printf("free clusters: %u\n", free_clusters);
+    }
+    printf("geometry kernels: %s\n", geom_kind != GEOM_GENERIC ? "specialized" : "generic");
+    printf("I/O engine: %s, queue depth %u\n", aio_engine(), aio_depth());
+    uint64_t hits, misses, bypassed;
+    if (image_direct_stat(image_latency_inner(fsinfo.dev), &hits, &misses, &bypassed) == 0) {
+        printf("direct I/O cache: %llu hits, %llu misses, %llu streamed requests\n",
+               (unsigned long long)hits, (unsigned long long)misses, (unsigned long long)bypassed);
+    }
+    LatencyModel m;
+    uint64_t ios, seeks, delay_us;
+    if (image_latency_stat(fsinfo.dev, &m, &ios, &seeks, &delay_us) == 0) {
+        printf("slow device: lat %u us, seek %u us, %u MB/s, queue depth %u; %llu requests, %llu seeks, %.3f s device time\n",
+               m.lat_us, m.seek_us, m.bw_mbps, m.qd, (unsigned long long)ios, (unsigned long long)seeks, delay_us / 1e6);
+    }
+    uint32_t dentries;
+    dcache_stat(&hits, &misses, &dentries);
+    printf("dentry cache: %u directories, %llu hits, %llu misses\n", dentries,
+           (unsigned long long)hits, (unsigned long long)misses);
     return 0;
 }
 
+/* Stored names are compared in their padded 11-byte form, so a slot costs one short loop and no copying. */
+static bool name_matches(const uint8_t stored[11], const char key[11]) {
+    for (int k = 0; k < 11; k++) {
+        if (toupper(stored[k]) != (unsigned char)key[k]) return false;
+    }
+    return true;
+}
+
 int fs_find_entry_in_dir(uint32_t dir_cluster, const char *name, DirEntry *out_entry, uint32_t *out_sector, uint32_t *out_offset) {
-    char upper_name[256];
-    strncpy(upper_name, name, sizeof(upper_name)-1);
-    upper_name[sizeof(upper_name)-1] = '\0';
-    to_upper(upper_name);
+    /* Stored names are at most 11 characters with the padding trimmed; nothing else can match. */
+    size_t len = strlen(name);
+    if (len > MAX_NAME_LEN || (len > 0 && name[len-1] == ' ')) return -1;
+    char key[11];
+    format_name_11(name, key);
+    int known = catalog_lookup(dir_cluster, key, out_entry, out_sector, out_offset);
+    if (known >= 0) return known ? 0 : -1;
 
     uint32_t cluster = dir_cluster;
-    uint8_t buf[512];
+    uint8_t buf[SECTOR_SIZE_MAX];
 
     while (cluster < 0x0FFFFFF8) {
         for (int s=0; s<fsinfo.sectors_per_cluster; s++) {
@@ -142,16 +337,7 @@ int fs_find_entry_in_dir(uint32_t dir_cluster, const char *name, DirEntry *out_e
                 if ((entry->DIR_Attr & ATTR_LONG_NAME)==ATTR_LONG_NAME || entry->DIR_Name[0]==0xE5) {
                     continue;
                 }
-                char fname[12];
-                memcpy(fname, entry->DIR_Name, 11);
-                fname[11]='\0';
-                for (int k=10;k>=0;k--){
-                    if (fname[k]==' '||fname[k]==0x20)
-                        fname[k]='\0';
-                    else break;
-                }
-                to_upper(fname);
-                if (strcmp(fname, upper_name)==0) {
+                if (name_matches(entry->DIR_Name, key)) {
                     memcpy(out_entry, entry, sizeof(DirEntry));
                     *out_sector = sec;
                     *out_offset = i;
@@ -171,38 +357,34 @@ bool fs_name_exists_in_dir(uint32_t dir_cluster, const char *name) {
 
 
 int fs_cd(const char *dirname) {
-    if (strcmp(dirname,".")==0) return 0;
-    if (strcmp(dirname,"..")==0) {
-        if (fsinfo.cwd_cluster == fsinfo.root_cluster) return 0;
-        DirEntry entry; uint32_t sec, off;
-        if (fs_find_entry_in_dir(fsinfo.cwd_cluster,"..",&entry,&sec,&off)==0) {
-            uint32_t parent = ((uint32_t)entry.DIR_FstClusHI<<16)|entry.DIR_FstClusLO;
-            if (parent==0) parent=fsinfo.root_cluster;
-            fsinfo.cwd_cluster=parent;
-        }
-        return 0;
-    } else {
-        DirEntry entry; uint32_t sec, off;
-        if (fs_find_entry_in_dir(fsinfo.cwd_cluster, dirname,&entry,&sec,&off)==0) {
-            if (entry.DIR_Attr & ATTR_DIRECTORY) {
-                uint32_t c = ((uint32_t)entry.DIR_FstClusHI<<16)|entry.DIR_FstClusLO;
-                if (c==0) c=fsinfo.root_cluster;
-                fsinfo.cwd_cluster=c;
-                return 0;
-            } else {
-                print_error("Not a directory.");
-                return -1;
-            }
-        } else {
-            print_error("Directory does not exist.");
-            return -1;
-        }
+    uint32_t c;
+    char path[512];
+    int rc = path_dir(dirname, &c);
+    if (rc == -2) {
+        print_error("Not a directory.");
+        return -1;
+    }
+    if (rc != 0) {
+        print_error("Directory does not exist.");
+        return -1;
+    }
+    if (path_normalize(current_path, dirname, path, sizeof(path)) != 0) {
+        print_error("Path too long.");
+        return -1;
     }
+    fsinfo.cwd_cluster = c;
+    strcpy(current_path, path);
+    return 0;
 }
 
-int fs_ls() {
+int fs_ls(const char *dirname) {
     uint32_t cluster = fsinfo.cwd_cluster;
-    uint8_t buf[512];
+    if (dirname && path_dir(dirname, &cluster) != 0) {
+        print_error("Directory does not exist.");
+        return -1;
+    }
+    if (catalog_ls(cluster) == 0) return 0;
+    uint8_t buf[SECTOR_SIZE_MAX];
     while (cluster<0x0FFFFFF8) {
         for (int s=0; s<fsinfo.sectors_per_cluster; s++) {
             uint32_t sec = cluster_to_sector(cluster)+s;
@@ -212,12 +394,7 @@ int fs_ls() {
                 if (e->DIR_Name[0]==0x00) return 0;
                 if ((e->DIR_Attr & ATTR_LONG_NAME)==ATTR_LONG_NAME || e->DIR_Name[0]==0xE5) continue;
                 char fname[12];
-                memcpy(fname,e->DIR_Name,11);
-                fname[11]='\0';
-                for (int k=10;k>=0;k--) {
-                    if (fname[k]==' '||fname[k]==0x20) fname[k]='\0';
-                    else break;
-                }
+                entry_name(e, fname);
                 
                 if(e->DIR_Attr & ATTR_DIRECTORY) printf("\033[34m%s\033[0m    ",fname);
                 else printf("%s    ",fname);
@@ -228,20 +405,43 @@ int fs_ls() {
     return 0;
 }
 
+/* Resolves the directory part of a path argument into dir and leaf; prints msg if it does not exist. */
+static int split_arg(const char *path, uint32_t *dir, char *leaf, const char *msg) {
+    int rc = path_split(path, dir, leaf, PATH_LEAF_MAX);
+    if (rc == -3) print_error("Name too long.");
+    else if (rc != 0) print_error(msg);
+    return rc == 0 ? 0 : -1;
+}
+
+static bool bad_leaf(const char *leaf) {
+    return leaf[0] == '\0' || strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0;
+}
+
 int fs_mkdir(const char *dirname) {
-    if (fs_name_exists_in_dir(fsinfo.cwd_cluster, dirname)) {
+    uint32_t dir;
+    char leaf[PATH_LEAF_MAX];
+    if (split_arg(dirname, &dir, leaf, "Parent directory does not exist.") != 0) return -1;
+    if (bad_leaf(leaf)) {
+        print_error("Name already exists.");
+        return -1;
+    }
+    return fs_make_dir(dir, leaf, NULL);
+}
+
+int fs_make_dir(uint32_t parent, const char *dirname, uint32_t *out_cluster) {
+    if (fs_name_exists_in_dir(parent, dirname)) {
         print_error("Name already exists.");
         return -1;
     }
     uint32_t new_cluster;
     
-    if (fs_allocate_cluster_chain(1,&new_cluster)!=0) {
+    if (fs_allocate_cluster_chain(1,parent,&new_cluster)!=0) {
         print_error("No space.");
         return -1;
     }
 
-    uint8_t buf[512];
-    memset(buf,0,512);
+    uint8_t buf[SECTOR_SIZE_MAX];
+    memset(buf,0,sizeof(buf));
     for (int i=0;i<fsinfo.sectors_per_cluster;i++) {
         if (write_sector(cluster_to_sector(new_cluster)+i,buf)!=0) {
             print_error("Failed init dir cluster.");
@@ -254,25 +454,28 @@ int fs_mkdir(const char *dirname) {
         print_error("Failed to create '.'");
         return -1;
     }
-    uint32_t parent = fsinfo.cwd_cluster;
     if (create_dir_entry(new_cluster,"..",ATTR_DIRECTORY,(parent==0?fsinfo.root_cluster:parent),0)!=0) {
         print_error("Failed to create '..'");
         return -1;
     }
 
-    if (create_dir_entry(fsinfo.cwd_cluster, dirname, ATTR_DIRECTORY,new_cluster,0)!=0) {
+    if (create_dir_entry(parent, dirname, ATTR_DIRECTORY,new_cluster,0)!=0) {
         print_error("Failed to create directory entry in cwd.");
         return -1;
     }
+    if (out_cluster) *out_cluster = new_cluster;
     return 0;
 }
 
 int fs_creat(const char *filename) {
-    if (fs_name_exists_in_dir(fsinfo.cwd_cluster, filename)) {
+    uint32_t dir;
+    char leaf[PATH_LEAF_MAX];
+    if (split_arg(filename, &dir, leaf, "Parent directory does not exist.") != 0) return -1;
+    if (bad_leaf(leaf) || fs_name_exists_in_dir(dir, leaf)) {
         print_error("Name already exists.");
         return -1;
     }
-    if (create_dir_entry(fsinfo.cwd_cluster, filename, 0, 0, 0)!=0) {
+    if (create_dir_entry(dir, leaf, 0, 0, 0)!=0) {
         print_error("Failed to create file entry.");
         return -1;
     }
@@ -280,9 +483,84 @@ int fs_creat(const char *filename) {
 }
 
 
+/* Upper-case absolute path of a file, the key handles are found by. */
+static int handle_path(const char *filename, char *out, size_t cap) {
+    if (path_normalize(current_path, filename, out, cap) != 0) return -1;
+    to_upper(out);
+    return 0;
+}
+
+/* Handle named by a descriptor number, or by the path of a file opened exactly once. */
+static OpenFileEntry *find_handle(const char *arg) {
+    char *end;
+    unsigned long fd = strtoul(arg, &end, 10);
+    if (*arg && !*end && fd < FD_MAX && fd_get((int)fd)) return fd_get((int)fd);
+
+    char path[512];
+    uint32_t n;
+    OpenFileEntry *of = handle_path(arg, path, sizeof(path)) == 0 ? fd_by_path(path, &n) : NULL;
+    if (!of) n = 0;
+    if (n > 1) {
+        print_error("File is opened more than once; use its descriptor.");
+        return NULL;
+    }
+    if (!of) print_error("File not opened or does not exist.");
+    return of;
+}
+
+static bool same_entry(const OpenFileEntry *a, const OpenFileEntry *b) {
+    return a->dir_entry_sector == b->dir_entry_sector && a->dir_entry_offset == b->dir_entry_offset;
+}
+
+static void adopt(OpenFileEntry *of, uint32_t cluster, uint32_t size) {
+    for (OpenFileEntry *o = of; o; o = o->next_same) {
+        if (!same_entry(o, of)) continue;
+        if (cluster >= 2) o->cluster = cluster;
+        if (size > o->size) o->size = size;
+        o->chain_known = false;
+        o->pos_cluster = 0;
+        ra_invalidate(o->ra);
+    }
+}
+
+/*
+ * Handles on the same file see each other's writes: before one is used, the
+ * others' buffered data goes to disk and all of them agree on the first
+ * cluster and size. Chain caches are dropped since another handle may have
+ * grown the chain. Costs one hash lookup when the file is open once.
+ */
+static void share_state(OpenFileEntry *of) {
+    uint32_t n;
+    OpenFileEntry *head = fd_by_path(of->path, &n);
+    if (n < 2) return;
+    uint32_t cluster = of->cluster, size = of->size;
+    for (OpenFileEntry *o = head; o; o = o->next_same) {
+        if (!same_entry(o, of)) continue;
+        if (cluster < 2) cluster = o->cluster;
+        if (o->size > size) size = o->size;
+    }
+    adopt(head, cluster, size);
+    for (OpenFileEntry *o = head; o; o = o->next_same) {
+        if (o == of || !same_entry(o, of) || o->wb_len == 0) continue;
+        fs_flush_data(o);
+        adopt(head, o->cluster, o->size);
+    }
+}
+
+static bool entry_is_open(uint32_t sector, uint32_t offset) {
+    for (int fd = 0; fd < fd_limit(); fd++) {
+        OpenFileEntry *of = fd_get(fd);
+        if (of && of->dir_entry_sector == sector && of->dir_entry_offset == offset) return true;
+    }
+    return false;
+}
+
+/* Opens a file and returns its descriptor. */
 int fs_open(const char *filename, const char *flags) {
-    DirEntry entry; uint32_t sec, off;
-    if (fs_find_entry_in_dir(fsinfo.cwd_cluster, filename, &entry, &sec, &off) != 0) {
+    DirEntry entry; uint32_t sec, off, dir;
+    char leaf[PATH_LEAF_MAX];
+    if (split_arg(filename, &dir, leaf, "File does not exist.") != 0) return -1;
+    if (fs_find_entry_in_dir(dir, leaf, &entry, &sec, &off) != 0) {
         print_error("File does not exist.");
         return -1;
     }
@@ -291,101 +569,75 @@ int fs_open(const char *filename, const char *flags) {
         return -1;
     }
 
-    for (int i=0; i<MAX_OPEN_FILES; i++) {
-        if (open_files[i].in_use && strcmp(open_files[i].name, filename) == 0) {
-            print_error("File already opened.");
-            return -1;
-        }
-    }
-
     char mode[4];
     if (parse_flags(flags, mode) != 0) {
         print_error("Invalid mode.");
         return -1;
     }
 
-    int idx = -1;
-    for (int i=0; i<MAX_OPEN_FILES; i++) {
-        if (!open_files[i].in_use) { idx = i; break; }
+    char path[512];
+    if (handle_path(filename, path, sizeof(path)) != 0) {
+        print_error("Path too long.");
+        return -1;
     }
-    if (idx < 0) {
+
+    OpenFileEntry *of;
+    int fd = fd_alloc(&of);
+    if (fd < 0) {
         print_error("Too many open files.");
         return -1;
     }
-
-    uint32_t c = ((uint32_t)entry.DIR_FstClusHI << 16) | entry.DIR_FstClusLO;
-    open_files[idx].in_use = true;
-    strncpy(open_files[idx].name, filename, MAX_NAME_LEN);
-    open_files[idx].name[MAX_NAME_LEN] = '\0';
-    open_files[idx].cluster = c;
-    open_files[idx].size = entry.DIR_FileSize;
-    open_files[idx].attr = entry.DIR_Attr;
-    strcpy(open_files[idx].mode, mode);
-    open_files[idx].offset = 0;
-    open_files[idx].dir_entry_sector = sec;
-    open_files[idx].dir_entry_offset = off;
-
-    
-    open_files[idx].path[0] = '\0'; 
-
-    size_t path_cap = sizeof(open_files[idx].path);
-    size_t cp_len = strlen(current_path);
-    size_t fn_len = strlen(filename);
-
-    
-    if (cp_len + 1 + fn_len + 1 > path_cap) {
-        
-        print_error("Path too long, truncating file path.");
-        
-        open_files[idx].path[0] = '/';
-        open_files[idx].path[1] = '\0';
-        strncat(open_files[idx].path, filename, path_cap - 2);
-    } else {
-        
-        if (strcmp(current_path, "/") == 0) {
-            
-            open_files[idx].path[0] = '/';
-            open_files[idx].path[1] = '\0';
-            strncat(open_files[idx].path, filename, path_cap - 2);
-        } else {
-            
-            strncat(open_files[idx].path, current_path, path_cap - 1);
-            strncat(open_files[idx].path, "/", path_cap - strlen(open_files[idx].path) - 1);
-            strncat(open_files[idx].path, filename, path_cap - strlen(open_files[idx].path) - 1);
-        }
+    if (fd_set_path(of, path) != 0) {
+        fd_free(fd);
+        print_error("Out of memory.");
+        return -1;
     }
 
-    return 0;
+    of->cluster = ((uint32_t)entry.DIR_FstClusHI << 16) | entry.DIR_FstClusLO;
+    of->size = entry.DIR_FileSize;
+    of->attr = entry.DIR_Attr;
+    strcpy(of->mode, mode);
+    of->offset = 0;
+    of->dir_entry_sector = sec;
+    of->dir_entry_offset = off;
+    of->ra = ra_create();
+    of->wb = NULL;
+    of->wb_len = 0;
+    of->wb_cap = WB_MAX_BYTES;
+
+    share_state(of);
+    return fd;
 }
 
 
 int fs_close(const char *filename) {
-    for (int i=0;i<MAX_OPEN_FILES;i++) {
-        if (open_files[i].in_use && strcmp(open_files[i].name,filename)==0){
-            open_files[i].in_use=false;
-            return 0;
-        }
-    }
-    print_error("File not opened.");
-    return -1;
+    OpenFileEntry *of = find_handle(filename);
+    if (!of) return -1;
+    int rc = fs_flush(of);
+    if (rc!=0) print_error("Flush on close failed.");
+    ra_destroy(of->ra);
+    free(of->wb);
+    fd_free(of->fd);
+    return rc;
 }
 
 int fs_lsof() {
-    int count=0;
-    for (int i=0;i<MAX_OPEN_FILES;i++){
-        if (open_files[i].in_use) {
-            
-            printf("%d: %s %s %u %s\n", i, open_files[i].name, open_files[i].mode, open_files[i].offset, open_files[i].path);
-            count++;
-        }
+    if (fd_count()==0) {
+        printf("No files opened.\n");
+        return 0;
+    }
+    for (int fd=0; fd<fd_limit(); fd++) {
+        OpenFileEntry *of = fd_get(fd);
+        if (of) printf("%d: %s %s %u %s\n", fd, of->name, of->mode, of->offset, of->path);
     }
-    if (count==0) printf("No files opened.\n");
     return 0;
 }
 
 int fs_size(const char *filename) {
-    DirEntry e;uint32_t s,o;
-    if (fs_find_entry_in_dir(fsinfo.cwd_cluster,filename,&e,&s,&o)!=0) {
+    DirEntry e;uint32_t s,o,dir;
+    char leaf[PATH_LEAF_MAX];
+    if (split_arg(filename, &dir, leaf, "File not found.") != 0) return -1;
+    if (fs_find_entry_in_dir(dir,leaf,&e,&s,&o)!=0) {
         print_error("File not found.");
         return -1;
     }
@@ -393,166 +645,451 @@ int fs_size(const char *filename) {
         print_error("Is a directory.");
         return -1;
     }
-    printf("%u\n",e.DIR_FileSize);
+    uint32_t size=e.DIR_FileSize;
+    for (int fd=0; fd<fd_limit(); fd++) {
+        OpenFileEntry *of = fd_get(fd);
+        if (of && of->dir_entry_sector==s && of->dir_entry_offset==o && of->size>size) size=of->size;
+    }
+    printf("%u\n",size);
     return 0;
 }
 
 int fs_lseek(const char *filename, uint32_t offset) {
-    for (int i=0;i<MAX_OPEN_FILES;i++){
-        if (open_files[i].in_use && strcmp(open_files[i].name,filename)==0) {
-            if (offset>open_files[i].size) {
-                print_error("Offset larger than file size.");
-                return -1;
-            }
-            open_files[i].offset=offset;
-            return 0;
-        }
+    OpenFileEntry *of = find_handle(filename);
+    if (!of) return -1;
+    share_state(of);
+    if (offset>of->size) {
+        print_error("Offset larger than file size.");
+        return -1;
     }
-    print_error("File not opened or does not exist.");
-    return -1;
+    of->offset=offset;
+    return 0;
 }
 
 int fs_read(const char *filename, uint32_t size) {
-    int idx=-1;
-    for (int i=0;i<MAX_OPEN_FILES;i++){
-        if (open_files[i].in_use && strcmp(open_files[i].name,filename)==0){idx=i;break;}
-    }
-    if (idx<0) {
-        print_error("File not opened or does not exist.");
-        return -1;
-    }
-    if (!strchr(open_files[idx].mode,'r')) {
+    OpenFileEntry *of = find_handle(filename);
+    if (!of) return -1;
+    share_state(of);
+    if (!strchr(of->mode,'r')) {
         print_error("Not opened for reading.");
         return -1;
     }
 
-    if (open_files[idx].offset+size > open_files[idx].size)
-        size = open_files[idx].size - open_files[idx].offset;
+    if (of->offset+size > of->size)
+        size = of->size - of->offset;
+    if (fs_flush_data(of)!=0) {
+        print_error("Flush before read failed.");
+        return -1;
+    }
 
     uint8_t *buf = malloc(size+1);
     if (!buf) return -1;
-    if (fs_read_cluster_chain(open_files[idx].cluster, buf, open_files[idx].offset,size)!=0) {
+    int rc;
+    if (of->ra)
+        rc = ra_read(of->ra, of->cluster, of->size, buf, of->offset, size);
+    else
+        rc = fs_read_cluster_chain(of->cluster, buf, of->offset, size);
+    if (rc!=0) {
         free(buf);
         print_error("Read error.");
         return -1;
     }
     buf[size]='\0';
     printf("%s\n",buf);
-    open_files[idx].offset+=size;
+    of->offset+=size;
     free(buf);
     return 0;
 }
 
 
-int fs_write(const char *filename, const char *str) {
-    int idx = -1;
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (open_files[i].in_use && strcmp(open_files[i].name, filename) == 0) {
-            idx = i;
-            break;
+static int of_cluster_at(OpenFileEntry *of, uint32_t idx, uint32_t *out) {
+    uint32_t c = of->cluster, i = 0;
+    if (of->pos_cluster >= 2 && of->pos_idx <= idx) {
+        c = of->pos_cluster;
+        i = of->pos_idx;
+    }
+    while (i < idx && c >= 2 && c < 0x0FFFFFF8) {
+        c = get_fat_entry(c);
+        i++;
+    }
+    if (c < 2 || c >= 0x0FFFFFF8) return -1;
+    of->pos_idx = i;
+    of->pos_cluster = c;
+    *out = c;
+    return 0;
+}
+
+/* Grows the handle's chain to cover new_size bytes, appending after the cached tail. */
+static int of_reserve(OpenFileEntry *of, uint32_t new_size) {
+    uint32_t bytes_per_cluster = fs_cluster_bytes();
+    uint32_t need = (new_size == 0) ? 0 : ((new_size - 1)/bytes_per_cluster + 1);
+
+    if (!of->chain_known) {
+        of->nclusters = 0;
+        of->last_cluster = 0;
+        uint32_t c = of->cluster;
+        while (c >= 2 && c < 0x0FFFFFF8) {
+            of->last_cluster = c;
+            of->nclusters++;
+            c = get_fat_entry(c);
         }
+        of->chain_known = true;
     }
-    if (idx < 0) {
-        print_error("File not opened or does not exist.");
-        return -1;
+
+    while (of->nclusters < need) {
+        uint32_t c;
+        /* Grow after the tail, or near the parent directory for the first cluster. */
+        uint32_t goal = of->nclusters ? of->last_cluster
+                      : geom_sector_to_cluster(of->dir_entry_sector);
+        if (fs_allocate_cluster_chain(1, goal, &c) != 0) return -1;
+        if (of->nclusters == 0) of->cluster = c;
+        else if (set_fat_entry(of->last_cluster, c) != 0) return -1;
+        of->last_cluster = c;
+        of->nclusters++;
+        of->meta_dirty = true;
+    }
+    return 0;
+}
+
+static int of_write_through(OpenFileEntry *of, const uint8_t *data, uint32_t offset, uint32_t len) {
+    uint32_t bytes_per_cluster = fs_cluster_bytes();
+    if (len == 0) return 0;
+    if (of_reserve(of, offset + len) != 0) return -1;
+    uint32_t c;
+    if (of_cluster_at(of, offset / bytes_per_cluster, &c) != 0) return -1;
+    return fs_write_cluster_chain(c, data, offset % bytes_per_cluster, len);
+}
+
+int fs_flush_data(OpenFileEntry *of) {
+    if (of->wb_len == 0) return 0;
+    /* A failed write keeps the buffer, so a later flush can still retry it. */
+    if (of_write_through(of, of->wb, of->wb_start, of->wb_len) != 0) return -1;
+    of->wb_len = 0;
+    return 0;
+}
+
+int fs_flush_meta(OpenFileEntry *of) {
+    if (!of->meta_dirty) return 0;
+    share_state(of);
+    uint8_t sec_buf[SECTOR_SIZE_MAX];
+    if (read_sector(of->dir_entry_sector, sec_buf) != 0) return -1;
+
+    DirEntry *d = (DirEntry*)&sec_buf[of->dir_entry_offset];
+    d->DIR_FileSize = of->size;
+    d->DIR_FstClusHI = (uint16_t)(of->cluster >> 16);
+    d->DIR_FstClusLO = (uint16_t)(of->cluster & 0xFFFF);
+    fat_timestamp(&d->DIR_WrtDate, &d->DIR_WrtTime);
+    d->DIR_LstAccDate = d->DIR_WrtDate;
+
+    if (write_sector(of->dir_entry_sector, sec_buf) != 0) return -1;
+    of->meta_dirty = false;
+    return 0;
+}
+
+int fs_flush(OpenFileEntry *of) {
+    int rc = 0;
+    if (fs_flush_data(of) != 0) rc = -1;
+    if (fs_flush_meta(of) != 0) rc = -1;
+    return rc;
+}
+
+int fs_sync() {
+    int rc = 0;
+    for (int fd = 0; fd < fd_limit(); fd++) {
+        OpenFileEntry *of = fd_get(fd);
+        if (of && fs_flush(of) != 0) rc = -1;
     }
-    if (!strchr(open_files[idx].mode, 'w')) {
+    if (fsinfo.dev && fsinfo.dev->sync(fsinfo.dev) != 0) rc = -1;
+    hash_track_save();
+    if (rc != 0) print_error("Sync failed.");
+    return rc;
+}
+
+int fs_write(const char *filename, const char *str) {
+    OpenFileEntry *of = find_handle(filename);
+    if (!of) return -1;
+    share_state(of);
+    if (!strchr(of->mode, 'w')) {
         print_error("Not opened for writing.");
         return -1;
     }
 
     uint32_t len = (uint32_t)strlen(str);
-    uint32_t old_size = open_files[idx].size;
-    uint32_t new_offset = open_files[idx].offset + len;
+    ra_invalidate(of->ra);
 
-    
-    if (new_offset > open_files[idx].size) {
-        if (fs_extend_file(&open_files[idx].cluster, open_files[idx].size, new_offset) != 0) {
-            print_error("Extend file failed.");
+    /* Only a write continuing the buffered range can join it. */
+    if (of->wb_len > 0 && (of->offset != of->wb_start + of->wb_len || of->wb_len + len > of->wb_cap)) {
+        if (fs_flush_data(of) != 0) {
+            print_error("Write error.");
             return -1;
         }
-        if (open_files[idx].cluster < 2) {
-            print_error("Invalid cluster after extend.");
+    }
+
+    if (len > of->wb_cap) {
+        if (of_write_through(of, (const uint8_t*)str, of->offset, len) != 0) {
+            print_error("Write error.");
+            return -1;
+        }
+    } else if (len > 0) {
+        if (!of->wb && !(of->wb = malloc(of->wb_cap))) return -1;
+        if (of->wb_len == 0) of->wb_start = of->offset;
+        memcpy(of->wb + of->wb_len, str, len);
+        of->wb_len += len;
+        if (of->wb_len == of->wb_cap && fs_flush_data(of) != 0) {
+            of->wb_len -= len;
+            print_error("Write error.");
             return -1;
         }
     }
 
-    if (fs_write_cluster_chain(open_files[idx].cluster, (const uint8_t*)str, open_files[idx].offset, len) != 0) {
-        print_error("Write error.");
+    of->offset += len;
+    if (of->offset > of->size) of->size = of->offset;
+    of->meta_dirty = true;
+    return 0;
+}
+
+/*
+ * Looks up a file for fallocate and truncate. Its handles are flushed first,
+ * so the entry, read back from disk, holds their chain and size.
+ */
+static int resize_target(const char *filename, DirEntry *e, uint32_t *s, uint32_t *o) {
+    uint32_t dir;
+    char leaf[PATH_LEAF_MAX];
+    if (split_arg(filename, &dir, leaf, "File does not exist.") != 0) return -1;
+    if (fs_find_entry_in_dir(dir, leaf, e, s, o) != 0) {
+        print_error("File does not exist.");
         return -1;
     }
-
-    open_files[idx].offset = new_offset;
-
-    if (new_offset > old_size) {
-        open_files[idx].size = new_offset;
+    if (e->DIR_Attr & ATTR_DIRECTORY) {
+        print_error("Is a directory.");
+        return -1;
     }
+    int rc = 0;
+    for (int fd = 0; fd < fd_limit(); fd++) {
+        OpenFileEntry *of = fd_get(fd);
+        if (of && of->dir_entry_sector == *s && of->dir_entry_offset == *o && fs_flush(of) != 0) rc = -1;
+    }
+    uint8_t sec_buf[SECTOR_SIZE_MAX];
+    if (rc != 0 || read_sector(*s, sec_buf) != 0) {
+        print_error("Flush failed.");
+        return -1;
+    }
+    memcpy(e, &sec_buf[*o], sizeof(DirEntry));
+    return 0;
+}
 
-    if (new_offset > old_size) {
-        uint8_t sec_buf[512];
-        if (read_sector(open_files[idx].dir_entry_sector, sec_buf) != 0) {
-            print_error("Update dir entry read error.");
-            return -1;
-        }
+/* Points the handles on an entry at its new chain and size. */
+static void resize_handles(uint32_t sector, uint32_t offset, uint32_t cluster, uint32_t size) {
+    for (int fd = 0; fd < fd_limit(); fd++) {
+        OpenFileEntry *of = fd_get(fd);
+        if (!of || of->dir_entry_sector != sector || of->dir_entry_offset != offset) continue;
+        of->cluster = cluster;
+        of->size = size;
+        if (of->offset > size) of->offset = size;
+        of->chain_known = false;
+        of->pos_cluster = 0;
+        ra_invalidate(of->ra);
+    }
+}
 
-        DirEntry *d = (DirEntry*)&sec_buf[open_files[idx].dir_entry_offset];
-        d->DIR_FileSize = open_files[idx].size;
+/*
+ * Reserves clusters for a file of size bytes as one contiguous run after its
+ * current chain, without writing data. The file size stays as it is; writes
+ * past it use the reserved clusters, and truncate to the size releases them.
+ */
+int fs_fallocate(const char *filename, uint32_t size) {
+    DirEntry e; uint32_t s, o;
+    if (resize_target(filename, &e, &s, &o) != 0) return -1;
+    uint32_t bytes_per_cluster = fs_cluster_bytes();
+    uint32_t need = (size == 0) ? 0 : ((size - 1)/bytes_per_cluster + 1);
+    uint32_t first = ((uint32_t)e.DIR_FstClusHI << 16) | e.DIR_FstClusLO;
+
+    ExtentList ext = {0};
+    if (first >= 2 && fs_chain_extents(first, UINT32_MAX, &ext) != 0) {
+        extent_list_free(&ext);
+        print_error("Failed to read cluster chain.");
+        return -1;
+    }
+    uint32_t have = 0, last = 0;
+    for (uint32_t i = 0; i < ext.count; i++) {
+        have += ext.items[i].count;
+        last = ext.items[i].start + ext.items[i].count - 1;
+    }
+    extent_list_free(&ext);
+    if (need <= have) return 0;
 
-        if (write_sector(open_files[idx].dir_entry_sector, sec_buf) != 0) {
-            print_error("Update dir entry write error.");
+    /* An empty file starts near its directory, like a first write would. */
+    uint32_t start;
+    if (fs_allocate_run(need - have, last ? last : geom_sector_to_cluster(s), last != 0, &start) != 0) {
+        print_error("Not enough contiguous free space.");
+        return -1;
+    }
+    if (first < 2) {
+        first = start;
+        e.DIR_FstClusHI = (uint16_t)(first >> 16);
+        e.DIR_FstClusLO = (uint16_t)(first & 0xFFFF);
+        if (fs_update_dir_entry(s, o, &e) != 0) {
+            print_error("Failed to update directory entry.");
             return -1;
         }
     }
-
+    resize_handles(s, o, first, e.DIR_FileSize);
     return 0;
 }
 
+/* Shrinks a file to size bytes: one directory-entry write, then the chain tail is cut and freed. */
+int fs_truncate(const char *filename, uint32_t size) {
+    DirEntry e; uint32_t s, o;
+    if (resize_target(filename, &e, &s, &o) != 0) return -1;
+    if (size > e.DIR_FileSize) {
+        print_error("Size larger than file size.");
+        return -1;
+    }
+    uint32_t bytes_per_cluster = fs_cluster_bytes();
+    uint32_t keep = (size == 0) ? 0 : ((size - 1)/bytes_per_cluster + 1);
+    uint32_t first = ((uint32_t)e.DIR_FstClusHI << 16) | e.DIR_FstClusLO;
+
+    FatCursor fc = {0};
+    ClusterList chain = {0};
+    if (first >= 2 && fs_collect_chain(first, &fc, &chain) != 0) {
+        cluster_list_free(&chain);
+        print_error("Failed to read cluster chain.");
+        return -1;
+    }
+
+    /* Entry first, chain second: a crash in between leaks the tail clusters but loses nothing. */
+    if (keep == 0) first = 0;
+    e.DIR_FileSize = size;
+    e.DIR_FstClusHI = (uint16_t)(first >> 16);
+    e.DIR_FstClusLO = (uint16_t)(first & 0xFFFF);
+    fat_timestamp(&e.DIR_WrtDate, &e.DIR_WrtTime);
+    e.DIR_LstAccDate = e.DIR_WrtDate;
+    int rc = fs_update_dir_entry(s, o, &e);
+    if (rc == 0 && chain.count > keep) {
+        if (keep > 0) rc = set_fat_entry(chain.items[keep - 1], EOC);
+        if (rc == 0) rc = fs_free_clusters(chain.items + keep, chain.count - keep);
+    }
+    cluster_list_free(&chain);
+    resize_handles(s, o, first, size);
+    if (rc != 0) print_error("Truncate failed.");
+    return rc;
+}
 
+/* True if dir is anc or lies below it. */
+static bool dir_within(uint32_t dir, uint32_t anc) {
+    for (uint32_t depth = 0; depth < fsinfo.total_clusters; depth++) {
+        if (dir == anc) return true;
+        uint32_t up;
+        if (dir == fsinfo.root_cluster || path_parent_of(dir, &up) != 0) return false;
+        dir = up;
+    }
+    return false;
+}
 
-int fs_rename(const char *oldname, const char *newname) {
-    for (int i=0;i<MAX_OPEN_FILES;i++){
-        if (open_files[i].in_use && strcmp(open_files[i].name,oldname)==0){
-            print_error("File must be closed first.");
-            return -1;
-        }
+static bool files_open_below(const char *dir_path) {
+    size_t len = strlen(dir_path);
+    for (int fd = 0; fd < fd_limit(); fd++) {
+        OpenFileEntry *of = fd_get(fd);
+        if (of && strncmp(of->path, dir_path, len) == 0 && of->path[len] == '/') return true;
     }
+    return false;
+}
 
-    DirEntry olde;uint32_t s,o;
-    if (fs_find_entry_in_dir(fsinfo.cwd_cluster,oldname,&olde,&s,&o)!=0) {
+/* Renames an entry. A new path in another directory moves the entry there. */
+int fs_rename(const char *oldname, const char *newname) {
+    DirEntry olde;uint32_t s,o,odir,ndir;
+    char oleaf[PATH_LEAF_MAX], nleaf[PATH_LEAF_MAX];
+    if (split_arg(oldname, &odir, oleaf, "Old name does not exist.") != 0) return -1;
+    if (fs_find_entry_in_dir(odir,oleaf,&olde,&s,&o)!=0) {
         print_error("Old name does not exist.");
         return -1;
     }
-    if (strcmp(oldname,".")==0||strcmp(oldname,"..")==0) {
+    if (entry_is_open(s,o)) {
+        print_error("File must be closed first.");
+        return -1;
+    }
+    if (strcmp(oleaf,".")==0||strcmp(oleaf,"..")==0) {
         print_error("Cannot rename special directories.");
         return -1;
     }
-    if (fs_name_exists_in_dir(fsinfo.cwd_cluster,newname)) {
+    if (split_arg(newname, &ndir, nleaf, "Destination directory does not exist.") != 0) return -1;
+    if (bad_leaf(nleaf) || fs_name_exists_in_dir(ndir,nleaf)) {
         print_error("New name already exists.");
         return -1;
     }
 
-    uint8_t sec_buf[512];
-    if (read_sector(s,sec_buf)!=0) return -1;
-    DirEntry *ent=(DirEntry*)&sec_buf[o];
-    char formatted[11]; format_name_11(newname,formatted);
-    memcpy(ent->DIR_Name,formatted,11);
-    if (write_sector(s,sec_buf)!=0) return -1;
+    bool is_dir = (olde.DIR_Attr & ATTR_DIRECTORY) != 0;
+    uint32_t c = ((uint32_t)olde.DIR_FstClusHI<<16)|olde.DIR_FstClusLO;
+    char old_path[512], new_path[512];
+    if (handle_path(oldname, old_path, sizeof(old_path)) != 0 || path_normalize(current_path, newname, new_path, sizeof(new_path)) != 0) {
+        print_error("Path too long.");
+        return -1;
+    }
+    if (is_dir && ndir != odir && dir_within(ndir, c)) {
+        print_error("Cannot move a directory into itself.");
+        return -1;
+    }
+    if (is_dir && files_open_below(old_path)) {
+        print_error("A file in the directory is opened.");
+        return -1;
+    }
+
+    uint8_t sec_buf[SECTOR_SIZE_MAX];
+    if (ndir == odir) {
+        if (read_sector(s,sec_buf)!=0) return -1;
+        DirEntry *ent=(DirEntry*)&sec_buf[o];
+        char formatted[11]; format_name_11(nleaf,formatted);
+        memcpy(ent->DIR_Name,formatted,11);
+        if (write_sector(s,sec_buf)!=0) return -1;
+    } else {
+        /* Link into the new directory before unlinking from the old one. */
+        DirEntry moved = olde, ne; uint32_t ns, no;
+        format_name_11(nleaf, (char*)moved.DIR_Name);
+        if (create_dir_entry(ndir, nleaf, olde.DIR_Attr, c, olde.DIR_FileSize) != 0 ||
+            fs_find_entry_in_dir(ndir, nleaf, &ne, &ns, &no) != 0 || fs_update_dir_entry(ns, no, &moved) != 0) {
+            print_error("Failed to create directory entry.");
+            return -1;
+        }
+        if (read_sector(s,sec_buf)!=0) return -1;
+        sec_buf[o]=0xE5;
+        if (write_sector(s,sec_buf)!=0) return -1;
+        if (is_dir && fs_find_entry_in_dir(c, "..", &ne, &ns, &no) == 0) {
+            ne.DIR_FstClusHI = (uint16_t)(ndir >> 16);
+            ne.DIR_FstClusLO = (uint16_t)(ndir & 0xFFFF);
+            if (fs_update_dir_entry(ns, no, &ne) != 0) return -1;
+        }
+        dir_maybe_compact(odir);
+    }
 
+    if (is_dir) {
+        dcache_forget(odir, oleaf);
+        dcache_note(ndir, nleaf, c);
+        /* The shell's path may run through the renamed directory. */
+        size_t len = strlen(old_path);
+        char upper[512];
+        strcpy(upper, current_path);
+        to_upper(upper);
+        if (strncmp(upper, old_path, len) == 0 && (upper[len] == '\0' || upper[len] == '/')) {
+            char cwd[512];
+            int n = snprintf(cwd, sizeof(cwd), "%s%s", new_path, current_path + len);
+            if (n > 0 && (size_t)n < sizeof(cwd)) strcpy(current_path, cwd);
+        }
+    }
     return 0;
 }
 
 int fs_rm(const char *filename) {
-    for (int i=0;i<MAX_OPEN_FILES;i++){
-        if (open_files[i].in_use && strcmp(open_files[i].name,filename)==0){
-            print_error("File is opened.");
-            return -1;
-        }
-    }
-    DirEntry e;uint32_t s,o;
-    if (fs_find_entry_in_dir(fsinfo.cwd_cluster,filename,&e,&s,&o)!=0) {
+    DirEntry e;uint32_t s,o,dir;
+    char leaf[PATH_LEAF_MAX];
+    if (split_arg(filename, &dir, leaf, "File does not exist.") != 0) return -1;
+    if (fs_find_entry_in_dir(dir,leaf,&e,&s,&o)!=0) {
         print_error("File does not exist.");
         return -1;
     }
+    if (entry_is_open(s,o)) {
+        print_error("File is opened.");
+        return -1;
+    }
     if (e.DIR_Attr & ATTR_DIRECTORY) {
         print_error("Is a directory.");
         return -1;
@@ -560,16 +1097,23 @@ int fs_rm(const char *filename) {
     uint32_t c=((uint32_t)e.DIR_FstClusHI<<16)|e.DIR_FstClusLO;
     if (c!=0) fs_free_cluster_chain(c);
 
-    uint8_t sec_buf[512];
+    uint8_t sec_buf[SECTOR_SIZE_MAX];
     if (read_sector(s,sec_buf)!=0)return -1;
     sec_buf[o]=0xE5;
     if (write_sector(s,sec_buf)!=0)return -1;
+    dir_maybe_compact(dir);
     return 0;
 }
 
 int fs_rmdir(const char *dirname) {
-    DirEntry e;uint32_t s,o;
-    if (fs_find_entry_in_dir(fsinfo.cwd_cluster,dirname,&e,&s,&o)!=0) {
+    DirEntry e;uint32_t s,o,dir;
+    char leaf[PATH_LEAF_MAX];
+    if (split_arg(dirname, &dir, leaf, "Dir does not exist.") != 0) return -1;
+    if (bad_leaf(leaf)) {
+        print_error("Cannot remove special directories.");
+        return -1;
+    }
+    if (fs_find_entry_in_dir(dir,leaf,&e,&s,&o)!=0) {
         print_error("Dir does not exist.");
         return -1;
     }
@@ -579,6 +1123,10 @@ int fs_rmdir(const char *dirname) {
     }
 
     uint32_t c=((uint32_t)e.DIR_FstClusHI<<16)|e.DIR_FstClusLO;
+    if (c==fsinfo.cwd_cluster) {
+        print_error("Cannot remove the current directory.");
+        return -1;
+    }
     if (!fs_is_dir_empty(c)){
         print_error("Directory not empty.");
         return -1;
@@ -586,39 +1134,520 @@ int fs_rmdir(const char *dirname) {
 
     if (c!=fsinfo.root_cluster && c!=0) fs_free_cluster_chain(c);
 
-    uint8_t sec_buf[512];
+    uint8_t sec_buf[SECTOR_SIZE_MAX];
     if (read_sector(s,sec_buf)!=0)return -1;
     sec_buf[o]=0xE5;
     if (write_sector(s,sec_buf)!=0)return -1;
+    /* Its cluster may come back as another directory. */
+    dcache_clear();
+    dir_maybe_compact(dir);
 
     return 0;
 }
 
-int fs_allocate_cluster_chain(uint32_t count, uint32_t *start_cluster) {
-    for (uint32_t c=2; c<fsinfo.total_clusters+2; c++) {
-        if (get_fat_entry(c)==0) {
-            if (set_fat_entry(c,EOC)!=0) return -1; 
-            *start_cluster = c;
-            return 0;
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+bool is_dot_entry(const DirEntry *d) {
+    return d->DIR_Name[0] == '.' && (d->DIR_Name[1] == ' ' || (d->DIR_Name[1] == '.' && d->DIR_Name[2] == ' '));
+}
+
+/* The 8.3 name as stored, with the trailing padding cut off. */
+void entry_name(const DirEntry *e, char out[12]) {
+    memcpy(out, e->DIR_Name, 11);
+    out[11] = '\0';
+    for (int k = 10; k >= 0 && out[k] == ' '; k--) out[k] = '\0';
+}
+
+#define DIR_BATCH_CLUSTERS 32
+
+/* Collects every cluster below dir_cluster, including its own chain, without recursion. */
+static int collect_subtree(uint32_t dir_cluster, FatCursor *fc, ClusterList *clusters) {
+    uint32_t bytes_per_cluster = fs_cluster_bytes();
+    ClusterList stack = {0};
+    uint8_t *cbuf = malloc((size_t)DIR_BATCH_CLUSTERS * bytes_per_cluster);
+    SectorReq reqs[DIR_BATCH_CLUSTERS];
+    int rc = 0;
+
+    if (!cbuf || cluster_list_push(&stack, dir_cluster) != 0) rc = -1;
+    while (rc == 0 && stack.count > 0) {
+        uint32_t d = stack.items[--stack.count];
+        uint32_t first = clusters->count;
+        if (fs_collect_chain(d, fc, clusters) != 0) {
+            rc = -1;
+            break;
+        }
+        uint32_t last = clusters->count;
+        bool end = false;
+        /* The directory's clusters are read a batch at a time, wherever they lie. */
+        for (uint32_t b = first; b < last && !end && rc == 0; b += DIR_BATCH_CLUSTERS) {
+            uint32_t nb = last - b < DIR_BATCH_CLUSTERS ? last - b : DIR_BATCH_CLUSTERS;
+            for (uint32_t k = 0; k < nb; k++) {
+                reqs[k] = (SectorReq){cluster_to_sector(clusters->items[b+k]), fsinfo.sectors_per_cluster,
+                                      cbuf + (size_t)k * bytes_per_cluster, false};
+            }
+            if (sectors_batch(reqs, nb) != 0) {
+                rc = -1;
+                break;
+            }
+            for (uint32_t i = 0; i < nb * bytes_per_cluster; i += 32) {
+                DirEntry *e = (DirEntry*)&cbuf[i];
+                if (e->DIR_Name[0] == 0x00) {
+                    end = true;
+                    break;
+                }
+                if ((e->DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME || e->DIR_Name[0] == 0xE5) continue;
+                if (e->DIR_Attr & ATTR_VOLUME_ID || is_dot_entry(e)) continue;
+                uint32_t c = ((uint32_t)e->DIR_FstClusHI << 16) | e->DIR_FstClusLO;
+                if (c < 2 || c == fsinfo.root_cluster) continue;
+                if (e->DIR_Attr & ATTR_DIRECTORY) {
+                    if (cluster_list_push(&stack, c) != 0) rc = -1;
+                } else if (fs_collect_chain(c, fc, clusters) != 0) {
+                    rc = -1;
+                }
+                if (clusters->count > fsinfo.total_clusters) rc = -1;
+                if (rc != 0) break;
+            }
         }
     }
-    return -1;
+    free(cbuf);
+    cluster_list_free(&stack);
+    return rc;
+}
+
+typedef struct {
+    uint32_t sector;
+    uint32_t offset;
+    uint32_t dir;
+} EntryLoc;
+
+static int cmp_entry_loc(const void *a, const void *b) {
+    const EntryLoc *x = a, *y = b;
+    if (x->sector != y->sector) return (x->sector > y->sector) - (x->sector < y->sector);
+    return (x->offset > y->offset) - (x->offset < y->offset);
 }
 
+int fs_rm_recursive(char **names, int count) {
+    FatCursor fc = {0};
+    ClusterList clusters = {0};
+    EntryLoc *locs = calloc(count > 0 ? count : 1, sizeof(EntryLoc));
+    int nlocs = 0;
+    int rc = 0;
+    if (!locs) return -1;
+
+    for (int n = 0; n < count && rc == 0; n++) {
+        if (strcmp(names[n], ".") == 0 || strcmp(names[n], "..") == 0) {
+            print_error("Cannot remove special directories.");
+            rc = -1;
+            break;
+        }
+        DirEntry e; uint32_t s, o, dir;
+        char leaf[PATH_LEAF_MAX];
+        if (path_split(names[n], &dir, leaf, sizeof(leaf)) != 0 || bad_leaf(leaf) ||
+            fs_find_entry_in_dir(dir, leaf, &e, &s, &o) != 0) {
+            fprintf(stderr, "Error: %s does not exist.\n", names[n]);
+            rc = -1;
+            break;
+        }
+        if (entry_is_open(s, o)) {
+            print_error("File is opened.");
+            rc = -1;
+        }
+        uint32_t c = ((uint32_t)e.DIR_FstClusHI << 16) | e.DIR_FstClusLO;
+        if (rc == 0 && c >= 2) {
+            if (e.DIR_Attr & ATTR_DIRECTORY) rc = collect_subtree(c, &fc, &clusters);
+            else rc = fs_collect_chain(c, &fc, &clusters);
+            if (rc != 0) print_error("Corrupted cluster chain.");
+        }
+        locs[nlocs].sector = s;
+        locs[nlocs].offset = o;
+        locs[nlocs].dir = dir;
+        nlocs++;
+    }
+
+    if (rc == 0) {
+        qsort(clusters.items, clusters.count, sizeof(uint32_t), cmp_u32);
+        if (bsearch(&fsinfo.cwd_cluster, clusters.items, clusters.count, sizeof(uint32_t), cmp_u32)) {
+            print_error("Cannot remove the current directory.");
+            rc = -1;
+        }
+        for (int fd = 0; fd < fd_limit() && rc == 0; fd++) {
+            OpenFileEntry *of = fd_get(fd);
+            if (!of) continue;
+            uint32_t dc = geom_sector_to_cluster(of->dir_entry_sector);
+            if (bsearch(&dc, clusters.items, clusters.count, sizeof(uint32_t), cmp_u32)) {
+                print_error("A file in the tree is opened.");
+                rc = -1;
+            }
+        }
+    }
+
+    /* Unlink first, then free: a crash in between leaks clusters instead of cross-linking them. */
+    if (rc == 0) {
+        uint8_t sec_buf[SECTOR_SIZE_MAX];
+        qsort(locs, nlocs, sizeof(EntryLoc), cmp_entry_loc);
+        for (int i = 0; i < nlocs && rc == 0; ) {
+            uint32_t s = locs[i].sector;
+            if (read_sector(s, sec_buf) != 0) rc = -1;
+            for (; i < nlocs && locs[i].sector == s; i++) sec_buf[locs[i].offset] = 0xE5;
+            if (rc == 0 && write_sector(s, sec_buf) != 0) rc = -1;
+        }
+    }
+    if (rc == 0 && fs_free_clusters(clusters.items, clusters.count) != 0) rc = -1;
+    if (rc == 0) {
+        dcache_clear();
+        for (int i = 0; i < nlocs; i++) {
+            bool seen = false;
+            for (int j = 0; j < i && !seen; j++) seen = locs[j].dir == locs[i].dir;
+            if (!seen) dir_maybe_compact(locs[i].dir);
+        }
+    }
+
+    free(locs);
+    cluster_list_free(&clusters);
+    return rc;
+}
 
 int fs_free_cluster_chain(uint32_t start_cluster) {
-    uint32_t c=start_cluster;
-    while (c<0x0FFFFFF8 && c>=2) {
-        uint32_t nxt = get_fat_entry(c);
-        set_fat_entry(c,0);
-        if (nxt==c||nxt==0||nxt>=0x0FFFFFF8) break;
-        c=nxt;
+    FatCursor fc = {0};
+    ClusterList chain = {0};
+    int rc = fs_collect_chain(start_cluster, &fc, &chain);
+    if (fs_free_clusters(chain.items, chain.count) != 0) rc = -1;
+    cluster_list_free(&chain);
+    return rc;
+}
+
+int cluster_list_push(ClusterList *l, uint32_t c) {
+    if (l->count == l->cap) {
+        uint32_t cap = l->cap ? l->cap * 2 : 64;
+        uint32_t *items = realloc(l->items, cap * sizeof(uint32_t));
+        if (!items) return -1;
+        l->items = items;
+        l->cap = cap;
+    }
+    l->items[l->count++] = c;
+    return 0;
+}
+
+void cluster_list_free(ClusterList *l) {
+    free(l->items);
+    l->items = NULL;
+    l->count = l->cap = 0;
+}
+
+uint32_t fat_cursor_get(FatCursor *fc, uint32_t cluster) {
+    uint32_t sector = fsinfo.first_FAT_sector + geom_fat_sector(cluster);
+    if (!fc->valid || fc->sector != sector) {
+        if (read_sector(sector, fc->buf) != 0) {
+            fc->valid = false;
+            return EOC;
+        }
+        fc->sector = sector;
+        fc->valid = true;
+    }
+    return ((const uint32_t*)fc->buf)[geom_fat_index(cluster)] & 0x0FFFFFFF;
+}
+
+int fs_collect_chain(uint32_t start_cluster, FatCursor *fc, ClusterList *out) {
+    uint32_t c = start_cluster;
+    uint32_t n = 0;
+    while (c >= 2 && c < 0x0FFFFFF8) {
+        if (c >= fsinfo.total_clusters + 2) return -1;
+        /* Contiguous stretches known from the FAT scan need no FAT reads. */
+        uint32_t run = fatscan_link_run(c, fsinfo.total_clusters);
+        n += run + 1;
+        if (n > fsinfo.total_clusters) return -1;
+        for (uint32_t k = 0; k <= run; k++) {
+            if (cluster_list_push(out, c + k) != 0) return -1;
+        }
+        c = fat_cursor_get(fc, c + run);
+    }
+    return 0;
+}
+
+/* Zeroes the FAT entries of the given clusters. */
+int fs_free_clusters(uint32_t *clusters, uint32_t count) {
+    qsort(clusters, count, sizeof(uint32_t), cmp_u32);
+    if (fs_set_fat_entries(clusters, NULL, count) != 0) return -1;
+    alloc_note_free(clusters, count);
+    return 0;
+}
+
+int extent_list_push(ExtentList *l, uint32_t start, uint32_t count) {
+    if (l->count > 0 && l->items[l->count-1].start + l->items[l->count-1].count == start) {
+        l->items[l->count-1].count += count;
+        return 0;
+    }
+    if (l->count == l->cap) {
+        uint32_t cap = l->cap ? l->cap * 2 : 16;
+        Extent *items = realloc(l->items, cap * sizeof(Extent));
+        if (!items) return -1;
+        l->items = items;
+        l->cap = cap;
+    }
+    l->items[l->count].start = start;
+    l->items[l->count].count = count;
+    l->count++;
+    return 0;
+}
+
+void extent_list_free(ExtentList *l) {
+    free(l->items);
+    l->items = NULL;
+    l->count = l->cap = 0;
+}
+
+/* Resolves up to max_clusters clusters of a chain into runs of physically adjacent clusters. */
+int fs_chain_extents(uint32_t start_cluster, uint32_t max_clusters, ExtentList *out) {
+    FatCursor fc = {0};
+    uint32_t c = start_cluster;
+    uint32_t n = 0;
+    while (c >= 2 && c < 0x0FFFFFF8 && n < max_clusters) {
+        if (c >= fsinfo.total_clusters + 2) return -1;
+        uint32_t run = fatscan_link_run(c, max_clusters - n - 1);
+        if (extent_list_push(out, c, run + 1) != 0) return -1;
+        n += run + 1;
+        c = fat_cursor_get(&fc, c + run);
+    }
+    return (n == max_clusters || max_clusters == UINT32_MAX) ? 0 : -1;
+}
+
+#define FAT_BATCH_SECTORS 256
+
+/*
+ * Writes FAT entries (all zero when values is NULL). The touched FAT sectors
+ * are read in one batch, edited, and written to every FAT copy in a second
+ * batch, adjacent sectors sharing a request. Clusters should come in
+ * ascending order; a step backwards only starts a new batch.
+ */
+int fs_set_fat_entries(const uint32_t *clusters, const uint32_t *values, uint32_t count) {
+    uint32_t bps = fsinfo.bytes_per_sector;
+    uint32_t *rel = malloc(FAT_BATCH_SECTORS * sizeof(uint32_t));
+    uint8_t *buf = malloc((size_t)FAT_BATCH_SECTORS * bps);
+    SectorReq *reqs = malloc((size_t)FAT_BATCH_SECTORS * (fsinfo.num_FATs + 1) * sizeof(SectorReq));
+    int rc = (rel && buf && reqs) ? 0 : -1;
+    uint32_t i = 0;
+
+    while (rc == 0 && i < count) {
+        uint32_t first = i, nsec = 0;
+        while (i < count) {
+            uint32_t r = geom_fat_sector(clusters[i]);
+            if (nsec == 0 || r != rel[nsec-1]) {
+                if (nsec == FAT_BATCH_SECTORS || (nsec > 0 && r < rel[nsec-1])) break;
+                rel[nsec++] = r;
+            }
+            i++;
+        }
+        uint32_t nreq = 0;
+        for (uint32_t k = 0; k < nsec; ) {
+            uint32_t run = 1;
+            while (k + run < nsec && rel[k+run] == rel[k] + run) run++;
+            reqs[nreq++] = (SectorReq){fsinfo.first_FAT_sector + rel[k], run, buf + (size_t)k * bps, false};
+            k += run;
+        }
+        if (sectors_batch(reqs, nreq) != 0) {
+            rc = -1;
+            break;
+        }
+        uint32_t k = 0;
+        for (uint32_t j = first; j < i; j++) {
+            while (rel[k] != geom_fat_sector(clusters[j])) k++;
+            uint32_t *e = (uint32_t*)&buf[(size_t)k * bps + geom_fat_index(clusters[j]) * 4];
+            uint32_t v = values ? values[j] : 0;
+            *e = (*e & 0xF0000000) | (v & 0x0FFFFFFF);
+        }
+        SectorReq *w = reqs + nreq;
+        for (int f = 0; f < fsinfo.num_FATs; f++) {
+            for (uint32_t q = 0; q < nreq; q++) {
+                w[f*nreq + q] = reqs[q];
+                w[f*nreq + q].sector += f * fsinfo.FATSz32;
+                w[f*nreq + q].write = true;
+            }
+        }
+        if (sectors_batch(w, nreq * fsinfo.num_FATs) != 0) {
+            rc = -1;
+            break;
+        }
+        /* Only once the FAT is on disk, or a scan in between would undo the note. */
+        for (uint32_t j = first; j < i; j++) fatscan_note(clusters[j], values ? values[j] : 0);
+    }
+    free(rel);
+    free(buf);
+    free(reqs);
+    return rc;
+}
+
+#define COPY_BUF_BYTES (1024*1024)
+
+/* Copies sectors within the image, letting the backend do it in place when it can. */
+int fs_copy_sectors(uint32_t src_sector, uint32_t dst_sector, uint32_t count) {
+    uint64_t src = (uint64_t)src_sector * fsinfo.bytes_per_sector;
+    uint64_t dst = (uint64_t)dst_sector * fsinfo.bytes_per_sector;
+    uint64_t len = (uint64_t)count * fsinfo.bytes_per_sector;
+
+    hash_note_write(dst, len);
+    count_io(&io_stats.read_ops, &io_stats.sectors_read, count);
+    count_io(&io_stats.write_ops, &io_stats.sectors_written, count);
+    if (fsinfo.dev->copy && fsinfo.dev->copy(fsinfo.dev, src, dst, len) == 0) return 0;
+
+    uint32_t chunk = len < COPY_BUF_BYTES ? (uint32_t)len : COPY_BUF_BYTES;
+    uint8_t *buf = malloc(chunk);
+    if (!buf) return -1;
+    int rc = 0;
+    for (uint64_t done = 0; done < len && rc == 0; ) {
+        uint32_t n = (len - done < chunk) ? (uint32_t)(len - done) : chunk;
+        if (fsinfo.dev->read(fsinfo.dev, src + done, buf, n) != 0) rc = -1;
+        else if (fsinfo.dev->write(fsinfo.dev, dst + done, buf, n) != 0) rc = -1;
+        done += n;
+    }
+    free(buf);
+    return rc;
+}
+
+/*
+ * Calls fn for every byte range of the image that holds live data: the
+ * reserved region and FATs, runs of allocated clusters, and anything past
+ * the last cluster. Ranges come in ascending order; free clusters are skipped.
+ */
+int fs_for_each_used_range(UsedRangeFn fn, void *ctx) {
+    FatCursor fc = {0};
+    uint64_t bytes_per_cluster = (uint64_t)fsinfo.sectors_per_cluster * fsinfo.bytes_per_sector;
+    uint64_t data_start = (uint64_t)fsinfo.first_data_sector * fsinfo.bytes_per_sector;
+    uint64_t data_end = data_start + (uint64_t)fsinfo.total_clusters * bytes_per_cluster;
+    uint32_t end = fsinfo.total_clusters + 2;
+
+    if (fn(0, data_start, ctx) != 0) return -1;
+    for (uint32_t c = 2; c < end; ) {
+        if (fat_cursor_get(&fc, c) == 0) {
+            c++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (c + run < end && fat_cursor_get(&fc, c + run) != 0) run++;
+        if (fn(data_start + (uint64_t)(c - 2) * bytes_per_cluster, run * bytes_per_cluster, ctx) != 0) return -1;
+        c += run;
+    }
+    if (fsinfo.image_size_bytes > data_end) {
+        if (fn(data_end, fsinfo.image_size_bytes - data_end, ctx) != 0) return -1;
     }
     return 0;
 }
 
+/* One directory on the walk stack: its live entries, and the next one to visit. */
+typedef struct {
+    uint32_t cluster;
+    char *path;
+    DirEntry *entries;
+    uint32_t count, next;
+} WalkFrame;
+
+static int walk_load(WalkFrame *f) {
+    uint32_t bytes_per_cluster = fs_cluster_bytes();
+    uint8_t *cbuf = malloc(bytes_per_cluster);
+    if (!cbuf) return -1;
+    uint32_t cap = 0;
+    int rc = 0;
+    bool end = false;
+    for (uint32_t c = f->cluster; !end && rc == 0 && c >= 2 && c < 0x0FFFFFF8; c = get_fat_entry(c)) {
+        if (read_sectors(cluster_to_sector(c), fsinfo.sectors_per_cluster, cbuf) != 0) {
+            rc = -1;
+            break;
+        }
+        for (uint32_t i = 0; i < bytes_per_cluster; i += 32) {
+            DirEntry *e = (DirEntry*)&cbuf[i];
+            if (e->DIR_Name[0] == 0x00) {
+                end = true;
+                break;
+            }
+            if ((e->DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME || e->DIR_Name[0] == 0xE5) continue;
+            if (e->DIR_Attr & ATTR_VOLUME_ID || is_dot_entry(e)) continue;
+            if (f->count == cap) {
+                cap = cap ? cap * 2 : 16;
+                DirEntry *entries = realloc(f->entries, cap * sizeof(DirEntry));
+                if (!entries) {
+                    rc = -1;
+                    break;
+                }
+                f->entries = entries;
+            }
+            f->entries[f->count++] = *e;
+        }
+    }
+    free(cbuf);
+    return rc;
+}
+
+/*
+ * Calls fn for every file and directory below dir, parents before children,
+ * with its path. The walk keeps its own stack and builds paths on the heap,
+ * so no depth or path length is cut off. A directory that contains one of
+ * its own ancestors is reported and ends the walk.
+ */
+int fs_walk_tree(uint32_t dir, TreeWalkFn fn, void *ctx) {
+    WalkFrame *stack = malloc(16 * sizeof(WalkFrame));
+    if (!stack) return -1;
+    uint32_t depth = 1, cap = 16;
+    stack[0] = (WalkFrame){ .cluster = dir, .path = calloc(1, 1) };
+    int rc = stack[0].path ? walk_load(&stack[0]) : -1;
+    while (rc == 0 && depth > 0) {
+        WalkFrame *top = &stack[depth - 1];
+        if (top->next == top->count) {
+            free(top->path);
+            free(top->entries);
+            depth--;
+            continue;
+        }
+        DirEntry e = top->entries[top->next++];
+        char name[12];
+        entry_name(&e, name);
+        size_t len = strlen(top->path) + strlen(name) + 2;
+        char *path = malloc(len);
+        if (!path) {
+            rc = -1;
+            break;
+        }
+        snprintf(path, len, "%s/%s", top->path, name);
+        rc = fn(&e, path, ctx);
+        uint32_t sub = ((uint32_t)e.DIR_FstClusHI << 16) | e.DIR_FstClusLO;
+        if (rc != 0 || !(e.DIR_Attr & ATTR_DIRECTORY) || sub < 2) {
+            free(path);
+            continue;
+        }
+        for (uint32_t i = 0; i < depth; i++) {
+            if (stack[i].cluster == sub) {
+                print_error("Directory loop in the file system; the walk stopped.");
+                rc = -1;
+            }
+        }
+        if (rc == 0 && depth == cap) {
+            WalkFrame *grown = realloc(stack, cap * 2 * sizeof(WalkFrame));
+            if (grown) {
+                stack = grown;
+                cap *= 2;
+            } else {
+                rc = -1;
+            }
+        }
+        if (rc != 0) {
+            free(path);
+            break;
+        }
+        stack[depth] = (WalkFrame){ .cluster = sub, .path = path };
+        rc = walk_load(&stack[depth++]);
+    }
+    while (depth > 0) {
+        depth--;
+        free(stack[depth].path);
+        free(stack[depth].entries);
+    }
+    free(stack);
+    return rc;
+}
+
 int fs_update_dir_entry(uint32_t sector, uint32_t offset, DirEntry *entry) {
-    uint8_t buf[512];
+    uint8_t buf[SECTOR_SIZE_MAX];
     if (read_sector(sector,buf)!=0)return -1;
     memcpy(&buf[offset],entry,sizeof(DirEntry));
     if (write_sector(sector,buf)!=0)return -1;
@@ -627,7 +1656,7 @@ int fs_update_dir_entry(uint32_t sector, uint32_t offset, DirEntry *entry) {
 
 int fs_read_cluster_chain(uint32_t start_cluster, uint8_t *buffer, uint32_t offset, uint32_t size) {
     uint32_t cluster = start_cluster;
-    uint32_t bytes_per_cluster = fsinfo.sectors_per_cluster*fsinfo.bytes_per_sector;
+    uint32_t bytes_per_cluster = fs_cluster_bytes();
 
     
     while (offset>=bytes_per_cluster && cluster<0x0FFFFFF8 && cluster>=2) {
@@ -635,7 +1664,7 @@ int fs_read_cluster_chain(uint32_t start_cluster, uint8_t *buffer, uint32_t offs
         cluster=get_fat_entry(cluster);
     }
 
-    uint8_t temp[512];
+    uint8_t temp[SECTOR_SIZE_MAX];
     uint32_t remain=size;
     uint32_t buf_pos=0;
 
@@ -674,7 +1703,8 @@ int fs_write_cluster_chain(uint32_t start_cluster, const uint8_t *buffer, uint32
     }
 
     uint32_t cluster = start_cluster;
-    uint32_t bytes_per_cluster = fsinfo.sectors_per_cluster * fsinfo.bytes_per_sector;
+    uint32_t bytes_per_cluster = fs_cluster_bytes();
+    uint32_t bps = fsinfo.bytes_per_sector;
 
     while (offset >= bytes_per_cluster && cluster < 0x0FFFFFF8 && cluster >= 2) {
         offset -= bytes_per_cluster;
@@ -683,33 +1713,43 @@ int fs_write_cluster_chain(uint32_t start_cluster, const uint8_t *buffer, uint32
 
     uint32_t remain = size;
     uint32_t buf_pos = 0;
-    uint8_t temp[512];
+    uint8_t temp[SECTOR_SIZE_MAX];
 
+    /* Partial sectors need a read-modify-write; whole sectors of a cluster go out in one request. */
     while (remain > 0 && cluster < 0x0FFFFFF8 && cluster >= 2) {
-        for (int s=0; s<fsinfo.sectors_per_cluster; s++){
-            if (read_sector(cluster_to_sector(cluster)+s,temp)!=0) return -1;
-            uint32_t chunk_size = fsinfo.bytes_per_sector;
-            if (offset > 0) {
-                if (offset >= chunk_size) {
-                    offset -= chunk_size;
-                    continue;
-                } else {
-                    uint32_t to_copy = chunk_size - offset;
-                    if (to_copy > remain) to_copy = remain;
-                    memcpy(&temp[offset], &buffer[buf_pos], to_copy);
-                    buf_pos += to_copy;
-                    remain -= to_copy;
-                    offset = 0;
-                }
-            } else {
-                uint32_t to_copy = (remain > chunk_size) ? chunk_size : remain;
-                memcpy(temp, &buffer[buf_pos], to_copy);
-                buf_pos += to_copy;
-                remain -= to_copy;
-            }
-            if (write_sector(cluster_to_sector(cluster)+s,temp)!=0) return -1;
-            if (remain == 0) break;
+        uint32_t base = cluster_to_sector(cluster);
+        uint32_t s = offset / bps;
+        uint32_t in = offset % bps;
+
+        if (in > 0) {
+            uint32_t to_copy = bps - in;
+            if (to_copy > remain) to_copy = remain;
+            if (read_sector(base+s, temp) != 0) return -1;
+            memcpy(&temp[in], &buffer[buf_pos], to_copy);
+            if (write_sector(base+s, temp) != 0) return -1;
+            buf_pos += to_copy;
+            remain -= to_copy;
+            s++;
+        }
+
+        uint32_t full = remain / bps;
+        if (full > fsinfo.sectors_per_cluster - s) full = fsinfo.sectors_per_cluster - s;
+        if (full > 0) {
+            if (write_sectors(base+s, full, &buffer[buf_pos]) != 0) return -1;
+            buf_pos += full * bps;
+            remain -= full * bps;
+            s += full;
         }
+
+        if (remain > 0 && remain < bps && s < fsinfo.sectors_per_cluster) {
+            if (read_sector(base+s, temp) != 0) return -1;
+            memcpy(temp, &buffer[buf_pos], remain);
+            if (write_sector(base+s, temp) != 0) return -1;
+            buf_pos += remain;
+            remain = 0;
+        }
+
+        offset = 0;
         if (remain > 0) {
             uint32_t nxt = get_fat_entry(cluster);
             if (nxt < 2 || nxt >= 0x0FFFFFF8) break; 
@@ -722,7 +1762,7 @@ int fs_write_cluster_chain(uint32_t start_cluster, const uint8_t *buffer, uint32
 
 
 int fs_extend_file(uint32_t *start_cluster, uint32_t old_size, uint32_t new_size) {
-    uint32_t bytes_per_cluster = fsinfo.sectors_per_cluster * fsinfo.bytes_per_sector;
+    uint32_t bytes_per_cluster = fs_cluster_bytes();
     uint32_t old_clusters = (old_size == 0) ? 0 : ((old_size - 1)/bytes_per_cluster + 1);
     uint32_t new_clusters = (new_size == 0) ? 0 : ((new_size - 1)/bytes_per_cluster + 1);
 
@@ -730,7 +1770,7 @@ int fs_extend_file(uint32_t *start_cluster, uint32_t old_size, uint32_t new_size
         
         if (*start_cluster == 0 && new_clusters > 0) {
             uint32_t c;
-            if (fs_allocate_cluster_chain(1, &c) != 0) {
+            if (fs_allocate_cluster_chain(1, 0, &c) != 0) {
                 return -1;
             }
             if (c < 2) return -1; 
@@ -747,7 +1787,7 @@ int fs_extend_file(uint32_t *start_cluster, uint32_t old_size, uint32_t new_size
        
         for (uint32_t i = old_clusters; i < new_clusters; i++) {
             uint32_t c;
-            if (fs_allocate_cluster_chain(1, &c)!=0) return -1;
+            if (fs_allocate_cluster_chain(1, last, &c)!=0) return -1;
             if (c < 2) return -1;
             if (last != EOC && last >= 2) {
                 if (set_fat_entry(last,c)!=0) return -1;
@@ -765,7 +1805,7 @@ int fs_extend_file(uint32_t *start_cluster, uint32_t old_size, uint32_t new_size
 int fs_is_dir_empty(uint32_t dir_cluster) {
     
     uint32_t cluster=dir_cluster;
-    uint8_t buf[512];
+    uint8_t buf[SECTOR_SIZE_MAX];
     int entry_count=0;
     while (cluster<0x0FFFFFF8 && cluster>=2) {
         for (int sec=0; sec<fsinfo.sectors_per_cluster;sec++){
@@ -785,6 +1825,61 @@ int fs_is_dir_empty(uint32_t dir_cluster) {
 }
 
 
+/*
+ * Adds count prepared entries in one pass: each directory cluster is read
+ * once, each sector that receives entries is written once, and entries that
+ * do not fit go into new clusters written whole before they are linked in.
+ */
+int create_dir_entries(uint32_t dir_cluster, const DirEntry *entries, uint32_t count) {
+    uint32_t bps = fsinfo.bytes_per_sector;
+    uint32_t bpc = (uint32_t)fsinfo.sectors_per_cluster * bps;
+    uint8_t *buf = malloc(bpc);
+    if (!buf) return -1;
+
+    int rc = 0;
+    uint32_t done = 0, last = dir_cluster;
+    for (uint32_t cluster = dir_cluster; rc == 0 && done < count && cluster >= 2 && cluster < 0x0FFFFFF8;
+         cluster = get_fat_entry(cluster)) {
+        last = cluster;
+        if (read_sectors(cluster_to_sector(cluster), fsinfo.sectors_per_cluster, buf) != 0) {
+            rc = -1;
+            break;
+        }
+        uint32_t first_dirty = UINT32_MAX, last_dirty = 0;
+        for (uint32_t i = 0; i < bpc && done < count; i += 32) {
+            if (buf[i] != 0x00 && buf[i] != 0xE5) continue;
+            memcpy(buf + i, &entries[done++], sizeof(DirEntry));
+            if (first_dirty == UINT32_MAX) first_dirty = i / bps;
+            last_dirty = i / bps;
+        }
+        if (first_dirty != UINT32_MAX) {
+            rc = write_sectors(cluster_to_sector(cluster) + first_dirty, last_dirty - first_dirty + 1, buf + first_dirty * bps);
+        }
+    }
+
+    if (rc == 0 && done < count) {
+        uint32_t per = bpc / 32;
+        uint32_t need = (count - done + per - 1) / per;
+        ExtentList ext = {0};
+        uint8_t *nb = calloc(need, bpc);
+        if (!nb || fs_allocate_extents(need, last, &ext) != 0) {
+            rc = -1;
+        } else {
+            memcpy(nb, entries + done, (size_t)(count - done) * sizeof(DirEntry));
+            uint8_t *at = nb;
+            for (uint32_t r = 0; rc == 0 && r < ext.count; r++) {
+                rc = write_sectors(cluster_to_sector(ext.items[r].start), ext.items[r].count * fsinfo.sectors_per_cluster, at);
+                at += (size_t)ext.items[r].count * bpc;
+            }
+            if (rc == 0) rc = set_fat_entry(last, ext.items[0].start);
+        }
+        extent_list_free(&ext);
+        free(nb);
+    }
+    free(buf);
+    return rc;
+}
+
 int create_dir_entry(uint32_t dir_cluster, const char *name, uint8_t attr, uint32_t start_cluster, uint32_t size) {
     DirEntry newe;
     memset(&newe, 0, sizeof(newe));
@@ -795,7 +1890,7 @@ int create_dir_entry(uint32_t dir_cluster, const char *name, uint8_t attr, uint3
     newe.DIR_FstClusLO = (uint16_t)(start_cluster & 0xFFFF);
 
     uint32_t cluster = dir_cluster;
-    uint8_t buf[512];
+    uint8_t buf[SECTOR_SIZE_MAX];
 
     while (cluster < 0x0FFFFFF8) {
         for (int s = 0; s < fsinfo.sectors_per_cluster; s++) {
@@ -818,12 +1913,12 @@ int create_dir_entry(uint32_t dir_cluster, const char *name, uint8_t attr, uint3
         if (nxt >= 0x0FFFFFF8) {
             
             uint32_t c;
-            if (fs_allocate_cluster_chain(1, &c) != 0) return -1;
+            if (fs_allocate_cluster_chain(1, cluster, &c) != 0) return -1;
             if (set_fat_entry(cluster, c) != 0) return -1;
             if (set_fat_entry(c, 0x0FFFFFFF) != 0) return -1; 
 
             
-            memset(buf, 0, 512);
+            memset(buf, 0, sizeof(buf));
             for (int i = 0; i < fsinfo.sectors_per_cluster; i++) {
                 if (write_sector(cluster_to_sector(c) + i, buf) != 0) return -1;
             }
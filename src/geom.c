@@ -0,0 +1,20 @@
+#include "fs.h"
+#include "geom.h"
+
+/*
+ * Every cluster-to-sector conversion and FAT lookup used to multiply, divide
+ * and take remainders by the sector size and cluster size read from the boot
+ * sector. Both are powers of two, so at mount their logarithms are stored in
+ * fsinfo and the sector size is classified for the inline helpers in geom.h.
+ */
+
+GeomKind geom_kind = GEOM_GENERIC;
+
+/* Needs bytes_per_sector and sectors_per_cluster validated as powers of two. */
+void geom_select(void) {
+    fsinfo.sector_shift = (uint8_t)__builtin_ctz(fsinfo.bytes_per_sector);
+    fsinfo.cluster_shift = (uint8_t)__builtin_ctz(fsinfo.sectors_per_cluster);
+    if (fsinfo.bytes_per_sector == 512) geom_kind = GEOM_SECTOR_512;
+    else if (fsinfo.bytes_per_sector == 4096) geom_kind = GEOM_SECTOR_4096;
+    else geom_kind = GEOM_GENERIC;
+}
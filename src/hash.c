@@ -0,0 +1,655 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "fs.h"
+#include "hash.h"
+#include "crc32c.h"
+#include "utils.h"
+
+/*
+ * Cluster hash index. `hash` stores a CRC32C for every allocated cluster in
+ * a sidecar file next to the image (IMAGE.crc, or DELTA.crc in overlay
+ * mode), together with the allocation map at that time. While the sidecar
+ * exists, every write into the data region sets the cluster's bit in a
+ * written-since-hash map that is kept in memory and saved back into the
+ * sidecar on sync and unmount, so `verify` only has to reread clusters that
+ * were written or changed allocation state since the index was built.
+ *
+ * The header's in_use flag is set, and flushed, at mount before any write,
+ * and cleared at unmount once the image is synced. A sidecar found with the
+ * flag set belongs to a session that ended without unmounting, so its map
+ * may miss writes: every cluster then counts as written, and `verify`
+ * rechecks them all.
+ *
+ * Sidecar layout: header, crc[cluster_count], alloc bitmap, written bitmap.
+ */
+
+#define HASH_MAGIC      "F32CRC1"
+#define HASH_VERSION    1
+#define HASH_READ_BYTES (1024*1024)
+#define HASH_WORKERS_MAX 8
+
+#pragma pack(push,1)
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t cluster_size;
+    uint32_t cluster_count;
+    uint32_t volume_id;
+    uint64_t image_size;
+    uint64_t hashed_at;
+    uint8_t  in_use;            /* a session is tracking writes against it */
+    uint8_t  reserved[23];
+} HashHeader;
+#pragma pack(pop)
+
+typedef struct {
+    char path[512];
+    uint32_t count;
+    uint8_t *written;
+    bool dirty;
+} HashTrack;
+
+static HashTrack track;
+
+static uint64_t bitmap_bytes(uint32_t n) {
+    return ((uint64_t)n + 7) / 8;
+}
+
+static bool bit_get(const uint8_t *map, uint32_t i) {
+    return (map[i>>3] >> (i&7)) & 1;
+}
+
+static void bit_set(uint8_t *map, uint32_t i) {
+    map[i>>3] |= (uint8_t)(1u << (i&7));
+}
+
+static uint64_t off_crcs(void) { return sizeof(HashHeader); }
+static uint64_t off_alloc(uint32_t n) { return off_crcs() + (uint64_t)n * 4; }
+static uint64_t off_written(uint32_t n) { return off_alloc(n) + bitmap_bytes(n); }
+
+static void sidecar_path(const char *image_path, char *out, size_t cap) {
+    snprintf(out, cap, "%s.crc", image_path);
+}
+
+static uint32_t volume_id(void) {
+    FAT32BootSector b;
+    if (fsinfo.dev->read(fsinfo.dev, 0, &b, sizeof(b)) != 0) return 0;
+    return b.BS_VolID;
+}
+
+static bool header_fits(const HashHeader *h, uint32_t vol_id) {
+    return memcmp(h->magic, HASH_MAGIC, 8) == 0 && h->version == HASH_VERSION &&
+           h->cluster_size == fs_cluster_bytes() && h->cluster_count == fsinfo.total_clusters &&
+           h->volume_id == vol_id && h->image_size == fsinfo.image_size_bytes;
+}
+
+static bool header_matches(const HashHeader *h) {
+    return header_fits(h, volume_id());
+}
+
+static int set_in_use(int fd, bool in_use) {
+    uint8_t v = in_use;
+    if (image_pwrite(fd, &v, 1, offsetof(HashHeader, in_use)) != 0) return -1;
+    return fdatasync(fd);
+}
+
+/* ---- write tracking ---- */
+
+void hash_track_load(const char *image_path) {
+    memset(&track, 0, sizeof(track));
+    sidecar_path(image_path, track.path, sizeof(track.path));
+    int fd = open(track.path, O_RDWR);
+    if (fd < 0) return;
+    HashHeader h;
+    uint32_t n = fsinfo.total_clusters;
+    if (image_pread(fd, &h, sizeof(h), 0) == 0 && header_matches(&h)) {
+        track.written = malloc(bitmap_bytes(n) ? bitmap_bytes(n) : 1);
+        if (track.written && h.in_use) {
+            memset(track.written, 0xFF, bitmap_bytes(n));
+            track.dirty = true;
+        } else if (track.written && image_pread(fd, track.written, (uint32_t)bitmap_bytes(n), off_written(n)) != 0) {
+            free(track.written);
+            track.written = NULL;
+        }
+        /* Without the flag on disk, writes of this session could go unnoticed after a crash. */
+        if (track.written && set_in_use(fd, true) != 0) {
+            free(track.written);
+            track.written = NULL;
+        }
+        track.count = n;
+    }
+    close(fd);
+}
+
+void hash_note_write(uint64_t off, uint64_t len) {
+    if (!track.written || len == 0) return;
+    uint64_t data_start = (uint64_t)fsinfo.first_data_sector * fsinfo.bytes_per_sector;
+    if (off + len <= data_start) return;
+    if (off < data_start) {
+        len -= data_start - off;
+        off = data_start;
+    }
+    uint64_t first = (off - data_start) / fs_cluster_bytes();
+    uint64_t last = (off + len - 1 - data_start) / fs_cluster_bytes();
+    if (last >= track.count) last = (uint64_t)track.count - 1;
+    /* Copy workers write concurrently, so bits are set atomically. */
+    for (uint64_t i = first; i <= last && i < track.count; i++) {
+        __atomic_fetch_or(&track.written[i>>3], (uint8_t)(1u << (i&7)), __ATOMIC_RELAXED);
+    }
+    track.dirty = true;
+}
+
+void hash_track_save(void) {
+    if (!track.written || !track.dirty) return;
+    int fd = open(track.path, O_WRONLY);
+    if (fd < 0) return;
+    if (image_pwrite(fd, track.written, (uint32_t)bitmap_bytes(track.count), off_written(track.count)) == 0) {
+        track.dirty = false;
+    }
+    close(fd);
+}
+
+/* Called once the image is synced, so the saved map covers every write. */
+void hash_track_close(void) {
+    hash_track_save();
+    if (track.written && !track.dirty) {
+        int fd = open(track.path, O_WRONLY);
+        if (fd >= 0) {
+            set_in_use(fd, false);
+            close(fd);
+        }
+    }
+    free(track.written);
+    memset(&track, 0, sizeof(track));
+}
+
+/* Copies the index of the mounted image next to a clone of it. */
+int hash_copy_index(const char *dst_image_path) {
+    if (!track.written) return 0;
+    hash_track_save();
+    char dst[512];
+    sidecar_path(dst_image_path, dst, sizeof(dst));
+    if (image_copy_file(track.path, dst) != 0) return -1;
+    /* The clone is not mounted, and its map is complete as of the copy. */
+    int fd = open(dst, O_WRONLY);
+    int rc = fd >= 0 ? set_in_use(fd, false) : -1;
+    if (fd >= 0) close(fd);
+    return rc;
+}
+
+/* Removes the index of an image that was changed without write tracking. */
+void hash_drop_index(const char *image_path) {
+    char path[512];
+    sidecar_path(image_path, path, sizeof(path));
+    unlink(path);
+}
+
+/*
+ * Loads the CRCs of an index that still describe the cluster contents:
+ * clean gets a bit for every cluster that was allocated when hashed and has
+ * not been written since. image_path NULL means the mounted image; another
+ * image must have the same geometry and the given volume id.
+ */
+int hash_clean_crcs(const char *image_path, uint32_t vol_id, uint32_t **crcs, uint8_t **clean) {
+    char path[512];
+    uint32_t n = fsinfo.total_clusters;
+    uint64_t nb = bitmap_bytes(n);
+    *crcs = NULL;
+    *clean = NULL;
+    if (image_path) sidecar_path(image_path, path, sizeof(path));
+    else if (track.written) snprintf(path, sizeof(path), "%s", track.path);
+    else return -1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    HashHeader h;
+    uint32_t *c = malloc((size_t)n * 4 + 4);
+    uint8_t *alloc = malloc(nb + 1), *written = malloc(nb + 1);
+    int rc = (c && alloc && written) ? 0 : -1;
+    if (rc == 0 && (image_pread(fd, &h, sizeof(h), 0) != 0 || !header_fits(&h, vol_id))) rc = -1;
+    /* Another image's map cannot be trusted while it is mounted or after a crash. */
+    if (rc == 0 && image_path && h.in_use) rc = -1;
+    if (rc == 0 && image_pread(fd, c, n * 4, off_crcs()) != 0) rc = -1;
+    if (rc == 0 && image_pread(fd, alloc, (uint32_t)nb, off_alloc(n)) != 0) rc = -1;
+    if (rc == 0) {
+        /* The mounted image's write map is newer in memory than in the file. */
+        if (image_path) rc = image_pread(fd, written, (uint32_t)nb, off_written(n));
+        else memcpy(written, track.written, nb);
+    }
+    close(fd);
+    if (rc != 0) {
+        free(c);
+        free(alloc);
+        free(written);
+        return -1;
+    }
+    for (uint64_t i = 0; i < nb; i++) alloc[i] &= (uint8_t)~written[i];
+    free(written);
+    *crcs = c;
+    *clean = alloc;
+    return 0;
+}
+
+/* ---- parallel hashing ---- */
+
+typedef struct {
+    const uint8_t *want;
+    uint32_t *crcs;
+    uint32_t lo, hi;
+    int rc;
+} HashJob;
+
+/* Hashes every wanted cluster in [lo, hi), reading contiguous runs in large requests. */
+static void *hash_worker(void *arg) {
+    HashJob *j = arg;
+    uint32_t bpc = fs_cluster_bytes();
+    uint32_t max_run = HASH_READ_BYTES / bpc;
+    if (max_run == 0) max_run = 1;
+    uint8_t *buf = malloc((size_t)max_run * bpc);
+    if (!buf) {
+        j->rc = -1;
+        return NULL;
+    }
+    for (uint32_t i = j->lo; i < j->hi; ) {
+        if (!bit_get(j->want, i)) {
+            i++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (i + run < j->hi && run < max_run && bit_get(j->want, i + run)) run++;
+        if (read_sectors(cluster_to_sector(i + 2), run * fsinfo.sectors_per_cluster, buf) != 0) {
+            j->rc = -1;
+            break;
+        }
+        for (uint32_t k = 0; k < run; k++) j->crcs[i + k] = crc32c(0, buf + (size_t)k * bpc, bpc);
+        i += run;
+    }
+    free(buf);
+    return NULL;
+}
+
+static int hash_clusters(const uint8_t *want, uint32_t *crcs, uint32_t n) {
+    HashJob jobs[HASH_WORKERS_MAX];
+    pthread_t threads[HASH_WORKERS_MAX];
+    bool started[HASH_WORKERS_MAX] = {0};
+    long nw = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nw < 1) nw = 1;
+    if (nw > HASH_WORKERS_MAX) nw = HASH_WORKERS_MAX;
+
+    /* Stripes are aligned to 8 clusters so no two workers share a bitmap byte. */
+    uint32_t stripe = (n / (uint32_t)nw + 7) & ~7u;
+    if (stripe == 0) stripe = 8;
+    int rc = 0;
+    for (long t = 0; t < nw; t++) {
+        jobs[t].want = want;
+        jobs[t].crcs = crcs;
+        jobs[t].lo = (uint32_t)t * stripe < n ? (uint32_t)t * stripe : n;
+        jobs[t].hi = t == nw - 1 || jobs[t].lo + stripe > n ? n : jobs[t].lo + stripe;
+        jobs[t].rc = 0;
+        if (t > 0 && pthread_create(&threads[t], NULL, hash_worker, &jobs[t]) == 0) started[t] = true;
+    }
+    hash_worker(&jobs[0]);
+    for (long t = 1; t < nw; t++) {
+        if (started[t]) pthread_join(threads[t], NULL);
+        else hash_worker(&jobs[t]);
+    }
+    for (long t = 0; t < nw; t++) if (jobs[t].rc != 0) rc = -1;
+    return rc;
+}
+
+static uint8_t *alloc_map(uint32_t n) {
+    uint8_t *map = calloc(1, bitmap_bytes(n) ? bitmap_bytes(n) : 1);
+    if (!map) return NULL;
+    FatCursor fc = {0};
+    for (uint32_t i = 0; i < n; i++) {
+        if (fat_cursor_get(&fc, i + 2) != 0) bit_set(map, i);
+    }
+    return map;
+}
+
+static int write_index(const char *path, const uint32_t *crcs, const uint8_t *alloc, uint32_t n) {
+    HashHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, HASH_MAGIC, 8);
+    h.version = HASH_VERSION;
+    h.cluster_size = fs_cluster_bytes();
+    h.cluster_count = n;
+    h.volume_id = volume_id();
+    h.image_size = fsinfo.image_size_bytes;
+    h.hashed_at = (uint64_t)time(NULL);
+    h.in_use = 1;
+
+    uint8_t *clear = calloc(1, bitmap_bytes(n) ? bitmap_bytes(n) : 1);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int rc = (clear && fd >= 0) ? 0 : -1;
+    if (rc == 0 && image_pwrite(fd, &h, sizeof(h), 0) != 0) rc = -1;
+    if (rc == 0 && image_pwrite(fd, crcs, n * 4, off_crcs()) != 0) rc = -1;
+    if (rc == 0 && image_pwrite(fd, alloc, (uint32_t)bitmap_bytes(n), off_alloc(n)) != 0) rc = -1;
+    if (rc == 0 && image_pwrite(fd, clear, (uint32_t)bitmap_bytes(n), off_written(n)) != 0) rc = -1;
+    if (rc == 0 && fdatasync(fd) != 0) rc = -1;
+    if (fd >= 0) close(fd);
+    free(clear);
+    return rc;
+}
+
+typedef struct {
+    uint32_t *crcs;
+    uint8_t *alloc;
+    uint8_t *written;
+    uint32_t count;
+} HashIndex;
+
+static void index_free(HashIndex *ix) {
+    free(ix->crcs);
+    free(ix->alloc);
+    free(ix->written);
+    memset(ix, 0, sizeof(*ix));
+}
+
+static int load_index(HashIndex *ix) {
+    memset(ix, 0, sizeof(*ix));
+    int fd = open(track.path, O_RDONLY);
+    if (fd < 0) {
+        print_error("No hash index; run hash first.");
+        return -1;
+    }
+    HashHeader h;
+    uint32_t n = fsinfo.total_clusters;
+    int rc = 0;
+    if (image_pread(fd, &h, sizeof(h), 0) != 0 || !header_matches(&h)) {
+        print_error("Hash index does not match this image; run hash again.");
+        rc = -1;
+    } else {
+        ix->count = n;
+        ix->crcs = malloc((size_t)n * 4 + 4);
+        ix->alloc = malloc(bitmap_bytes(n) + 1);
+        if (!ix->crcs || !ix->alloc) rc = -1;
+        else if (image_pread(fd, ix->crcs, n * 4, off_crcs()) != 0) rc = -1;
+        else if (image_pread(fd, ix->alloc, (uint32_t)bitmap_bytes(n), off_alloc(n)) != 0) rc = -1;
+        if (rc != 0) print_error("Failed to read hash index.");
+    }
+    close(fd);
+    if (rc != 0) index_free(ix);
+    return rc;
+}
+
+int fs_hash() {
+    fs_sync();
+    uint32_t n = fsinfo.total_clusters;
+    uint8_t *alloc = alloc_map(n);
+    uint32_t *crcs = calloc(n ? n : 1, 4);
+    int rc = (alloc && crcs) ? 0 : -1;
+    if (rc == 0 && hash_clusters(alloc, crcs, n) != 0) {
+        print_error("Read error while hashing.");
+        rc = -1;
+    }
+    if (rc == 0 && write_index(track.path, crcs, alloc, n) != 0) {
+        print_error("Failed to write hash index.");
+        rc = -1;
+    }
+    if (rc == 0) {
+        uint32_t used = 0;
+        for (uint64_t i = 0; i < bitmap_bytes(n); i++) used += __builtin_popcount(alloc[i]);
+        printf("hashed %u clusters (crc32c/%s) -> %s\n", used, crc32c_impl(), track.path);
+        /* Start tracking writes against the new index. */
+        free(track.written);
+        track.written = calloc(1, bitmap_bytes(n) ? bitmap_bytes(n) : 1);
+        track.count = n;
+        track.dirty = false;
+    }
+    free(alloc);
+    free(crcs);
+    return rc;
+}
+
+int fs_verify(bool full) {
+    fs_sync();
+    HashIndex ix;
+    if (load_index(&ix) != 0) return -1;
+    uint32_t n = ix.count;
+    uint8_t *alloc = alloc_map(n);
+    uint8_t *want = calloc(1, bitmap_bytes(n) + 1);
+    uint32_t *fresh = malloc((size_t)n * 4 + 4);
+    if (!alloc || !want || !fresh) {
+        free(alloc); free(want); free(fresh);
+        index_free(&ix);
+        return -1;
+    }
+
+    /* Recheck clusters written since the index was built or whose allocation changed. */
+    uint32_t checked = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (!bit_get(alloc, i)) continue;
+        bool written = track.written && bit_get(track.written, i);
+        if (full || written || !bit_get(ix.alloc, i)) {
+            bit_set(want, i);
+            checked++;
+        }
+    }
+    memcpy(fresh, ix.crcs, (size_t)n * 4);
+    int rc = hash_clusters(want, fresh, n);
+    if (rc != 0) print_error("Read error while verifying.");
+
+    uint32_t changed = 0, corrupt = 0, freed = 0;
+    for (uint32_t i = 0; rc == 0 && i < n; i++) {
+        if (!bit_get(alloc, i)) {
+            if (bit_get(ix.alloc, i)) freed++;
+            fresh[i] = 0;
+            continue;
+        }
+        if (!bit_get(want, i) || !bit_get(ix.alloc, i) || fresh[i] == ix.crcs[i]) continue;
+        if (track.written && bit_get(track.written, i)) {
+            changed++;
+        } else {
+            corrupt++;
+            printf("cluster %u: crc %08x, index has %08x\n", i + 2, fresh[i], ix.crcs[i]);
+            /* Keep the recorded hash so the mismatch is reported again until fixed. */
+            fresh[i] = ix.crcs[i];
+        }
+    }
+    if (rc == 0 && write_index(track.path, fresh, alloc, n) != 0) {
+        print_error("Failed to update hash index.");
+        rc = -1;
+    }
+    if (rc == 0) {
+        printf("verify: %u clusters rechecked, %u rewritten with new content, %u freed, %u mismatched without a write\n",
+               checked, changed, freed, corrupt);
+        if (track.written) memset(track.written, 0, bitmap_bytes(n));
+        track.dirty = false;
+        if (corrupt) rc = -1;
+    }
+    free(alloc);
+    free(want);
+    free(fresh);
+    index_free(&ix);
+    return rc;
+}
+
+/* ---- duplicate report ---- */
+
+typedef struct {
+    uint32_t size;
+    uint32_t sig;
+    uint32_t cluster;
+    char *path;
+} FileSig;
+
+typedef struct {
+    FileSig *items;
+    uint32_t count, cap;
+    const HashIndex *ix;
+    uint8_t *tail;              /* one cluster */
+    bool stale;
+} SigList;
+
+/* Reads len bytes at byte offset off of a file whose chain is ext. */
+static int extent_read(const ExtentList *ext, uint64_t off, uint8_t *buf, uint32_t len) {
+    uint32_t bpc = fs_cluster_bytes();
+    for (uint32_t e = 0; e < ext->count && len > 0; e++) {
+        uint64_t run = (uint64_t)ext->items[e].count * bpc;
+        if (off >= run) {
+            off -= run;
+            continue;
+        }
+        uint32_t n = run - off < len ? (uint32_t)(run - off) : len;
+        uint64_t at = (uint64_t)cluster_to_sector(ext->items[e].start) * fsinfo.bytes_per_sector + off;
+        if (fsinfo.dev->read(fsinfo.dev, at, buf, n) != 0) return -1;
+        buf += n;
+        len -= n;
+        off = 0;
+    }
+    return len == 0 ? 0 : -1;
+}
+
+/*
+ * Combines the indexed hashes of the file's whole clusters, walked from its
+ * chain. The last cluster's slack past the end of the file is not part of
+ * the content, so a partial last cluster is read and hashed up to the size.
+ */
+static int file_signature(SigList *l, uint32_t start, uint32_t size, uint32_t *sig) {
+    uint32_t bpc = fs_cluster_bytes();
+    uint32_t nclusters = (uint32_t)(((uint64_t)size + bpc - 1) / bpc), seen = 0;
+    ExtentList ext = {0};
+    if (fs_chain_extents(start, nclusters, &ext) != 0) {
+        extent_list_free(&ext);
+        return -1;
+    }
+    uint32_t s = crc32c(0, &size, sizeof(size));
+    int rc = 0;
+    for (uint32_t e = 0; rc == 0 && e < ext.count; e++) {
+        for (uint32_t k = 0; rc == 0 && k < ext.items[e].count; k++) {
+            uint32_t i = ext.items[e].start + k - 2;
+            if (++seen == nclusters && size % bpc) {
+                uint32_t n = size % bpc;
+                rc = extent_read(&ext, (uint64_t)(nclusters - 1) * bpc, l->tail, n);
+                if (rc == 0) s = crc32c(s, l->tail, n);
+                continue;
+            }
+            if (i >= l->ix->count) continue;
+            if (!bit_get(l->ix->alloc, i) || (track.written && bit_get(track.written, i))) l->stale = true;
+            s = crc32c(s, &l->ix->crcs[i], 4);
+        }
+    }
+    extent_list_free(&ext);
+    *sig = s;
+    return rc;
+}
+
+/* Byte comparison of two files of the same size; a and b are HASH_READ_BYTES each. */
+static int files_equal(const FileSig *x, const FileSig *y, uint8_t *a, uint8_t *b, bool *equal) {
+    uint32_t bpc = fs_cluster_bytes();
+    uint32_t nclusters = (uint32_t)(((uint64_t)x->size + bpc - 1) / bpc);
+    ExtentList ex = {0}, ey = {0};
+    int rc = (fs_chain_extents(x->cluster, nclusters, &ex) == 0 && fs_chain_extents(y->cluster, nclusters, &ey) == 0) ? 0 : -1;
+    *equal = rc == 0;
+    for (uint64_t off = 0; rc == 0 && *equal && off < x->size; off += HASH_READ_BYTES) {
+        uint32_t n = x->size - off < HASH_READ_BYTES ? (uint32_t)(x->size - off) : HASH_READ_BYTES;
+        if (extent_read(&ex, off, a, n) != 0 || extent_read(&ey, off, b, n) != 0) rc = -1;
+        else *equal = memcmp(a, b, n) == 0;
+    }
+    extent_list_free(&ex);
+    extent_list_free(&ey);
+    return rc;
+}
+
+static int sig_push(SigList *l, uint32_t size, uint32_t sig, uint32_t cluster, const char *path) {
+    if (l->count == l->cap) {
+        uint32_t cap = l->cap ? l->cap * 2 : 64;
+        FileSig *items = realloc(l->items, cap * sizeof(FileSig));
+        if (!items) return -1;
+        l->items = items;
+        l->cap = cap;
+    }
+    char *p = strdup(path);
+    if (!p) return -1;
+    l->items[l->count].size = size;
+    l->items[l->count].sig = sig;
+    l->items[l->count].cluster = cluster;
+    l->items[l->count].path = p;
+    l->count++;
+    return 0;
+}
+
+static int collect_sig(const DirEntry *e, const char *path, void *ctx) {
+    SigList *l = ctx;
+    uint32_t fc = ((uint32_t)e->DIR_FstClusHI << 16) | e->DIR_FstClusLO;
+    if ((e->DIR_Attr & ATTR_DIRECTORY) || fc < 2 || e->DIR_FileSize == 0) return 0;
+    uint32_t sig;
+    if (file_signature(l, fc, e->DIR_FileSize, &sig) != 0) return 0;
+    return sig_push(l, e->DIR_FileSize, sig, fc, path);
+}
+
+static int cmp_sig(const void *a, const void *b) {
+    const FileSig *x = a, *y = b;
+    if (x->size != y->size) return x->size < y->size ? 1 : -1;
+    if (x->sig != y->sig) return x->sig < y->sig ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+int fs_dupes() {
+    fs_sync();
+    HashIndex ix;
+    if (load_index(&ix) != 0) return -1;
+    SigList l = {0};
+    l.ix = &ix;
+    l.tail = malloc(fs_cluster_bytes());
+    uint8_t *a = malloc(HASH_READ_BYTES), *b = malloc(HASH_READ_BYTES);
+    int rc = (l.tail && a && b) ? 0 : -1;
+    if (rc == 0 && fs_walk_tree(fsinfo.root_cluster, collect_sig, &l) != 0) {
+        print_error("Failed to walk the directory tree.");
+        rc = -1;
+    }
+    if (l.stale) printf("note: index is stale for some files; run verify first for exact results\n");
+
+    /* Equal signatures only make candidates; each group is split by comparing the bytes. */
+    qsort(l.items, l.count, sizeof(FileSig), cmp_sig);
+    bool *done = calloc(l.count ? l.count : 1, sizeof(bool));
+    uint32_t *same = malloc((l.count ? l.count : 1) * sizeof(uint32_t));
+    if (!done || !same) rc = -1;
+    uint32_t groups = 0;
+    uint64_t wasted = 0;
+    for (uint32_t i = 0; rc == 0 && i < l.count; ) {
+        uint32_t j = i + 1;
+        while (j < l.count && l.items[j].size == l.items[i].size && l.items[j].sig == l.items[i].sig) j++;
+        for (uint32_t r = i; rc == 0 && r < j; r++) {
+            if (done[r]) continue;
+            uint32_t n = 0;
+            same[n++] = r;
+            for (uint32_t k = r + 1; rc == 0 && k < j; k++) {
+                bool eq;
+                if (done[k]) continue;
+                if (files_equal(&l.items[r], &l.items[k], a, b, &eq) != 0) rc = -1;
+                else if (eq) {
+                    same[n++] = k;
+                    done[k] = true;
+                }
+            }
+            if (rc == 0 && n > 1) {
+                groups++;
+                wasted += (uint64_t)(n - 1) * l.items[r].size;
+                printf("%u bytes x %u:\n", l.items[r].size, n);
+                for (uint32_t k = 0; k < n; k++) printf("  %s\n", l.items[same[k]].path);
+            }
+        }
+        i = j;
+    }
+    if (rc != 0) print_error("Failed to compare files.");
+    else printf("%u duplicate groups, %llu bytes reclaimable\n", groups, (unsigned long long)wasted);
+    for (uint32_t i = 0; i < l.count; i++) free(l.items[i].path);
+    free(l.items);
+    free(l.tail);
+    free(a);
+    free(b);
+    free(done);
+    free(same);
+    index_free(&ix);
+    return rc;
+}
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "image.h"
+#include "fat32.h"
+#include "crc32c.h"
+
+typedef struct {
+    int fd;
+} FileDev;
+
+int image_pread(int fd, void *buf, uint32_t len, uint64_t off) {
+    uint32_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (uint8_t*)buf + done, len - done, (off_t)(off + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += (uint32_t)n;
+    }
+    return 0;
+}
+
+int image_pwrite(int fd, const void *buf, uint32_t len, uint64_t off) {
+    uint32_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, (const uint8_t*)buf + done, len - done, (off_t)(off + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += (uint32_t)n;
+    }
+    return 0;
+}
+
+static int file_read(ImageDev *dev, uint64_t off, void *buf, uint32_t len) {
+    FileDev *f = dev->priv;
+    return image_pread(f->fd, buf, len, off);
+}
+
+static int file_write(ImageDev *dev, uint64_t off, const void *buf, uint32_t len) {
+    FileDev *f = dev->priv;
+    if (!dev->writable) return -1;
+    if (image_pwrite(f->fd, buf, len, off) != 0) return -1;
+    if (off + len > dev->size) dev->size = off + len;
+    return 0;
+}
+
+static int file_copy(ImageDev *dev, uint64_t src, uint64_t dst, uint64_t len) {
+    FileDev *f = dev->priv;
+    if (!dev->writable) return -1;
+    loff_t in = (loff_t)src, out = (loff_t)dst;
+    while (len > 0) {
+        ssize_t n = copy_file_range(f->fd, &in, f->fd, &out, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        len -= (uint64_t)n;
+    }
+    return 0;
+}
+
+static int file_sync(ImageDev *dev) {
+    FileDev *f = dev->priv;
+    if (!dev->writable) return 0;
+    return fdatasync(f->fd) == 0 ? 0 : -1;
+}
+
+static void file_close(ImageDev *dev) {
+    FileDev *f = dev->priv;
+    close(f->fd);
+    free(f);
+    free(dev);
+}
+
+ImageDev *image_open_file(const char *path, bool writable) {
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        close(fd);
+        return NULL;
+    }
+
+    ImageDev *dev = calloc(1, sizeof(ImageDev));
+    FileDev *f = calloc(1, sizeof(FileDev));
+    if (!dev || !f) {
+        free(dev); free(f);
+        close(fd);
+        return NULL;
+    }
+    f->fd = fd;
+    dev->kind = "file";
+    dev->size = (uint64_t)st.st_size;
+    dev->writable = writable;
+    dev->read = file_read;
+    dev->write = file_write;
+    dev->copy = file_copy;
+    dev->sync = file_sync;
+    dev->close = file_close;
+    dev->priv = f;
+    return dev;
+}
+
+/* Descriptor of a plain image file for engines that bypass the backend, -1 for other backends. */
+int image_file_fd(ImageDev *dev) {
+    if (strcmp(dev->kind, "file") != 0) return -1;
+    return ((FileDev*)dev->priv)->fd;
+}
+
+/* Copies an image file to dst, skipping holes so sparse images stay sparse. */
+int image_copy_file(const char *src_path, const char *dst_path) {
+    int in = open(src_path, O_RDONLY);
+    if (in < 0) return -1;
+    int out = open(dst_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    struct stat st;
+    int rc = (out >= 0 && fstat(in, &st) == 0 && ftruncate(out, st.st_size) == 0) ? 0 : -1;
+    off_t pos = 0;
+    while (rc == 0 && pos < st.st_size) {
+        off_t data = lseek(in, pos, SEEK_DATA);
+        if (data < 0) break;
+        off_t hole = lseek(in, data, SEEK_HOLE);
+        if (hole < 0) hole = st.st_size;
+        loff_t i = data, o = data;
+        while (rc == 0 && i < hole) {
+            ssize_t n = copy_file_range(in, &i, out, &o, (size_t)(hole - i), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) rc = -1;
+        }
+        pos = hole;
+    }
+    close(in);
+    if (out >= 0) close(out);
+    return rc;
+}
+
+/* Opens an image file, recognising the compressed container format by its footer. */
+ImageDev *image_open(const char *path, bool writable) {
+    if (image_is_container(path)) return image_open_container(path, writable);
+    return image_open_file(path, writable);
+}
+
+#define META_CRC_CHUNK (1024*1024)
+
+/* CRC32C of a volume's metadata: the reserved sectors and every FAT copy, read through the backend. */
+int image_meta_crc(ImageDev *dev, uint32_t *out) {
+    FAT32BootSector b;
+    if (dev->read(dev, 0, &b, sizeof(b)) != 0) return -1;
+    uint64_t end = ((uint64_t)b.BPB_RsvdSecCnt + (uint64_t)b.BPB_NumFATs * b.BPB_FATSz32) * b.BPB_BytsPerSec;
+    if (end > dev->size) end = dev->size;
+    uint8_t *buf = malloc(META_CRC_CHUNK);
+    if (!buf) return -1;
+    uint32_t crc = 0;
+    for (uint64_t off = 0; off < end; ) {
+        uint32_t n = end - off > META_CRC_CHUNK ? META_CRC_CHUNK : (uint32_t)(end - off);
+        if (dev->read(dev, off, buf, n) != 0) {
+            free(buf);
+            return -1;
+        }
+        crc = crc32c(crc, buf, n);
+        off += n;
+    }
+    free(buf);
+    *out = crc;
+    return 0;
+}
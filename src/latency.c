@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "image.h"
+
+/*
+ * Slow-device backend for measurements. It wraps any other backend and holds
+ * each request back until a simple storage model says it would have
+ * finished, so caching, read-ahead and batching can be compared on slow
+ * storage with the image itself still in page cache.
+ *
+ *   lat   fixed time per request (command overhead, or rotation with seek)
+ *   seek  time to move across the whole image. A request that does not start
+ *         where the previous one ended pays lat + seek * sqrt(distance / size);
+ *         one that does pays only its transfer, as in a sequential stream.
+ *   bw    transfer rate. Transfers share one channel, one at a time.
+ *   qd    requests the device accepts at once; the rest wait for a slot.
+ *
+ * With seek set the device has one head, and requests are served strictly
+ * one after another. Without it, the fixed latencies of requests in flight
+ * overlap, and only their transfers queue for the channel. The real request
+ * runs first, then the caller sleeps until the modelled completion time.
+ */
+
+typedef struct {
+    ImageDev *inner;
+    LatencyModel m;
+
+    pthread_mutex_t lock;
+    pthread_cond_t slot_free;
+    uint32_t in_flight;
+    uint64_t head;              /* byte after the last request */
+    uint64_t busy_until;        /* head or channel, in monotonic microseconds */
+
+    uint64_t ios, seeks, delay_us;
+} SlowDev;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void sleep_until(uint64_t t) {
+    struct timespec ts = {(time_t)(t / 1000000), (long)(t % 1000000) * 1000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {}
+}
+
+/* Claims a queue slot and books the request on the model; returns when it completes. */
+static uint64_t slow_begin(SlowDev *s, uint64_t size, uint64_t off, uint64_t len) {
+    uint64_t now = now_us();
+    pthread_mutex_lock(&s->lock);
+    while (s->m.qd && s->in_flight >= s->m.qd) pthread_cond_wait(&s->slot_free, &s->lock);
+    s->in_flight++;
+    if (s->m.qd) now = now_us();
+
+    uint64_t seek = 0;
+    if (s->m.seek_us && off != s->head && size > 0) {
+        double dist = (double)(off > s->head ? off - s->head : s->head - off);
+        seek = s->m.lat_us + (uint64_t)(s->m.seek_us * sqrt(dist / (double)size));
+        s->seeks++;
+    }
+    uint64_t xfer = s->m.bw_mbps ? len / s->m.bw_mbps : 0;     /* MB/s is bytes per microsecond */
+    uint64_t done;
+    if (s->m.seek_us) {
+        uint64_t start = now > s->busy_until ? now : s->busy_until;
+        done = start + seek + xfer;
+    } else {
+        uint64_t start = now + s->m.lat_us;
+        if (start < s->busy_until) start = s->busy_until;
+        done = start + xfer;
+    }
+    if (s->m.seek_us || xfer) s->busy_until = done;
+    s->head = off + len;
+    s->ios++;
+    s->delay_us += done - now;
+    pthread_mutex_unlock(&s->lock);
+    return done;
+}
+
+static void slow_end(SlowDev *s, uint64_t done) {
+    sleep_until(done);
+    pthread_mutex_lock(&s->lock);
+    s->in_flight--;
+    pthread_cond_signal(&s->slot_free);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int slow_read(ImageDev *dev, uint64_t off, void *buf, uint32_t len) {
+    SlowDev *s = dev->priv;
+    uint64_t done = slow_begin(s, dev->size, off, len);
+    int rc = s->inner->read(s->inner, off, buf, len);
+    slow_end(s, done);
+    return rc;
+}
+
+static int slow_write(ImageDev *dev, uint64_t off, const void *buf, uint32_t len) {
+    SlowDev *s = dev->priv;
+    uint64_t done = slow_begin(s, dev->size, off, len);
+    int rc = s->inner->write(s->inner, off, buf, len);
+    dev->size = s->inner->size;
+    slow_end(s, done);
+    return rc;
+}
+
+/* A device-side copy still reads and writes every byte once. */
+static int slow_copy(ImageDev *dev, uint64_t src, uint64_t dst, uint64_t len) {
+    SlowDev *s = dev->priv;
+    slow_end(s, slow_begin(s, dev->size, src, len));
+    uint64_t done = slow_begin(s, dev->size, dst, len);
+    int rc = s->inner->copy(s->inner, src, dst, len);
+    slow_end(s, done);
+    return rc;
+}
+
+static int slow_sync(ImageDev *dev) {
+    SlowDev *s = dev->priv;
+    return s->inner->sync(s->inner);
+}
+
+static void slow_close(ImageDev *dev) {
+    SlowDev *s = dev->priv;
+    s->inner->close(s->inner);
+    pthread_cond_destroy(&s->slot_free);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+    free(dev);
+}
+
+ImageDev *image_open_latency(ImageDev *inner, const LatencyModel *m) {
+    ImageDev *dev = calloc(1, sizeof(ImageDev));
+    SlowDev *s = calloc(1, sizeof(SlowDev));
+    if (!dev || !s) {
+        free(dev); free(s);
+        return NULL;
+    }
+    s->inner = inner;
+    s->m = *m;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->slot_free, NULL);
+    dev->kind = "latency";
+    dev->size = inner->size;
+    dev->writable = inner->writable;
+    dev->read = slow_read;
+    dev->write = slow_write;
+    dev->copy = inner->copy ? slow_copy : NULL;
+    dev->sync = slow_sync;
+    dev->close = slow_close;
+    dev->priv = s;
+    return dev;
+}
+
+/* The wrapped backend, for the calls that only apply to one kind; other devices come back as they are. */
+ImageDev *image_latency_inner(ImageDev *dev) {
+    if (!dev || strcmp(dev->kind, "latency") != 0) return dev;
+    return ((SlowDev*)dev->priv)->inner;
+}
+
+int image_latency_stat(ImageDev *dev, LatencyModel *m, uint64_t *ios, uint64_t *seeks, uint64_t *delay_us) {
+    if (!dev || strcmp(dev->kind, "latency") != 0) return -1;
+    SlowDev *s = dev->priv;
+    pthread_mutex_lock(&s->lock);
+    *m = s->m;
+    *ios = s->ios;
+    *seeks = s->seeks;
+    *delay_us = s->delay_us;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+/*
+ * Parses "hdd", "ssd" or a list such as "lat=100,bw=200,qd=4"; settings after
+ * a preset override it. lat and seek are in microseconds, bw in MB/s.
+ */
+int image_latency_parse(const char *spec, LatencyModel *out) {
+    char buf[256];
+    if (snprintf(buf, sizeof(buf), "%s", spec) >= (int)sizeof(buf)) return -1;
+    memset(out, 0, sizeof(*out));
+    char *save = NULL;
+    for (char *item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        if (strcmp(item, "hdd") == 0) {
+            *out = (LatencyModel){4000, 15000, 150, 1};
+            continue;
+        }
+        if (strcmp(item, "ssd") == 0) {
+            *out = (LatencyModel){80, 0, 500, 32};
+            continue;
+        }
+        char *eq = strchr(item, '='), *end;
+        if (!eq) return -1;
+        *eq = '\0';
+        unsigned long v = strtoul(eq + 1, &end, 10);
+        if (*end || eq[1] == '\0' || v > UINT32_MAX) return -1;
+        if (strcmp(item, "lat") == 0) out->lat_us = (uint32_t)v;
+        else if (strcmp(item, "seek") == 0) out->seek_us = (uint32_t)v;
+        else if (strcmp(item, "bw") == 0) out->bw_mbps = (uint32_t)v;
+        else if (strcmp(item, "qd") == 0) out->qd = (uint32_t)v;
+        else return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include <string.h>
+#include "lz.h"
+
+/*
+ * Small byte-oriented LZ77 codec for container chunks. A block is a series
+ * of sequences: a token (literal count in the high nibble, match length - 4
+ * in the low nibble, 15 meaning "more length bytes follow"), the literals,
+ * then a 16-bit offset and any extra match length. The last sequence has
+ * literals only.
+ */
+
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS  14
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t hash32(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static int put_length(uint8_t *out, uint32_t *op, uint32_t cap, uint32_t len) {
+    while (len >= 255) {
+        if (*op >= cap) return -1;
+        out[(*op)++] = 255;
+        len -= 255;
+    }
+    if (*op >= cap) return -1;
+    out[(*op)++] = (uint8_t)len;
+    return 0;
+}
+
+static int emit(uint8_t *out, uint32_t *op, uint32_t cap, const uint8_t *lit, uint32_t nlit, uint32_t offset, uint32_t mlen) {
+    uint32_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    if (*op >= cap) return -1;
+    out[(*op)++] = (uint8_t)(((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15));
+    if (nlit >= 15 && put_length(out, op, cap, nlit - 15) != 0) return -1;
+    if (*op + nlit > cap) return -1;
+    memcpy(out + *op, lit, nlit);
+    *op += nlit;
+    if (mlen == 0) return 0;
+    if (*op + 2 > cap) return -1;
+    out[(*op)++] = (uint8_t)(offset & 0xFF);
+    out[(*op)++] = (uint8_t)(offset >> 8);
+    if (ml >= 15 && put_length(out, op, cap, ml - 15) != 0) return -1;
+    return 0;
+}
+
+/* Returns the compressed size, or -1 if the output does not fit in out_cap. */
+int lz_compress(const uint8_t *in, uint32_t in_len, uint8_t *out, uint32_t out_cap) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    uint32_t ip = 0, anchor = 0, op = 0;
+    memset(table, 0, sizeof(table));
+
+    while (ip + LZ_MIN_MATCH <= in_len) {
+        uint32_t seq = read32(in + ip);
+        uint32_t h = hash32(seq);
+        uint32_t ref = table[h];
+        table[h] = ip + 1;
+        if (ref && ip - (ref - 1) <= LZ_MAX_OFFSET && read32(in + ref - 1) == seq) {
+            ref--;
+            uint32_t mlen = LZ_MIN_MATCH;
+            while (ip + mlen < in_len && in[ref + mlen] == in[ip + mlen]) mlen++;
+            if (emit(out, &op, out_cap, in + anchor, ip - anchor, ip - ref, mlen) != 0) return -1;
+            ip += mlen;
+            anchor = ip;
+        } else {
+            ip++;
+        }
+    }
+    if (emit(out, &op, out_cap, in + anchor, in_len - anchor, 0, 0) != 0) return -1;
+    return (int)op;
+}
+
+static int get_length(const uint8_t *in, uint32_t *ip, uint32_t in_len, uint32_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= in_len) return -1;
+        b = in[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* Returns 0 when exactly out_len bytes were produced. */
+int lz_decompress(const uint8_t *in, uint32_t in_len, uint8_t *out, uint32_t out_len) {
+    uint32_t ip = 0, op = 0;
+    while (ip < in_len) {
+        uint8_t token = in[ip++];
+        uint32_t nlit = token >> 4;
+        if (nlit == 15 && get_length(in, &ip, in_len, &nlit) != 0) return -1;
+        if (ip + nlit > in_len || op + nlit > out_len) return -1;
+        memcpy(out + op, in + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip >= in_len) break;
+
+        if (ip + 2 > in_len) return -1;
+        uint32_t offset = in[ip] | ((uint32_t)in[ip+1] << 8);
+        ip += 2;
+        uint32_t mlen = token & 0x0F;
+        if (mlen == 15 && get_length(in, &ip, in_len, &mlen) != 0) return -1;
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op + mlen > out_len) return -1;
+        for (uint32_t i = 0; i < mlen; i++, op++) out[op] = out[op - offset];
+    }
+    return op == out_len ? 0 : -1;
+}
@@ -4,23 +4,111 @@
 #include "fs.h"
 #include "commands.h"
 #include "utils.h"
+#include "alloc.h"
+#include "trace.h"
+#include "aio.h"
+#include "delta.h"
 
 char current_path[512];
 
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--overlay DELTA] [--direct] [--queue-depth N] [--alloc first-fit|next-fit|best-fit|affinity] [--auto-compact PCT] [--slow-dev MODEL] [--trace OUT] [FAT32 IMAGE]\n"
+                    "       %s --export-tar PATH [--overlay DELTA] [FAT32 IMAGE]\n"
+                    "       %s --replay TRACE [--paced] [FAT32 IMAGE]\n"
+                    "       %s --apply DELTA [FAT32 IMAGE]\n", prog, prog, prog, prog);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s [FAT32 IMAGE]\n", argv[0]);
+    MountOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    const char *image = NULL;
+    const char *trace_out = NULL, *replay = NULL, *apply = NULL, *export_tar = NULL;
+    bool paced = false;
+    LatencyModel slow;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--overlay") == 0 && i + 1 < argc) {
+            opts.overlay_path = argv[++i];
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            opts.direct_io = true;
+        } else if (strcmp(argv[i], "--queue-depth") == 0 && i + 1 < argc) {
+            char *end;
+            unsigned long d = strtoul(argv[++i], &end, 10);
+            if (*end || d == 0 || d > AIO_MAX_DEPTH) {
+                usage(argv[0]);
+                return 1;
+            }
+            opts.io_depth = (uint32_t)d;
+        } else if (strcmp(argv[i], "--alloc") == 0 && i + 1 < argc) {
+            int p = alloc_policy_parse(argv[++i]);
+            if (p < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            opts.alloc_policy = (AllocPolicy)p;
+        } else if (strcmp(argv[i], "--auto-compact") == 0 && i + 1 < argc) {
+            char *end;
+            unsigned long p = strtoul(argv[++i], &end, 10);
+            if (*end || p > 100) {
+                usage(argv[0]);
+                return 1;
+            }
+            opts.compact_pct = (uint8_t)p;
+        } else if (strcmp(argv[i], "--slow-dev") == 0 && i + 1 < argc) {
+            if (image_latency_parse(argv[++i], &slow) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            opts.latency = &slow;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_out = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay = argv[++i];
+        } else if (strcmp(argv[i], "--apply") == 0 && i + 1 < argc) {
+            apply = argv[++i];
+        } else if (strcmp(argv[i], "--export-tar") == 0 && i + 1 < argc) {
+            export_tar = argv[++i];
+        } else if (strcmp(argv[i], "--paced") == 0) {
+            paced = true;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            image = argv[i];
+        }
+    }
+    if (!image) {
+        usage(argv[0]);
         return 1;
     }
 
-    if (fs_mount(argv[1]) != 0) {
+    if (apply) return delta_apply(apply, image) == 0 ? 0 : 1;
+
+    if (replay) {
+        strcpy(current_path, "/");
+        return trace_replay(replay, image, paced, &opts) == 0 ? 0 : 1;
+    }
+
+    if (fs_mount(image, &opts) != 0) {
         fprintf(stderr, "Error: failed to mount image.\n");
         return 1;
     }
 
     strcpy(current_path, "/"); 
 
+    /* The archive goes to stdout, so no shell prompt may share it. */
+    if (export_tar) {
+        int rc = fs_export_tar(export_tar, NULL);
+        fs_unmount();
+        return rc == 0 ? 0 : 1;
+    }
+
+    if (trace_out && trace_start(trace_out) != 0) {
+        fs_unmount();
+        return 1;
+    }
     run_shell();
+    trace_stop();
     fs_unmount();
     return 0;
 }
@@ -0,0 +1,387 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include "image.h"
+#include "fat32.h"
+
+/*
+ * Copy-on-write overlay: the base image is opened read-only and every write
+ * lands in a sparse delta file. The delta is split into units of one cluster;
+ * a bitmap records which units have been copied up. Unit N lives at
+ * data_offset + N*unit_size in the delta, so untouched units cost no space.
+ *
+ * The header holds a CRC32C of the base's metadata (reserved sectors and
+ * FATs), so a delta is only opened over the base it was made from. The
+ * bitmap is written at sync and close, and also as a
+ * checkpoint every few seconds while writes go on, after the data it covers
+ * has been flushed; a crash loses only the units copied up since then.
+ */
+
+#define DELTA_MAGIC   "F32DELTA"
+#define DELTA_VERSION 2             /* 1: no base fingerprint */
+#define CHECKPOINT_SEC 5
+
+#pragma pack(push,1)
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t unit_size;
+    uint64_t base_size;
+    uint64_t unit_count;
+    uint64_t data_offset;
+    uint32_t base_crc;          /* image_meta_crc of the base */
+    uint8_t  committing;        /* a commit started and has not finished */
+    uint8_t  reserved[19];
+} DeltaHeader;
+#pragma pack(pop)
+
+typedef struct {
+    ImageDev *base;
+    char base_path[512];
+    int delta_fd;
+    uint32_t unit;
+    uint64_t units;
+    uint64_t data_off;
+    uint8_t *bitmap;
+    uint64_t used;
+    uint32_t base_crc;
+    bool committing;
+    bool index_dirty;
+    time_t saved_at;            /* monotonic seconds of the last index write */
+    pthread_mutex_t lock;
+} OverlayDev;
+
+static bool unit_present(OverlayDev *o, uint64_t u) {
+    return (o->bitmap[u>>3] >> (u&7)) & 1;
+}
+
+static void unit_mark(OverlayDev *o, uint64_t u) {
+    o->bitmap[u>>3] |= (uint8_t)(1u << (u&7));
+    o->used++;
+    o->index_dirty = true;
+}
+
+static uint64_t bitmap_bytes(OverlayDev *o) {
+    return (o->units + 7) / 8;
+}
+
+static time_t now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static int overlay_save_index(OverlayDev *o) {
+    DeltaHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DELTA_MAGIC, 8);
+    h.version = DELTA_VERSION;
+    h.unit_size = o->unit;
+    h.base_size = o->base->size;
+    h.unit_count = o->units;
+    h.data_offset = o->data_off;
+    h.base_crc = o->base_crc;
+    h.committing = o->committing;
+    if (image_pwrite(o->delta_fd, &h, sizeof(h), 0) != 0) return -1;
+    if (image_pwrite(o->delta_fd, o->bitmap, (uint32_t)bitmap_bytes(o), sizeof(h)) != 0) return -1;
+    o->index_dirty = false;
+    o->saved_at = now_sec();
+    return 0;
+}
+
+/* Units are only marked in the saved bitmap once their data is on disk. */
+static int overlay_checkpoint(OverlayDev *o) {
+    if (fdatasync(o->delta_fd) != 0) return -1;
+    return overlay_save_index(o);
+}
+
+/* Length of the run starting at off whose units all share one presence state. */
+static uint32_t run_length(OverlayDev *o, uint64_t off, uint32_t len, bool *present) {
+    uint64_t u = off / o->unit;
+    *present = unit_present(o, u);
+    uint64_t end = (u + 1) * o->unit;
+    while (end < off + len && unit_present(o, end / o->unit) == *present) end += o->unit;
+    uint64_t n = end - off;
+    return n < len ? (uint32_t)n : len;
+}
+
+static int overlay_read_locked(ImageDev *dev, uint64_t off, void *buf, uint32_t len) {
+    OverlayDev *o = dev->priv;
+    if (off + len > dev->size) return -1;
+    uint8_t *p = buf;
+    while (len > 0) {
+        bool present;
+        uint32_t n = run_length(o, off, len, &present);
+        if (present) {
+            if (image_pread(o->delta_fd, p, n, o->data_off + off) != 0) return -1;
+        } else {
+            if (o->base->read(o->base, off, p, n) != 0) return -1;
+        }
+        p += n; off += n; len -= n;
+    }
+    return 0;
+}
+
+static int overlay_copy_up(OverlayDev *o, uint64_t u, uint8_t *scratch) {
+    uint64_t start = u * o->unit;
+    uint32_t n = o->unit;
+    if (start + n > o->base->size) n = (uint32_t)(o->base->size - start);
+    if (o->base->read(o->base, start, scratch, n) != 0) return -1;
+    if (image_pwrite(o->delta_fd, scratch, n, o->data_off + start) != 0) return -1;
+    unit_mark(o, u);
+    return 0;
+}
+
+static int overlay_read(ImageDev *dev, uint64_t off, void *buf, uint32_t len) {
+    OverlayDev *o = dev->priv;
+    pthread_mutex_lock(&o->lock);
+    int rc = overlay_read_locked(dev, off, buf, len);
+    pthread_mutex_unlock(&o->lock);
+    return rc;
+}
+
+static int overlay_write_locked(ImageDev *dev, uint64_t off, const void *buf, uint32_t len) {
+    OverlayDev *o = dev->priv;
+    if (off + len > dev->size) return -1;
+
+    uint64_t first = off / o->unit;
+    uint64_t last = (off + len - 1) / o->unit;
+    uint8_t *scratch = NULL;
+    for (uint64_t u = first; u <= last; u++) {
+        if (unit_present(o, u)) continue;
+        uint64_t ustart = u * o->unit;
+        /* A unit fully covered by this write needs no copy-up. */
+        if (ustart >= off && ustart + o->unit <= off + len) {
+            unit_mark(o, u);
+            continue;
+        }
+        if (!scratch && !(scratch = malloc(o->unit))) return -1;
+        if (overlay_copy_up(o, u, scratch) != 0) {
+            free(scratch);
+            return -1;
+        }
+    }
+    free(scratch);
+    return image_pwrite(o->delta_fd, buf, len, o->data_off + off);
+}
+
+static int overlay_write(ImageDev *dev, uint64_t off, const void *buf, uint32_t len) {
+    OverlayDev *o = dev->priv;
+    pthread_mutex_lock(&o->lock);
+    int rc = overlay_write_locked(dev, off, buf, len);
+    if (rc == 0 && o->index_dirty && now_sec() - o->saved_at >= CHECKPOINT_SEC) rc = overlay_checkpoint(o);
+    pthread_mutex_unlock(&o->lock);
+    return rc;
+}
+
+static int overlay_sync(ImageDev *dev) {
+    OverlayDev *o = dev->priv;
+    pthread_mutex_lock(&o->lock);
+    int rc = 0;
+    if (o->index_dirty && overlay_checkpoint(o) != 0) rc = -1;
+    else if (fdatasync(o->delta_fd) != 0) rc = -1;
+    pthread_mutex_unlock(&o->lock);
+    return rc;
+}
+
+static void overlay_close(ImageDev *dev) {
+    OverlayDev *o = dev->priv;
+    if (o->index_dirty) overlay_checkpoint(o);
+    close(o->delta_fd);
+    o->base->close(o->base);
+    pthread_mutex_destroy(&o->lock);
+    free(o->bitmap);
+    free(o);
+    free(dev);
+}
+
+static uint32_t probe_cluster_size(ImageDev *base) {
+    FAT32BootSector bs;
+    if (base->read(base, 0, &bs, sizeof(bs)) != 0) return 4096;
+    uint32_t unit = (uint32_t)bs.BPB_BytsPerSec * bs.BPB_SecPerClus;
+    if (unit < 512 || unit > (1u << 20) || (unit & (unit - 1))) return 4096;
+    return unit;
+}
+
+static int overlay_load_index(OverlayDev *o) {
+    DeltaHeader h;
+    if (image_pread(o->delta_fd, &h, sizeof(h), 0) != 0) return -1;
+    if (memcmp(h.magic, DELTA_MAGIC, 8) != 0 || (h.version != DELTA_VERSION && h.version != 1)) {
+        fprintf(stderr, "Error: not an overlay delta file.\n");
+        return -1;
+    }
+    if (image_meta_crc(o->base, &o->base_crc) != 0) return -1;
+    /* Version 1 deltas carry no fingerprint; they get one at their next index write. A
+     * commit cut short has already changed the base, and is finished at open instead. */
+    o->committing = h.version == DELTA_VERSION && h.committing;
+    if (h.base_size != o->base->size || (h.version == DELTA_VERSION && !o->committing && h.base_crc != o->base_crc)) {
+        fprintf(stderr, "Error: delta was created for a different base image.\n");
+        return -1;
+    }
+    o->unit = h.unit_size;
+    o->units = h.unit_count;
+    o->data_off = h.data_offset;
+    o->bitmap = calloc(1, bitmap_bytes(o));
+    if (!o->bitmap) return -1;
+    if (image_pread(o->delta_fd, o->bitmap, (uint32_t)bitmap_bytes(o), sizeof(h)) != 0) return -1;
+    for (uint64_t i = 0; i < bitmap_bytes(o); i++) o->used += __builtin_popcount(o->bitmap[i]);
+    o->saved_at = now_sec();
+    return 0;
+}
+
+static int overlay_init_index(OverlayDev *o) {
+    o->unit = probe_cluster_size(o->base);
+    o->units = (o->base->size + o->unit - 1) / o->unit;
+    uint64_t meta = sizeof(DeltaHeader) + bitmap_bytes(o);
+    o->data_off = (meta + o->unit - 1) / o->unit * o->unit;
+    o->bitmap = calloc(1, bitmap_bytes(o));
+    if (!o->bitmap) return -1;
+    if (image_meta_crc(o->base, &o->base_crc) != 0) return -1;
+    return overlay_save_index(o);
+}
+
+ImageDev *image_open_overlay(const char *base_path, const char *delta_path) {
+    ImageDev *base = image_open(base_path, false);
+    if (!base) return NULL;
+
+    OverlayDev *o = calloc(1, sizeof(OverlayDev));
+    ImageDev *dev = calloc(1, sizeof(ImageDev));
+    if (!o || !dev) goto fail;
+    o->base = base;
+    strncpy(o->base_path, base_path, sizeof(o->base_path)-1);
+
+    o->delta_fd = open(delta_path, O_RDWR | O_CREAT, 0644);
+    if (o->delta_fd < 0) {
+        perror("open delta");
+        goto fail;
+    }
+    struct stat st;
+    if (fstat(o->delta_fd, &st) != 0) goto fail_fd;
+    if (st.st_size == 0) {
+        if (overlay_init_index(o) != 0) goto fail_fd;
+    } else {
+        if (overlay_load_index(o) != 0) goto fail_fd;
+    }
+
+    pthread_mutex_init(&o->lock, NULL);
+    dev->kind = "overlay";
+    dev->size = base->size;
+    dev->writable = true;
+    dev->read = overlay_read;
+    dev->write = overlay_write;
+    dev->sync = overlay_sync;
+    dev->close = overlay_close;
+    dev->priv = o;
+    if (o->committing) {
+        fprintf(stderr, "Finishing an interrupted overlay commit.\n");
+        if (image_overlay_commit(dev) != 0) {
+            fprintf(stderr, "Error: overlay commit failed; the base is only partly updated.\n");
+            overlay_close(dev);
+            return NULL;
+        }
+    }
+    return dev;
+
+fail_fd:
+    close(o->delta_fd);
+fail:
+    if (o) free(o->bitmap);
+    free(o);
+    free(dev);
+    base->close(base);
+    return NULL;
+}
+
+static int overlay_discard_locked(OverlayDev *o) {
+    memset(o->bitmap, 0, bitmap_bytes(o));
+    o->used = 0;
+    if (ftruncate(o->delta_fd, (off_t)o->data_off) != 0) return -1;
+    /* After a commit the base has changed under the delta. */
+    if (image_meta_crc(o->base, &o->base_crc) != 0) return -1;
+    return overlay_save_index(o);
+}
+
+int image_overlay_discard(ImageDev *dev) {
+    if (!dev || strcmp(dev->kind, "overlay") != 0) return -1;
+    OverlayDev *o = dev->priv;
+    pthread_mutex_lock(&o->lock);
+    int rc = overlay_discard_locked(o);
+    pthread_mutex_unlock(&o->lock);
+    return rc;
+}
+
+/* Byte offset of the data region, from the base's boot sector. */
+static uint64_t data_start(OverlayDev *o) {
+    FAT32BootSector bs;
+    if (o->base->read(o->base, 0, &bs, sizeof(bs)) != 0) return o->base->size;
+    return ((uint64_t)bs.BPB_RsvdSecCnt + (uint64_t)bs.BPB_NumFATs * bs.BPB_FATSz32) * bs.BPB_BytsPerSec;
+}
+
+/* Copies the present units on one side of meta_end into the base. */
+static int commit_units(OverlayDev *o, ImageDev *target, uint64_t meta_end, bool meta, uint8_t *buf) {
+    for (uint64_t u = 0; u < o->units; u++) {
+        if (!unit_present(o, u)) continue;
+        uint64_t start = u * o->unit;
+        if ((start < meta_end) != meta) continue;
+        uint32_t n = o->unit;
+        if (start + n > o->base->size) n = (uint32_t)(o->base->size - start);
+        if (image_pread(o->delta_fd, buf, n, o->data_off + start) != 0) return -1;
+        if (target->write(target, start, buf, n) != 0) return -1;
+    }
+    return target->sync(target);
+}
+
+/*
+ * Data units go first and the reserved sectors and FATs last, each followed
+ * by a sync, so the base never points at clusters that still hold old data.
+ * The delta is marked as committing before the first write; if the commit is
+ * cut short, the next open skips the fingerprint check and runs it again.
+ */
+int image_overlay_commit(ImageDev *dev) {
+    if (!dev || strcmp(dev->kind, "overlay") != 0) return -1;
+    OverlayDev *o = dev->priv;
+    uint8_t *buf = malloc(o->unit);
+    if (!buf) return -1;
+    pthread_mutex_lock(&o->lock);
+    uint64_t meta_end = data_start(o);
+    o->committing = true;
+    int rc = overlay_checkpoint(o);
+    if (rc == 0) rc = fdatasync(o->delta_fd);
+    ImageDev *target = rc == 0 ? image_open(o->base_path, true) : NULL;
+    if (!target) rc = -1;
+    if (rc == 0) rc = commit_units(o, target, meta_end, false, buf);
+    if (rc == 0) rc = commit_units(o, target, meta_end, true, buf);
+    if (target) target->close(target);
+    free(buf);
+    /* The open base still has the old contents cached (a container keeps its old index). */
+    if (rc == 0) {
+        ImageDev *base = image_open(o->base_path, false);
+        if (!base) {
+            rc = -1;
+        } else {
+            o->base->close(o->base);
+            o->base = base;
+        }
+    }
+    if (rc == 0) {
+        o->committing = false;
+        rc = overlay_discard_locked(o);
+    }
+    pthread_mutex_unlock(&o->lock);
+    return rc;
+}
+
+int image_overlay_stat(ImageDev *dev, uint64_t *used_units, uint64_t *total_units, uint32_t *unit_size) {
+    if (!dev || strcmp(dev->kind, "overlay") != 0) return -1;
+    OverlayDev *o = dev->priv;
+    *used_units = o->used;
+    *total_units = o->units;
+    *unit_size = o->unit;
+    return 0;
+}
@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fs.h"
+#include "utils.h"
+
+/*
+ * pack / unpack: export the mounted image as a compressed container or as a
+ * sparse raw image. Both only read the ranges fs_for_each_used_range()
+ * reports, so free clusters are neither read nor stored.
+ */
+
+#define UNPACK_BUF_BYTES (1024*1024)
+
+typedef struct {
+    ContainerWriter *w;
+    uint8_t *chunk;
+    uint32_t chunk_size;
+    uint64_t cur;
+    bool have;
+} PackState;
+
+static int pack_emit(PackState *st) {
+    if (!st->have) return 0;
+    int rc = container_put_chunk(st->w, st->cur, st->chunk);
+    st->have = false;
+    return rc;
+}
+
+static int pack_range(uint64_t off, uint64_t len, void *ctx) {
+    PackState *st = ctx;
+    while (len > 0) {
+        uint64_t idx = off / st->chunk_size;
+        if (!st->have || idx != st->cur) {
+            if (pack_emit(st) != 0) return -1;
+            memset(st->chunk, 0, st->chunk_size);
+            st->cur = idx;
+            st->have = true;
+        }
+        uint32_t in = (uint32_t)(off % st->chunk_size);
+        uint32_t n = st->chunk_size - in;
+        if (n > len) n = (uint32_t)len;
+        if (fsinfo.dev->read(fsinfo.dev, off, st->chunk + in, n) != 0) return -1;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int fs_pack(const char *out_path) {
+    fs_sync();
+    PackState st;
+    memset(&st, 0, sizeof(st));
+    st.chunk_size = CONTAINER_CHUNK_BYTES;
+    st.chunk = malloc(st.chunk_size);
+    st.w = st.chunk ? container_create(out_path, fsinfo.image_size_bytes, st.chunk_size) : NULL;
+    if (!st.w) {
+        free(st.chunk);
+        print_error("Cannot create container.");
+        return -1;
+    }
+
+    int rc = fs_for_each_used_range(pack_range, &st);
+    if (rc == 0) rc = pack_emit(&st);
+    uint64_t stored, zero;
+    container_stat(st.w, &stored, &zero);
+    if (container_finish(st.w) != 0) rc = -1;
+    free(st.chunk);
+    if (rc != 0) {
+        print_error("Pack failed.");
+        return -1;
+    }
+    printf("packed %llu bytes into %llu bytes (%llu empty chunks)\n",
+           (unsigned long long)fsinfo.image_size_bytes, (unsigned long long)stored, (unsigned long long)zero);
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    uint8_t *buf;
+} UnpackState;
+
+static int unpack_range(uint64_t off, uint64_t len, void *ctx) {
+    UnpackState *st = ctx;
+    while (len > 0) {
+        uint32_t n = len > UNPACK_BUF_BYTES ? UNPACK_BUF_BYTES : (uint32_t)len;
+        if (fsinfo.dev->read(fsinfo.dev, off, st->buf, n) != 0) return -1;
+        if (image_pwrite(st->fd, st->buf, n, off) != 0) return -1;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int fs_unpack(const char *out_path) {
+    fs_sync();
+    UnpackState st;
+    st.buf = malloc(UNPACK_BUF_BYTES);
+    st.fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (st.fd < 0 || !st.buf) {
+        if (st.fd >= 0) close(st.fd);
+        free(st.buf);
+        print_error("Cannot create output image.");
+        return -1;
+    }
+
+    /* Free clusters stay holes in the output file. */
+    int rc = ftruncate(st.fd, (off_t)fsinfo.image_size_bytes);
+    if (rc == 0) rc = fs_for_each_used_range(unpack_range, &st);
+    if (rc == 0 && fdatasync(st.fd) != 0) rc = -1;
+    close(st.fd);
+    free(st.buf);
+    if (rc != 0) {
+        print_error("Unpack failed.");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <string.h>
+#include "fs.h"
+#include "path.h"
+#include "utils.h"
+
+/*
+ * Path resolution. Commands take absolute or relative paths with any number
+ * of components; every component but the last must be a directory. Those
+ * steps go through a dentry cache keyed by (parent cluster, name) that maps
+ * to the child directory's first cluster and also records each directory's
+ * parent, so `..` does not need a scan either. A deep path that has been
+ * walked before costs one table probe per component.
+ *
+ * Both tables are set-associative with a fixed size; a full set evicts its
+ * least recently used way. Only directories are cached. Entries go away when
+ * a directory is renamed or moved (forget) and when directories are removed
+ * (clear), since their clusters can come back as new directories.
+ */
+
+#define DCACHE_SETS 1024
+#define DCACHE_WAYS 4
+
+typedef struct {
+    uint32_t parent;
+    uint32_t child;             /* 0: empty */
+    uint32_t used;
+    char name[MAX_NAME_LEN + 1];
+} Dentry;
+
+typedef struct {
+    uint32_t dir;               /* 0: empty */
+    uint32_t parent;
+    uint32_t used;
+} ParentLink;
+
+static Dentry dentries[DCACHE_SETS][DCACHE_WAYS];
+static ParentLink parents[DCACHE_SETS][DCACHE_WAYS];
+static uint32_t tick;
+static uint64_t hits, misses;
+
+static uint32_t name_hash(uint32_t parent, const char *name) {
+    uint32_t h = 2166136261u ^ (parent * 2654435761u);
+    while (*name) h = (h ^ (uint8_t)*name++) * 16777619u;
+    return h % DCACHE_SETS;
+}
+
+static uint32_t dir_hash(uint32_t dir) {
+    return (dir * 2654435761u) % DCACHE_SETS;
+}
+
+static void note_parent(uint32_t dir, uint32_t parent) {
+    ParentLink *set = parents[dir_hash(dir)], *victim = NULL;
+    for (int w = 0; w < DCACHE_WAYS && !victim; w++) {
+        if (set[w].dir == dir) victim = &set[w];
+    }
+    for (int w = 0; w < DCACHE_WAYS && !victim; w++) {
+        if (set[w].dir == 0) victim = &set[w];
+    }
+    if (!victim) {
+        victim = &set[0];
+        for (int w = 1; w < DCACHE_WAYS; w++) if (set[w].used < victim->used) victim = &set[w];
+    }
+    victim->dir = dir;
+    victim->parent = parent;
+    victim->used = ++tick;
+}
+
+static void note_child(uint32_t parent, const char *name, uint32_t child) {
+    Dentry *set = dentries[name_hash(parent, name)], *victim = NULL;
+    for (int w = 0; w < DCACHE_WAYS && !victim; w++) {
+        if (set[w].child && set[w].parent == parent && strcmp(set[w].name, name) == 0) victim = &set[w];
+    }
+    for (int w = 0; w < DCACHE_WAYS && !victim; w++) {
+        if (set[w].child == 0) victim = &set[w];
+    }
+    if (!victim) {
+        victim = &set[0];
+        for (int w = 1; w < DCACHE_WAYS; w++) if (set[w].used < victim->used) victim = &set[w];
+    }
+    victim->parent = parent;
+    victim->child = child;
+    victim->used = ++tick;
+    strcpy(victim->name, name);
+    note_parent(child, parent);
+}
+
+static bool find_child(uint32_t parent, const char *name, uint32_t *child) {
+    Dentry *set = dentries[name_hash(parent, name)];
+    for (int w = 0; w < DCACHE_WAYS; w++) {
+        if (set[w].child && set[w].parent == parent && strcmp(set[w].name, name) == 0) {
+            set[w].used = ++tick;
+            *child = set[w].child;
+            return true;
+        }
+    }
+    return false;
+}
+
+void dcache_clear(void) {
+    memset(dentries, 0, sizeof(dentries));
+    memset(parents, 0, sizeof(parents));
+    tick = 0;
+}
+
+void dcache_forget(uint32_t parent, const char *name) {
+    char key[MAX_NAME_LEN + 1];
+    if (strlen(name) > MAX_NAME_LEN) return;
+    strcpy(key, name);
+    to_upper(key);
+    Dentry *set = dentries[name_hash(parent, key)];
+    for (int w = 0; w < DCACHE_WAYS; w++) {
+        if (set[w].child && set[w].parent == parent && strcmp(set[w].name, key) == 0) set[w].child = 0;
+    }
+}
+
+/* Records a directory's new place after a move. */
+void dcache_note(uint32_t parent, const char *name, uint32_t child) {
+    char key[MAX_NAME_LEN + 1];
+    if (strlen(name) > MAX_NAME_LEN) return;
+    strcpy(key, name);
+    to_upper(key);
+    note_child(parent, key, child);
+}
+
+void dcache_stat(uint64_t *out_hits, uint64_t *out_misses, uint32_t *entries) {
+    uint32_t n = 0;
+    for (int s = 0; s < DCACHE_SETS; s++) {
+        for (int w = 0; w < DCACHE_WAYS; w++) if (dentries[s][w].child) n++;
+    }
+    *out_hits = hits;
+    *out_misses = misses;
+    *entries = n;
+}
+
+int path_parent_of(uint32_t dir, uint32_t *out) {
+    if (dir == fsinfo.root_cluster) {
+        *out = dir;
+        return 0;
+    }
+    ParentLink *set = parents[dir_hash(dir)];
+    for (int w = 0; w < DCACHE_WAYS; w++) {
+        if (set[w].dir == dir) {
+            set[w].used = ++tick;
+            hits++;
+            *out = set[w].parent;
+            return 0;
+        }
+    }
+    misses++;
+    DirEntry e; uint32_t s, o;
+    if (fs_find_entry_in_dir(dir, "..", &e, &s, &o) != 0) return -1;
+    uint32_t p = ((uint32_t)e.DIR_FstClusHI << 16) | e.DIR_FstClusLO;
+    if (p == 0) p = fsinfo.root_cluster;
+    note_parent(dir, p);
+    *out = p;
+    return 0;
+}
+
+/* One step down (or up) from dir. Returns -1 if the name does not exist, -2 if it is not a directory. */
+static int step(uint32_t dir, const char *name, uint32_t *out) {
+    if (name[0] == '\0' || strcmp(name, ".") == 0) {
+        *out = dir;
+        return 0;
+    }
+    if (strcmp(name, "..") == 0) return path_parent_of(dir, out);
+
+    char key[MAX_NAME_LEN + 1];
+    bool cacheable = strlen(name) <= MAX_NAME_LEN;
+    if (cacheable) {
+        strcpy(key, name);
+        to_upper(key);
+        if (find_child(dir, key, out)) {
+            hits++;
+            return 0;
+        }
+    }
+    misses++;
+    DirEntry e; uint32_t s, o;
+    if (fs_find_entry_in_dir(dir, name, &e, &s, &o) != 0) return -1;
+    if (!(e.DIR_Attr & ATTR_DIRECTORY)) return -2;
+    uint32_t c = ((uint32_t)e.DIR_FstClusHI << 16) | e.DIR_FstClusLO;
+    if (c == 0) c = fsinfo.root_cluster;
+    if (cacheable) note_child(dir, key, c);
+    *out = c;
+    return 0;
+}
+
+/*
+ * Resolves every component of path except the last, which is copied to leaf
+ * ("" for "/"). Trailing slashes are ignored. Returns -1 if a directory on
+ * the way does not exist, -2 if a component is not a directory, -3 if a
+ * component is too long.
+ */
+int path_split(const char *path, uint32_t *dir, char *leaf, size_t cap) {
+    uint32_t d = path[0] == '/' ? fsinfo.root_cluster : fsinfo.cwd_cluster;
+    size_t len = strlen(path);
+    while (len > 1 && path[len-1] == '/') len--;
+
+    const char *p = path;
+    const char *end = path + len;
+    while (p < end && *p == '/') p++;
+    while (1) {
+        const char *slash = memchr(p, '/', (size_t)(end - p));
+        const char *stop = slash ? slash : end;
+        size_t n = (size_t)(stop - p);
+        char comp[PATH_LEAF_MAX];
+        if (n >= cap || n >= sizeof(comp)) return -3;
+        memcpy(comp, p, n);
+        comp[n] = '\0';
+        if (!slash) {
+            strcpy(leaf, comp);
+            break;
+        }
+        int rc = step(d, comp, &d);
+        if (rc != 0) return rc;
+        p = slash + 1;
+        while (p < end && *p == '/') p++;
+    }
+    *dir = d;
+    return 0;
+}
+
+/* Resolves a path that names a directory. Same return codes as path_split(). */
+int path_dir(const char *path, uint32_t *dir) {
+    char leaf[PATH_LEAF_MAX];
+    uint32_t d;
+    int rc = path_split(path, &d, leaf, sizeof(leaf));
+    if (rc == 0) rc = step(d, leaf, dir);
+    return rc;
+}
+
+/* Absolute form of path relative to base, with "." and ".." folded away. */
+int path_normalize(const char *base, const char *path, char *out, size_t cap) {
+    char buf[1024];
+    int n = path[0] == '/' ? snprintf(buf, sizeof(buf), "%s", path) : snprintf(buf, sizeof(buf), "%s/%s", base, path);
+    if (n < 0 || (size_t)n >= sizeof(buf) || cap < 2) return -1;
+
+    size_t len = 0;
+    char *save = NULL;
+    for (char *comp = strtok_r(buf, "/", &save); comp; comp = strtok_r(NULL, "/", &save)) {
+        if (strcmp(comp, ".") == 0) continue;
+        if (strcmp(comp, "..") == 0) {
+            while (len > 0 && out[len-1] != '/') len--;
+            if (len > 0) len--;
+            continue;
+        }
+        size_t k = strlen(comp);
+        if (len + 1 + k >= cap) return -1;
+        out[len++] = '/';
+        memcpy(out + len, comp, k);
+        len += k;
+    }
+    if (len == 0) out[len++] = '/';
+    out[len] = '\0';
+    return 0;
+}
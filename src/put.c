@@ -0,0 +1,529 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "fs.h"
+#include "path.h"
+#include "utils.h"
+
+/*
+ * put / put -r: imports host files into the image. The calling thread walks
+ * the host tree and does all of the metadata. For each directory it allocates
+ * the children's clusters (one contiguous run per file where free space
+ * allows), waits for their data to be written and then writes all of their
+ * entries as one batch, so no entry points at clusters not yet filled. If
+ * anything in the batch fails, its clusters are freed again and no entries
+ * are written. File data goes through a two-stage pipeline. Reader threads fill large buffers from the
+ * host files, and writer threads write each buffer to its run in one request.
+ * A fixed set of buffers bounds memory and keeps the readers from getting far
+ * ahead of the writers.
+ */
+
+#define PUT_CHUNK_BYTES  (1u << 20)
+#define PUT_BUFFERS      16
+#define PUT_READERS_MAX  4
+#define PUT_WRITERS_MAX  4
+
+typedef struct {
+    uint32_t file;              /* index into paths */
+    uint64_t off;
+    uint32_t len;
+    uint32_t sector;
+} PutJob;
+
+typedef struct {
+    PutJob job;
+    uint8_t *buf;
+} PutFilled;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready, buf_free, filled_ready, drained;
+    char **paths;
+    uint32_t npaths, paths_cap;
+    PutJob *jobs;
+    uint32_t njobs, cap, next;
+    bool closed;
+    uint8_t *bufs[PUT_BUFFERS];
+    uint8_t *free_bufs[PUT_BUFFERS];
+    int nfree;
+    PutFilled filled[PUT_BUFFERS];
+    int nfilled;
+    int readers_left;
+    uint32_t pending;           /* jobs queued and not yet written */
+    int rc;
+    int64_t bad_file;           /* first host file that failed to read, -1 if none */
+    pthread_t readers[PUT_READERS_MAX], writers[PUT_WRITERS_MAX];
+    int nreaders, nwriters;
+
+    ClusterList batch;          /* allocated for the current directory's entries */
+    uint32_t goal;              /* allocate the next file after the previous one */
+    uint32_t files, dirs, skipped;
+    uint64_t bytes;
+} PutPipe;
+
+static int read_full(const char *path, uint64_t off, uint8_t *buf, uint32_t len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    uint32_t got = 0;
+    while (got < len) {
+        ssize_t n = pread(fd, buf + got, len - got, (off_t)(off + got));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += (uint32_t)n;
+    }
+    close(fd);
+    return got == len ? 0 : -1;
+}
+
+/* The last sector of a file is padded with zeros rather than stale buffer contents. */
+static uint32_t pad_sectors(uint8_t *buf, uint32_t len) {
+    uint32_t sectors = (len + fsinfo.bytes_per_sector - 1) / fsinfo.bytes_per_sector;
+    memset(buf + len, 0, (size_t)sectors * fsinfo.bytes_per_sector - len);
+    return sectors;
+}
+
+static void *put_reader(void *arg) {
+    PutPipe *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (p->next == p->njobs && !p->closed) pthread_cond_wait(&p->job_ready, &p->lock);
+        if (p->next == p->njobs) break;
+        PutJob job = p->jobs[p->next++];
+        while (p->nfree == 0) pthread_cond_wait(&p->buf_free, &p->lock);
+        uint8_t *buf = p->free_bufs[--p->nfree];
+        const char *path = p->paths[job.file];
+        pthread_mutex_unlock(&p->lock);
+        int rc = read_full(path, job.off, buf, job.len);
+        pthread_mutex_lock(&p->lock);
+        if (rc != 0) {
+            p->rc = -1;
+            if (p->bad_file < 0) p->bad_file = job.file;
+        }
+        p->filled[p->nfilled++] = (PutFilled){job, buf};
+        pthread_cond_signal(&p->filled_ready);
+    }
+    if (--p->readers_left == 0) pthread_cond_broadcast(&p->filled_ready);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void *put_writer(void *arg) {
+    PutPipe *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (p->nfilled == 0 && p->readers_left > 0) pthread_cond_wait(&p->filled_ready, &p->lock);
+        if (p->nfilled == 0) break;
+        PutFilled f = p->filled[--p->nfilled];
+        pthread_mutex_unlock(&p->lock);
+        int rc = write_sectors(f.job.sector, pad_sectors(f.buf, f.job.len), f.buf);
+        pthread_mutex_lock(&p->lock);
+        if (rc != 0) p->rc = -1;
+        p->free_bufs[p->nfree++] = f.buf;
+        pthread_cond_signal(&p->buf_free);
+        if (--p->pending == 0) pthread_cond_broadcast(&p->drained);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static int pipe_start(PutPipe *p) {
+    memset(p, 0, sizeof(*p));
+    p->bad_file = -1;
+    for (int i = 0; i < PUT_BUFFERS; i++) {
+        p->bufs[i] = malloc(PUT_CHUNK_BYTES);
+        if (!p->bufs[i]) {
+            while (i-- > 0) free(p->bufs[i]);
+            return -1;
+        }
+        p->free_bufs[p->nfree++] = p->bufs[i];
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->job_ready, NULL);
+    pthread_cond_init(&p->buf_free, NULL);
+    pthread_cond_init(&p->filled_ready, NULL);
+    pthread_cond_init(&p->drained, NULL);
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    int readers = n < PUT_READERS_MAX ? (int)n : PUT_READERS_MAX;
+    int writers = n < PUT_WRITERS_MAX ? (int)n : PUT_WRITERS_MAX;
+
+    /* Writers wait for readers_left to reach zero, so it counts the planned readers until they exist. */
+    p->readers_left = readers;
+    for (int i = 0; i < writers; i++) {
+        if (pthread_create(&p->writers[p->nwriters], NULL, put_writer, p) == 0) p->nwriters++;
+    }
+    for (int i = 0; p->nwriters > 0 && i < readers; i++) {
+        if (pthread_create(&p->readers[p->nreaders], NULL, put_reader, p) == 0) p->nreaders++;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->readers_left = p->nreaders;
+    if (p->readers_left == 0) pthread_cond_broadcast(&p->filled_ready);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+static int pipe_push(PutPipe *p, uint32_t file, uint64_t off, uint32_t len, uint32_t sector) {
+    if (p->nreaders == 0) {
+        if (read_full(p->paths[file], off, p->bufs[0], len) != 0) {
+            if (p->bad_file < 0) p->bad_file = file;
+            return -1;
+        }
+        return write_sectors(sector, pad_sectors(p->bufs[0], len), p->bufs[0]);
+    }
+    pthread_mutex_lock(&p->lock);
+    if (p->njobs == p->cap) {
+        uint32_t cap = p->cap ? p->cap * 2 : 256;
+        PutJob *jobs = realloc(p->jobs, cap * sizeof(PutJob));
+        if (!jobs) {
+            pthread_mutex_unlock(&p->lock);
+            return -1;
+        }
+        p->jobs = jobs;
+        p->cap = cap;
+    }
+    p->jobs[p->njobs++] = (PutJob){file, off, len, sector};
+    p->pending++;
+    pthread_cond_signal(&p->job_ready);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+/* Waits until every queued chunk is on disk; returns the pipeline's status. */
+static int pipe_drain(PutPipe *p) {
+    pthread_mutex_lock(&p->lock);
+    while (p->pending > 0) pthread_cond_wait(&p->drained, &p->lock);
+    int rc = p->rc;
+    pthread_mutex_unlock(&p->lock);
+    return rc;
+}
+
+/*
+ * Ends one directory's batch: once its data is written, creates the entries.
+ * On any failure, the batch's or an earlier one, the clusters are freed instead.
+ */
+static int batch_end(PutPipe *p, uint32_t dir, const DirEntry *entries, uint32_t n, int rc) {
+    if (pipe_drain(p) != 0) rc = -1;
+    if (rc == 0 && n > 0 && create_dir_entries(dir, entries, n) != 0) {
+        print_error("Failed to create directory entries.");
+        rc = -1;
+    }
+    if (rc != 0 && p->batch.count > 0) fs_free_clusters(p->batch.items, p->batch.count);
+    p->batch.count = 0;
+    return rc;
+}
+
+static int pipe_finish(PutPipe *p) {
+    pthread_mutex_lock(&p->lock);
+    p->closed = true;
+    pthread_cond_broadcast(&p->job_ready);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->nreaders; i++) pthread_join(p->readers[i], NULL);
+    for (int i = 0; i < p->nwriters; i++) pthread_join(p->writers[i], NULL);
+    if (p->bad_file >= 0) {
+        char msg[600];
+        snprintf(msg, sizeof(msg), "Failed to read %s.", p->paths[p->bad_file]);
+        print_error(msg);
+    }
+    int rc = p->rc;
+    for (uint32_t i = 0; i < p->npaths; i++) free(p->paths[i]);
+    for (int i = 0; i < PUT_BUFFERS; i++) free(p->bufs[i]);
+    free(p->paths);
+    free(p->jobs);
+    cluster_list_free(&p->batch);
+    pthread_cond_destroy(&p->job_ready);
+    pthread_cond_destroy(&p->buf_free);
+    pthread_cond_destroy(&p->filled_ready);
+    pthread_cond_destroy(&p->drained);
+    pthread_mutex_destroy(&p->lock);
+    return rc;
+}
+
+static int add_path(PutPipe *p, const char *path, uint32_t *index) {
+    char *copy = strdup(path);
+    if (!copy) return -1;
+    pthread_mutex_lock(&p->lock);
+    if (p->npaths == p->paths_cap) {
+        uint32_t cap = p->paths_cap ? p->paths_cap * 2 : 256;
+        char **paths = realloc(p->paths, cap * sizeof(char*));
+        if (!paths) {
+            pthread_mutex_unlock(&p->lock);
+            free(copy);
+            return -1;
+        }
+        p->paths = paths;
+        p->paths_cap = cap;
+    }
+    *index = p->npaths;
+    p->paths[p->npaths++] = copy;
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+static void fill_entry(DirEntry *e, const char *name, uint8_t attr, uint32_t cluster, uint32_t size) {
+    memset(e, 0, sizeof(*e));
+    format_name_11(name, (char*)e->DIR_Name);
+    e->DIR_Attr = attr;
+    e->DIR_FstClusHI = (uint16_t)(cluster >> 16);
+    e->DIR_FstClusLO = (uint16_t)(cluster & 0xFFFF);
+    e->DIR_FileSize = size;
+    fat_timestamp(&e->DIR_WrtDate, &e->DIR_WrtTime);
+    e->DIR_CrtDate = e->DIR_WrtDate;
+    e->DIR_CrtTime = e->DIR_WrtTime;
+}
+
+/* Allocates a file's clusters and queues its data in chunks that never cross a run. */
+static int put_file(PutPipe *p, const char *host, uint32_t size, const char *name, DirEntry *e) {
+    uint32_t bpc = fs_cluster_bytes();
+    uint32_t n = (uint32_t)(((uint64_t)size + bpc - 1) / bpc);
+    uint32_t first = 0, file = 0;
+    ExtentList ext = {0};
+    int rc = 0;
+    if (n > 0) {
+        if (fs_allocate_extents(n, p->goal, &ext) != 0) {
+            print_error("No space.");
+            return -1;
+        }
+        first = ext.items[0].start;
+        p->goal = ext.items[ext.count - 1].start + ext.items[ext.count - 1].count - 1;
+        for (uint32_t r = 0; rc == 0 && r < ext.count; r++) {
+            for (uint32_t c = 0; rc == 0 && c < ext.items[r].count; c++) rc = cluster_list_push(&p->batch, ext.items[r].start + c);
+        }
+        if (rc == 0) rc = add_path(p, host, &file);
+    }
+    uint32_t chunk = PUT_CHUNK_BYTES / bpc;
+    uint64_t off = 0;
+    for (uint32_t r = 0; rc == 0 && r < ext.count; r++) {
+        for (uint32_t c = 0; rc == 0 && c < ext.items[r].count && off < size; c += chunk) {
+            uint32_t k = ext.items[r].count - c < chunk ? ext.items[r].count - c : chunk;
+            uint32_t len = (uint64_t)k * bpc < size - off ? k * bpc : (uint32_t)(size - off);
+            rc = pipe_push(p, file, off, len, cluster_to_sector(ext.items[r].start + c));
+            off += len;
+        }
+    }
+    extent_list_free(&ext);
+    if (rc != 0) return -1;
+    fill_entry(e, name, 0, first, size);
+    p->files++;
+    p->bytes += size;
+    return 0;
+}
+
+/* A new directory's cluster holds "." and ".."; its entry in the parent is left to the caller. */
+static int put_new_dir(PutPipe *p, uint32_t parent, const char *name, DirEntry *e, uint32_t *out) {
+    uint32_t bpc = fs_cluster_bytes();
+    uint32_t c;
+    if (fs_allocate_cluster_chain(1, parent, &c) != 0) {
+        print_error("No space.");
+        return -1;
+    }
+    if (cluster_list_push(&p->batch, c) != 0) {
+        fs_free_clusters(&c, 1);
+        return -1;
+    }
+    uint8_t *buf = calloc(1, bpc);
+    if (!buf) return -1;
+    DirEntry *dots = (DirEntry*)buf;
+    fill_entry(&dots[0], ".", ATTR_DIRECTORY, c, 0);
+    fill_entry(&dots[1], "..", ATTR_DIRECTORY, parent, 0);
+    int rc = write_sectors(cluster_to_sector(c), fsinfo.sectors_per_cluster, buf);
+    free(buf);
+    if (rc != 0) return -1;
+    fill_entry(e, name, ATTR_DIRECTORY, c, 0);
+    *out = c;
+    p->dirs++;
+    return 0;
+}
+
+static void skip(PutPipe *p, const char *path, const char *why) {
+    fprintf(stderr, "skipping %s: %s\n", path, why);
+    p->skipped++;
+}
+
+typedef struct {
+    char *name;                 /* host name */
+    char key[MAX_NAME_LEN + 1]; /* upper case, as stored */
+} HostName;
+
+static int cmp_key(const void *a, const void *b) {
+    return strcmp(((const HostName*)a)->key, ((const HostName*)b)->key);
+}
+
+/*
+ * Imports the contents of host directory into dir. Entries are created
+ * after all children have their clusters, in one batch; subdirectories are
+ * descended into afterwards, so only one directory's batch is held at a time.
+ * fresh means dir was just created and needs no existence checks.
+ */
+static int put_dir(PutPipe *p, const char *host, uint32_t dir, bool fresh) {
+    DIR *d = opendir(host);
+    if (!d) {
+        skip(p, host, strerror(errno));
+        return 0;
+    }
+    HostName *names = NULL;
+    uint32_t n = 0, cap = 0;
+    int rc = 0;
+    for (struct dirent *de = readdir(d); de && rc == 0; de = readdir(d)) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (de->d_name[0] == '.') {
+            skip(p, de->d_name, "names starting with '.' are reserved");
+            continue;
+        }
+        if (strlen(de->d_name) > MAX_NAME_LEN) {
+            skip(p, de->d_name, "name longer than 11 characters");
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            HostName *grown = realloc(names, cap * sizeof(HostName));
+            if (!grown) {
+                rc = -1;
+                break;
+            }
+            names = grown;
+        }
+        names[n].name = strdup(de->d_name);
+        if (!names[n].name) {
+            rc = -1;
+            break;
+        }
+        strcpy(names[n].key, de->d_name);
+        to_upper(names[n].key);
+        n++;
+    }
+    closedir(d);
+    if (n > 0) qsort(names, n, sizeof(HostName), cmp_key);
+
+    DirEntry *entries = n ? malloc(n * sizeof(DirEntry)) : NULL;
+    uint32_t *subdirs = n ? malloc(n * sizeof(uint32_t)) : NULL;
+    uint32_t *sub_of = n ? malloc(n * sizeof(uint32_t)) : NULL;
+    uint32_t nentries = 0, nsub = 0;
+    if (n > 0 && (!entries || !subdirs || !sub_of)) rc = -1;
+
+    char path[4096];
+    for (uint32_t i = 0; rc == 0 && i < n; i++) {
+        snprintf(path, sizeof(path), "%s/%s", host, names[i].name);
+        struct stat st;
+        if (i > 0 && strcmp(names[i].key, names[i-1].key) == 0) {
+            skip(p, path, "differs from another name only in case");
+        } else if (lstat(path, &st) != 0) {
+            skip(p, path, strerror(errno));
+        } else if (!fresh && fs_name_exists_in_dir(dir, names[i].key)) {
+            skip(p, path, "already exists");
+        } else if (S_ISDIR(st.st_mode)) {
+            rc = put_new_dir(p, dir, names[i].key, &entries[nentries], &subdirs[nsub]);
+            if (rc == 0) {
+                sub_of[nsub++] = i;
+                nentries++;
+            }
+        } else if (!S_ISREG(st.st_mode)) {
+            skip(p, path, "not a regular file or directory");
+        } else if ((uint64_t)st.st_size > 0xFFFFFFFFull) {
+            skip(p, path, "larger than 4 GiB");
+        } else {
+            rc = put_file(p, path, (uint32_t)st.st_size, names[i].key, &entries[nentries]);
+            if (rc == 0) nentries++;
+        }
+    }
+    rc = batch_end(p, dir, entries, nentries, rc);
+    for (uint32_t i = 0; rc == 0 && i < nsub; i++) {
+        snprintf(path, sizeof(path), "%s/%s", host, names[sub_of[i]].name);
+        rc = put_dir(p, path, subdirs[i], true);
+    }
+    for (uint32_t i = 0; i < n; i++) free(names[i].name);
+    free(names);
+    free(entries);
+    free(subdirs);
+    free(sub_of);
+    return rc;
+}
+
+int fs_put(const char *host, const char *dst, bool recursive) {
+    struct stat st;
+    if (stat(host, &st) != 0) {
+        print_error("Host path does not exist.");
+        return -1;
+    }
+    if (S_ISDIR(st.st_mode) && !recursive) {
+        print_error("Is a directory (use put -r).");
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+        print_error("Not a regular file or directory.");
+        return -1;
+    }
+    if ((uint64_t)st.st_size > 0xFFFFFFFFull && !S_ISDIR(st.st_mode)) {
+        print_error("File too large for FAT32.");
+        return -1;
+    }
+
+    /* An existing directory receives the source under its own name. */
+    uint32_t dst_dir;
+    char name[PATH_LEAF_MAX];
+    int rc = path_dir(dst, &dst_dir);
+    if (rc == 0) {
+        const char *end = host + strlen(host);
+        while (end > host + 1 && end[-1] == '/') end--;
+        const char *base = end;
+        while (base > host && base[-1] != '/') base--;
+        if ((size_t)(end - base) >= sizeof(name)) {
+            print_error("Name too long.");
+            return -1;
+        }
+        memcpy(name, base, (size_t)(end - base));
+        name[end - base] = '\0';
+    } else if (rc == -2) {
+        print_error("Destination already exists.");
+        return -1;
+    } else if (path_split(dst, &dst_dir, name, sizeof(name)) != 0) {
+        print_error("Destination directory does not exist.");
+        return -1;
+    }
+    if (name[0] == '\0' || name[0] == '.' || strcmp(name, "/") == 0) {
+        print_error("Invalid name.");
+        return -1;
+    }
+    if (strlen(name) > MAX_NAME_LEN) {
+        print_error("Name too long.");
+        return -1;
+    }
+    to_upper(name);
+    if (fs_name_exists_in_dir(dst_dir, name)) {
+        print_error("Destination already exists.");
+        return -1;
+    }
+
+    PutPipe p;
+    if (pipe_start(&p) != 0) {
+        print_error("Out of memory.");
+        return -1;
+    }
+    DirEntry e;
+    uint32_t c;
+    p.goal = dst_dir;
+    if (S_ISDIR(st.st_mode)) {
+        rc = put_new_dir(&p, dst_dir, name, &e, &c);
+        rc = batch_end(&p, dst_dir, &e, 1, rc);
+        if (rc == 0) rc = put_dir(&p, host, c, true);
+    } else {
+        rc = put_file(&p, host, (uint32_t)st.st_size, name, &e);
+        rc = batch_end(&p, dst_dir, &e, 1, rc);
+    }
+    if (pipe_finish(&p) != 0) {
+        print_error("Import I/O error.");
+        rc = -1;
+    }
+    printf("%u files, %u directories, %llu bytes", p.files, p.dirs, (unsigned long long)p.bytes);
+    if (p.skipped) printf(", %u skipped", p.skipped);
+    printf("\n");
+    return rc;
+}
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "fs.h"
+#include "readahead.h"
+#include "fatscan.h"
+
+/*
+ * Per-file sequential read-ahead. Each open file keeps two buffers: the one
+ * reads are served from, and one a background thread fills with the next
+ * window. The window doubles while reads stay sequential and drops to zero
+ * on a seek, at which point reads go straight to the cluster chain again.
+ */
+
+struct ReadAhead {
+    uint8_t *buf;
+    uint32_t buf_start, buf_len;
+
+    uint8_t *pf_buf;
+    uint32_t pf_start, pf_len;
+    uint32_t pf_cluster0;
+    int pf_rc;
+    bool pending;
+    pthread_t thread;
+
+    uint32_t cap;
+    uint32_t window;
+    uint32_t next_expected;
+
+    uint32_t chain_start, chain_idx, chain_cluster;
+};
+
+ReadAhead *ra_create(void) {
+    ReadAhead *ra = calloc(1, sizeof(ReadAhead));
+    if (!ra) return NULL;
+    uint32_t bpc = fs_cluster_bytes();
+    ra->cap = (RA_MAX_BYTES + bpc - 1) / bpc * bpc;
+    if (ra->cap < 2*bpc) ra->cap = 2*bpc;
+    return ra;
+}
+
+/* Cluster number at position idx of the chain, resuming from the last lookup when possible. */
+static uint32_t chain_at(ReadAhead *ra, uint32_t start_cluster, uint32_t idx) {
+    uint32_t c = start_cluster, i = 0;
+    if (ra->chain_start == start_cluster && ra->chain_idx <= idx && fs_valid_cluster(ra->chain_cluster)) {
+        c = ra->chain_cluster;
+        i = ra->chain_idx;
+    }
+    while (i < idx && fs_valid_cluster(c)) {
+        c = get_fat_entry(c);
+        i++;
+    }
+    return c;
+}
+
+/* Reads whole clusters covering [from, from+len): one request per contiguous run, all runs in one batch. */
+static int fetch(ReadAhead *ra, uint32_t start_cluster, uint32_t file_size, uint32_t from, uint32_t len, uint8_t *dst, uint32_t *got) {
+    uint32_t bpc = fs_cluster_bytes();
+    uint32_t idx = from / bpc;
+    uint32_t nclus = (len + bpc - 1) / bpc;
+    uint32_t cluster = chain_at(ra, start_cluster, idx);
+    uint32_t i = 0, nreq = 0;
+    SectorReq *reqs = malloc((nclus ? nclus : 1) * sizeof(SectorReq));
+    if (!reqs) return -1;
+
+    while (i < nclus && fs_valid_cluster(cluster)) {
+        uint32_t run = 1 + fatscan_link_run(cluster, nclus - i - 1);
+        uint32_t next = get_fat_entry(cluster + run - 1);
+        while (i + run < nclus && next == cluster + run) {
+            run++;
+            next = get_fat_entry(next);
+        }
+        reqs[nreq++] = (SectorReq){cluster_to_sector(cluster), run * fsinfo.sectors_per_cluster, dst + i*bpc, false};
+        i += run;
+        cluster = next;
+    }
+    int rc = sectors_batch(reqs, nreq);
+    free(reqs);
+    if (rc != 0) return -1;
+
+    ra->chain_start = start_cluster;
+    ra->chain_idx = idx + i;
+    ra->chain_cluster = cluster;
+
+    uint32_t n = i * bpc;
+    if (n > file_size - from) n = file_size - from;
+    *got = n;
+    return 0;
+}
+
+static void *prefetch_thread(void *arg) {
+    ReadAhead *ra = arg;
+    uint32_t got = 0;
+    ra->pf_rc = fetch(ra, ra->pf_cluster0, ra->pf_start + ra->pf_len, ra->pf_start, ra->pf_len, ra->pf_buf, &got);
+    ra->pf_len = got;
+    return NULL;
+}
+
+static void wait_prefetch(ReadAhead *ra) {
+    if (!ra->pending) return;
+    pthread_join(ra->thread, NULL);
+    ra->pending = false;
+    if (ra->pf_rc != 0) ra->pf_len = 0;
+}
+
+static void start_prefetch(ReadAhead *ra, uint32_t start_cluster, uint32_t from, uint32_t len) {
+    ra->pf_cluster0 = start_cluster;
+    ra->pf_start = from;
+    ra->pf_len = len;
+    ra->pf_rc = 0;
+    if (pthread_create(&ra->thread, NULL, prefetch_thread, ra) == 0) ra->pending = true;
+    else ra->pf_len = 0;
+}
+
+static bool covers(uint32_t start, uint32_t len, uint32_t pos) {
+    return pos >= start && pos < start + len;
+}
+
+int ra_read(ReadAhead *ra, uint32_t start_cluster, uint32_t file_size, uint8_t *out, uint32_t offset, uint32_t size) {
+    if (size == 0) return 0;
+    uint32_t bpc = fs_cluster_bytes();
+
+    if (offset == ra->next_expected) {
+        if (ra->window == 0) ra->window = (RA_MIN_BYTES + bpc - 1) / bpc * bpc;
+        else if (ra->window < ra->cap) ra->window *= 2;
+        if (ra->window > ra->cap) ra->window = ra->cap;
+    } else {
+        ra->window = 0;
+    }
+    ra->next_expected = offset + size;
+
+    if (ra->window == 0) {
+        ra_invalidate(ra);
+        return fs_read_cluster_chain(start_cluster, out, offset, size);
+    }
+
+    if (!ra->buf) ra->buf = malloc(ra->cap);
+    if (!ra->pf_buf) ra->pf_buf = malloc(ra->cap);
+    if (!ra->buf || !ra->pf_buf) return fs_read_cluster_chain(start_cluster, out, offset, size);
+
+    uint32_t done = 0;
+    while (done < size) {
+        uint32_t pos = offset + done;
+        if (!covers(ra->buf_start, ra->buf_len, pos) && ra->pending) {
+            wait_prefetch(ra);
+            if (covers(ra->pf_start, ra->pf_len, pos)) {
+                uint8_t *t = ra->buf; ra->buf = ra->pf_buf; ra->pf_buf = t;
+                ra->buf_start = ra->pf_start;
+                ra->buf_len = ra->pf_len;
+                ra->pf_len = 0;
+            }
+        }
+        if (!covers(ra->buf_start, ra->buf_len, pos)) {
+            uint32_t from = pos / bpc * bpc;
+            uint32_t want = size - done + (pos - from);
+            if (want < ra->window) want = ra->window;
+            if (want > ra->cap) want = ra->cap;
+            if (want > file_size - from) want = file_size - from;
+            uint32_t got = 0;
+            if (fetch(ra, start_cluster, file_size, from, want, ra->buf, &got) != 0 || got <= pos - from) {
+                ra->buf_len = 0;
+                return -1;
+            }
+            ra->buf_start = from;
+            ra->buf_len = got;
+        }
+        uint32_t n = ra->buf_start + ra->buf_len - pos;
+        if (n > size - done) n = size - done;
+        memcpy(out + done, ra->buf + (pos - ra->buf_start), n);
+        done += n;
+    }
+
+    uint32_t next = ra->buf_start + ra->buf_len;
+    if (!ra->pending && next < file_size && next >= ra->next_expected) {
+        uint32_t len = ra->window;
+        if (len > file_size - next) len = file_size - next;
+        start_prefetch(ra, start_cluster, next, len);
+    }
+    return 0;
+}
+
+void ra_invalidate(ReadAhead *ra) {
+    if (!ra) return;
+    wait_prefetch(ra);
+    ra->buf_len = 0;
+    ra->pf_len = 0;
+    ra->chain_start = 0;
+    ra->chain_cluster = 0;
+}
+
+void ra_destroy(ReadAhead *ra) {
+    if (!ra) return;
+    wait_prefetch(ra);
+    free(ra->buf);
+    free(ra->pf_buf);
+    free(ra);
+}
@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fs.h"
+#include "trace.h"
+#include "commands.h"
+#include "utils.h"
+
+/*
+ * Workload traces. With --trace FILE every shell command is logged as one
+ * tab-separated line:
+ *
+ *   start_us  latency_us  read_ops  write_ops  sectors_read  sectors_written  command
+ *
+ * start_us counts from the first record. --replay FILE copies the image to a
+ * scratch file, runs the commands against it (back to back, or with --paced
+ * at the recorded start times) and reports throughput and latency
+ * percentiles next to the recorded ones.
+ */
+
+static FILE *trace_fp;
+static uint64_t trace_t0;
+
+uint64_t trace_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000;
+}
+
+int trace_start(const char *path) {
+    trace_fp = fopen(path, "w");
+    if (!trace_fp) {
+        perror("trace");
+        return -1;
+    }
+    trace_t0 = 0;
+    fprintf(trace_fp, "# filesys trace v1: start_us latency_us read_ops write_ops sectors_read sectors_written command\n");
+    return 0;
+}
+
+void trace_stop(void) {
+    if (trace_fp) fclose(trace_fp);
+    trace_fp = NULL;
+}
+
+void trace_record(const char *line, uint64_t start_us, const IoStats *before) {
+    if (!trace_fp) return;
+    uint64_t end = trace_now_us();
+    IoStats now;
+    io_stats_get(&now);
+    if (trace_t0 == 0) trace_t0 = start_us;
+    fprintf(trace_fp, "%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%s\n",
+            (unsigned long long)(start_us - trace_t0), (unsigned long long)(end - start_us),
+            (unsigned long long)(now.read_ops - before->read_ops),
+            (unsigned long long)(now.write_ops - before->write_ops),
+            (unsigned long long)(now.sectors_read - before->sectors_read),
+            (unsigned long long)(now.sectors_written - before->sectors_written), line);
+    fflush(trace_fp);
+}
+
+typedef struct {
+    uint64_t start_us, latency_us;
+    uint64_t sectors_read, sectors_written;
+    char *cmd;
+} TraceOp;
+
+static int load_trace(const char *path, TraceOp **out, uint32_t *count) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror("replay");
+        return -1;
+    }
+    TraceOp *ops = NULL;
+    uint32_t n = 0, cap = 0;
+    char line[512];
+    int rc = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        line[strcspn(line, "\n")] = '\0';
+        unsigned long long t, lat, ro, wo, sr, sw;
+        int pos = 0;
+        if (sscanf(line, "%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%n", &t, &lat, &ro, &wo, &sr, &sw, &pos) != 6 || pos == 0) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            TraceOp *grown = realloc(ops, cap * sizeof(TraceOp));
+            if (!grown) { rc = -1; break; }
+            ops = grown;
+        }
+        ops[n].start_us = t;
+        ops[n].latency_us = lat;
+        ops[n].sectors_read = sr;
+        ops[n].sectors_written = sw;
+        ops[n].cmd = strdup(line + pos);
+        if (!ops[n].cmd) { rc = -1; break; }
+        n++;
+    }
+    fclose(fp);
+    *out = ops;
+    *count = n;
+    return rc;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, uint32_t n, double p) {
+    if (n == 0) return 0;
+    uint32_t i = (uint32_t)(p * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+static void print_latencies(const char *label, uint64_t *lat, uint32_t n) {
+    qsort(lat, n, sizeof(uint64_t), cmp_u64);
+    printf("%-9s p50 %llu us, p90 %llu us, p99 %llu us, p99.9 %llu us, max %llu us\n", label,
+           (unsigned long long)percentile(lat, n, 0.50), (unsigned long long)percentile(lat, n, 0.90),
+           (unsigned long long)percentile(lat, n, 0.99), (unsigned long long)percentile(lat, n, 0.999),
+           (unsigned long long)(n ? lat[n-1] : 0));
+}
+
+int trace_replay(const char *trace_path, const char *image_path, bool paced, const MountOptions *opts) {
+    TraceOp *ops = NULL;
+    uint32_t n = 0;
+    if (load_trace(trace_path, &ops, &n) != 0) return -1;
+
+    char scratch[512];
+    snprintf(scratch, sizeof(scratch), "%s.replay", image_path);
+    /* The scratch copy is mounted directly; an overlay would only measure the delta file. */
+    MountOptions mo = *opts;
+    mo.overlay_path = NULL;
+    int rc = 0;
+    uint64_t *lat = calloc(n ? n : 1, sizeof(uint64_t));
+    uint64_t *orig = calloc(n ? n : 1, sizeof(uint64_t));
+    if (!lat || !orig) rc = -1;
+    else if (image_copy_file(image_path, scratch) != 0) {
+        fprintf(stderr, "Error: failed to copy image to %s.\n", scratch);
+        rc = -1;
+    } else if (fs_mount(scratch, &mo) != 0) {
+        fprintf(stderr, "Error: failed to mount image.\n");
+        rc = -1;
+    }
+    if (rc != 0) goto out;
+
+    /* Command output is not part of the measurement. */
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull >= 0) {
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+    }
+
+    IoStats before, after;
+    io_stats_get(&before);
+    uint64_t rec_read = 0, rec_written = 0;
+    uint32_t ran = 0;
+    uint64_t t0 = trace_now_us();
+    for (uint32_t i = 0; i < n; i++) {
+        if (paced) {
+            uint64_t due = t0 + ops[i].start_us, now = trace_now_us();
+            if (due > now) usleep((useconds_t)(due - now));
+        }
+        char line[512];
+        snprintf(line, sizeof(line), "%s", ops[i].cmd);
+        uint64_t s = trace_now_us();
+        int quit = shell_execute(line);
+        lat[i] = trace_now_us() - s;
+        orig[i] = ops[i].latency_us;
+        rec_read += ops[i].sectors_read;
+        rec_written += ops[i].sectors_written;
+        ran++;
+        if (quit) break;
+    }
+    uint64_t t_cmds = trace_now_us() - t0;
+    io_stats_get(&after);
+    fs_unmount();
+    uint64_t t_all = trace_now_us() - t0;
+
+    fflush(stdout);
+    if (saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+
+    uint64_t sr = after.sectors_read - before.sectors_read;
+    uint64_t sw = after.sectors_written - before.sectors_written;
+    double secs = t_all / 1e6;
+    double cmd_secs = t_cmds / 1e6;
+    double mib = (double)(sr + sw) * fsinfo.bytes_per_sector / (1024.0 * 1024.0);
+    printf("replayed %u commands%s in %.3f s (%.3f s + %.3f s unmount)\n", ran, paced ? " (paced)" : "",
+           secs, t_cmds / 1e6, (t_all - t_cmds) / 1e6);
+    printf("throughput: %.1f commands/s, %.1f MiB/s of sector I/O\n", cmd_secs > 0 ? ran / cmd_secs : 0.0,
+           cmd_secs > 0 ? mib / cmd_secs : 0.0);
+    printf("sectors:   %llu read, %llu written (trace: %llu read, %llu written)\n",
+           (unsigned long long)sr, (unsigned long long)sw, (unsigned long long)rec_read, (unsigned long long)rec_written);
+    print_latencies("replay:", lat, ran);
+    print_latencies("recorded:", orig, ran);
+
+out:
+    if (lat && orig) unlink(scratch);
+    for (uint32_t i = 0; i < n; i++) free(ops[i].cmd);
+    free(ops);
+    free(lat);
+    free(orig);
+    return rc;
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
 #include "utils.h"
 
 int parse_flags(const char *flag_str, char *out_flags) {
@@ -50,3 +51,18 @@ void print_hex_dump(const uint8_t *data, uint32_t length) {
     printf("\n");
 }
 
+void fat_timestamp(uint16_t *date, uint16_t *time_out) {
+    time_t now = time(NULL);
+    struct tm tmv;
+    struct tm *t = localtime(&now);
+    if (!t) {
+        *date = 0;
+        *time_out = 0;
+        return;
+    }
+    tmv = *t;
+    int year = tmv.tm_year + 1900 - 1980;
+    if (year < 0) year = 0;
+    *date = (uint16_t)((year << 9) | ((tmv.tm_mon + 1) << 5) | tmv.tm_mday);
+    *time_out = (uint16_t)((tmv.tm_hour << 11) | (tmv.tm_min << 5) | (tmv.tm_sec / 2));
+}
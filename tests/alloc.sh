@@ -0,0 +1,29 @@
+#!/bin/sh
+# Allocation policies: every policy keeps data intact and accounts for every cluster.
+. "$(dirname "$0")/lib.sh"
+
+"$MKIMAGE" "$WORK/empty.img" 32
+empty=$(free_clusters "$WORK/empty.img")
+for p in first-fit next-fit best-fit affinity; do
+    cp "$WORK/empty.img" "$WORK/a.img"
+    # Holes of different sizes, then imports and copies that have to fill them.
+    printf 'put -r %s /\ncp -r SRC X\nrm SRC/SUB/B.BIN\nrm SRC/A.BIN\nput %s/D.BIN /X/D.BIN\ncp -r X Y\nrm -r X\nexit\n' \
+        "$SRC" "$WORK/EXTRA" | run --alloc $p "$WORK/a.img"
+    tree "$WORK/a.img" "$WORK/t"
+    rm -rf "$WORK/want" && cp -r "$SRC2" "$WORK/want"
+    if diff -r "$WORK/want" "$WORK/t/Y" > /dev/null; then
+        printf 'rm -r SRC Y\nexit\n' | run --alloc $p "$WORK/a.img"
+        [ "$(free_clusters "$WORK/a.img")" = "$empty" ] && pass "alloc-$p" || fail "alloc-$p"
+    else
+        fail "alloc-$p"
+    fi
+done
+
+# One command under another policy, then back to the mount's.
+cp "$BASE" "$WORK/a.img"
+printf 'alloc best-fit cp -r SRC Z\nalloc\nexit\n' | run "$WORK/a.img"
+tree "$WORK/a.img" "$WORK/t"
+if grep -q "allocation policy: first-fit" "$WORK/out.txt" && diff -r "$SRC" "$WORK/t/Z" > /dev/null
+then pass alloc-command; else fail alloc-command; fi
+
+exit $FAILED
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Metadata catalog: lookups through the catalog answer as the directories do.
+. "$(dirname "$0")/lib.sh"
+
+cp "$BASE" "$WORK/k.img"
+printf 'catalog build\nexit\n' | run "$WORK/k.img"
+q='find /\nfind / -name *.BIN\nls SRC/SUB\nsize SRC/SUB/DEEP/C.TXT\nexit\n'
+printf "$q" | run "$WORK/k.img"
+cp "$WORK/out.txt" "$WORK/with.txt"
+printf 'catalog\ncatalog drop\nexit\n' | run "$WORK/k.img"
+grep -q "current" "$WORK/out.txt" && printf "$q" | run "$WORK/k.img"
+if grep -q "DEEP/C.TXT" "$WORK/with.txt" && cmp -s "$WORK/with.txt" "$WORK/out.txt" && same_tree "$WORK/k.img" "$SRC"
+then pass catalog; else fail catalog; fi
+
+# A write makes the catalog stale, and unmount rebuilds it.
+printf 'catalog build\nexit\n' | run "$WORK/k.img"
+printf 'put %s/D.BIN /SRC/D.BIN\nexit\n' "$WORK/EXTRA" | run "$WORK/k.img"
+printf 'catalog\nfind / -name D.BIN\nexit\n' | run "$WORK/k.img"
+if grep -q "current" "$WORK/out.txt" && grep -q "/SRC/D.BIN" "$WORK/out.txt" && same_tree "$WORK/k.img" "$SRC2"
+then pass catalog-write; else fail catalog-write; fi
+
+# An overlay commit writes the base behind its stamp, so the base's catalog must go.
+cp "$BASE" "$WORK/b.img"
+printf 'catalog build\nexit\n' | run "$WORK/b.img"
+printf 'put %s/D.BIN /SRC/D.BIN\nrm SRC/A.BIN\noverlay commit\nexit\n' "$WORK/EXTRA" | run --overlay "$WORK/b.dlt" "$WORK/b.img"
+printf 'catalog\nls SRC\nexit\n' | run "$WORK/b.img"
+rm -rf "$WORK/want" && cp -r "$SRC2" "$WORK/want" && rm "$WORK/want/A.BIN"
+if grep -q "catalog: none" "$WORK/out.txt" && ! grep -q "A.BIN" "$WORK/out.txt" && same_tree "$WORK/b.img" "$WORK/want"
+then pass catalog-overlay-commit; else fail catalog-overlay-commit; fi
+
+exit $FAILED
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Directory compaction.
+. "$(dirname "$0")/lib.sh"
+
+# 60 empty files fill four 512-byte directory clusters; after 50 go, one is enough.
+"$MKIMAGE" "$WORK/c.img" 32
+i=1; { echo "mkdir D"; echo "cd D"; while [ $i -le 60 ]; do echo "touch F$i"; i=$((i + 1)); done; echo exit; } | run "$WORK/c.img"
+printf 'put -r %s /D\nexit\n' "$SRC" | run "$WORK/c.img"
+i=11; { echo "cd D"; while [ $i -le 60 ]; do echo "rm F$i"; i=$((i + 1)); done; echo exit; } | run "$WORK/c.img"
+before=$(free_clusters "$WORK/c.img")
+printf 'compact D\nls D\nexit\n' | run "$WORK/c.img"
+tree "$WORK/c.img" "$WORK/t"
+if [ "$(free_clusters "$WORK/c.img")" = "$((before + 3))" ] && grep -q "F10 " "$WORK/out.txt" &&
+    ! grep -q "F11 " "$WORK/out.txt" && diff -r "$SRC" "$WORK/t/D/SRC" > /dev/null
+then pass compact; else fail compact; fi
+
+# Auto-compaction runs on the parent of a removed entry, from any current directory.
+i=1; { echo "mkdir E"; echo "cd E"; while [ $i -le 60 ]; do echo "touch G$i"; i=$((i + 1)); done; echo exit; } | run "$WORK/c.img"
+before=$(free_clusters "$WORK/c.img")
+i=11; { echo "compact -auto 50"; while [ $i -le 60 ]; do echo "rm E/G$i"; i=$((i + 1)); done; echo "ls E"; echo exit; } | run "$WORK/c.img"
+if [ "$(free_clusters "$WORK/c.img")" = "$((before + 3))" ] && grep -q "G10 " "$WORK/out.txt"
+then pass compact-auto; else fail compact-auto; fi
+
+exit $FAILED
@@ -0,0 +1,14 @@
+#!/bin/sh
+# Compressed containers: pack, mount the container, unpack, and compare with the source image.
+. "$(dirname "$0")/lib.sh"
+
+printf 'pack %s\nexit\n' "$WORK/c.f32z" | run "$BASE"
+printf 'unpack %s\nexit\n' "$WORK/c.img" | run "$WORK/c.f32z"
+if cmp -s "$BASE" "$WORK/c.img" && same_tree "$WORK/c.f32z" "$SRC"
+then pass container; else fail container; fi
+
+# Writes into a container land in its append area and survive a remount.
+printf 'put %s/D.BIN /SRC/D.BIN\nexit\n' "$WORK/EXTRA" | run "$WORK/c.f32z"
+if same_tree "$WORK/c.f32z" "$SRC2"; then pass container-write; else fail container-write; fi
+
+exit $FAILED
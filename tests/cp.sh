@@ -0,0 +1,23 @@
+#!/bin/sh
+# cp and cp -r inside the image.
+. "$(dirname "$0")/lib.sh"
+
+cp "$BASE" "$WORK/c.img"
+printf 'cp -r SRC COPY\ncp SRC/A.BIN SRC/SUB/A2.BIN\nexit\n' | run "$WORK/c.img"
+tree "$WORK/c.img" "$WORK/t"
+if diff -r "$SRC" "$WORK/t/COPY" > /dev/null && cmp -s "$SRC/A.BIN" "$WORK/t/SRC/SUB/A2.BIN"
+then pass cp; else fail cp; fi
+
+# Names that start with a dot are copied too.
+printf 'cd SRC\ntouch .RC\ncd /\ncp -r SRC DOTS\nls DOTS\nexit\n' | run "$WORK/c.img"
+if grep -q "\.RC" "$WORK/out.txt"; then pass cp-dot; else fail cp-dot; fi
+
+# A copy that runs out of space leaves nothing behind.
+"$MKIMAGE" "$WORK/s.img" 3
+printf 'put -r %s /\nexit\n' "$SRC" | run "$WORK/s.img"
+before=$(free_clusters "$WORK/s.img")
+printf 'cp -r SRC FULL\nls\nexit\n' | run "$WORK/s.img"
+if grep -q "No space" "$WORK/out.txt" && ! grep -q "FULL" "$WORK/out.txt" && [ "$(free_clusters "$WORK/s.img")" = "$before" ]
+then pass cp-no-space; else fail cp-no-space; fi
+
+exit $FAILED
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Clones and deltas: diff a changed image against its clone, apply the delta, compare.
+. "$(dirname "$0")/lib.sh"
+
+cp "$BASE" "$WORK/d.img"
+printf 'clone %s\nexit\n' "$WORK/d0.img" | run "$WORK/d.img"
+printf 'put %s/D.BIN /SRC/D.BIN\nopen SRC/A.BIN -rw\nwrite SRC/A.BIN changed in place\nclose SRC/A.BIN\nrm SRC/EMPTY.TXT\nmkdir NEW\ndiff %s %s\nexit\n' \
+    "$WORK/EXTRA" "$WORK/d0.img" "$WORK/d.delta" | run "$WORK/d.img"
+"$BIN" --apply "$WORK/d.delta" "$WORK/d0.img" > "$WORK/out.txt" 2>&1
+if ! cmp -s "$BASE" "$WORK/d.img" && cmp -s "$WORK/d.img" "$WORK/d0.img"; then pass delta; else fail delta; fi
+
+# A delta applies only to the image it was made from, so not twice.
+if "$BIN" --apply "$WORK/d.delta" "$WORK/d0.img" > "$WORK/out.txt" 2>&1; then fail delta-base; else pass delta-base; fi
+
+exit $FAILED
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Cluster hashes: verify after writes, after a session that never unmounted, and after an overlay commit.
+. "$(dirname "$0")/lib.sh"
+
+cp "$BASE" "$WORK/h.img"
+head -c 300000 /dev/urandom > "$WORK/EXTRA/X.BIN"
+printf 'hash\nexit\n' | run "$WORK/h.img"
+printf 'rm SRC/A.BIN\nput %s/X.BIN /SRC/X.BIN\nverify\nexit\n' "$WORK/EXTRA" | run "$WORK/h.img"
+if grep -q " 0 mismatched" "$WORK/out.txt"; then pass hash-verify; else fail hash-verify; fi
+
+# A crash leaves the in_use flag set and a map without the last writes; verify then rechecks everything.
+cp "$BASE" "$WORK/k.img"
+printf 'hash\nexit\n' | run "$WORK/k.img"
+cp "$WORK/k.img.crc" "$WORK/saved.crc"
+printf 'rm SRC/A.BIN\nput %s/X.BIN /SRC/X.BIN\nexit\n' "$WORK/EXTRA" | run "$WORK/k.img"
+cp "$WORK/saved.crc" "$WORK/k.img.crc"
+printf '\001' | dd of="$WORK/k.img.crc" bs=1 seek=40 conv=notrunc 2>/dev/null
+printf 'verify\nexit\n' | run "$WORK/k.img"
+if grep -q " [1-9][0-9]* rewritten .* 0 mismatched" "$WORK/out.txt"; then pass hash-unclean; else fail hash-unclean; fi
+
+# An overlay commit writes the base without tracking, so the base's index is removed.
+cp "$BASE" "$WORK/o.img"
+printf 'hash\nexit\n' | run "$WORK/o.img"
+printf 'put %s/D.BIN /SRC/D.BIN\noverlay commit\nexit\n' "$WORK/EXTRA" | run --overlay "$WORK/o.dlt" "$WORK/o.img"
+if [ -f "$WORK/o.img.crc" ]; then fail hash-overlay-commit; else pass hash-overlay-commit; fi
+
+exit $FAILED
@@ -0,0 +1,56 @@
+# Shared setup for the tests in this directory; each test script sources it.
+#   sh tests/NAME.sh [BIN [MKIMAGE]]      (`make test` runs them all)
+
+BIN=${1:-bin/filesys}
+MKIMAGE=${2:-tests/mkimage}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/fstest.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT
+FAILED=0
+
+pass() { echo "PASS $1"; }
+fail() { echo "FAIL $1"; FAILED=1; }
+
+# Feeds the shell commands on stdin to one session: run [OPTIONS] IMAGE
+run() { "$BIN" "$@" > "$WORK/out.txt" 2>&1; }
+
+# Writes IMAGE's tree below / as a tar archive and unpacks it into DIR: tree IMAGE DIR [OPTIONS]
+tree() {
+    img=$1 dir=$2
+    shift 2
+    rm -rf "$dir" && mkdir -p "$dir" &&
+        "$BIN" "$@" --export-tar / "$img" 2> /dev/null | tar -x -C "$dir"
+}
+
+# Whether IMAGE's /SRC holds exactly the host tree DIR: same_tree IMAGE DIR [OPTIONS]
+same_tree() {
+    img=$1 want=$2
+    shift 2
+    tree "$img" "$WORK/t" "$@" && diff -r "$want" "$WORK/t/SRC" > /dev/null
+}
+
+# Free clusters reported by df: free_clusters IMAGE [OPTIONS]
+free_clusters() {
+    img=$1
+    shift
+    printf 'df\nexit\n' | "$BIN" "$@" "$img" 2>&1 | sed -n 's/.* used, \([0-9]*\) free.*/\1/p'
+}
+
+# The host tree the tests start from; names are already 8.3 and upper case.
+SRC=$WORK/SRC
+mkdir -p "$SRC/SUB/DEEP"
+head -c 300000 /dev/urandom > "$SRC/A.BIN"
+head -c 1500000 /dev/urandom > "$SRC/BIG.BIN"
+head -c 70001 /dev/urandom > "$SRC/SUB/B.BIN"
+: > "$SRC/EMPTY.TXT"
+i=0
+while [ $i -lt 200 ]; do echo "line $i of a text file that compresses well"; i=$((i + 1)); done > "$SRC/SUB/DEEP/C.TXT"
+mkdir -p "$WORK/EXTRA"
+head -c 9000 /dev/urandom > "$WORK/EXTRA/D.BIN"
+# The same tree after D.BIN is added.
+SRC2=$WORK/SRC2
+cp -r "$SRC" "$SRC2" && cp "$WORK/EXTRA/D.BIN" "$SRC2/D.BIN"
+
+# A 32 MiB image holding SRC as /SRC.
+BASE=$WORK/base.img
+"$MKIMAGE" "$BASE" 32 || exit 1
+printf 'put -r %s /\nexit\n' "$SRC" | run "$BASE"
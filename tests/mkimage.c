@@ -0,0 +1,85 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fat32.h"
+
+/*
+ * Writes an empty FAT32 image for the round-trip tests:
+ *   mkimage IMAGE MB [SECTORS_PER_CLUSTER] [BYTES_PER_SECTOR]
+ * 32 reserved sectors, two FATs, the root directory in cluster 2.
+ */
+
+static int put(FILE *f, long long off, const void *buf, size_t len) {
+    return fseeko(f, off, SEEK_SET) == 0 && fwrite(buf, 1, len, f) == len ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s IMAGE MB [SECTORS_PER_CLUSTER] [BYTES_PER_SECTOR]\n", argv[0]);
+        return 2;
+    }
+    unsigned mb = (unsigned)atoi(argv[2]);
+    unsigned spc = argc > 3 ? (unsigned)atoi(argv[3]) : 1;
+    unsigned bps = argc > 4 ? (unsigned)atoi(argv[4]) : 512;
+    if (mb == 0 || spc == 0 || spc > 128 || (spc & (spc - 1)) || bps < 512 || bps > 4096 || (bps & (bps - 1))) {
+        fprintf(stderr, "Error: Invalid geometry.\n");
+        return 2;
+    }
+    uint32_t total = (uint32_t)((unsigned long long)mb * 1024 * 1024 / bps);
+    uint32_t fat_sectors = (total / spc * 4 + bps - 1) / bps + 1;
+
+    uint8_t *sec = calloc(1, bps);
+    FILE *f = fopen(argv[1], "wb");
+    if (!sec || !f) {
+        fprintf(stderr, "Error: Cannot create %s.\n", argv[1]);
+        return 1;
+    }
+
+    FAT32BootSector bs;
+    memset(&bs, 0, sizeof(bs));
+    memcpy(bs.BS_jmpBoot, "\xEB\x58\x90", 3);
+    memcpy(bs.BS_OEMName, "MSWIN4.1", 8);
+    bs.BPB_BytsPerSec = (uint16_t)bps;
+    bs.BPB_SecPerClus = (uint8_t)spc;
+    bs.BPB_RsvdSecCnt = 32;
+    bs.BPB_NumFATs = 2;
+    bs.BPB_Media = 0xF8;
+    bs.BPB_SecPerTrk = 63;
+    bs.BPB_NumHeads = 255;
+    bs.BPB_TotSec32 = total;
+    bs.BPB_FATSz32 = fat_sectors;
+    bs.BPB_RootClus = 2;
+    bs.BPB_FSInfo = 1;
+    bs.BPB_BkBootSec = 6;
+    bs.BS_DrvNum = 0x80;
+    bs.BS_BootSig = 0x29;
+    bs.BS_VolID = 0x1234;
+    memcpy(bs.BS_VolLab, "NO NAME    ", 11);
+    memcpy(bs.BS_FilSysType, "FAT32   ", 8);
+    memcpy(sec, &bs, sizeof(bs));
+    sec[510] = 0x55;
+    sec[511] = 0xAA;
+    int rc = put(f, 0, sec, bps) | put(f, 6LL * bps, sec, bps);
+
+    uint32_t fsi[3] = {0x61417272, 0xFFFFFFFF, 0xFFFFFFFF}, lead = 0x41615252;
+    memset(sec, 0, bps);
+    memcpy(sec, &lead, 4);
+    memcpy(sec + 484, fsi, sizeof(fsi));
+    sec[510] = 0x55;
+    sec[511] = 0xAA;
+    rc |= put(f, bps, sec, bps);
+
+    uint32_t fat[3] = {0x0FFFFFF8, 0x0FFFFFFF, 0x0FFFFFFF};
+    for (int i = 0; i < 2; i++) rc |= put(f, (32LL + (long long)i * fat_sectors) * bps, fat, sizeof(fat));
+
+    if (rc == 0 && ftruncate(fileno(f), (off_t)total * bps) != 0) rc = -1;
+    if (fclose(f) != 0) rc = -1;
+    free(sec);
+    if (rc != 0) {
+        fprintf(stderr, "Error: Cannot write %s.\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Overlay deltas: writes go to the delta, and the base stays as it was until commit.
+. "$(dirname "$0")/lib.sh"
+
+cp "$BASE" "$WORK/o.img"
+printf 'put %s/D.BIN /SRC/D.BIN\nexit\n' "$WORK/EXTRA" | run --overlay "$WORK/o.dlt" "$WORK/o.img"
+if cmp -s "$BASE" "$WORK/o.img" && same_tree "$WORK/o.img" "$SRC2" --overlay "$WORK/o.dlt"
+then pass overlay; else fail overlay; fi
+
+printf 'overlay commit\nexit\n' | run --overlay "$WORK/o.dlt" "$WORK/o.img"
+if same_tree "$WORK/o.img" "$SRC2"; then pass overlay-commit; else fail overlay-commit; fi
+
+# The session reads the committed base afterwards, also when the base is a container.
+printf 'pack %s\nexit\n' "$WORK/c.f32z" | run "$BASE"
+printf 'put %s/D.BIN /SRC/D.BIN\noverlay commit\nls /SRC\nexit\n' "$WORK/EXTRA" | run --overlay "$WORK/c.dlt" "$WORK/c.f32z"
+if grep -q D.BIN "$WORK/out.txt" && same_tree "$WORK/c.f32z" "$SRC2"
+then pass overlay-commit-container; else fail overlay-commit-container; fi
+
+# A commit cut short after the metadata landed is finished at the next open.
+cp "$BASE" "$WORK/p.img"
+cp "$BASE" "$WORK/q.img"
+printf 'put %s/D.BIN /SRC/D.BIN\nexit\n' "$WORK/EXTRA" | run --overlay "$WORK/p.dlt" "$WORK/p.img"
+cp "$WORK/p.dlt" "$WORK/q.dlt"
+printf 'overlay commit\nexit\n' | run --overlay "$WORK/q.dlt" "$WORK/q.img"
+dd if="$WORK/q.img" of="$WORK/p.img" bs=65536 count=1 conv=notrunc 2>/dev/null
+printf '\001' | dd of="$WORK/p.dlt" bs=1 seek=44 conv=notrunc 2>/dev/null
+printf 'exit\n' | run --overlay "$WORK/p.dlt" "$WORK/p.img"
+if cmp -s "$WORK/p.img" "$WORK/q.img" && same_tree "$WORK/p.img" "$SRC2"
+then pass overlay-commit-resume; else fail overlay-commit-resume; fi
+
+exit $FAILED
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Multi-component paths: absolute and relative paths, . and .., moves between directories.
+. "$(dirname "$0")/lib.sh"
+
+"$MKIMAGE" "$WORK/p.img" 32
+printf 'mkdir A\nmkdir A/B\nmkdir /A/B/C\ncd A/B/C\nput %s/D.BIN ../../D.BIN\ncd ../..\nsize /A/D.BIN\nsize ./B/C/../../D.BIN\nexit\n' \
+    "$WORK/EXTRA" | run "$WORK/p.img"
+if [ "$(grep -c "> 9000$" "$WORK/out.txt")" = 2 ]; then pass paths; else fail paths; fi
+
+# rename to a path moves the entry; a moved directory's .. follows it.
+printf 'cd A\nrename D.BIN B/C/E.BIN\nrename /A/B/C /C\ncd /C/..\nls\ncd C\ncd ..\nls\nexit\n' | run "$WORK/p.img"
+tree "$WORK/p.img" "$WORK/t"
+if cmp -s "$WORK/EXTRA/D.BIN" "$WORK/t/C/E.BIN" && [ -d "$WORK/t/A/B" ] && [ ! -e "$WORK/t/A/B/C" ] &&
+    [ "$(grep -o "34mC" "$WORK/out.txt" | wc -l)" -eq 2 ]
+then pass paths-move; else fail paths-move; fi
+
+# A directory cannot move into itself, and a missing step is an error.
+printf 'rename /A /A/B/X\nsize /A/B/C/../E.BIN\ncd /C/NOPE/..\nexit\n' | run "$WORK/p.img"
+if grep -q "into itself" "$WORK/out.txt" && [ "$(grep -c "Error" "$WORK/out.txt")" = 3 ] && [ -d "$WORK/t/A/B" ]
+then pass paths-errors; else fail paths-errors; fi
+
+exit $FAILED
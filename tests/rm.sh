@@ -0,0 +1,21 @@
+#!/bin/sh
+# rm -r: removing trees returns every cluster they held.
+. "$(dirname "$0")/lib.sh"
+
+"$MKIMAGE" "$WORK/r.img" 32
+empty=$(free_clusters "$WORK/r.img")
+printf 'put -r %s /\nmkdir OTHER\ncp -r SRC OTHER\nexit\n' "$SRC" | run "$WORK/r.img"
+full=$(free_clusters "$WORK/r.img")
+printf 'rm -r SRC OTHER\nls\nexit\n' | run "$WORK/r.img"
+if [ -n "$empty" ] && [ "$full" -lt "$empty" ] && [ "$(free_clusters "$WORK/r.img")" = "$empty" ] && ! grep -q "SRC\|OTHER" "$WORK/out.txt"
+then pass rm-r; else fail rm-r; fi
+
+# The freed space holds a fresh import.
+printf 'put -r %s /\nexit\n' "$SRC" | run "$WORK/r.img"
+if same_tree "$WORK/r.img" "$SRC"; then pass rm-r-reuse; else fail rm-r-reuse; fi
+
+# Special directories and missing names are refused, and nothing is removed.
+printf 'rm -r SRC/SUB ..\nrm -r SRC/NOPE SRC/SUB\nexit\n' | run "$WORK/r.img"
+if same_tree "$WORK/r.img" "$SRC"; then pass rm-r-refuse; else fail rm-r-refuse; fi
+
+exit $FAILED
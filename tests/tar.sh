@@ -0,0 +1,25 @@
+#!/bin/sh
+# Tar export: the archive holds exactly the imported files.
+. "$(dirname "$0")/lib.sh"
+
+if same_tree "$BASE" "$SRC"; then pass tar; else fail tar; fi
+
+# export-tar inside the shell writes the same archive for a subtree.
+printf 'export-tar /SRC/SUB -o %s\nexit\n' "$WORK/sub.tar" | run "$BASE"
+rm -rf "$WORK/s" && mkdir -p "$WORK/s" && tar -x -C "$WORK/s" -f "$WORK/sub.tar"
+if diff -r "$SRC/SUB" "$WORK/s" > /dev/null; then pass tar-subtree; else fail tar-subtree; fi
+
+# A tree deeper than 64 levels, with paths past 512 bytes, is exported and found in full.
+d=$WORK/DEEP/TREE
+i=0
+while [ $i -lt 71 ]; do d=$d/LEVEL$i; i=$((i + 1)); done
+mkdir -p "$d" && echo bottom > "$d/X.TXT"
+"$MKIMAGE" "$WORK/d.img" 8 || exit 1
+printf 'put -r %s /\nexit\n' "$WORK/DEEP/TREE" | run "$WORK/d.img"
+want=$(cd "$WORK/DEEP" && find TREE -name X.TXT)
+printf 'find / -name X.TXT\nexit\n' | run "$WORK/d.img"
+if tree "$WORK/d.img" "$WORK/dt" && diff -r "$WORK/DEEP/TREE" "$WORK/dt/TREE" > /dev/null &&
+    grep -qF "> /$want" "$WORK/out.txt"
+then pass tar-deep; else fail tar-deep; fi
+
+exit $FAILED
@@ -0,0 +1,31 @@
+#!/bin/sh
+# fallocate and truncate.
+. "$(dirname "$0")/lib.sh"
+
+"$MKIMAGE" "$WORK/f.img" 32
+empty=$(free_clusters "$WORK/f.img")
+# 100000 bytes are 196 clusters of 512 bytes; the size stays 0.
+printf 'touch F\nfallocate F 100000\nsize F\nexit\n' | run "$WORK/f.img"
+if grep -q "> 0$" "$WORK/out.txt" && [ "$(free_clusters "$WORK/f.img")" = "$((empty - 196))" ]
+then pass fallocate; else fail fallocate; fi
+
+# Writes fill the reservation; truncating to the file's own size releases the rest.
+printf 'open F -rw\nwrite F hello\nclose F\ntruncate F 5\nsize F\nexit\n' | run "$WORK/f.img"
+if grep -q "> 5$" "$WORK/out.txt" && [ "$(free_clusters "$WORK/f.img")" = "$((empty - 1))" ]
+then pass truncate-release; else fail truncate-release; fi
+
+# Shrinking a file keeps its head and frees the tail.
+cp "$BASE" "$WORK/t.img"
+before=$(free_clusters "$WORK/t.img")
+printf 'truncate SRC/A.BIN 1000\nexit\n' | run "$WORK/t.img"
+head -c 1000 "$SRC/A.BIN" > "$WORK/a.head"
+tree "$WORK/t.img" "$WORK/t"
+if cmp -s "$WORK/a.head" "$WORK/t/SRC/A.BIN" && [ "$(free_clusters "$WORK/t.img")" = "$((before + 586 - 2))" ]
+then pass truncate; else fail truncate; fi
+
+# Sizes must be whole numbers that fit in 32 bits.
+printf 'truncate SRC/A.BIN 1e3\ntruncate SRC/A.BIN 4294967296\nfallocate SRC/A.BIN -1\nsize SRC/A.BIN\nexit\n' | run "$WORK/t.img"
+if [ "$(grep -c Usage "$WORK/out.txt")" = 3 ] && grep -q "> 1000$" "$WORK/out.txt"
+then pass truncate-args; else fail truncate-args; fi
+
+exit $FAILED